@@ -0,0 +1,232 @@
+/*
+ * Copyright 2017 Rene Sugar
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ *
+ * @file capnp2arrow.cpp
+ * @author Rene Sugar <rene.sugar@gmail.com>
+ * @brief Convert Cap'n Proto messages of the root struct to Arrow record batches.
+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <capnp/serialize.h>
+
+#include <cstdlib>
+#include <iostream>
+
+#include "capnparrow.h"
+#include "capnpstream.h"
+
+#ifdef CAPNP_PLASMA
+#include "capnpplasma.h"
+#endif
+
+// Reads Cap'n Proto messages of the $schema struct and writes them as Arrow
+// record batches, either as an Arrow IPC stream or as a Parquet file written
+// through parquet::arrow:
+//
+//   capnp compile -o- file.capnp > file.request
+//   capnp2arrow --schema file.request --output file.arrows < file.bin
+//   capnp2arrow --schema file.request --format parquet --output file.parquet < file.bin
+//
+// When built with Plasma, batches can instead be put into a local Plasma
+// store as sealed objects; their object ids are printed to standard output:
+//
+//   capnp2arrow --schema file.request --plasma /tmp/plasma < file.bin
+//
+
+class Capnp2ArrowMain {
+public:
+  explicit Capnp2ArrowMain(kj::ProcessContext& context)
+  : context(context), format("stream"), batchRows(DEFAULT_BATCH_ROWS), follow(false) {}
+
+  kj::MainFunc getMain() {
+    return kj::MainBuilder(context, "capnp2arrow",
+                           "Reads Cap'n Proto messages of the $schema struct from <file> "
+                           "(default: standard input) and writes them as Arrow record batches.")
+        .addOptionWithArg({'s', "schema"}, KJ_BIND_METHOD(*this, setSchema), "<request>",
+                          "CodeGeneratorRequest of the schema (capnp compile -o- file.capnp).")
+        .addOptionWithArg({'o', "output"}, KJ_BIND_METHOD(*this, setOutput), "<file>",
+                          "File to write the record batches to.")
+        .addOptionWithArg("format", KJ_BIND_METHOD(*this, setFormat), "<format>",
+                          "stream: Arrow IPC stream, parquet: Parquet file written through "
+                          "parquet::arrow. Default: stream")
+#ifdef CAPNP_PLASMA
+        .addOptionWithArg("plasma", KJ_BIND_METHOD(*this, setPlasma), "<socket>",
+                          "Put each record batch into the Plasma store listening on <socket> "
+                          "and print its object id.")
+#endif
+        .addOptionWithArg("batch-rows", KJ_BIND_METHOD(*this, setBatchRows), "<n>",
+                          "Rows per record batch. Default: 65536")
+        .addOption({'f', "follow"}, KJ_BIND_METHOD(*this, setFollow),
+                   "Keep reading messages appended to <file> after its end.")
+        .expectOptionalArg("<file>", KJ_BIND_METHOD(*this, setInput))
+        .callAfterParsing(KJ_BIND_METHOD(*this, run))
+        .build();
+  }
+
+private:
+  static const int64_t DEFAULT_BATCH_ROWS = 64 * 1024;
+
+  kj::ProcessContext& context;
+  std::string         schemaPath;
+  std::string         outputPath;
+  std::string         format;
+  std::string         inputPath;
+  std::string         plasmaSocket;
+  int64_t             batchRows;
+  bool                follow;
+
+  kj::MainBuilder::Validity setSchema(kj::StringPtr path) {
+    schemaPath = path.cStr();
+    return true;
+  }
+
+  kj::MainBuilder::Validity setOutput(kj::StringPtr path) {
+    outputPath = path.cStr();
+    return true;
+  }
+
+  kj::MainBuilder::Validity setFormat(kj::StringPtr name) {
+    if ((name != "stream") && (name != "parquet")) {
+      return "expected stream or parquet";
+    }
+    format = name.cStr();
+    return true;
+  }
+
+  kj::MainBuilder::Validity setPlasma(kj::StringPtr path) {
+    plasmaSocket = path.cStr();
+    return true;
+  }
+
+  kj::MainBuilder::Validity setBatchRows(kj::StringPtr text) {
+    char* end = nullptr;
+    long long value = strtoll(text.cStr(), &end, 10);
+    if ((end == text.cStr()) || (*end != '\0') || (value <= 0)) {
+      return "expected a positive number";
+    }
+    batchRows = value;
+    return true;
+  }
+
+  kj::MainBuilder::Validity setFollow() {
+    follow = true;
+    return true;
+  }
+
+  kj::MainBuilder::Validity setInput(kj::StringPtr path) {
+    inputPath = path.cStr();
+    return true;
+  }
+
+  std::unique_ptr<capnpparquet::ArrowBatchWriter> openWriter(std::shared_ptr<::arrow::Schema> schema) {
+#ifdef CAPNP_PLASMA
+    if (!plasmaSocket.empty()) {
+      return std::unique_ptr<capnpparquet::ArrowBatchWriter>(new capnpparquet::ArrowPlasmaWriter(
+          plasmaSocket, [](const plasma::ObjectID& id, int64_t rows) {
+            std::cout << id.hex() << " " << rows << std::endl;
+          }));
+    }
+#endif
+
+    std::shared_ptr<::arrow::io::FileOutputStream> file;
+    PARQUET_THROW_NOT_OK(::arrow::io::FileOutputStream::Open(outputPath, &file));
+
+    if (format == "parquet") {
+      return std::unique_ptr<capnpparquet::ArrowBatchWriter>(new capnpparquet::ArrowParquetWriter(
+          schema, std::make_shared<parquet::ArrowOutputStream>(file)));
+    }
+    return std::unique_ptr<capnpparquet::ArrowBatchWriter>(
+        new capnpparquet::ArrowStreamWriter(schema, file));
+  }
+
+  kj::MainBuilder::Validity run() {
+    if (schemaPath.empty()) {
+      return "--schema is required";
+    }
+    if (outputPath.empty() == plasmaSocket.empty()) {
+      return "one of --output or --plasma is required";
+    }
+
+    capnpparquet::CapnpSchemaFile schema(schemaPath);
+
+    kj::AutoCloseFd inputFd;
+    int fd = STDIN_FILENO;
+    if (!inputPath.empty()) {
+      inputFd = kj::AutoCloseFd(open(inputPath.c_str(), O_RDONLY));
+      if (inputFd.get() < 0) {
+        return kj::str("could not open ", inputPath.c_str());
+      }
+      fd = inputFd.get();
+    }
+
+    capnp::ReaderOptions options;
+    options.traversalLimitInWords = capnpparquet::CapnpcParquet::TRAVERSAL_LIMIT;
+
+    try {
+      capnpparquet::CapnpColumnMap map(schema.root(), schema.descr(), nullptr,
+                                       capnpparquet::sourceUnitsFromMetadata(schema.metadata(),
+                                                                             schema.descr()->num_columns()));
+      capnpparquet::CapnpArrowBuilder builder(map);
+      auto writer = openWriter(builder.schema());
+      capnpparquet::CapnpMessageStream stream(fd, follow);
+
+      // Messages of a batch stay alive until its record batch is built
+      std::vector<kj::Array<capnp::word>> words;
+      std::vector<std::unique_ptr<capnp::FlatArrayMessageReader>> readers;
+      std::vector<capnp::DynamicStruct::Reader> messages;
+
+      auto writeBatch = [&]() {
+        if (messages.empty()) {
+          return;
+        }
+        builder.appendBatch(messages);
+        writer->write(builder.finish());
+        messages.clear();
+        readers.clear();
+        words.clear();
+      };
+
+      while (stream.wait(-1)) {
+        for (;;) {
+          auto message = stream.next();
+          if (message == nullptr) {
+            break;
+          }
+          words.push_back(kj::mv(message));
+          readers.emplace_back(new capnp::FlatArrayMessageReader(words.back(), options));
+          messages.push_back(readers.back()->getRoot<capnp::DynamicStruct>(schema.root()));
+
+          if (static_cast<int64_t>(messages.size()) >= batchRows) {
+            writeBatch();
+          }
+        }
+      }
+
+      writeBatch();
+      writer->close();
+    } catch (const std::exception& e) {
+      return kj::str("Arrow write error: ", e.what());
+    }
+
+    return true;
+  }
+};
+
+KJ_MAIN(Capnp2ArrowMain);
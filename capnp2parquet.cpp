@@ -0,0 +1,393 @@
+/*
+ * Copyright 2017 Rene Sugar
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ *
+ * @file capnp2parquet.cpp
+ * @author Rene Sugar <rene.sugar@gmail.com>
+ * @brief Write Cap'n Proto messages of the root struct to Parquet files.
+ */
+
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include <capnp/serialize.h>
+
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+#include "capnppipeline.h"
+
+// Reads Cap'n Proto messages of the $schema struct and writes them as rows of
+// Parquet files.
+//
+//   capnp compile -o- file.capnp > file.request
+//   capnp2parquet --schema file.request --output file.parquet < file.bin
+//
+// Messages pass through read, decode, shred, encode and write stages that run
+// on their own threads (see capnppipeline.h).
+//
+// With --directory the messages are written to a sequence of files that are
+// closed when a row, size or time limit is reached. With --follow the input
+// file is read as it grows, as a long running converter:
+//
+//   producer | capnp2parquet --schema file.request --directory out --max-seconds 60
+//   capnp2parquet --schema file.request --directory out --max-rows 1000000 --follow file.bin
+//
+// When the schema has $partitionKey fields, --directory writes each row to a
+// Hive style partition directory below <dir> (see capnppartition.h).
+//
+
+namespace {
+
+volatile sig_atomic_t stopRequested = 0;
+
+void requestStop(int) {
+  stopRequested = 1;
+}
+
+};  // namespace
+
+class Capnp2ParquetMain {
+public:
+  explicit Capnp2ParquetMain(kj::ProcessContext& context)
+  : context(context), prefix("part"), follow(false),
+    encoding(capnpparquet::CapnpMessageStream::DETECT),
+    rowGroupRows(0), maxOpenFiles(capnpparquet::PartitionedParquetWriter::DEFAULT_MAX_OPEN_FILES),
+    writeThreads(1), memoryBudget(0), stats(false) {}
+
+  kj::MainFunc getMain() {
+    return kj::MainBuilder(context, "capnp2parquet",
+                           "Reads Cap'n Proto messages of the $schema struct from <file> "
+                           "(default: standard input) and writes them as rows of Parquet files.")
+        .addOptionWithArg({'s', "schema"}, KJ_BIND_METHOD(*this, setSchema), "<request>",
+                          "CodeGeneratorRequest of the schema (capnp compile -o- file.capnp).")
+        .addOptionWithArg({'o', "output"}, KJ_BIND_METHOD(*this, setOutput), "<file>",
+                          "Write a single Parquet file.")
+        .addOptionWithArg({'d', "directory"}, KJ_BIND_METHOD(*this, setDirectory), "<dir>",
+                          "Write a sequence of Parquet files to <dir>, rolling to a new file "
+                          "when a limit is reached.")
+        .addOptionWithArg("prefix", KJ_BIND_METHOD(*this, setPrefix), "<name>",
+                          "File name prefix of the files written to --directory. Default: part")
+        .addOptionWithArg("max-rows", KJ_BIND_METHOD(*this, setMaxRows), "<n>",
+                          "Close a file after <n> rows.")
+        .addOptionWithArg("max-bytes", KJ_BIND_METHOD(*this, setMaxBytes), "<n>",
+                          "Close a file once it reaches about <n> bytes.")
+        .addOptionWithArg("max-seconds", KJ_BIND_METHOD(*this, setMaxSeconds), "<n>",
+                          "Close a file <n> seconds after its first row, even when no more "
+                          "messages arrive.")
+        .addOptionWithArg("max-open-files", KJ_BIND_METHOD(*this, setMaxOpenFiles), "<n>",
+                          "Files of different partitions open at once in --directory. The file "
+                          "written least recently is closed to open another. Default: 64")
+        .addOptionWithArg("row-group-rows", KJ_BIND_METHOD(*this, setRowGroupRows), "<n>",
+                          "Rows per row group. Default: $rowGroupRows of the schema, or 65536")
+        .addOptionWithArg("decode-threads", KJ_BIND_METHOD(*this, setDecodeThreads), "<n>",
+                          "Threads that decode and validate messages. Default: 1")
+        .addOptionWithArg("shred-threads", KJ_BIND_METHOD(*this, setShredThreads), "<n>",
+                          "Threads that shred messages into columns. Default: 1")
+        .addOptionWithArg("encode-threads", KJ_BIND_METHOD(*this, setEncodeThreads), "<n>",
+                          "Threads that encode the row groups of different partitions at once. Default: 1")
+        .addOptionWithArg("write-threads", KJ_BIND_METHOD(*this, setWriteThreads), "<n>",
+                          "Threads that write encoded bytes to files. Default: 1")
+        .addOptionWithArg("queue-capacity", KJ_BIND_METHOD(*this, setQueueCapacity), "<n>",
+                          "Row groups queued between two stages. Default: 4")
+        .addOptionWithArg("memory-budget", KJ_BIND_METHOD(*this, setMemoryBudget), "<bytes>",
+                          "Bytes of buffered messages, column data and encoder memory to stay "
+                          "within, with an optional K, M or G suffix. Row groups are flushed early "
+                          "and reading stalls when it is reached.")
+        .addOption("unique-map-keys", KJ_BIND_METHOD(*this, setUniqueMapKeys),
+                   "Stop with an error on a $map with the same key twice.")
+        .addOption("stats", KJ_BIND_METHOD(*this, setStats),
+                   "Print queue depth and stall counters of each stage to standard error.")
+        .addOption({'f', "follow"}, KJ_BIND_METHOD(*this, setFollow),
+                   "Keep reading messages appended to <file> after its end.")
+        .addOption("packed", KJ_BIND_METHOD(*this, setPacked),
+                   "Read messages in the packed encoding. Default: detected from the first word")
+        .addOption("unpacked", KJ_BIND_METHOD(*this, setUnpacked),
+                   "Read messages in the standard, unpacked encoding.")
+        .expectOptionalArg("<file>", KJ_BIND_METHOD(*this, setInput))
+        .callAfterParsing(KJ_BIND_METHOD(*this, run))
+        .build();
+  }
+
+private:
+  kj::ProcessContext&          context;
+  std::string                  schemaPath;
+  std::string                  outputPath;
+  std::string                  directory;
+  std::string                  prefix;
+  std::string                  inputPath;
+  capnpparquet::RollingPolicy  policy;
+  bool                         follow;
+  capnpparquet::CapnpMessageStream::Encoding encoding;
+  int64_t                      rowGroupRows;
+  int64_t                      maxOpenFiles;
+  int64_t                      writeThreads;
+  int64_t                      memoryBudget;
+  bool                         stats;
+  capnpparquet::PipelineOptions pipelineOptions;
+
+  kj::MainBuilder::Validity setSchema(kj::StringPtr path) {
+    schemaPath = path.cStr();
+    return true;
+  }
+
+  kj::MainBuilder::Validity setOutput(kj::StringPtr path) {
+    outputPath = path.cStr();
+    return true;
+  }
+
+  kj::MainBuilder::Validity setDirectory(kj::StringPtr path) {
+    directory = path.cStr();
+    return true;
+  }
+
+  kj::MainBuilder::Validity setPrefix(kj::StringPtr name) {
+    prefix = name.cStr();
+    return true;
+  }
+
+  static kj::MainBuilder::Validity parseCount(kj::StringPtr text, int64_t* count) {
+    char* end = nullptr;
+    long long value = strtoll(text.cStr(), &end, 10);
+    if ((end == text.cStr()) || (*end != '\0') || (value <= 0)) {
+      return "expected a positive number";
+    }
+    *count = value;
+    return true;
+  }
+
+  kj::MainBuilder::Validity setMaxRows(kj::StringPtr text) {
+    return parseCount(text, &policy.max_rows);
+  }
+
+  kj::MainBuilder::Validity setMaxBytes(kj::StringPtr text) {
+    return parseCount(text, &policy.max_bytes);
+  }
+
+  kj::MainBuilder::Validity setMaxSeconds(kj::StringPtr text) {
+    return parseCount(text, &policy.max_seconds);
+  }
+
+  kj::MainBuilder::Validity setRowGroupRows(kj::StringPtr text) {
+    return parseCount(text, &rowGroupRows);
+  }
+
+  kj::MainBuilder::Validity setDecodeThreads(kj::StringPtr text) {
+    int64_t count = 0;
+    auto validity = parseCount(text, &count);
+    pipelineOptions.decode_threads = static_cast<int>(count);
+    return validity;
+  }
+
+  kj::MainBuilder::Validity setShredThreads(kj::StringPtr text) {
+    int64_t count = 0;
+    auto validity = parseCount(text, &count);
+    pipelineOptions.shred_threads = static_cast<int>(count);
+    return validity;
+  }
+
+  kj::MainBuilder::Validity setEncodeThreads(kj::StringPtr text) {
+    int64_t count = 0;
+    auto validity = parseCount(text, &count);
+    pipelineOptions.encode_threads = static_cast<int>(count);
+    return validity;
+  }
+
+  kj::MainBuilder::Validity setMaxOpenFiles(kj::StringPtr text) {
+    return parseCount(text, &maxOpenFiles);
+  }
+
+  kj::MainBuilder::Validity setWriteThreads(kj::StringPtr text) {
+    return parseCount(text, &writeThreads);
+  }
+
+  kj::MainBuilder::Validity setQueueCapacity(kj::StringPtr text) {
+    int64_t count = 0;
+    auto validity = parseCount(text, &count);
+    pipelineOptions.queue_capacity = static_cast<size_t>(count);
+    return validity;
+  }
+
+  kj::MainBuilder::Validity setMemoryBudget(kj::StringPtr text) {
+    char* end = nullptr;
+    long long value = strtoll(text.cStr(), &end, 10);
+    if ((end == text.cStr()) || (value <= 0)) {
+      return "expected a positive number of bytes";
+    }
+    switch (*end) {
+      case 'G': case 'g': value *= 1024;  // fall through
+      case 'M': case 'm': value *= 1024;  // fall through
+      case 'K': case 'k': value *= 1024; end++; break;
+      case '\0': break;
+      default: return "expected a K, M or G suffix";
+    }
+    if (*end != '\0') {
+      return "expected a K, M or G suffix";
+    }
+    memoryBudget = value;
+    return true;
+  }
+
+  kj::MainBuilder::Validity setUniqueMapKeys() {
+    pipelineOptions.unique_map_keys = true;
+    return true;
+  }
+
+  kj::MainBuilder::Validity setStats() {
+    stats = true;
+    return true;
+  }
+
+  kj::MainBuilder::Validity setFollow() {
+    follow = true;
+    return true;
+  }
+
+  kj::MainBuilder::Validity setPacked() {
+    encoding = capnpparquet::CapnpMessageStream::PACKED;
+    return true;
+  }
+
+  kj::MainBuilder::Validity setUnpacked() {
+    encoding = capnpparquet::CapnpMessageStream::UNPACKED;
+    return true;
+  }
+
+  kj::MainBuilder::Validity setInput(kj::StringPtr path) {
+    inputPath = path.cStr();
+    return true;
+  }
+
+  template <typename Pipeline>
+  void printStats(const Pipeline& pipeline, const capnpparquet::MemoryBudget& budget) {
+    if (stats) {
+      pipeline.printStats(std::cerr);
+    } else if (memoryBudget > 0) {
+      std::cerr << "memory peak " << budget.peak() << " bytes of " << memoryBudget
+                << " budget" << std::endl;
+    }
+  }
+
+  kj::MainBuilder::Validity run() {
+    if (schemaPath.empty()) {
+      return "--schema is required";
+    }
+    if (outputPath.empty() == directory.empty()) {
+      return "one of --output or --directory is required";
+    }
+
+    capnpparquet::CapnpSchemaFile schema(schemaPath);
+
+    kj::AutoCloseFd inputFd;
+    int fd = STDIN_FILENO;
+    if (!inputPath.empty()) {
+      inputFd = kj::AutoCloseFd(open(inputPath.c_str(), O_RDONLY));
+      if (inputFd.get() < 0) {
+        return kj::str("could not open ", inputPath.c_str());
+      }
+      fd = inputFd.get();
+    }
+
+    // Close the current file cleanly on SIGINT and SIGTERM. No SA_RESTART, so a
+    // blocked poll() or read() returns.
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = requestStop;
+    sigaction(SIGINT, &action, nullptr);
+    sigaction(SIGTERM, &action, nullptr);
+
+    // Command line settings override the annotations of the schema
+    const capnpparquet::ParquetWriterOptions& writerOptions = schema.writerOptions();
+    rowGroupRows = capnpparquet::resolveRowGroupRows(rowGroupRows, writerOptions);
+    pipelineOptions.row_group_rows = rowGroupRows;
+    pipelineOptions.row_group_bytes = writerOptions.row_group_bytes;
+
+    capnpparquet::MemoryBudget budget(memoryBudget);
+    pipelineOptions.budget = &budget;
+
+    // Smaller pages when a budget has to hold every column's page buffers
+    parquet::WriterProperties::Builder builder;
+    capnpparquet::applyWriterOptions(builder, writerOptions);
+    capnpparquet::applyMemoryBudget(builder, memoryBudget, schema.descr()->num_columns(),
+                                    (writerOptions.data_page_size > 0) ? writerOptions.data_page_size
+                                                                       : parquet::DEFAULT_PAGE_SIZE);
+    pipelineOptions.stopped = []() { return stopRequested != 0; };
+
+    try {
+      for (const auto& warning : capnpparquet::applyColumnOptions(builder, schema.descr(), schema.columnOptions())) {
+        std::cerr << warning << std::endl;
+      }
+      auto properties = builder.build();
+      auto bloomFilters = capnpparquet::bloomFilterColumns(schema.descr(), schema.columnOptions());
+
+      capnpparquet::CapnpMessageStream stream(fd, follow, encoding);
+      capnpparquet::WriteStage writeStage(writeThreads, pipelineOptions.queue_capacity);
+
+      if (!outputPath.empty()) {
+        if (!schema.partitionColumns().empty()) {
+          std::cerr << "$partitionKey applies to --directory, writing a single file" << std::endl;
+        }
+        capnpparquet::CapnpParquetWriter writer(schema.root(), schema.parquetSchema(),
+                                                writeStage.sinkFactory()(outputPath),
+                                                properties, rowGroupRows, schema.metadata());
+        writer.set_bloom_filters(bloomFilters);
+        writer.set_page_index(capnpparquet::pageIndexColumns(schema.columnOptions()));
+        capnpparquet::SingleFileTarget target(writer);
+        capnpparquet::CapnpPipeline<capnpparquet::SingleFileTarget> pipeline(
+            schema, stream, target, writeStage, pipelineOptions);
+
+        pipeline.run();
+        writer.close();
+        writeStage.finish();
+        printStats(pipeline, budget);
+      } else {
+        capnpparquet::PartitionedParquetWriter writer(schema.root(), schema.parquetSchema(),
+                                                      directory, prefix, policy,
+                                                      properties, rowGroupRows,
+                                                      writeStage.sinkFactory(), schema.metadata(),
+                                                      static_cast<int>(maxOpenFiles));
+        writer.set_bloom_filters(bloomFilters);
+        writer.set_page_index(capnpparquet::pageIndexColumns(schema.columnOptions()));
+
+        // A partial row group is passed on in time for its file to close within the window
+        if (policy.max_seconds > 0) {
+          pipelineOptions.flush_ms = static_cast<int>(policy.max_seconds * 1000 / 2);
+        }
+        pipelineOptions.partition_columns = schema.partitionColumns();
+        capnpparquet::CapnpPipeline<capnpparquet::PartitionedParquetWriter> pipeline(
+            schema, stream, writer, writeStage, pipelineOptions);
+
+        pipeline.run();
+        writer.close();
+        writeStage.finish();
+        printStats(pipeline, budget);
+        if (stats && !schema.partitionColumns().empty()) {
+          std::cerr << writer.partitions() << " partitions, " << writer.evicted_files()
+                    << " files closed early for --max-open-files" << std::endl;
+        }
+      }
+    } catch (const std::exception& e) {
+      return kj::str("Parquet write error: ", e.what());
+    }
+
+    return true;
+  }
+};
+
+KJ_MAIN(Capnp2ParquetMain);
@@ -0,0 +1,1822 @@
+/*
+ * Copyright 2017 Rene Sugar
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * @file capnp2parquet.h
+ * @author Rene Sugar <rene.sugar@gmail.com>
+ * @brief Write Cap'n Proto messages to Parquet files with a capnpc-parquet schema.
+ */
+#ifndef _CAPNP2PARQUET_H_
+#define _CAPNP2PARQUET_H_
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <arrow/io/file.h>
+#include <arrow/memory_pool.h>
+
+#include <parquet/api/writer.h>
+#include <parquet/util/memory.h>
+
+#include <capnp/dynamic.h>
+#include <kj/io.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#include "capnpbloom.h"
+#include "capnpdecimal.h"
+#include "capnppageindex.h"
+#include "capnpschema.h"
+#include "capnpstats.h"
+#include "capnptemporal.h"
+
+namespace capnpparquet {
+
+// Values of a column in the representation WriteBatch takes.
+template <typename DType>
+class ValueVector {
+public:
+  typedef typename DType::c_type T;
+
+  void push(T value) { values_.push_back(value); }
+
+  void append(const ValueVector& other) { values_.insert(values_.end(), other.values_.begin(), other.values_.end()); }
+
+  const T* data() { return values_.data(); }
+
+  int64_t size() const { return static_cast<int64_t>(values_.size()); }
+
+  int64_t byte_size() const { return size() * sizeof(T); }
+
+  void clear() { values_.clear(); }
+
+private:
+  std::vector<T> values_;
+};
+
+template <>
+class ValueVector<parquet::BooleanType> {
+public:
+  ValueVector() : size_(0), capacity_(0) {}
+
+  void push(bool value) {
+    if (size_ == capacity_) {
+      // std::vector<bool> has no data() to hand to WriteBatch
+      int64_t capacity = std::max<int64_t>(64, capacity_ * 2);
+      std::unique_ptr<bool[]> values(new bool[capacity]);
+      std::copy(values_.get(), values_.get() + size_, values.get());
+      values_.swap(values);
+      capacity_ = capacity;
+    }
+    values_[size_++] = value;
+  }
+
+  void append(const ValueVector& other) {
+    for (int64_t i = 0; i < other.size_; i++) {
+      push(other.values_[i]);
+    }
+  }
+
+  const bool* data() { return values_.get(); }
+
+  int64_t size() const { return size_; }
+
+  int64_t byte_size() const { return size_; }
+
+  void clear() { size_ = 0; }
+
+private:
+  std::unique_ptr<bool[]> values_;
+  int64_t                 size_;
+  int64_t                 capacity_;
+};
+
+template <>
+class ValueVector<parquet::ByteArrayType> {
+public:
+  void push(const uint8_t* value, size_t length) {
+    offsets_.push_back(bytes_.size());
+    bytes_.insert(bytes_.end(), value, value + length);
+  }
+
+  void append(const ValueVector& other) {
+    size_t base = bytes_.size();
+    for (size_t offset : other.offsets_) {
+      offsets_.push_back(base + offset);
+    }
+    bytes_.insert(bytes_.end(), other.bytes_.begin(), other.bytes_.end());
+  }
+
+  // Pointers are taken once all values are appended, the byte buffer may move before then.
+  const parquet::ByteArray* data() {
+    values_.resize(offsets_.size());
+    for (size_t i = 0; i < offsets_.size(); i++) {
+      size_t end = (i + 1 < offsets_.size()) ? offsets_[i + 1] : bytes_.size();
+      values_[i].ptr = bytes_.data() + offsets_[i];
+      values_[i].len = static_cast<uint32_t>(end - offsets_[i]);
+    }
+    return values_.data();
+  }
+
+  int64_t size() const { return static_cast<int64_t>(offsets_.size()); }
+
+  int64_t byte_size() const { return bytes_.size() + (offsets_.size() * sizeof(parquet::ByteArray)); }
+
+  void clear() {
+    offsets_.clear();
+    bytes_.clear();
+  }
+
+private:
+  std::vector<size_t>             offsets_;
+  std::vector<uint8_t>            bytes_;
+  std::vector<parquet::ByteArray> values_;
+};
+
+template <>
+class ValueVector<parquet::FLBAType> {
+public:
+  explicit ValueVector(int32_t type_length = 0) : type_length_(type_length) {}
+
+  // Values are truncated or zero padded to the type length.
+  void push(const uint8_t* value, size_t length) {
+    size_t offset = bytes_.size();
+    bytes_.resize(offset + type_length_, 0);
+    if (length > 0) {
+      memcpy(bytes_.data() + offset, value, std::min<size_t>(length, type_length_));
+    }
+  }
+
+  void append(const ValueVector& other) { bytes_.insert(bytes_.end(), other.bytes_.begin(), other.bytes_.end()); }
+
+  const parquet::FixedLenByteArray* data() {
+    values_.resize(size());
+    for (int64_t i = 0; i < size(); i++) {
+      values_[i].ptr = bytes_.data() + (i * type_length_);
+    }
+    return values_.data();
+  }
+
+  int64_t size() const { return (type_length_ > 0) ? static_cast<int64_t>(bytes_.size()) / type_length_ : 0; }
+
+  int64_t byte_size() const { return bytes_.size(); }
+
+  void clear() { bytes_.clear(); }
+
+  // Append `count` values and return their bytes to fill in
+  uint8_t* extend(int64_t count) {
+    size_t offset = bytes_.size();
+    bytes_.resize(offset + (count * type_length_));
+    return bytes_.data() + offset;
+  }
+
+  int32_t type_length() const { return type_length_; }
+
+private:
+  int32_t                                 type_length_;
+  std::vector<uint8_t>                    bytes_;
+  std::vector<parquet::FixedLenByteArray> values_;
+};
+
+// Scale a floating point value to the unscaled integer of a DECIMAL column.
+inline int64_t encodeDecimal(double value, int32_t scale) {
+  return llround(value * decimalPowerOfTen(scale));
+}
+
+// Convert a Cap'n Proto value for an INT32, INT64 or BOOLEAN column.
+inline int64_t capnpInteger(const capnp::DynamicValue::Reader& value, const parquet::ColumnDescriptor* descr) {
+  switch (value.getType()) {
+    case capnp::DynamicValue::BOOL:
+      return value.as<bool>() ? 1 : 0;
+    case capnp::DynamicValue::INT:
+      return value.as<int64_t>();
+    case capnp::DynamicValue::UINT:
+      // UINT_32 and UINT_64 keep their bit pattern in signed columns
+      return static_cast<int64_t>(value.as<uint64_t>());
+    case capnp::DynamicValue::FLOAT:
+      if (descr->logical_type() == parquet::LogicalType::DECIMAL) {
+        return encodeDecimal(value.as<double>(), descr->type_scale());
+      }
+      return static_cast<int64_t>(value.as<double>());
+    case capnp::DynamicValue::ENUM:
+      return value.as<capnp::DynamicEnum>().getRaw();
+    case capnp::DynamicValue::VOID:
+      return 0;
+    default:
+      KJ_FAIL_REQUIRE("value cannot be stored in an integer column", descr->path()->ToDotString());
+  }
+}
+
+// Convert a Cap'n Proto value for a FLOAT or DOUBLE column.
+inline double capnpDouble(const capnp::DynamicValue::Reader& value, const parquet::ColumnDescriptor* descr) {
+  switch (value.getType()) {
+    case capnp::DynamicValue::FLOAT:
+      return value.as<double>();
+    case capnp::DynamicValue::INT:
+      return static_cast<double>(value.as<int64_t>());
+    case capnp::DynamicValue::UINT:
+      return static_cast<double>(value.as<uint64_t>());
+    case capnp::DynamicValue::BOOL:
+      return value.as<bool>() ? 1.0 : 0.0;
+    case capnp::DynamicValue::VOID:
+      return 0.0;
+    default:
+      KJ_FAIL_REQUIRE("value cannot be stored in a floating point column", descr->path()->ToDotString());
+  }
+}
+
+// Append a Cap'n Proto value to the values of a BYTE_ARRAY or FIXED_LEN_BYTE_ARRAY column.
+template <typename Values>
+void pushCapnpBytes(Values& values, const capnp::DynamicValue::Reader& value,
+                    const parquet::ColumnDescriptor* descr) {
+  switch (value.getType()) {
+    case capnp::DynamicValue::TEXT: {
+      capnp::Text::Reader text = value.as<capnp::Text>();
+      values.push(reinterpret_cast<const uint8_t*>(text.begin()), text.size());
+      break;
+    }
+    case capnp::DynamicValue::DATA: {
+      capnp::Data::Reader data = value.as<capnp::Data>();
+      values.push(data.begin(), data.size());
+      break;
+    }
+    case capnp::DynamicValue::ENUM: {
+      // Enums are stored as enumerant names, see NOTE(1) in capnpparquet.h
+      capnp::DynamicEnum enumerant = value.as<capnp::DynamicEnum>();
+      KJ_IF_MAYBE(known, enumerant.getEnumerant()) {
+        capnp::Text::Reader name = known->getProto().getName();
+        values.push(reinterpret_cast<const uint8_t*>(name.begin()), name.size());
+      } else {
+        // Enumerant added after the schema was compiled
+        std::string number = std::to_string(enumerant.getRaw());
+        values.push(reinterpret_cast<const uint8_t*>(number.data()), number.size());
+      }
+      break;
+    }
+    case capnp::DynamicValue::FLOAT: {
+      // DECIMAL as big-endian two's complement of the unscaled value
+      int32_t length = (descr->physical_type() == parquet::Type::FIXED_LEN_BYTE_ARRAY)
+                       ? descr->type_length() : static_cast<int32_t>(sizeof(int64_t));
+      int64_t unscaled = encodeDecimal(value.as<double>(), descr->type_scale());
+      std::vector<uint8_t> bytes(length);
+      decimalBytes(&unscaled, 1, length, bytes.data());
+      values.push(bytes.data(), bytes.size());
+      break;
+    }
+    case capnp::DynamicValue::VOID:
+      values.push(nullptr, 0);
+      break;
+    default:
+      KJ_FAIL_REQUIRE("value cannot be stored in a byte array column", descr->path()->ToDotString());
+  }
+}
+
+inline void pushCapnpValue(ValueVector<parquet::BooleanType>& values,
+                           const capnp::DynamicValue::Reader& value,
+                           const parquet::ColumnDescriptor* descr) {
+  values.push(capnpInteger(value, descr) != 0);
+}
+
+inline void pushCapnpValue(ValueVector<parquet::Int32Type>& values,
+                           const capnp::DynamicValue::Reader& value,
+                           const parquet::ColumnDescriptor* descr) {
+  values.push(static_cast<int32_t>(capnpInteger(value, descr)));
+}
+
+inline void pushCapnpValue(ValueVector<parquet::Int64Type>& values,
+                           const capnp::DynamicValue::Reader& value,
+                           const parquet::ColumnDescriptor* descr) {
+  values.push(capnpInteger(value, descr));
+}
+
+inline void pushCapnpValue(ValueVector<parquet::FloatType>& values,
+                           const capnp::DynamicValue::Reader& value,
+                           const parquet::ColumnDescriptor* descr) {
+  values.push(static_cast<float>(capnpDouble(value, descr)));
+}
+
+inline void pushCapnpValue(ValueVector<parquet::DoubleType>& values,
+                           const capnp::DynamicValue::Reader& value,
+                           const parquet::ColumnDescriptor* descr) {
+  values.push(capnpDouble(value, descr));
+}
+
+inline void pushCapnpValue(ValueVector<parquet::ByteArrayType>& values,
+                           const capnp::DynamicValue::Reader& value,
+                           const parquet::ColumnDescriptor* descr) {
+  pushCapnpBytes(values, value, descr);
+}
+
+inline void pushCapnpValue(ValueVector<parquet::FLBAType>& values,
+                           const capnp::DynamicValue::Reader& value,
+                           const parquet::ColumnDescriptor* descr) {
+  pushCapnpBytes(values, value, descr);
+}
+
+template <typename DType>
+void pushDefaultValue(ValueVector<DType>& values) {
+  values.push(typename DType::c_type());
+}
+
+template <>
+inline void pushDefaultValue(ValueVector<parquet::ByteArrayType>& values) {
+  values.push(nullptr, 0);
+}
+
+template <>
+inline void pushDefaultValue(ValueVector<parquet::FLBAType>& values) {
+  values.push(nullptr, 0);
+}
+
+// Insert the `count` buffered values of a column from `value` in its Bloom filter.
+template <typename DType>
+inline void insertBloomValues(BloomFilter& filter, ValueVector<DType>& values, int64_t value, int64_t count) {
+  bloomInsertValues(filter, values.data() + value, count);
+}
+
+// BOOLEAN columns have no Bloom filter, bloomFilterColumns() rejects them
+inline void insertBloomValues(BloomFilter& filter, ValueVector<parquet::BooleanType>& values,
+                              int64_t value, int64_t count) {}
+
+inline void insertBloomValues(BloomFilter& filter, ValueVector<parquet::FLBAType>& values,
+                              int64_t value, int64_t count) {
+  bloomInsertValues(filter, values.data() + value, count, values.type_length());
+}
+
+// Append converted values (see ConvertedColumnBuffer) to the values of an
+// INT32, INT64 or FIXED_LEN_BYTE_ARRAY column. Byte arrays hold unscaled
+// DECIMAL values.
+inline void appendConverted(ValueVector<parquet::Int32Type>& values, const int64_t* converted, int64_t count) {
+  for (int64_t i = 0; i < count; i++) {
+    values.push(static_cast<int32_t>(converted[i]));
+  }
+}
+
+inline void appendConverted(ValueVector<parquet::Int64Type>& values, const int64_t* converted, int64_t count) {
+  for (int64_t i = 0; i < count; i++) {
+    values.push(converted[i]);
+  }
+}
+
+inline void appendConverted(ValueVector<parquet::FLBAType>& values, const int64_t* converted, int64_t count) {
+  decimalBytes(converted, count, values.type_length(), values.extend(count));
+}
+
+// A value on its way down the column map while a level of values is shredded
+// (see CapnpShredder). Null entries stand for a null, or an empty list,
+// whose first undefined ancestor is below definition level `def`.
+struct ShredEntry {
+  capnp::DynamicValue::Reader value;
+  int16_t                     def;
+  int16_t                     rep;
+  bool                        is_null;
+};
+
+inline ShredEntry valueEntry(const capnp::DynamicValue::Reader& value, int16_t rep) {
+  return ShredEntry{value, 0, rep, false};
+}
+
+inline ShredEntry nullEntry(int16_t def, int16_t rep) {
+  return ShredEntry{capnp::DynamicValue::Reader(), def, rep, true};
+}
+
+// Buffers the levels and values of one leaf column of the row group being built.
+class ColumnBuffer {
+public:
+  explicit ColumnBuffer(const parquet::ColumnDescriptor* descr)
+  : descr_(descr),
+    max_def_(descr->max_definition_level()), max_rep_(descr->max_repetition_level()),
+    num_levels_(0), written_levels_(0), written_values_(0), chunk_values_(0) {}
+
+  virtual ~ColumnBuffer() {}
+
+  // Append a non-null value. Returns the number of bytes buffered for it.
+  int64_t append(const capnp::DynamicValue::Reader& value, int16_t rep) {
+    int64_t before = byte_size();
+    pushLevels(max_def_, rep);
+    pushValue(value);
+    return byte_size() - before;
+  }
+
+  // Append a null (or empty list) whose first undefined ancestor is below definition level `def`.
+  // A required column below only required nodes stores a default value instead.
+  int64_t appendNull(int16_t def, int16_t rep) {
+    int64_t before = byte_size();
+    pushLevels(def, rep);
+    if (def >= max_def_) {
+      pushDefault();
+    }
+    return byte_size() - before;
+  }
+
+  // Append the values and nulls of a level of entries. Returns the number of
+  // bytes buffered for them.
+  int64_t append(const std::vector<ShredEntry>& entries) {
+    int64_t before = byte_size();
+    if (max_def_ > 0) {
+      for (const auto& entry : entries) {
+        def_levels_.push_back(entry.is_null ? entry.def : max_def_);
+      }
+    }
+    if (max_rep_ > 0) {
+      for (const auto& entry : entries) {
+        rep_levels_.push_back(entry.rep);
+      }
+    }
+    num_levels_ += entries.size();
+    pushEntries(entries);
+    return byte_size() - before;
+  }
+
+  // Append the rows of `other`, a buffer of the same column with no rows
+  // written yet. Returns the number of bytes buffered for them.
+  int64_t appendBuffer(ColumnBuffer& other) {
+    KJ_REQUIRE(other.written_levels_ == 0, "rows of the buffer were written already");
+    int64_t before = byte_size();
+    def_levels_.insert(def_levels_.end(), other.def_levels_.begin(), other.def_levels_.end());
+    rep_levels_.insert(rep_levels_.end(), other.rep_levels_.begin(), other.rep_levels_.end());
+    num_levels_ += other.num_levels_;
+    appendValues(other);
+    return byte_size() - before;
+  }
+
+  // Write the levels and values of the next `rows` buffered rows (all the
+  // rows not yet written when negative) as the next column chunk of
+  // `row_group`. With an `index`, each of its row ranges is added to it and
+  // then written while its levels and values are still in cache.
+  void write(parquet::RowGroupWriter* row_group, ColumnPageIndex* index = nullptr, int64_t rows = -1) {
+    int64_t begin = written_levels_;
+    int64_t end = num_levels_;
+    if (rows == 0) {
+      end = begin;
+    } else if ((rows > 0) && (begin < num_levels_)) {
+      end = rowsEnd(begin, rows);
+    }
+    writeChunk(row_group, index, begin, end, written_values_);
+    chunk_values_ = written_values_;
+    written_levels_ = end;
+    written_values_ += (end - begin) - countNullLevels(begin, end);
+  }
+
+  // Insert the non-null values of the chunk written last in `filter`.
+  void insertValues(BloomFilter& filter) {
+    insertValueRange(filter, chunk_values_, written_values_ - chunk_values_);
+  }
+
+  // Non-null values buffered
+  virtual int64_t num_values() const = 0;
+
+  // Non-null values of the chunk written last, the Bloom filter is sized for them
+  int64_t chunk_num_values() const { return written_values_ - chunk_values_; }
+
+  void clear() {
+    def_levels_.clear();
+    rep_levels_.clear();
+    num_levels_ = 0;
+    written_levels_ = 0;
+    written_values_ = 0;
+    chunk_values_ = 0;
+    clearValues();
+  }
+
+  int64_t num_levels() const { return num_levels_; }
+
+  // Approximate size of the buffered levels and values
+  int64_t byte_size() const {
+    return ((def_levels_.size() + rep_levels_.size()) * sizeof(int16_t)) + valueByteSize();
+  }
+
+  const parquet::ColumnDescriptor* descr() const { return descr_; }
+
+protected:
+  const parquet::ColumnDescriptor* descr_;
+  int16_t                          max_def_;
+  int16_t                          max_rep_;
+  std::vector<int16_t>             def_levels_;
+  std::vector<int16_t>             rep_levels_;
+  int64_t                          num_levels_;
+  int64_t                          written_levels_;  // levels of the rows written so far
+  int64_t                          written_values_;  // and their non-null values
+  int64_t                          chunk_values_;    // first value of the chunk written last
+
+  // Write levels [begin, end), whose first non-null value is `value`, as the
+  // next column chunk of `row_group`.
+  virtual void writeChunk(parquet::RowGroupWriter* row_group, ColumnPageIndex* index,
+                          int64_t begin, int64_t end, int64_t value) = 0;
+
+  // Insert the `count` non-null values from `value` in `filter`.
+  virtual void insertValueRange(BloomFilter& filter, int64_t value, int64_t count) = 0;
+
+  virtual void pushValue(const capnp::DynamicValue::Reader& value) = 0;
+  virtual void pushDefault() = 0;
+  virtual void clearValues() = 0;
+
+  // Values of the levels appended by appendBuffer(), `other` has the type of this buffer
+  virtual void appendValues(ColumnBuffer& other) = 0;
+
+  // Values of the entries appended by append(entries)
+  virtual void pushEntries(const std::vector<ShredEntry>& entries) {
+    for (const auto& entry : entries) {
+      if (!entry.is_null) {
+        pushValue(entry.value);
+      } else if (entry.def >= max_def_) {
+        pushDefault();
+      }
+    }
+  }
+  virtual int64_t valueByteSize() const = 0;
+
+  // Required and non-repeated columns store no levels
+  void pushLevels(int16_t def, int16_t rep) {
+    if (max_def_ > 0) {
+      def_levels_.push_back(def);
+    }
+    if (max_rep_ > 0) {
+      rep_levels_.push_back(rep);
+    }
+    num_levels_++;
+  }
+
+  // End of the `rows` rows starting at `level`
+  int64_t rowsEnd(int64_t level, int64_t rows) const {
+    if (max_rep_ == 0) {
+      return std::min(level + rows, num_levels_);
+    }
+    for (level++; level < num_levels_; level++) {
+      if ((rep_levels_[level] == 0) && (--rows == 0)) {
+        break;
+      }
+    }
+    return level;
+  }
+
+  // Nulls and empty lists among levels [begin, end)
+  int64_t countNullLevels(int64_t begin, int64_t end) const {
+    return (max_def_ > 0) ? countNulls(def_levels_.data() + begin, end - begin, max_def_) : 0;
+  }
+};
+
+template <typename DType>
+class TypedColumnBuffer : public ColumnBuffer {
+public:
+  explicit TypedColumnBuffer(const parquet::ColumnDescriptor* descr)
+  : ColumnBuffer(descr) {}
+
+  int64_t num_values() const override { return values_.size(); }
+
+protected:
+  ValueVector<DType> values_;
+
+  void writeChunk(parquet::RowGroupWriter* row_group, ColumnPageIndex* index,
+                  int64_t begin, int64_t end, int64_t value) override {
+    auto writer = static_cast<parquet::TypedColumnWriter<DType>*>(row_group->NextColumn());
+    auto values = values_.data() + value;
+    if (index == nullptr) {
+      writeLevels(writer, begin, end, values);
+      return;
+    }
+
+    int64_t level = begin;
+    while (level < end) {
+      int64_t range_end = std::min(rowsEnd(level, index->range_rows()), end);
+      int64_t null_count = countNullLevels(level, range_end);
+      int64_t count = (range_end - level) - null_count;
+      index->add(pageIndexRange(descr_, values, count, null_count));
+      writeLevels(writer, level, range_end, values);
+      level = range_end;
+      values += count;
+    }
+  }
+
+  void insertValueRange(BloomFilter& filter, int64_t value, int64_t count) override {
+    insertBloomValues(filter, values_, value, count);
+  }
+
+  void pushValue(const capnp::DynamicValue::Reader& value) override {
+    pushCapnpValue(values_, value, descr_);
+  }
+
+  void pushDefault() override { pushDefaultValue(values_); }
+
+  // Without a virtual call per value
+  void pushEntries(const std::vector<ShredEntry>& entries) override {
+    for (const auto& entry : entries) {
+      if (!entry.is_null) {
+        pushCapnpValue(values_, entry.value, descr_);
+      } else if (entry.def >= max_def_) {
+        pushDefaultValue(values_);
+      }
+    }
+  }
+
+  void appendValues(ColumnBuffer& other) override {
+    values_.append(static_cast<TypedColumnBuffer&>(other).values_);
+  }
+
+  template <typename T>
+  void writeLevels(parquet::TypedColumnWriter<DType>* writer, int64_t begin, int64_t end, const T* values) {
+    writer->WriteBatch(end - begin,
+                       (max_def_ > 0) ? def_levels_.data() + begin : nullptr,
+                       (max_rep_ > 0) ? rep_levels_.data() + begin : nullptr,
+                       values);
+  }
+
+  void clearValues() override { values_.clear(); }
+
+  int64_t valueByteSize() const override { return values_.byte_size(); }
+};
+
+template <>
+inline TypedColumnBuffer<parquet::FLBAType>::TypedColumnBuffer(const parquet::ColumnDescriptor* descr)
+: ColumnBuffer(descr), values_(descr->type_length()) {}
+
+// Buffer of a column whose Cap'n Proto values are converted before they are
+// stored. Values are kept as Cap'n Proto holds them and converted in one
+// batch before the chunk is written.
+template <typename DType>
+class ConvertedColumnBuffer : public TypedColumnBuffer<DType> {
+public:
+  ConvertedColumnBuffer(const parquet::ColumnDescriptor* descr, bool is_float)
+  : TypedColumnBuffer<DType>(descr), is_float_(is_float) {}
+
+  int64_t num_values() const override {
+    return TypedColumnBuffer<DType>::num_values() + doubles_.size() + integers_.size();
+  }
+
+protected:
+  bool                 is_float_;
+  std::vector<double>  doubles_;   // Float32 and Float64 fields
+  std::vector<int64_t> integers_;  // other fields
+  std::vector<int64_t> converted_;
+
+  // Convert the held values into `converted`, failing on a value the column cannot store
+  virtual void convert(int64_t count, int64_t* converted) = 0;
+
+  void writeChunk(parquet::RowGroupWriter* row_group, ColumnPageIndex* index,
+                  int64_t begin, int64_t end, int64_t value) override {
+    flush();
+    TypedColumnBuffer<DType>::writeChunk(row_group, index, begin, end, value);
+  }
+
+  void insertValueRange(BloomFilter& filter, int64_t value, int64_t count) override {
+    flush();
+    TypedColumnBuffer<DType>::insertValueRange(filter, value, count);
+  }
+
+  void pushValue(const capnp::DynamicValue::Reader& value) override {
+    if (is_float_) {
+      doubles_.push_back(capnpDouble(value, this->descr_));
+    } else {
+      integers_.push_back(capnpInteger(value, this->descr_));
+    }
+  }
+
+  void pushDefault() override {
+    if (is_float_) {
+      doubles_.push_back(0.0);
+    } else {
+      integers_.push_back(0);
+    }
+  }
+
+  // Values are held until they are converted
+  void pushEntries(const std::vector<ShredEntry>& entries) override {
+    ColumnBuffer::pushEntries(entries);
+  }
+
+  // The converted values of `other` follow those of this buffer, its held values are held here
+  void appendValues(ColumnBuffer& other) override {
+    auto& source = static_cast<ConvertedColumnBuffer&>(other);
+    flush();
+    TypedColumnBuffer<DType>::appendValues(other);
+    doubles_.insert(doubles_.end(), source.doubles_.begin(), source.doubles_.end());
+    integers_.insert(integers_.end(), source.integers_.begin(), source.integers_.end());
+  }
+
+  void clearValues() override {
+    doubles_.clear();
+    integers_.clear();
+    TypedColumnBuffer<DType>::clearValues();
+  }
+
+  int64_t valueByteSize() const override {
+    return TypedColumnBuffer<DType>::valueByteSize() +
+           ((doubles_.size() + integers_.size()) * sizeof(int64_t));
+  }
+
+  void flush() {
+    int64_t count = is_float_ ? doubles_.size() : integers_.size();
+    if (count == 0) {
+      return;
+    }
+    converted_.resize(count);
+    convert(count, converted_.data());
+    appendConverted(this->values_, converted_.data(), count);
+    doubles_.clear();
+    integers_.clear();
+  }
+};
+
+// Values of a DECIMAL column are unscaled and checked against the precision.
+// Integer fields already hold the unscaled value.
+template <typename DType>
+class DecimalColumnBuffer : public ConvertedColumnBuffer<DType> {
+public:
+  DecimalColumnBuffer(const parquet::ColumnDescriptor* descr, bool is_float)
+  : ConvertedColumnBuffer<DType>(descr, is_float) {}
+
+protected:
+  void convert(int64_t count, int64_t* converted) override {
+    const parquet::ColumnDescriptor* descr = this->descr_;
+    int32_t precision = descr->type_precision();
+    int64_t fits = this->is_float_
+                   ? unscaleDecimals(this->doubles_.data(), count, descr->type_scale(), precision, converted)
+                   : unscaleDecimals(this->integers_.data(), count, 0, precision, converted);
+    KJ_REQUIRE(fits == count, "value does not fit the DECIMAL precision", descr->path()->ToDotString(), precision);
+  }
+};
+
+// Values of a date, time or timestamp column whose field has a $sourceUnit
+// are converted from that unit to the column's.
+template <typename DType>
+class TemporalColumnBuffer : public ConvertedColumnBuffer<DType> {
+public:
+  TemporalColumnBuffer(const parquet::ColumnDescriptor* descr, int64_t source_unit)
+  : ConvertedColumnBuffer<DType>(descr, false),
+    source_unit_(source_unit), unit_(temporalColumnUnit(descr->logical_type())) {
+    temporalColumnRange(descr->logical_type(), descr->physical_type(), &min_, &max_);
+  }
+
+protected:
+  int64_t source_unit_;
+  int64_t unit_;
+  int64_t min_;
+  int64_t max_;
+
+  void convert(int64_t count, int64_t* converted) override {
+    int64_t fits = convertTemporal(this->integers_.data(), count, source_unit_, unit_, min_, max_, converted);
+    KJ_REQUIRE(fits == count, "value is out of the range of its column", this->descr_->path()->ToDotString(),
+               this->integers_[(fits < count) ? fits : 0]);
+  }
+};
+
+// With the Cap'n Proto `leaf` of the column, DECIMAL columns are converted in
+// batches, as are the columns whose values have a `source_unit`.
+inline std::unique_ptr<ColumnBuffer> makeColumnBuffer(const parquet::ColumnDescriptor* descr,
+                                                      const CapnpFieldNode* leaf = nullptr,
+                                                      int64_t source_unit = 0) {
+  if ((source_unit != 0) && (temporalColumnUnit(descr->logical_type()) != 0)) {
+    switch (descr->physical_type()) {
+      case parquet::Type::INT32:
+        return std::unique_ptr<ColumnBuffer>(new TemporalColumnBuffer<parquet::Int32Type>(descr, source_unit));
+      case parquet::Type::INT64:
+        return std::unique_ptr<ColumnBuffer>(new TemporalColumnBuffer<parquet::Int64Type>(descr, source_unit));
+      default:
+        break;
+    }
+  }
+
+  if ((leaf != nullptr) && (descr->logical_type() == parquet::LogicalType::DECIMAL)) {
+    capnp::schema::Type::Which type = leaf->type.which();
+    bool is_float = (type == capnp::schema::Type::FLOAT32) || (type == capnp::schema::Type::FLOAT64);
+    switch (descr->physical_type()) {
+      case parquet::Type::INT32:
+        return std::unique_ptr<ColumnBuffer>(new DecimalColumnBuffer<parquet::Int32Type>(descr, is_float));
+      case parquet::Type::INT64:
+        return std::unique_ptr<ColumnBuffer>(new DecimalColumnBuffer<parquet::Int64Type>(descr, is_float));
+      case parquet::Type::FIXED_LEN_BYTE_ARRAY:
+        return std::unique_ptr<ColumnBuffer>(new DecimalColumnBuffer<parquet::FLBAType>(descr, is_float));
+      default:
+        break;
+    }
+  }
+
+  switch (descr->physical_type()) {
+    case parquet::Type::BOOLEAN:
+      return std::unique_ptr<ColumnBuffer>(new TypedColumnBuffer<parquet::BooleanType>(descr));
+    case parquet::Type::INT32:
+      return std::unique_ptr<ColumnBuffer>(new TypedColumnBuffer<parquet::Int32Type>(descr));
+    case parquet::Type::INT64:
+      return std::unique_ptr<ColumnBuffer>(new TypedColumnBuffer<parquet::Int64Type>(descr));
+    case parquet::Type::FLOAT:
+      return std::unique_ptr<ColumnBuffer>(new TypedColumnBuffer<parquet::FloatType>(descr));
+    case parquet::Type::DOUBLE:
+      return std::unique_ptr<ColumnBuffer>(new TypedColumnBuffer<parquet::DoubleType>(descr));
+    case parquet::Type::BYTE_ARRAY:
+      return std::unique_ptr<ColumnBuffer>(new TypedColumnBuffer<parquet::ByteArrayType>(descr));
+    case parquet::Type::FIXED_LEN_BYTE_ARRAY:
+      return std::unique_ptr<ColumnBuffer>(new TypedColumnBuffer<parquet::FLBAType>(descr));
+    default:
+      KJ_FAIL_REQUIRE("unsupported Parquet physical type", descr->path()->ToDotString());
+  }
+}
+
+// Is `field` set in `reader`, whose active union member is `active`
+// (reader.which())? Unset pointer fields and inactive union members are null.
+// Inactive members are ruled out without reading the struct.
+inline bool hasCapnpField(capnp::DynamicStruct::Reader reader, capnp::StructSchema::Field field,
+                          kj::Maybe<capnp::StructSchema::Field> active) {
+  if (isUnionMember(field)) {
+    KJ_IF_MAYBE(member, active) {
+      if (*member != field) {
+        return false;
+      }
+    } else {
+      return false;
+    }
+  }
+
+  switch (field.getType().which()) {
+    case capnp::schema::Type::TEXT:
+    case capnp::schema::Type::DATA:
+    case capnp::schema::Type::LIST:
+    case capnp::schema::Type::STRUCT:
+    case capnp::schema::Type::INTERFACE:
+    case capnp::schema::Type::ANY_POINTER:
+      return reader.has(field);
+    default:
+      return true;
+  }
+}
+
+inline bool hasCapnpField(capnp::DynamicStruct::Reader reader, capnp::StructSchema::Field field) {
+  return hasCapnpField(reader, field, isUnionMember(field) ? reader.which()
+                                                           : kj::Maybe<capnp::StructSchema::Field>(nullptr));
+}
+
+// Value of the discriminant column of a union whose active member is
+// `active`: the member's name, like enumerants (see NOTE(1) in
+// capnpparquet.h). Returns false when the member is unknown to the schema.
+inline bool unionDiscriminant(kj::Maybe<capnp::StructSchema::Field> active, capnp::DynamicValue::Reader* value) {
+  KJ_IF_MAYBE(member, active) {
+    *value = capnp::DynamicValue::Reader(member->getProto().getName());
+    return true;
+  }
+  return false;
+}
+
+// Bytes that tell map keys apart: those of Text and Data keys, the value of
+// the others.
+inline void mapKeyBytes(const capnp::DynamicValue::Reader& key, std::string* out) {
+  switch (key.getType()) {
+    case capnp::DynamicValue::TEXT: {
+      capnp::Text::Reader text = key.as<capnp::Text>();
+      out->assign(text.begin(), text.size());
+      break;
+    }
+    case capnp::DynamicValue::DATA: {
+      capnp::Data::Reader data = key.as<capnp::Data>();
+      out->assign(reinterpret_cast<const char*>(data.begin()), data.size());
+      break;
+    }
+    case capnp::DynamicValue::BOOL:
+      out->assign(1, key.as<bool>() ? '\1' : '\0');
+      break;
+    case capnp::DynamicValue::INT: {
+      int64_t value = key.as<int64_t>();
+      out->assign(reinterpret_cast<const char*>(&value), sizeof(value));
+      break;
+    }
+    case capnp::DynamicValue::UINT: {
+      uint64_t value = key.as<uint64_t>();
+      out->assign(reinterpret_cast<const char*>(&value), sizeof(value));
+      break;
+    }
+    case capnp::DynamicValue::FLOAT: {
+      double value = key.as<double>();
+      out->assign(reinterpret_cast<const char*>(&value), sizeof(value));
+      break;
+    }
+    case capnp::DynamicValue::ENUM: {
+      uint16_t value = key.as<capnp::DynamicEnum>().getRaw();
+      out->assign(reinterpret_cast<const char*>(&value), sizeof(value));
+      break;
+    }
+    default:
+      KJ_FAIL_REQUIRE("unsupported map key type", key.getType());
+  }
+}
+
+// Bytes held by a conversion: buffered messages and column data, plus what
+// parquet-cpp allocates from the Arrow memory pool while encoding.
+//
+// Buffers charge and release what they hold. The limit is not a hard
+// allocation failure; holders check exceeded() and flush early or stop
+// reading until memory is released. Zero means no limit.
+//
+class MemoryBudget {
+public:
+  explicit MemoryBudget(int64_t limit = 0, ::arrow::MemoryPool* pool = ::arrow::default_memory_pool())
+  : limit_(limit), pool_(pool), charged_(0), peak_(0) {}
+
+  KJ_DISALLOW_COPY(MemoryBudget);
+
+  void charge(int64_t bytes) {
+    int64_t charged = charged_.fetch_add(bytes, std::memory_order_relaxed) + bytes;
+    int64_t used = charged + pool_->bytes_allocated();
+    int64_t peak = peak_.load(std::memory_order_relaxed);
+    while ((used > peak) && !peak_.compare_exchange_weak(peak, used, std::memory_order_relaxed)) {}
+  }
+
+  void release(int64_t bytes) { charged_.fetch_sub(bytes, std::memory_order_relaxed); }
+
+  int64_t used() const { return charged_.load(std::memory_order_relaxed) + pool_->bytes_allocated(); }
+
+  bool exceeded() const { return (limit_ > 0) && (used() >= limit_); }
+
+  int64_t limit() const { return limit_; }
+
+  // Highest used() seen by charge(), or the pool's own peak if that is higher
+  int64_t peak() const { return std::max<int64_t>(peak_.load(std::memory_order_relaxed), pool_->max_memory()); }
+
+private:
+  int64_t              limit_;
+  ::arrow::MemoryPool* pool_;
+  std::atomic<int64_t> charged_;
+  std::atomic<int64_t> peak_;
+};
+
+// Smallest page size applyMemoryBudget() chooses
+static const int64_t MIN_BUDGET_PAGE_SIZE = 64 * 1024;
+
+// Page sizes that keep the pages parquet-cpp buffers for every column of a
+// row group within a share of `budget`, and no larger than `max_page_size`.
+inline void applyMemoryBudget(parquet::WriterProperties::Builder& builder, int64_t budget, int num_columns,
+                              int64_t max_page_size = parquet::DEFAULT_PAGE_SIZE) {
+  if ((budget > 0) && (num_columns > 0)) {
+    // A data page and a dictionary page per column, in a quarter of the budget
+    int64_t page_size = budget / (8 * static_cast<int64_t>(num_columns));
+    page_size = std::max<int64_t>(MIN_BUDGET_PAGE_SIZE, std::min<int64_t>(page_size, max_page_size));
+    builder.data_pagesize(page_size);
+    builder.dictionary_pagesize_limit(page_size);
+  }
+}
+
+// Apply the page sizes of the $schema struct's annotations.
+inline void applyWriterOptions(parquet::WriterProperties::Builder& builder, const ParquetWriterOptions& options) {
+  if (options.data_page_size > 0) {
+    builder.data_pagesize(options.data_page_size);
+  }
+  if (options.dictionary_page_limit > 0) {
+    builder.dictionary_pagesize_limit(options.dictionary_page_limit);
+  }
+}
+
+inline parquet::Compression::type parquetCompression(const std::string& name, const std::string& column) {
+  if (name == "UNCOMPRESSED") {
+    return parquet::Compression::UNCOMPRESSED;
+  } else if (name == "SNAPPY") {
+    return parquet::Compression::SNAPPY;
+  } else if (name == "GZIP") {
+    return parquet::Compression::GZIP;
+  } else if (name == "LZO") {
+    return parquet::Compression::LZO;
+  } else if (name == "BROTLI") {
+    return parquet::Compression::BROTLI;
+  } else if (name == "LZ4") {
+    return parquet::Compression::LZ4;
+  } else if (name == "ZSTD") {
+    return parquet::Compression::ZSTD;
+  }
+  KJ_FAIL_REQUIRE("unknown $compression", name, column);
+}
+
+// Apply the $encoding and $compression annotations of the leaf columns.
+//
+// parquet-cpp only writes PLAIN and dictionary encoded pages. A column
+// annotated with a delta encoding or BYTE_STREAM_SPLIT is written PLAIN with
+// the dictionary disabled, since the sorted or high cardinality values those
+// encodings are meant for only fill a dictionary that is thrown away.
+//
+// An $encoding that does not apply to the physical type of a field's own
+// column is an error. One set on a struct or list of several columns only
+// applies to the columns of a type it fits, the others keep the writer's
+// default. A warning is returned for each column written PLAIN or skipped.
+//
+// parquet-cpp has no compression level setting either, $compressionLevel is
+// checked but codecs use their default level.
+//
+inline std::vector<std::string> applyColumnOptions(parquet::WriterProperties::Builder& builder,
+                                                   const parquet::SchemaDescriptor* descr,
+                                                   const std::vector<ParquetColumnOptions>& options) {
+  std::vector<std::string> warnings;
+
+  for (int i = 0; (i < descr->num_columns()) && (i < static_cast<int>(options.size())); i++) {
+    const parquet::ColumnDescriptor* column = descr->Column(i);
+    const ParquetColumnOptions& option = options[i];
+    const std::string path = column->path()->ToDotString();
+    const parquet::Type::type physical_type = column->physical_type();
+
+    if (!option.compression.empty()) {
+      builder.compression(path, parquetCompression(option.compression, path));
+    }
+    KJ_REQUIRE(!option.has_compression_level || (option.compression_level >= 0),
+               "$compressionLevel must not be negative", path);
+
+    if (option.encoding.empty()) {
+      continue;
+    } else if (option.encoding == "DICTIONARY") {
+      builder.enable_dictionary(path);
+      continue;
+    } else if (option.encoding == "PLAIN") {
+      builder.disable_dictionary(path);
+      continue;
+    }
+
+    bool valid = false;
+    if (option.encoding == "DELTA_BINARY_PACKED") {
+      valid = (physical_type == parquet::Type::INT32) || (physical_type == parquet::Type::INT64);
+    } else if (option.encoding == "DELTA_LENGTH_BYTE_ARRAY") {
+      valid = (physical_type == parquet::Type::BYTE_ARRAY);
+    } else if (option.encoding == "DELTA_BYTE_ARRAY") {
+      valid = (physical_type == parquet::Type::BYTE_ARRAY) ||
+              (physical_type == parquet::Type::FIXED_LEN_BYTE_ARRAY);
+    } else if (option.encoding == "BYTE_STREAM_SPLIT") {
+      valid = (physical_type == parquet::Type::FLOAT) || (physical_type == parquet::Type::DOUBLE);
+    } else {
+      KJ_FAIL_REQUIRE("unknown $encoding", option.encoding, path);
+    }
+    if (!valid && option.encoding_inherited) {
+      warnings.push_back(path + ": $encoding " + option.encoding + " of an enclosing field does not apply to "
+                         "the column's type, ignored");
+      continue;
+    }
+    KJ_REQUIRE(valid, "$encoding does not apply to the physical type of the column", option.encoding, path);
+
+    builder.disable_dictionary(path);
+    warnings.push_back(path + ": $encoding " + option.encoding + " is not supported by parquet-cpp, writing PLAIN");
+  }
+
+  return warnings;
+}
+
+// False positive probabilities of the columns annotated with $bloomFilter,
+// by column index (0: no filter).
+inline std::vector<double> bloomFilterColumns(const parquet::SchemaDescriptor* descr,
+                                              const std::vector<ParquetColumnOptions>& options) {
+  std::vector<double> fpp(descr->num_columns(), 0.0);
+
+  for (int i = 0; (i < descr->num_columns()) && (i < static_cast<int>(options.size())); i++) {
+    if (options[i].bloom_filter_fpp == 0.0) {
+      continue;
+    }
+    const parquet::ColumnDescriptor* column = descr->Column(i);
+    KJ_REQUIRE((options[i].bloom_filter_fpp > 0.0) && (options[i].bloom_filter_fpp < 1.0),
+               "$bloomFilter must be between 0 and 1", column->path()->ToDotString());
+    KJ_REQUIRE(column->physical_type() != parquet::Type::BOOLEAN,
+               "$bloomFilter does not apply to BOOLEAN columns", column->path()->ToDotString());
+    fpp[i] = options[i].bloom_filter_fpp;
+  }
+
+  return fpp;
+}
+
+// Columns that get a page index: all but those below a $noPageIndex field
+inline std::vector<bool> pageIndexColumns(const std::vector<ParquetColumnOptions>& options) {
+  std::vector<bool> columns;
+  for (const auto& option : options) {
+    columns.push_back(option.page_index);
+  }
+  return columns;
+}
+
+// Writer properties with the page sizes and column settings of a schema's annotations
+inline std::shared_ptr<parquet::WriterProperties> schemaWriterProperties(const CapnpSchemaFile& schema) {
+  parquet::WriterProperties::Builder builder;
+  applyWriterOptions(builder, schema.writerOptions());
+  applyColumnOptions(builder, schema.descr(), schema.columnOptions());
+  return builder.build();
+}
+
+// Shreds Cap'n Proto messages into the column buffers of one row group
+// (Dremel encoding).
+//
+// Values are shredded a level at a time rather than one value at a time: the
+// elements of all the lists at a node of the column map are gathered in one
+// vector of entries, with their levels, then each child of the node is
+// filled from it in a loop and leaf columns append it as a batch. Nested
+// lists never recurse per value, only along the column map, whose depth
+// bounds the scratch vectors kept between rows.
+//
+// Lists of structs are read a field at a time across their elements, each
+// element found at its offset in the list from the list's step (the size of
+// its elements), so the fields read are close together. Maps are the
+// exception: the key and the value of an entry are read together, in one
+// pass over the list of entries.
+//
+// Shredders only read the column map, several can share one map and fill row
+// groups on different threads.
+//
+class CapnpShredder {
+public:
+  explicit CapnpShredder(const CapnpColumnMap& map, MemoryBudget* budget = nullptr)
+  : map_(map), budget_(budget), rows_(0), written_rows_(0), bytes_(0), unique_map_keys_(false) {
+    for (int i = 0; i < map_.num_columns(); i++) {
+      buffers_.push_back(makeColumnBuffer(map_.descr()->Column(i), map_.leaf(i), map_.sourceUnit(i)));
+    }
+    size_t depth = mapDepth(map_.root());
+    entries_.resize(depth + 1);
+    structs_.resize(depth + 1);
+  }
+
+  ~CapnpShredder() {
+    if (budget_ != nullptr) {
+      budget_->release(bytes_);
+    }
+  }
+
+  KJ_DISALLOW_COPY(CapnpShredder);
+
+  // Append a message as a row.
+  void shred(capnp::DynamicStruct::Reader message) {
+    int64_t before = bytes_;
+    entries_[0].clear();
+    entries_[0].push_back(valueEntry(message, 0));
+    shredEntries(map_.root(), 0);
+    rows_++;
+
+    if (budget_ != nullptr) {
+      budget_->charge(bytes_ - before);
+    }
+  }
+
+  // Append the rows of `other`, a shredder of the same column map with no
+  // rows written yet, so small row groups shredded apart can be written as
+  // one. `other` is left as it is.
+  void append(CapnpShredder& other) {
+    KJ_REQUIRE(&other.map_ == &map_, "row groups of different column maps");
+    int64_t before = bytes_;
+    for (size_t i = 0; i < buffers_.size(); i++) {
+      bytes_ += buffers_[i]->appendBuffer(*other.buffers_[i]);
+    }
+    rows_ += other.rows_;
+
+    if (budget_ != nullptr) {
+      budget_->charge(bytes_ - before);
+    }
+  }
+
+  // Write the next `rows` buffered rows (all the rows not yet written when
+  // negative) as the column chunks of `row_group`, so the rows of one
+  // shredder can be split between row groups. The ranges of column i are
+  // added to (*indexes)[i] when it is set.
+  void write(parquet::RowGroupWriter* row_group,
+             std::vector<std::unique_ptr<ColumnPageIndex>>* indexes = nullptr, int64_t rows = -1) {
+    rows = ((rows < 0) || (rows > rows_ - written_rows_)) ? rows_ - written_rows_ : rows;
+    for (size_t i = 0; i < buffers_.size(); i++) {
+      ColumnPageIndex* index = ((indexes != nullptr) && (i < indexes->size())) ? (*indexes)[i].get() : nullptr;
+      buffers_[i]->write(row_group, index, rows);
+    }
+    written_rows_ += rows;
+  }
+
+  void clear() {
+    for (auto& buffer : buffers_) {
+      buffer->clear();
+    }
+    if (budget_ != nullptr) {
+      budget_->release(bytes_);
+    }
+    rows_ = 0;
+    written_rows_ = 0;
+    bytes_ = 0;
+  }
+
+  int64_t rows() const { return rows_; }
+
+  // Rows already written by write()
+  int64_t written_rows() const { return written_rows_; }
+
+  // Approximate size of the buffered levels and values
+  int64_t byte_size() const { return bytes_; }
+
+  const CapnpColumnMap& columnMap() const { return map_; }
+
+  // Buffer of the leaf column at `column`
+  ColumnBuffer& buffer(int column) { return *buffers_[column]; }
+
+  // Fail on a map with the same key twice
+  void set_unique_map_keys(bool unique) { unique_map_keys_ = unique; }
+
+private:
+  // A struct of a level and its active union member
+  struct StructEntry {
+    capnp::DynamicStruct::Reader          reader;
+    kj::Maybe<capnp::StructSchema::Field> active;
+  };
+
+  const CapnpColumnMap&                      map_;
+  MemoryBudget*                              budget_;
+  std::vector<std::unique_ptr<ColumnBuffer>> buffers_;
+  int64_t                                    rows_;
+  int64_t                                    written_rows_;
+  int64_t                                    bytes_;
+  std::vector<std::vector<ShredEntry>>       entries_;  // by depth in the column map
+  std::vector<std::vector<StructEntry>>      structs_;  // by depth in the column map
+  std::vector<ShredEntry>                    keys_;     // map keys of a level
+  bool                                       unique_map_keys_;
+  std::unordered_set<std::string>            map_keys_;  // keys of the map being checked
+  std::string                                key_bytes_;
+
+  static size_t mapDepth(const CapnpFieldNode& node) {
+    size_t depth = 0;
+    for (const auto& child : node.children) {
+      depth = std::max(depth, mapDepth(child) + 1);
+    }
+    return depth;
+  }
+
+  // A null (or empty list) stores one entry in every leaf column below it.
+  void appendNulls(const CapnpFieldNode& node, int16_t def, int16_t rep) {
+    for (int i = node.first_column; i < node.last_column; i++) {
+      bytes_ += buffers_[i]->appendNull(def, rep);
+    }
+  }
+
+  // Shred entries_[depth], the values at `node` of the rows being shredded.
+  void shredEntries(const CapnpFieldNode& node, size_t depth) {
+    const std::vector<ShredEntry>& entries = entries_[depth];
+
+    switch (node.kind) {
+      case CapnpFieldNode::LEAF:
+      case CapnpFieldNode::DISCRIMINANT:
+        // Discriminant entries hold the member names (see shredStructs())
+        bytes_ += buffers_[node.column]->append(entries);
+        break;
+      case CapnpFieldNode::STRUCT:
+        shredStructs(node, depth);
+        break;
+      case CapnpFieldNode::LIST:
+        if (node.is_map) {
+          shredMaps(node, depth);
+        } else {
+          shredLists(node, depth);
+        }
+        break;
+      case CapnpFieldNode::UNMAPPED:
+        // List elements without a Parquet representation
+        for (const auto& entry : entries) {
+          appendNulls(node, entry.is_null ? entry.def : node.def_level, entry.rep);
+        }
+        break;
+    }
+  }
+
+  // The active union member is read once per struct, before any field. The
+  // other members are null and are not read at all.
+  void shredStructs(const CapnpFieldNode& node, size_t depth) {
+    const std::vector<ShredEntry>& entries = entries_[depth];
+    std::vector<StructEntry>& structs = structs_[depth];
+    std::vector<ShredEntry>& fields = entries_[depth + 1];
+
+    structs.clear();
+    for (const auto& entry : entries) {
+      if (entry.is_null) {
+        structs.push_back(StructEntry{capnp::DynamicStruct::Reader(), nullptr});
+      } else {
+        capnp::DynamicStruct::Reader reader = entry.value.as<capnp::DynamicStruct>();
+        structs.push_back(StructEntry{reader, reader.which()});
+      }
+    }
+
+    capnp::DynamicValue::Reader discriminant;
+    for (const auto& child : node.children) {
+      fields.clear();
+      for (size_t i = 0; i < entries.size(); i++) {
+        const ShredEntry& entry = entries[i];
+        const StructEntry& parent = structs[i];
+        if (entry.is_null) {
+          fields.push_back(entry);
+        } else if (child.kind == CapnpFieldNode::DISCRIMINANT) {
+          fields.push_back(unionDiscriminant(parent.active, &discriminant) ? valueEntry(discriminant, entry.rep)
+                                                                           : nullEntry(node.def_level, entry.rep));
+        } else if (child.is_mapped() && hasCapnpField(parent.reader, child.field, parent.active)) {
+          fields.push_back(valueEntry(parent.reader.get(child.field), entry.rep));
+        } else {
+          fields.push_back(nullEntry(node.def_level, entry.rep));
+        }
+      }
+      shredEntries(child, depth + 1);
+    }
+  }
+
+  // The elements of the lists become the next level. The first element of a
+  // list takes the repetition level of the list, the others repeat it.
+  void shredLists(const CapnpFieldNode& node, size_t depth) {
+    const std::vector<ShredEntry>& entries = entries_[depth];
+    std::vector<ShredEntry>& elements = entries_[depth + 1];
+
+    elements.clear();
+    for (const auto& entry : entries) {
+      if (entry.is_null) {
+        elements.push_back(entry);
+        continue;
+      }
+      capnp::DynamicList::Reader list = entry.value.as<capnp::DynamicList>();
+      uint size = list.size();
+      if (size == 0) {
+        elements.push_back(nullEntry(node.def_level, entry.rep));
+        continue;
+      }
+      elements.push_back(valueEntry(list[0], entry.rep));
+      for (uint i = 1; i < size; i++) {
+        elements.push_back(valueEntry(list[i], node.element_rep_level));
+      }
+    }
+
+    shredEntries(node.children[0], depth + 1);
+  }
+
+  // The key and the value of each entry of the maps are read together. Both
+  // take the repetition level of the entry: keys go straight to the key
+  // column, values become the level below the entries.
+  void shredMaps(const CapnpFieldNode& node, size_t depth) {
+    const std::vector<ShredEntry>& entries = entries_[depth];
+    const CapnpFieldNode& entry = node.children[0];
+    const CapnpFieldNode& key = entry.children[0];
+    const CapnpFieldNode& value = entry.children[1];
+    std::vector<ShredEntry>& values = entries_[depth + 2];
+
+    keys_.clear();
+    values.clear();
+    for (const auto& map : entries) {
+      if (map.is_null) {
+        keys_.push_back(map);
+        values.push_back(map);
+        continue;
+      }
+      capnp::DynamicList::Reader list = map.value.as<capnp::DynamicList>();
+      uint size = list.size();
+      if (size == 0) {
+        keys_.push_back(nullEntry(node.def_level, map.rep));
+        values.push_back(nullEntry(node.def_level, map.rep));
+        continue;
+      }
+      map_keys_.clear();
+      for (uint i = 0; i < size; i++) {
+        int16_t rep = (i == 0) ? map.rep : node.element_rep_level;
+        capnp::DynamicStruct::Reader reader = list[i].as<capnp::DynamicStruct>();
+        // A required key that is not set reads as its default value, like
+        // Cap'n Proto reads it. One in an inactive union member is stored as
+        // the type's zero value (see ColumnBuffer::appendNull()).
+        if (hasCapnpField(reader, key.field) || (key.node->is_required() && !isUnionMember(key.field))) {
+          capnp::DynamicValue::Reader key_value = reader.get(key.field);
+          if (unique_map_keys_) {
+            mapKeyBytes(key_value, &key_bytes_);
+            KJ_REQUIRE(map_keys_.insert(key_bytes_).second, "duplicate map key", node.path);
+          }
+          keys_.push_back(valueEntry(key_value, rep));
+        } else {
+          keys_.push_back(nullEntry(entry.def_level, rep));
+        }
+        if (value.is_mapped() && hasCapnpField(reader, value.field)) {
+          values.push_back(valueEntry(reader.get(value.field), rep));
+        } else {
+          values.push_back(nullEntry(entry.def_level, rep));
+        }
+      }
+    }
+
+    bytes_ += buffers_[key.column]->append(keys_);
+    shredEntries(value, depth + 2);
+  }
+};
+
+// Writes Cap'n Proto messages of a root struct as rows of a Parquet file.
+//
+// Messages are shredded into column buffers and written as a row group every
+// `row_group_rows` rows, or sooner when set_row_group_bytes() limits the
+// column data of a row group. Row groups shredded elsewhere (e.g. on pipeline
+// threads) are written with writeRowGroup(). Call close() to write the footer.
+// `metadata` is written to the footer, pass CapnpSchemaFile::metadata() to
+// store the field ids of the columns.
+//
+// Columns given a false positive probability by set_bloom_filters() get a
+// Bloom filter per column chunk. parquet-cpp has no place for them in the
+// column metadata, so each filter is written to the sink after its row group
+// and located through the CAPNP_BLOOM_FILTERS_KEY footer metadata. Page
+// indexes (see ColumnPageIndex) of the columns set by set_page_index() are
+// written the same way, under CAPNP_PAGE_INDEX_KEY, with their rows per
+// range under CAPNP_PAGE_INDEX_ROWS_KEY.
+//
+class CapnpParquetWriter {
+public:
+  static const int64_t DEFAULT_ROW_GROUP_ROWS = 64 * 1024;
+
+  CapnpParquetWriter(capnp::StructSchema root,
+                     std::shared_ptr<parquet::schema::GroupNode> schema,
+                     std::shared_ptr<parquet::OutputStream> sink,
+                     std::shared_ptr<parquet::WriterProperties> properties = parquet::default_writer_properties(),
+                     int64_t row_group_rows = DEFAULT_ROW_GROUP_ROWS,
+                     std::shared_ptr<const ::arrow::KeyValueMetadata> metadata = nullptr)
+  : sink_(sink),
+    metadata_(copyMetadata(metadata)),
+    file_writer_(parquet::ParquetFileWriter::Open(sink, schema, properties, metadata_)),
+    map_(root, file_writer_->schema(), nullptr,
+         sourceUnitsFromMetadata(metadata_, file_writer_->schema()->num_columns())),
+    shredder_(map_),
+    row_group_rows_(row_group_rows), row_group_bytes_(0), rows_written_(0), row_groups_written_(0),
+    page_index_rows_(PAGE_INDEX_RANGE_ROWS), closed_(false) {}
+
+  KJ_DISALLOW_COPY(CapnpParquetWriter);
+
+  // Append a message as a row. A row group is written when enough rows are buffered.
+  void write(capnp::DynamicStruct::Reader message) {
+    shredder_.shred(message);
+
+    if ((shredder_.rows() >= row_group_rows_) ||
+        ((row_group_bytes_ > 0) && (shredder_.byte_size() >= row_group_bytes_))) {
+      flush();
+    }
+  }
+
+  // Uncompressed column bytes that also end a row group (0: rows only)
+  void set_row_group_bytes(int64_t bytes) { row_group_bytes_ = bytes; }
+
+  // Fail on a map with the same key twice
+  void set_unique_map_keys(bool unique) { shredder_.set_unique_map_keys(unique); }
+
+  // False positive probability of the Bloom filter of each column (0: no
+  // filter), as returned by bloomFilterColumns().
+  void set_bloom_filters(const std::vector<double>& fpp) { bloom_filter_fpp_ = fpp; }
+
+  // Columns that get a page index of `range_rows` row ranges, as returned by pageIndexColumns().
+  void set_page_index(const std::vector<bool>& columns, int64_t range_rows = PAGE_INDEX_RANGE_ROWS) {
+    page_index_columns_ = columns;
+    page_index_rows_ = range_rows;
+  }
+
+  // Write the next `rows` rows of `row_group` not yet written (all of them
+  // when negative) as a row group, after any buffered rows.
+  void writeRowGroup(CapnpShredder& row_group, int64_t rows = -1) {
+    flush();
+    appendRowGroup(row_group, rows);
+  }
+
+  // Write the buffered rows as a row group.
+  void flush() {
+    appendRowGroup(shredder_, -1);
+    shredder_.clear();
+  }
+
+  // Write the buffered rows and the file footer.
+  void close() {
+    if (closed_) {
+      return;
+    }
+    flush();
+    // The file writer keeps metadata_ and serializes it in Close()
+    if (!bloom_filters_.empty()) {
+      metadata_->Append(CAPNP_BLOOM_FILTERS_KEY, formatColumnChunkLocations(bloom_filters_));
+    }
+    if (!page_indexes_.empty()) {
+      metadata_->Append(CAPNP_PAGE_INDEX_KEY, formatColumnChunkLocations(page_indexes_));
+      metadata_->Append(CAPNP_PAGE_INDEX_ROWS_KEY, std::to_string(page_index_rows_));
+    }
+    file_writer_->Close();
+    closed_ = true;
+  }
+
+  const CapnpColumnMap& columnMap() const { return map_; }
+
+  // Rows written or buffered
+  int64_t rows() const { return rows_written_ + shredder_.rows(); }
+
+  int64_t buffered_rows() const { return shredder_.rows(); }
+
+  int64_t buffered_bytes() const { return shredder_.byte_size(); }
+
+  // Bytes written to the sink so far
+  int64_t written_bytes() const { return sink_->Tell(); }
+
+private:
+  std::shared_ptr<parquet::OutputStream>      sink_;
+  std::shared_ptr<::arrow::KeyValueMetadata>  metadata_;
+  std::unique_ptr<parquet::ParquetFileWriter> file_writer_;
+  CapnpColumnMap                              map_;
+  CapnpShredder                               shredder_;
+  int64_t                                     row_group_rows_;
+  int64_t                                     row_group_bytes_;
+  int64_t                                     rows_written_;
+  int                                         row_groups_written_;
+  std::vector<double>                         bloom_filter_fpp_;
+  std::vector<ColumnChunkLocation>            bloom_filters_;
+  std::vector<bool>                           page_index_columns_;
+  int64_t                                     page_index_rows_;
+  std::vector<ColumnChunkLocation>            page_indexes_;
+  bool                                        closed_;
+
+  static std::shared_ptr<::arrow::KeyValueMetadata> copyMetadata(
+      const std::shared_ptr<const ::arrow::KeyValueMetadata>& metadata) {
+    auto copy = std::make_shared<::arrow::KeyValueMetadata>();
+    if (metadata != nullptr) {
+      for (int64_t i = 0; i < metadata->size(); i++) {
+        copy->Append(metadata->key(i), metadata->value(i));
+      }
+    }
+    return copy;
+  }
+
+  void appendRowGroup(CapnpShredder& row_group, int64_t rows) {
+    int64_t left = row_group.rows() - row_group.written_rows();
+    rows = ((rows < 0) || (rows > left)) ? left : rows;
+    if (rows == 0) {
+      return;
+    }
+
+    std::vector<std::unique_ptr<ColumnPageIndex>> indexes(page_index_columns_.size());
+    for (size_t i = 0; i < indexes.size(); i++) {
+      if (page_index_columns_[i]) {
+        indexes[i].reset(new ColumnPageIndex(page_index_rows_));
+      }
+    }
+
+    parquet::RowGroupWriter* writer = file_writer_->AppendRowGroup();
+    row_group.write(writer, &indexes, rows);
+    writer->Close();
+    writeBloomFilters(row_group);
+    writePageIndexes(indexes);
+
+    rows_written_ += rows;
+    row_groups_written_++;
+  }
+
+  // Filters are sized for the values of the chunks just written as if all were distinct.
+  void writeBloomFilters(CapnpShredder& row_group) {
+    for (int i = 0; i < static_cast<int>(bloom_filter_fpp_.size()); i++) {
+      if (bloom_filter_fpp_[i] <= 0.0) {
+        continue;
+      }
+      ColumnBuffer& buffer = row_group.buffer(i);
+      BloomFilter filter(BloomFilter::optimalNumBytes(buffer.chunk_num_values(), bloom_filter_fpp_[i]));
+      buffer.insertValues(filter);
+
+      bloom_filters_.push_back(writeColumnChunkData(i, filter.data(), filter.size()));
+    }
+  }
+
+  void writePageIndexes(const std::vector<std::unique_ptr<ColumnPageIndex>>& indexes) {
+    for (int i = 0; i < static_cast<int>(indexes.size()); i++) {
+      if (!indexes[i]) {
+        continue;
+      }
+      std::string index = indexes[i]->serialize();
+      page_indexes_.push_back(writeColumnChunkData(i, reinterpret_cast<const uint8_t*>(index.data()),
+                                                   static_cast<int64_t>(index.size())));
+    }
+  }
+
+  // Write side data of column `column` of the current row group after it
+  ColumnChunkLocation writeColumnChunkData(int column, const uint8_t* data, int64_t length) {
+    ColumnChunkLocation location;
+    location.row_group = row_groups_written_;
+    location.column = column;
+    location.offset = sink_->Tell();
+    location.length = length;
+    sink_->Write(data, length);
+    return location;
+  }
+};
+
+// Rows per row group: `requested` when set, otherwise the $rowGroupRows of
+// the schema, otherwise DEFAULT_ROW_GROUP_ROWS.
+inline int64_t resolveRowGroupRows(int64_t requested, const ParquetWriterOptions& options) {
+  if (requested > 0) {
+    return requested;
+  }
+  if (options.row_group_rows > 0) {
+    return options.row_group_rows;
+  }
+  return CapnpParquetWriter::DEFAULT_ROW_GROUP_ROWS;
+}
+
+// Limits that close the current file of a RollingParquetWriter. Zero means no limit.
+struct RollingPolicy {
+  RollingPolicy() : max_rows(0), max_bytes(0), max_seconds(0) {}
+
+  int64_t max_rows;     // rows per file
+  int64_t max_bytes;    // approximate bytes per file
+  int64_t max_seconds;  // seconds between the first row of a file and its close
+};
+
+// Opens the output stream a file is written to.
+typedef std::function<std::shared_ptr<parquet::OutputStream>(const std::string& path)> SinkFactory;
+
+inline std::shared_ptr<parquet::OutputStream> openFileSink(const std::string& path) {
+  std::shared_ptr<::arrow::io::FileOutputStream> file;
+  PARQUET_THROW_NOT_OK(::arrow::io::FileOutputStream::Open(path, &file));
+  return std::make_shared<parquet::ArrowOutputStream>(file);
+}
+
+// Flush the data of a file, or the entries of a directory, to disk.
+inline void syncPath(const std::string& path) {
+  int fd;
+  KJ_SYSCALL(fd = open(path.c_str(), O_RDONLY), path);
+  kj::AutoCloseFd file(fd);
+  KJ_SYSCALL(fsync(file.get()), path);
+}
+
+// Writes a stream of messages to a sequence of Parquet files in a directory.
+//
+// A file is written as <directory>/<prefix>-<YYYYMMDD-HHMMSS>-<sequence>.parquet.tmp
+// and renamed to drop the .tmp suffix once its footer is written, so readers
+// never see a partial file. The file is synced before the rename and the
+// directory after it, so a published file survives a crash whole. A file is
+// only opened when a message arrives, and is closed when any limit of the
+// policy is reached. Call tick() at least every timeout() milliseconds to
+// close files whose time window has passed. A file that is never closed
+// keeps its .tmp name.
+//
+class RollingParquetWriter {
+public:
+  typedef std::chrono::steady_clock::time_point time_point;
+
+  RollingParquetWriter(capnp::StructSchema root,
+                       std::shared_ptr<parquet::schema::GroupNode> schema,
+                       const std::string& directory, const std::string& prefix,
+                       const RollingPolicy& policy,
+                       std::shared_ptr<parquet::WriterProperties> properties = parquet::default_writer_properties(),
+                       int64_t row_group_rows = CapnpParquetWriter::DEFAULT_ROW_GROUP_ROWS,
+                       SinkFactory open_sink = openFileSink,
+                       std::shared_ptr<const ::arrow::KeyValueMetadata> metadata = nullptr)
+  : root_(root), schema_(schema), directory_(directory), prefix_(prefix), policy_(policy),
+    properties_(properties), row_group_rows_(row_group_rows), open_sink_(open_sink),
+    metadata_(metadata), page_index_rows_(PAGE_INDEX_RANGE_ROWS), sequence_(0), files_written_(0) {}
+
+  KJ_DISALLOW_COPY(RollingParquetWriter);
+
+  void write(capnp::DynamicStruct::Reader message) {
+    if (writer_ == nullptr) {
+      open(std::chrono::steady_clock::now());
+    }
+
+    writer_->write(message);
+    rollIfFull();
+  }
+
+  // Write a row group shredded elsewhere. `first_row` is when its first row
+  // arrived, the time window of a new file starts then. The rows are split
+  // between files where a file reaches the rows or bytes of the policy.
+  void writeRowGroup(CapnpShredder& row_group, time_point first_row) {
+    while (row_group.written_rows() < row_group.rows()) {
+      if (writer_ == nullptr) {
+        open(first_row);
+      }
+
+      int64_t left = row_group.rows() - row_group.written_rows();
+      int64_t rows = left;
+      bool full = false;
+      if ((policy_.max_rows > 0) && (writer_->rows() + left >= policy_.max_rows)) {
+        rows = policy_.max_rows - writer_->rows();
+        full = true;
+      }
+      if (policy_.max_bytes > 0) {
+        // Buffered bytes of the rows left, more than they take once encoded
+        double bytes = static_cast<double>(row_group.byte_size()) * left / row_group.rows();
+        int64_t room = policy_.max_bytes - writer_->written_bytes() - writer_->buffered_bytes();
+        if (bytes >= room) {
+          rows = std::min(rows, std::max<int64_t>(1, static_cast<int64_t>(left * (room / bytes))));
+          full = true;
+        }
+      }
+
+      writer_->writeRowGroup(row_group, rows);
+      if (full) {
+        roll();
+      } else {
+        rollIfFull();
+      }
+    }
+  }
+
+  // Close the current file when its time window has passed.
+  void tick() {
+    if ((writer_ != nullptr) && (timeout() == 0)) {
+      roll();
+    }
+  }
+
+  // Milliseconds until the current file has to be closed, or -1 when there is no deadline.
+  int timeout() const {
+    if ((writer_ == nullptr) || (policy_.max_seconds <= 0)) {
+      return -1;
+    }
+    auto deadline = opened_ + std::chrono::seconds(policy_.max_seconds);
+    auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(
+        deadline - std::chrono::steady_clock::now()).count();
+    return static_cast<int>(std::max<int64_t>(0, remaining));
+  }
+
+  // Close and publish the current file.
+  void roll() {
+    if (writer_ == nullptr) {
+      return;
+    }
+    writer_->close();
+    writer_.reset();
+
+    // Without the syncs a crash can leave the new name on an empty or
+    // partial file, or lose the rename of a complete one
+    syncPath(temp_path_);
+    KJ_SYSCALL(rename(temp_path_.c_str(), path_.c_str()), temp_path_, path_);
+    syncPath(directory_);
+    files_written_++;
+  }
+
+  void close() { roll(); }
+
+  // A file is open and not yet published
+  bool is_open() const { return writer_ != nullptr; }
+
+  int64_t files_written() const { return files_written_; }
+
+  // Sequence number of the next file. A writer for a directory another
+  // writer wrote to starts after the last number of that writer, so a file
+  // opened within the same second does not take the name of a published one.
+  int64_t sequence() const { return sequence_; }
+  void set_sequence(int64_t sequence) { sequence_ = sequence; }
+
+  // Bloom filters of the files opened after this call, see CapnpParquetWriter
+  void set_bloom_filters(const std::vector<double>& fpp) { bloom_filter_fpp_ = fpp; }
+
+  // Page indexes of the files opened after this call, see CapnpParquetWriter
+  void set_page_index(const std::vector<bool>& columns, int64_t range_rows = PAGE_INDEX_RANGE_ROWS) {
+    page_index_columns_ = columns;
+    page_index_rows_ = range_rows;
+  }
+
+  const RollingPolicy& policy() const { return policy_; }
+
+private:
+  capnp::StructSchema                         root_;
+  std::shared_ptr<parquet::schema::GroupNode> schema_;
+  std::string                                 directory_;
+  std::string                                 prefix_;
+  RollingPolicy                               policy_;
+  std::shared_ptr<parquet::WriterProperties>  properties_;
+  int64_t                                     row_group_rows_;
+  SinkFactory                                 open_sink_;
+  std::shared_ptr<const ::arrow::KeyValueMetadata> metadata_;
+  std::vector<double>                         bloom_filter_fpp_;
+  std::vector<bool>                           page_index_columns_;
+  int64_t                                     page_index_rows_;
+  std::unique_ptr<CapnpParquetWriter>         writer_;
+  time_point                                  opened_;
+  std::string                                 path_;
+  std::string                                 temp_path_;
+  int64_t                                     sequence_;
+  int64_t                                     files_written_;
+
+  void open(time_point first_row) {
+    char stamp[32];
+    time_t now = time(nullptr);
+    struct tm utc;
+    gmtime_r(&now, &utc);
+    strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", &utc);
+
+    path_ = directory_ + "/" + prefix_ + "-" + stamp + "-" + std::to_string(sequence_++) + ".parquet";
+    temp_path_ = path_ + ".tmp";
+
+    writer_.reset(new CapnpParquetWriter(root_, schema_, open_sink_(temp_path_), properties_,
+                                         row_group_rows_, metadata_));
+    writer_->set_bloom_filters(bloom_filter_fpp_);
+    writer_->set_page_index(page_index_columns_, page_index_rows_);
+    opened_ = first_row;
+  }
+
+  void rollIfFull() {
+    if (((policy_.max_rows > 0) && (writer_->rows() >= policy_.max_rows)) ||
+        ((policy_.max_bytes > 0) &&
+         (writer_->written_bytes() + writer_->buffered_bytes() >= policy_.max_bytes))) {
+      roll();
+    }
+  }
+};
+
+};  // namespace capnpparquet
+
+#endif  // _CAPNP2PARQUET_H_
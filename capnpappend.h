@@ -0,0 +1,156 @@
+/*
+ * Copyright 2017 Rene Sugar
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * @file capnpappend.h
+ * @author Rene Sugar <rene.sugar@gmail.com>
+ * @brief Write a Parquet file from the encoded row groups of other Parquet files.
+ */
+#ifndef _CAPNPAPPEND_H_
+#define _CAPNPAPPEND_H_
+
+#include <arrow/io/interfaces.h>
+#include <arrow/io/memory.h>
+#include <arrow/util/key_value_metadata.h>
+
+#include <parquet/api/reader.h>
+#include <parquet/api/writer.h>
+#include <parquet/util/memory.h>
+
+#include <kj/debug.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace capnpparquet {
+
+// First and last bytes of a Parquet file
+static const uint8_t PARQUET_FILE_MAGIC[4] = {'P', 'A', 'R', '1'};
+
+// Bytes read at a time when copying a column chunk
+static const int64_t APPEND_COPY_BYTES = 4 * 1024 * 1024;
+
+// Writes a Parquet file whose row groups are copied from other files with
+// the same schema, column chunk by column chunk, without decompressing a
+// page. Their statistics are copied with them.
+//
+// parquet-cpp cannot append a column chunk to a file it writes, so the
+// chunks are copied by their byte range and the footer is rebuilt with
+// FileMetaDataBuilder. Row groups encoded on other threads, each to a file
+// in memory, are written this way in the order they are appended.
+//
+// `metadata` is written to the footer by close(), entries can be appended to
+// it until then.
+//
+class ParquetRowGroupAppender {
+public:
+  ParquetRowGroupAppender(std::shared_ptr<parquet::OutputStream> sink, const parquet::SchemaDescriptor* descr,
+                          std::shared_ptr<parquet::WriterProperties> properties,
+                          std::shared_ptr<::arrow::KeyValueMetadata> metadata)
+  : sink_(sink), descr_(descr), metadata_(metadata), row_groups_(0), closed_(false) {
+    // The builder keeps metadata_ and serializes it in Finish()
+    builder_ = parquet::FileMetaDataBuilder::Make(descr, properties, metadata_);
+    sink_->Write(PARQUET_FILE_MAGIC, sizeof(PARQUET_FILE_MAGIC));
+  }
+
+  KJ_DISALLOW_COPY(ParquetRowGroupAppender);
+
+  // Copy the row group `index` of `file`, whose footer is `metadata`. `path`
+  // names the file in errors.
+  void append(::arrow::io::RandomAccessFile* file, const std::string& path,
+              const parquet::FileMetaData& metadata, int index) {
+    std::unique_ptr<parquet::RowGroupMetaData> row_group = metadata.RowGroup(index);
+    parquet::RowGroupMetaDataBuilder* row_group_builder = builder_->AppendRowGroup();
+    row_group_builder->set_num_rows(row_group->num_rows());
+
+    for (int i = 0; i < row_group->num_columns(); i++) {
+      std::unique_ptr<parquet::ColumnChunkMetaData> chunk = row_group->ColumnChunk(i);
+      bool has_dictionary = chunk->has_dictionary_page();
+      int64_t start = has_dictionary ? chunk->dictionary_page_offset() : chunk->data_page_offset();
+      int64_t offset = sink_->Tell();
+      copyBytes(file, path, start, chunk->total_compressed_size());
+
+      parquet::ColumnChunkMetaDataBuilder* column = row_group_builder->NextColumnChunk();
+      if (chunk->is_stats_set()) {
+        column->SetStatistics(descr_->Column(i)->sort_order() == parquet::SortOrder::SIGNED,
+                              chunk->statistics()->Encode());
+      }
+      // A dictionary chunk with PLAIN pages fell back from its dictionary
+      const std::vector<parquet::Encoding::type>& encodings = chunk->encodings();
+      bool fallback = has_dictionary &&
+                      (std::find(encodings.begin(), encodings.end(), parquet::Encoding::PLAIN) != encodings.end());
+      column->Finish(chunk->num_values(), has_dictionary ? offset : 0, 0,
+                     offset + (chunk->data_page_offset() - start), chunk->total_compressed_size(),
+                     chunk->total_uncompressed_size(), has_dictionary, fallback);
+      column->WriteTo(sink_.get());
+    }
+    row_group_builder->Finish(row_group->total_byte_size());
+    row_groups_++;
+  }
+
+  // Copy every row group of a file in memory
+  void append(std::shared_ptr<::arrow::Buffer> encoded, const std::string& path) {
+    auto buffer = std::make_shared<::arrow::io::BufferReader>(encoded);
+    std::shared_ptr<parquet::FileMetaData> metadata = parquet::ReadMetaData(buffer);
+    for (int r = 0; r < metadata->num_row_groups(); r++) {
+      append(buffer.get(), path, *metadata, r);
+    }
+  }
+
+  // Copy bytes[offset, offset + length) of `file` to the end of the sink
+  void copyBytes(::arrow::io::RandomAccessFile* file, const std::string& path, int64_t offset, int64_t length) {
+    while (length > 0) {
+      std::shared_ptr<::arrow::Buffer> buffer;
+      int64_t size = std::min(length, APPEND_COPY_BYTES);
+      PARQUET_THROW_NOT_OK(file->ReadAt(offset, size, &buffer));
+      KJ_REQUIRE(buffer->size() == size, "column chunk past the end of the file", path);
+      sink_->Write(buffer->data(), size);
+      offset += size;
+      length -= size;
+    }
+  }
+
+  // Write the footer and close the sink
+  void close() {
+    if (closed_) {
+      return;
+    }
+    closed_ = true;
+    std::unique_ptr<parquet::FileMetaData> metadata = builder_->Finish();
+    parquet::WriteFileMetaData(*metadata, sink_.get());
+    sink_->Close();
+  }
+
+  // Offset of the next byte written
+  int64_t tell() { return sink_->Tell(); }
+
+  int row_groups() const { return row_groups_; }
+
+private:
+  std::shared_ptr<parquet::OutputStream>          sink_;
+  const parquet::SchemaDescriptor*                descr_;
+  std::shared_ptr<::arrow::KeyValueMetadata>      metadata_;
+  std::unique_ptr<parquet::FileMetaDataBuilder>   builder_;
+  int                                             row_groups_;
+  bool                                            closed_;
+};
+
+};  // namespace capnpparquet
+
+#endif  // _CAPNPAPPEND_H_
@@ -0,0 +1,576 @@
+/*
+ * Copyright 2017 Rene Sugar
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * @file capnparrow.h
+ * @author Rene Sugar <rene.sugar@gmail.com>
+ * @brief Build Arrow record batches from Cap'n Proto messages with a capnpc-parquet schema.
+ */
+#ifndef _CAPNPARROW_H_
+#define _CAPNPARROW_H_
+
+#include <arrow/api.h>
+#include <arrow/io/file.h>
+#include <arrow/ipc/api.h>
+#include <arrow/util/decimal.h>
+
+#include <parquet/arrow/writer.h>
+#include <parquet/exception.h>
+
+#include <capnp/dynamic.h>
+
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "capnp2parquet.h"
+
+namespace capnpparquet {
+
+// Arrow type of a leaf column, the Arrow column of the table at the top of capnpparquet.h.
+inline std::shared_ptr<::arrow::DataType> arrowLeafType(const parquet::ColumnDescriptor* descr) {
+  switch (descr->physical_type()) {
+    case parquet::Type::BOOLEAN:
+      return ::arrow::boolean();
+    case parquet::Type::INT32:
+      switch (descr->logical_type()) {
+        case parquet::LogicalType::INT_8:       return ::arrow::int8();
+        case parquet::LogicalType::INT_16:      return ::arrow::int16();
+        case parquet::LogicalType::UINT_8:      return ::arrow::uint8();
+        case parquet::LogicalType::UINT_16:     return ::arrow::uint16();
+        case parquet::LogicalType::UINT_32:     return ::arrow::uint32();
+        case parquet::LogicalType::DATE:        return ::arrow::date32();
+        case parquet::LogicalType::TIME_MILLIS: return ::arrow::time32(::arrow::TimeUnit::MILLI);
+        case parquet::LogicalType::DECIMAL:
+          return ::arrow::decimal(descr->type_precision(), descr->type_scale());
+        default:                                return ::arrow::int32();
+      }
+    case parquet::Type::INT64:
+      switch (descr->logical_type()) {
+        case parquet::LogicalType::UINT_32:          return ::arrow::uint32();
+        case parquet::LogicalType::UINT_64:          return ::arrow::uint64();
+        case parquet::LogicalType::TIME_MICROS:      return ::arrow::time64(::arrow::TimeUnit::MICRO);
+        case parquet::LogicalType::TIMESTAMP_MILLIS: return ::arrow::timestamp(::arrow::TimeUnit::MILLI);
+        case parquet::LogicalType::TIMESTAMP_MICROS: return ::arrow::timestamp(::arrow::TimeUnit::MICRO);
+        case parquet::LogicalType::DECIMAL:
+          return ::arrow::decimal(descr->type_precision(), descr->type_scale());
+        default:                                     return ::arrow::int64();
+      }
+    case parquet::Type::FLOAT:
+      return ::arrow::float32();
+    case parquet::Type::DOUBLE:
+      return ::arrow::float64();
+    case parquet::Type::BYTE_ARRAY:
+      switch (descr->logical_type()) {
+        case parquet::LogicalType::UTF8:
+        case parquet::LogicalType::ENUM:
+        case parquet::LogicalType::JSON:
+          return ::arrow::utf8();
+        case parquet::LogicalType::DECIMAL:
+          return ::arrow::decimal(descr->type_precision(), descr->type_scale());
+        default:
+          return ::arrow::binary();
+      }
+    case parquet::Type::FIXED_LEN_BYTE_ARRAY:
+      if (descr->logical_type() == parquet::LogicalType::DECIMAL) {
+        return ::arrow::decimal(descr->type_precision(), descr->type_scale());
+      }
+      return ::arrow::fixed_size_binary(descr->type_length());
+    default:
+      KJ_FAIL_REQUIRE("unsupported Parquet physical type", descr->path()->ToDotString());
+  }
+}
+
+// Arrow field of a Cap'n Proto value, named after its Parquet node. Returns
+// nullptr for values without a Parquet representation, like unmapped fields
+// and structs without mapped fields.
+inline std::shared_ptr<::arrow::Field> arrowField(const CapnpFieldNode& node,
+                                                  const parquet::SchemaDescriptor* descr) {
+  std::shared_ptr<::arrow::DataType> type;
+
+  switch (node.kind) {
+    case CapnpFieldNode::LEAF:
+    case CapnpFieldNode::DISCRIMINANT:
+      type = arrowLeafType(descr->Column(node.column));
+      break;
+    case CapnpFieldNode::STRUCT: {
+      std::vector<std::shared_ptr<::arrow::Field>> fields;
+      for (const auto& child : node.children) {
+        auto field = arrowField(child, descr);
+        if (field != nullptr) {
+          fields.push_back(field);
+        }
+      }
+      if (fields.empty()) {
+        return nullptr;
+      }
+      type = ::arrow::struct_(fields);
+      break;
+    }
+    case CapnpFieldNode::LIST: {
+      auto element = arrowField(node.children[0], descr);
+      if (element == nullptr) {
+        return nullptr;
+      }
+      type = ::arrow::list(element);
+      break;
+    }
+    case CapnpFieldNode::UNMAPPED:
+      return nullptr;
+  }
+
+  return ::arrow::field(node.node->name(), type, node.node->is_optional());
+}
+
+// Appends Cap'n Proto values to the Arrow builder of one node of the column map.
+class ArrowValueBuilder {
+public:
+  ArrowValueBuilder(const CapnpFieldNode& node, ::arrow::ArrayBuilder* builder)
+  : node_(node), builder_(builder), nullable_(node.node->is_optional()) {}
+
+  virtual ~ArrowValueBuilder() {}
+
+  virtual void append(const capnp::DynamicValue::Reader& value) = 0;
+
+  // Append a null, or a default value when the Parquet node is required
+  virtual void appendNull() = 0;
+
+  // Pre-size for `rows` more values
+  virtual void reserve(int64_t rows) {
+    PARQUET_THROW_NOT_OK(builder_->Reserve(rows));
+  }
+
+  const CapnpFieldNode& node() const { return node_; }
+
+protected:
+  const CapnpFieldNode& node_;
+  ::arrow::ArrayBuilder* builder_;
+  bool                   nullable_;
+};
+
+inline std::unique_ptr<ArrowValueBuilder> makeArrowValueBuilder(const CapnpFieldNode& node,
+                                                                const CapnpColumnMap& map,
+                                                                ::arrow::ArrayBuilder* builder);
+
+// Append the fields of a struct to the builders of its children. The active
+// union member is read once, the other members are appended as nulls.
+inline void appendArrowFields(std::vector<std::unique_ptr<ArrowValueBuilder>>& children,
+                              capnp::DynamicStruct::Reader reader) {
+  kj::Maybe<capnp::StructSchema::Field> active = reader.which();
+  capnp::DynamicValue::Reader discriminant;
+
+  for (auto& child : children) {
+    const CapnpFieldNode& node = child->node();
+    if (node.kind == CapnpFieldNode::DISCRIMINANT) {
+      if (unionDiscriminant(active, &discriminant)) {
+        child->append(discriminant);
+      } else {
+        child->appendNull();
+      }
+    } else if (hasCapnpField(reader, node.field, active)) {
+      child->append(reader.get(node.field));
+    } else {
+      child->appendNull();
+    }
+  }
+}
+
+// Feeds Cap'n Proto byte values to an Arrow binary or string builder (see pushCapnpBytes).
+class ArrowBinaryValues {
+public:
+  explicit ArrowBinaryValues(::arrow::BinaryBuilder* builder) : builder_(builder) {}
+
+  void push(const uint8_t* value, size_t length) {
+    PARQUET_THROW_NOT_OK(builder_->Append(value, static_cast<int32_t>(length)));
+  }
+
+private:
+  ::arrow::BinaryBuilder* builder_;
+};
+
+// Feeds Cap'n Proto byte values to an Arrow fixed size binary builder,
+// truncated or zero padded like FIXED_LEN_BYTE_ARRAY values.
+class ArrowFixedSizeBinaryValues {
+public:
+  explicit ArrowFixedSizeBinaryValues(::arrow::FixedSizeBinaryBuilder* builder, int32_t byte_width)
+  : builder_(builder), bytes_(byte_width, 0) {}
+
+  void push(const uint8_t* value, size_t length) {
+    std::fill(bytes_.begin(), bytes_.end(), 0);
+    if (length > 0) {
+      memcpy(bytes_.data(), value, std::min<size_t>(length, bytes_.size()));
+    }
+    PARQUET_THROW_NOT_OK(builder_->Append(bytes_.data()));
+  }
+
+private:
+  ::arrow::FixedSizeBinaryBuilder* builder_;
+  std::vector<uint8_t>             bytes_;
+};
+
+// Values of a date, time or timestamp column whose field has a
+// `source_unit` are converted to the column's unit, as TemporalColumnBuffer
+// converts them for a Parquet file.
+class ArrowLeafBuilder : public ArrowValueBuilder {
+public:
+  ArrowLeafBuilder(const CapnpFieldNode& node, const parquet::ColumnDescriptor* descr,
+                   ::arrow::ArrayBuilder* builder, int64_t source_unit = 0)
+  : ArrowValueBuilder(node, builder), descr_(descr), type_(builder->type()->id()),
+    unit_(temporalColumnUnit(descr->logical_type())), source_unit_((unit_ != 0) ? source_unit : 0) {
+    temporalColumnRange(descr->logical_type(), descr->physical_type(), &min_, &max_);
+  }
+
+  void append(const capnp::DynamicValue::Reader& value) override {
+    switch (type_) {
+      case ::arrow::Type::BOOL:
+        PARQUET_THROW_NOT_OK(as<::arrow::BooleanBuilder>()->Append(capnpInteger(value, descr_) != 0));
+        break;
+      case ::arrow::Type::INT8:      appendInteger<::arrow::Int8Type>(value); break;
+      case ::arrow::Type::INT16:     appendInteger<::arrow::Int16Type>(value); break;
+      case ::arrow::Type::INT32:     appendInteger<::arrow::Int32Type>(value); break;
+      case ::arrow::Type::INT64:     appendInteger<::arrow::Int64Type>(value); break;
+      case ::arrow::Type::UINT8:     appendInteger<::arrow::UInt8Type>(value); break;
+      case ::arrow::Type::UINT16:    appendInteger<::arrow::UInt16Type>(value); break;
+      case ::arrow::Type::UINT32:    appendInteger<::arrow::UInt32Type>(value); break;
+      case ::arrow::Type::UINT64:    appendInteger<::arrow::UInt64Type>(value); break;
+      case ::arrow::Type::DATE32:    appendInteger<::arrow::Date32Type>(value); break;
+      case ::arrow::Type::TIME32:    appendInteger<::arrow::Time32Type>(value); break;
+      case ::arrow::Type::TIME64:    appendInteger<::arrow::Time64Type>(value); break;
+      case ::arrow::Type::TIMESTAMP: appendInteger<::arrow::TimestampType>(value); break;
+      case ::arrow::Type::FLOAT:
+        PARQUET_THROW_NOT_OK(as<::arrow::FloatBuilder>()->Append(
+            static_cast<float>(capnpDouble(value, descr_))));
+        break;
+      case ::arrow::Type::DOUBLE:
+        PARQUET_THROW_NOT_OK(as<::arrow::DoubleBuilder>()->Append(capnpDouble(value, descr_)));
+        break;
+      case ::arrow::Type::STRING:
+      case ::arrow::Type::BINARY: {
+        ArrowBinaryValues values(as<::arrow::BinaryBuilder>());
+        pushCapnpBytes(values, value, descr_);
+        break;
+      }
+      case ::arrow::Type::FIXED_SIZE_BINARY: {
+        ArrowFixedSizeBinaryValues values(as<::arrow::FixedSizeBinaryBuilder>(), descr_->type_length());
+        pushCapnpBytes(values, value, descr_);
+        break;
+      }
+      case ::arrow::Type::DECIMAL:
+        // capnpInteger() scales floating point values by the column's scale
+        PARQUET_THROW_NOT_OK(as<::arrow::Decimal128Builder>()->Append(
+            ::arrow::Decimal128(capnpInteger(value, descr_))));
+        break;
+      default:
+        KJ_FAIL_REQUIRE("unsupported Arrow type", builder_->type()->ToString());
+    }
+  }
+
+  void appendNull() override {
+    if (nullable_) {
+      PARQUET_THROW_NOT_OK(appendArrowNull());
+    } else {
+      append(capnp::DynamicValue::Reader(capnp::VOID));
+    }
+  }
+
+private:
+  const parquet::ColumnDescriptor* descr_;
+  ::arrow::Type::type              type_;
+  int64_t                          unit_;
+  int64_t                          source_unit_;
+  int64_t                          min_;
+  int64_t                          max_;
+
+  template <typename Builder>
+  Builder* as() { return static_cast<Builder*>(builder_); }
+
+  template <typename ArrowType>
+  void appendInteger(const capnp::DynamicValue::Reader& value) {
+    typedef typename ArrowType::c_type T;
+    int64_t integer = capnpInteger(value, descr_);
+    if (source_unit_ != 0) {
+      int64_t converted;
+      KJ_REQUIRE(convertTemporalValue(integer, source_unit_, unit_, min_, max_, &converted),
+                 "value is out of the range of its column", descr_->path()->ToDotString(), integer);
+      integer = converted;
+    }
+    PARQUET_THROW_NOT_OK(as<::arrow::NumericBuilder<ArrowType>>()->Append(static_cast<T>(integer)));
+  }
+
+  ::arrow::Status appendArrowNull() {
+    switch (type_) {
+      case ::arrow::Type::BOOL:              return as<::arrow::BooleanBuilder>()->AppendNull();
+      case ::arrow::Type::INT8:              return as<::arrow::Int8Builder>()->AppendNull();
+      case ::arrow::Type::INT16:             return as<::arrow::Int16Builder>()->AppendNull();
+      case ::arrow::Type::INT32:             return as<::arrow::Int32Builder>()->AppendNull();
+      case ::arrow::Type::INT64:             return as<::arrow::Int64Builder>()->AppendNull();
+      case ::arrow::Type::UINT8:             return as<::arrow::UInt8Builder>()->AppendNull();
+      case ::arrow::Type::UINT16:            return as<::arrow::UInt16Builder>()->AppendNull();
+      case ::arrow::Type::UINT32:            return as<::arrow::UInt32Builder>()->AppendNull();
+      case ::arrow::Type::UINT64:            return as<::arrow::UInt64Builder>()->AppendNull();
+      case ::arrow::Type::DATE32:            return as<::arrow::Date32Builder>()->AppendNull();
+      case ::arrow::Type::TIME32:            return as<::arrow::Time32Builder>()->AppendNull();
+      case ::arrow::Type::TIME64:            return as<::arrow::Time64Builder>()->AppendNull();
+      case ::arrow::Type::TIMESTAMP:         return as<::arrow::TimestampBuilder>()->AppendNull();
+      case ::arrow::Type::FLOAT:             return as<::arrow::FloatBuilder>()->AppendNull();
+      case ::arrow::Type::DOUBLE:            return as<::arrow::DoubleBuilder>()->AppendNull();
+      case ::arrow::Type::STRING:
+      case ::arrow::Type::BINARY:            return as<::arrow::BinaryBuilder>()->AppendNull();
+      case ::arrow::Type::FIXED_SIZE_BINARY:
+      case ::arrow::Type::DECIMAL:           return as<::arrow::FixedSizeBinaryBuilder>()->AppendNull();
+      default:
+        KJ_FAIL_REQUIRE("unsupported Arrow type", builder_->type()->ToString());
+    }
+  }
+};
+
+class ArrowStructBuilder : public ArrowValueBuilder {
+public:
+  ArrowStructBuilder(const CapnpFieldNode& node, const CapnpColumnMap& map,
+                     ::arrow::ArrayBuilder* builder)
+  : ArrowValueBuilder(node, builder) {
+    // Children are in the order arrowField() added them
+    int index = 0;
+    for (const auto& child : node.children) {
+      if (arrowField(child, map.descr()) != nullptr) {
+        children_.push_back(makeArrowValueBuilder(child, map, structBuilder()->field_builder(index++)));
+      }
+    }
+  }
+
+  void append(const capnp::DynamicValue::Reader& value) override {
+    PARQUET_THROW_NOT_OK(structBuilder()->Append(true));
+    appendArrowFields(children_, value.as<capnp::DynamicStruct>());
+  }
+
+  void appendNull() override {
+    // Every child holds an entry for a null struct too
+    PARQUET_THROW_NOT_OK(structBuilder()->Append(!nullable_));
+    for (auto& child : children_) {
+      child->appendNull();
+    }
+  }
+
+  void reserve(int64_t rows) override {
+    ArrowValueBuilder::reserve(rows);
+    for (auto& child : children_) {
+      child->reserve(rows);
+    }
+  }
+
+private:
+  std::vector<std::unique_ptr<ArrowValueBuilder>> children_;
+
+  ::arrow::StructBuilder* structBuilder() { return static_cast<::arrow::StructBuilder*>(builder_); }
+};
+
+// The element count of a batch is not known up front, only the list offsets are pre-sized.
+class ArrowListBuilder : public ArrowValueBuilder {
+public:
+  ArrowListBuilder(const CapnpFieldNode& node, const CapnpColumnMap& map,
+                   ::arrow::ArrayBuilder* builder)
+  : ArrowValueBuilder(node, builder),
+    element_(makeArrowValueBuilder(node.children[0], map, listBuilder()->value_builder())) {}
+
+  void append(const capnp::DynamicValue::Reader& value) override {
+    capnp::DynamicList::Reader list = value.as<capnp::DynamicList>();
+    PARQUET_THROW_NOT_OK(listBuilder()->Append(true));
+    for (auto element : list) {
+      element_->append(element);
+    }
+  }
+
+  // A null list of a required node is an empty list, as in the Parquet file
+  void appendNull() override {
+    PARQUET_THROW_NOT_OK(listBuilder()->Append(!nullable_));
+  }
+
+private:
+  std::unique_ptr<ArrowValueBuilder> element_;
+
+  ::arrow::ListBuilder* listBuilder() { return static_cast<::arrow::ListBuilder*>(builder_); }
+};
+
+inline std::unique_ptr<ArrowValueBuilder> makeArrowValueBuilder(const CapnpFieldNode& node,
+                                                                const CapnpColumnMap& map,
+                                                                ::arrow::ArrayBuilder* builder) {
+  switch (node.kind) {
+    case CapnpFieldNode::LEAF:
+    case CapnpFieldNode::DISCRIMINANT:
+      return std::unique_ptr<ArrowValueBuilder>(new ArrowLeafBuilder(node, map.descr()->Column(node.column), builder,
+                                                                     map.sourceUnit(node.column)));
+    case CapnpFieldNode::STRUCT:
+      return std::unique_ptr<ArrowValueBuilder>(new ArrowStructBuilder(node, map, builder));
+    case CapnpFieldNode::LIST:
+      return std::unique_ptr<ArrowValueBuilder>(new ArrowListBuilder(node, map, builder));
+    default:
+      KJ_FAIL_REQUIRE("field has no Arrow representation", node.path);
+  }
+}
+
+// Builds Arrow record batches from Cap'n Proto messages of a root struct.
+//
+// Each mapped field of the root struct is a column, with the Arrow type of the
+// table at the top of capnpparquet.h and the name and nullability of its
+// Parquet node. Values are converted from the source units of the map. Messages are appended with append() or appendBatch(); finish()
+// returns the appended rows as a record batch and starts the next one.
+//
+// Like CapnpShredder, builders only read the column map and several can
+// share one map on different threads.
+//
+class CapnpArrowBuilder {
+public:
+  explicit CapnpArrowBuilder(const CapnpColumnMap& map,
+                             ::arrow::MemoryPool* pool = ::arrow::default_memory_pool())
+  : map_(map), rows_(0) {
+    std::vector<std::shared_ptr<::arrow::Field>> fields;
+
+    for (const auto& child : map_.root().children) {
+      auto field = arrowField(child, map_.descr());
+      if (field == nullptr) {
+        continue;
+      }
+
+      std::unique_ptr<::arrow::ArrayBuilder> builder;
+      PARQUET_THROW_NOT_OK(::arrow::MakeBuilder(pool, field->type(), &builder));
+      columns_.push_back(makeArrowValueBuilder(child, map_, builder.get()));
+      builders_.push_back(std::move(builder));
+      fields.push_back(field);
+    }
+
+    schema_ = ::arrow::schema(fields);
+  }
+
+  KJ_DISALLOW_COPY(CapnpArrowBuilder);
+
+  std::shared_ptr<::arrow::Schema> schema() const { return schema_; }
+
+  // Pre-size the builders for `rows` more messages.
+  void reserve(int64_t rows) {
+    for (auto& column : columns_) {
+      column->reserve(rows);
+    }
+  }
+
+  // Append a message as a row.
+  void append(capnp::DynamicStruct::Reader message) {
+    appendArrowFields(columns_, message);
+    rows_++;
+  }
+
+  // Append messages as rows, with the builders pre-sized for all of them.
+  template <typename Messages>
+  void appendBatch(const Messages& messages) {
+    reserve(static_cast<int64_t>(messages.size()));
+    for (const auto& message : messages) {
+      append(message);
+    }
+  }
+
+  // Take the appended rows as a record batch.
+  std::shared_ptr<::arrow::RecordBatch> finish() {
+    std::vector<std::shared_ptr<::arrow::Array>> arrays(builders_.size());
+    for (size_t i = 0; i < builders_.size(); i++) {
+      PARQUET_THROW_NOT_OK(builders_[i]->Finish(&arrays[i]));
+    }
+
+    auto batch = ::arrow::RecordBatch::Make(schema_, rows_, arrays);
+    rows_ = 0;
+    return batch;
+  }
+
+  // Rows appended since the last finish()
+  int64_t rows() const { return rows_; }
+
+  const CapnpColumnMap& columnMap() const { return map_; }
+
+private:
+  const CapnpColumnMap&                               map_;
+  std::shared_ptr<::arrow::Schema>                    schema_;
+  std::vector<std::unique_ptr<::arrow::ArrayBuilder>> builders_;
+  std::vector<std::unique_ptr<ArrowValueBuilder>>     columns_;
+  int64_t                                             rows_;
+};
+
+// Writes Arrow record batches to an output.
+class ArrowBatchWriter {
+public:
+  virtual ~ArrowBatchWriter() {}
+
+  virtual void write(const std::shared_ptr<::arrow::RecordBatch>& batch) = 0;
+
+  virtual void close() = 0;
+};
+
+// Writes record batches as an Arrow IPC stream.
+class ArrowStreamWriter : public ArrowBatchWriter {
+public:
+  ArrowStreamWriter(std::shared_ptr<::arrow::Schema> schema,
+                    std::shared_ptr<::arrow::io::OutputStream> sink)
+  : sink_(sink) {
+    PARQUET_THROW_NOT_OK(::arrow::ipc::RecordBatchStreamWriter::Open(sink_.get(), schema, &writer_));
+  }
+
+  void write(const std::shared_ptr<::arrow::RecordBatch>& batch) override {
+    PARQUET_THROW_NOT_OK(writer_->WriteRecordBatch(*batch));
+  }
+
+  void close() override {
+    PARQUET_THROW_NOT_OK(writer_->Close());
+    PARQUET_THROW_NOT_OK(sink_->Close());
+  }
+
+private:
+  std::shared_ptr<::arrow::io::OutputStream>        sink_;
+  std::shared_ptr<::arrow::ipc::RecordBatchWriter>  writer_;
+};
+
+// Writes record batches to a Parquet file through parquet::arrow::FileWriter,
+// a row group per batch. The Parquet schema is derived from the Arrow schema,
+// so logical types without an Arrow type (e.g. ENUM) are written as their
+// Arrow type. parquet::arrow does not write struct columns, schemas with
+// nested structs are written with CapnpParquetWriter instead.
+class ArrowParquetWriter : public ArrowBatchWriter {
+public:
+  ArrowParquetWriter(std::shared_ptr<::arrow::Schema> schema,
+                     std::shared_ptr<parquet::OutputStream> sink,
+                     std::shared_ptr<parquet::WriterProperties> properties = parquet::default_writer_properties()) {
+    PARQUET_THROW_NOT_OK(parquet::arrow::FileWriter::Open(*schema, ::arrow::default_memory_pool(),
+                                                          sink, properties, &writer_));
+  }
+
+  void write(const std::shared_ptr<::arrow::RecordBatch>& batch) override {
+    if (batch->num_rows() == 0) {
+      return;
+    }
+    std::shared_ptr<::arrow::Table> table;
+    PARQUET_THROW_NOT_OK(::arrow::Table::FromRecordBatches({batch}, &table));
+    PARQUET_THROW_NOT_OK(writer_->WriteTable(*table, batch->num_rows()));
+  }
+
+  void close() override {
+    PARQUET_THROW_NOT_OK(writer_->Close());
+  }
+
+private:
+  std::unique_ptr<parquet::arrow::FileWriter> writer_;
+};
+
+};  // namespace capnpparquet
+
+#endif  // _CAPNPARROW_H_
@@ -0,0 +1,338 @@
+/*
+ * Copyright 2017 Rene Sugar
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * @file capnpbloom.h
+ * @author Rene Sugar <rene.sugar@gmail.com>
+ * @brief Split block Bloom filters of Parquet column chunks.
+ */
+#ifndef _CAPNPBLOOM_H_
+#define _CAPNPBLOOM_H_
+
+#include <kj/debug.h>
+
+#include <parquet/types.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <vector>
+
+#include "capnpcpu.h"
+
+namespace capnpparquet {
+
+// Sizes of a filter, in bytes
+static const int64_t BLOOM_FILTER_BLOCK_BYTES = 32;
+static const int64_t BLOOM_FILTER_MIN_BYTES = 32;
+static const int64_t BLOOM_FILTER_MAX_BYTES = 128 * 1024 * 1024;
+
+// Values hashed at a time before they are inserted
+static const int64_t BLOOM_HASH_BATCH = 256;
+
+// Salts of the eight bits set in a block, from the Parquet Bloom filter specification
+static const uint32_t BLOOM_FILTER_SALT[8] = {
+  0x47b6137bU, 0x44974d91U, 0x8824ad5bU, 0xa2b7289dU,
+  0x705495c7U, 0x2df1424bU, 0x9efc4947U, 0x5c6bfb31U
+};
+
+static const uint64_t XXH64_PRIME_1 = 11400714785074694791ULL;
+static const uint64_t XXH64_PRIME_2 = 14029467366897019727ULL;
+static const uint64_t XXH64_PRIME_3 = 1609587929392839161ULL;
+static const uint64_t XXH64_PRIME_4 = 9650029242287828579ULL;
+static const uint64_t XXH64_PRIME_5 = 2870177450012600261ULL;
+
+inline uint64_t xxh64Rotate(uint64_t value, int bits) {
+  return (value << bits) | (value >> (64 - bits));
+}
+
+inline uint64_t xxh64Round(uint64_t acc, uint64_t input) {
+  acc += input * XXH64_PRIME_2;
+  acc = xxh64Rotate(acc, 31);
+  return acc * XXH64_PRIME_1;
+}
+
+inline uint64_t xxh64Merge(uint64_t acc, uint64_t value) {
+  acc ^= xxh64Round(0, value);
+  return (acc * XXH64_PRIME_1) + XXH64_PRIME_4;
+}
+
+inline uint64_t xxh64Avalanche(uint64_t hash) {
+  hash ^= hash >> 33;
+  hash *= XXH64_PRIME_2;
+  hash ^= hash >> 29;
+  hash *= XXH64_PRIME_3;
+  hash ^= hash >> 32;
+  return hash;
+}
+
+// XXH64 with seed 0, the hash the Parquet specification uses for Bloom
+// filters. Multi-byte reads assume a little-endian host, like parquet-cpp.
+inline uint64_t xxHash64(const uint8_t* data, size_t length) {
+  const uint8_t* end = data + length;
+  uint64_t hash;
+
+  if (length >= 32) {
+    uint64_t v1 = XXH64_PRIME_1 + XXH64_PRIME_2;
+    uint64_t v2 = XXH64_PRIME_2;
+    uint64_t v3 = 0;
+    uint64_t v4 = 0 - XXH64_PRIME_1;
+    const uint8_t* limit = end - 32;
+    do {
+      uint64_t lanes[4];
+      memcpy(lanes, data, sizeof(lanes));
+      v1 = xxh64Round(v1, lanes[0]);
+      v2 = xxh64Round(v2, lanes[1]);
+      v3 = xxh64Round(v3, lanes[2]);
+      v4 = xxh64Round(v4, lanes[3]);
+      data += 32;
+    } while (data <= limit);
+
+    hash = xxh64Rotate(v1, 1) + xxh64Rotate(v2, 7) + xxh64Rotate(v3, 12) + xxh64Rotate(v4, 18);
+    hash = xxh64Merge(hash, v1);
+    hash = xxh64Merge(hash, v2);
+    hash = xxh64Merge(hash, v3);
+    hash = xxh64Merge(hash, v4);
+  } else {
+    hash = XXH64_PRIME_5;
+  }
+
+  hash += static_cast<uint64_t>(length);
+
+  while (data + 8 <= end) {
+    uint64_t lane;
+    memcpy(&lane, data, sizeof(lane));
+    hash ^= xxh64Round(0, lane);
+    hash = (xxh64Rotate(hash, 27) * XXH64_PRIME_1) + XXH64_PRIME_4;
+    data += 8;
+  }
+  if (data + 4 <= end) {
+    uint32_t lane;
+    memcpy(&lane, data, sizeof(lane));
+    hash ^= static_cast<uint64_t>(lane) * XXH64_PRIME_1;
+    hash = (xxh64Rotate(hash, 23) * XXH64_PRIME_2) + XXH64_PRIME_3;
+    data += 4;
+  }
+  while (data < end) {
+    hash ^= static_cast<uint64_t>(*data) * XXH64_PRIME_5;
+    hash = xxh64Rotate(hash, 11) * XXH64_PRIME_1;
+    data++;
+  }
+
+  return xxh64Avalanche(hash);
+}
+
+// xxHash64() of the plain encoding of fixed width values, without branches
+// so loops over a column's values vectorize.
+inline uint64_t bloomHash(uint32_t bits) {
+  uint64_t hash = XXH64_PRIME_5 + 4;
+  hash ^= static_cast<uint64_t>(bits) * XXH64_PRIME_1;
+  hash = (xxh64Rotate(hash, 23) * XXH64_PRIME_2) + XXH64_PRIME_3;
+  return xxh64Avalanche(hash);
+}
+
+inline uint64_t bloomHash(uint64_t bits) {
+  uint64_t hash = XXH64_PRIME_5 + 8;
+  hash ^= xxh64Round(0, bits);
+  hash = (xxh64Rotate(hash, 27) * XXH64_PRIME_1) + XXH64_PRIME_4;
+  return xxh64Avalanche(hash);
+}
+
+inline uint64_t bloomHash(int32_t value) { return bloomHash(static_cast<uint32_t>(value)); }
+
+inline uint64_t bloomHash(int64_t value) { return bloomHash(static_cast<uint64_t>(value)); }
+
+// -0.0 equals +0.0 and a NaN matches any NaN, so floating point values are
+// hashed as +0.0 and the quiet NaN for them, on insert and on lookup alike.
+// The filter of a column with such values only answers for them like a
+// reader that canonicalizes them too, other values hash as the specification
+// says.
+template <typename T>
+inline T canonicalBloomFloat(T value) {
+  value = (value == T(0)) ? T(0) : value;
+  return (value != value) ? std::numeric_limits<T>::quiet_NaN() : value;
+}
+
+inline uint64_t bloomHash(float value) {
+  value = canonicalBloomFloat(value);
+  uint32_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  return bloomHash(bits);
+}
+
+inline uint64_t bloomHash(double value) {
+  value = canonicalBloomFloat(value);
+  uint64_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  return bloomHash(bits);
+}
+
+inline uint64_t bloomHash(const parquet::ByteArray& value) {
+  return xxHash64(value.ptr, value.len);
+}
+
+// Set, and test, the eight bits of `key` in a block
+inline void bloomBlockInsertScalar(uint32_t* block, uint32_t key) {
+  for (int i = 0; i < 8; i++) {
+    block[i] |= uint32_t(1) << ((key * BLOOM_FILTER_SALT[i]) >> 27);
+  }
+}
+
+inline bool bloomBlockContainsScalar(const uint32_t* block, uint32_t key) {
+  for (int i = 0; i < 8; i++) {
+    if ((block[i] & (uint32_t(1) << ((key * BLOOM_FILTER_SALT[i]) >> 27))) == 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+#ifdef CAPNPPARQUET_X86_KERNELS
+CAPNPPARQUET_TARGET("avx2")
+inline __m256i bloomBlockMask(uint32_t key) {
+  const __m256i salt = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(BLOOM_FILTER_SALT));
+  __m256i bits = _mm256_srli_epi32(_mm256_mullo_epi32(_mm256_set1_epi32(key), salt), 27);
+  return _mm256_sllv_epi32(_mm256_set1_epi32(1), bits);
+}
+
+CAPNPPARQUET_TARGET("avx2")
+inline void bloomBlockInsertAvx2(uint32_t* block, uint32_t key) {
+  __m256i words = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(block));
+  _mm256_storeu_si256(reinterpret_cast<__m256i*>(block), _mm256_or_si256(words, bloomBlockMask(key)));
+}
+
+CAPNPPARQUET_TARGET("avx2")
+inline bool bloomBlockContainsAvx2(const uint32_t* block, uint32_t key) {
+  __m256i words = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(block));
+  return _mm256_testc_si256(words, bloomBlockMask(key)) != 0;
+}
+#endif
+
+// A split block Bloom filter (the Parquet SBBF).
+//
+// The filter is an array of 256-bit blocks. A hash picks a block with its
+// upper 32 bits and sets one bit in each of the block's eight 32-bit words
+// with its lower 32 bits, so a lookup touches a single cache line. With AVX2
+// the eight words of a block are handled in one register (picked at run
+// time, see capnpcpu.h).
+//
+class BloomFilter {
+public:
+  // An empty filter of `num_bytes`, rounded up to a power of two blocks
+  explicit BloomFilter(int64_t num_bytes) : avx2_(cpuHasAvx2()) {
+    int64_t bytes = BLOOM_FILTER_MIN_BYTES;
+    while ((bytes < num_bytes) && (bytes < BLOOM_FILTER_MAX_BYTES)) {
+      bytes *= 2;
+    }
+    words_.resize(bytes / sizeof(uint32_t), 0);
+  }
+
+  // A filter read back from its bytes
+  BloomFilter(const uint8_t* data, int64_t num_bytes) : avx2_(cpuHasAvx2()) {
+    KJ_REQUIRE((num_bytes >= BLOOM_FILTER_MIN_BYTES) && ((num_bytes % BLOOM_FILTER_BLOCK_BYTES) == 0),
+               "invalid Bloom filter size", num_bytes);
+    words_.resize(num_bytes / sizeof(uint32_t));
+    memcpy(words_.data(), data, num_bytes);
+  }
+
+  // Bytes for `ndv` distinct values at a false positive probability of `fpp`
+  static int64_t optimalNumBytes(int64_t ndv, double fpp) {
+    if (ndv <= 0) {
+      return BLOOM_FILTER_MIN_BYTES;
+    }
+    double bits = -8.0 * static_cast<double>(ndv) / log(1.0 - pow(fpp, 1.0 / 8.0));
+    return std::min<int64_t>(static_cast<int64_t>(ceil(bits / 8.0)), BLOOM_FILTER_MAX_BYTES);
+  }
+
+  void insert(uint64_t hash) {
+    uint32_t* block = blockOf(hash);
+    uint32_t key = static_cast<uint32_t>(hash);
+#ifdef CAPNPPARQUET_X86_KERNELS
+    if (avx2_) {
+      bloomBlockInsertAvx2(block, key);
+      return;
+    }
+#endif
+    bloomBlockInsertScalar(block, key);
+  }
+
+  void insert(const uint64_t* hashes, int64_t count) {
+    for (int64_t i = 0; i < count; i++) {
+      insert(hashes[i]);
+    }
+  }
+
+  // False when the value with this hash was never inserted
+  bool mayContain(uint64_t hash) const {
+    const uint32_t* block = blockOf(hash);
+    uint32_t key = static_cast<uint32_t>(hash);
+#ifdef CAPNPPARQUET_X86_KERNELS
+    if (avx2_) {
+      return bloomBlockContainsAvx2(block, key);
+    }
+#endif
+    return bloomBlockContainsScalar(block, key);
+  }
+
+  const uint8_t* data() const { return reinterpret_cast<const uint8_t*>(words_.data()); }
+
+  int64_t size() const { return static_cast<int64_t>(words_.size() * sizeof(uint32_t)); }
+
+private:
+  std::vector<uint32_t> words_;
+  bool                  avx2_;
+
+  int64_t num_blocks() const { return static_cast<int64_t>(words_.size() / 8); }
+
+  uint32_t* blockOf(uint64_t hash) {
+    return &words_[(((hash >> 32) * static_cast<uint64_t>(num_blocks())) >> 32) * 8];
+  }
+
+  const uint32_t* blockOf(uint64_t hash) const {
+    return &words_[(((hash >> 32) * static_cast<uint64_t>(num_blocks())) >> 32) * 8];
+  }
+};
+
+// Insert the values of a column chunk, hashed BLOOM_HASH_BATCH at a time.
+template <typename T>
+void bloomInsertValues(BloomFilter& filter, const T* values, int64_t count) {
+  uint64_t hashes[BLOOM_HASH_BATCH];
+  for (int64_t start = 0; start < count; start += BLOOM_HASH_BATCH) {
+    int64_t batch = std::min<int64_t>(BLOOM_HASH_BATCH, count - start);
+    for (int64_t i = 0; i < batch; i++) {
+      hashes[i] = bloomHash(values[start + i]);
+    }
+    filter.insert(hashes, batch);
+  }
+}
+
+inline void bloomInsertValues(BloomFilter& filter, const parquet::FixedLenByteArray* values,
+                              int64_t count, int32_t type_length) {
+  uint64_t hashes[BLOOM_HASH_BATCH];
+  for (int64_t start = 0; start < count; start += BLOOM_HASH_BATCH) {
+    int64_t batch = std::min<int64_t>(BLOOM_HASH_BATCH, count - start);
+    for (int64_t i = 0; i < batch; i++) {
+      hashes[i] = xxHash64(values[start + i].ptr, type_length);
+    }
+    filter.insert(hashes, batch);
+  }
+}
+
+};  // namespace capnpparquet
+
+#endif  // _CAPNPBLOOM_H_
@@ -0,0 +1,518 @@
+/*
+ * Copyright 2017 Rene Sugar
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * @file capnpcompact.h
+ * @author Rene Sugar <rene.sugar@gmail.com>
+ * @brief Merge Parquet files written with a Cap'n Proto schema into one file.
+ */
+#ifndef _CAPNPCOMPACT_H_
+#define _CAPNPCOMPACT_H_
+
+#include <arrow/io/file.h>
+#include <arrow/io/memory.h>
+
+#include <parquet/api/reader.h>
+#include <parquet/api/writer.h>
+#include <parquet/util/memory.h>
+
+#include <capnp/message.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "capnp2parquet.h"
+#include "capnpappend.h"
+#include "capnpsort.h"
+#include "parquet2capnp.h"
+
+namespace capnpparquet {
+
+struct CompactOptions {
+  CompactOptions() : threads(1), row_group_rows(0), min_copy_rows(0) {}
+
+  int64_t threads;         // threads re-encoding row groups
+  int64_t row_group_rows;  // rows per re-encoded row group (0: resolveRowGroupRows())
+  int64_t min_copy_rows;   // smaller row groups are merged (0: half of row_group_rows)
+};
+
+// Merges Parquet files with the schema generated for a $schema struct into
+// one file, in the order of the files and their row groups.
+//
+// Row groups that are large enough and whose column chunks the output would
+// write the same way (the codec, whether a dictionary is used, the encodings
+// parquet-cpp writes, the Bloom filters and page indexes of the schema's
+// annotations, and the settings the schema stores in the key/value metadata)
+// are copied as they are, without decompressing a page. Their
+// statistics are copied with them. The others are read back into messages,
+// sorted by the $sortKey columns, and written again by CapnpParquetWriter in
+// row groups of `row_group_rows` rows, which rebuilds their statistics, Bloom
+// filters and page indexes. Up to `threads` of these merges run at once, each
+// to a file in memory whose column chunks are then copied in turn.
+//
+// The output is written by a ParquetRowGroupAppender, which copies the
+// chunks by their byte range and rebuilds the footer.
+//
+class ParquetCompactor {
+public:
+  ParquetCompactor(const CapnpSchemaFile& schema,
+                   std::shared_ptr<parquet::WriterProperties> properties,
+                   const CompactOptions& options = CompactOptions())
+  : schema_(schema), properties_(properties),
+    map_(schema.root(), schema.descr(), nullptr,
+         sourceUnitsFromMetadata(schema.metadata(), schema.descr()->num_columns())),
+    sorter_(map_, schema.sortingColumns()),
+    bloom_filter_fpp_(bloomFilterColumns(schema.descr(), schema.columnOptions())),
+    page_index_columns_(pageIndexColumns(schema.columnOptions())),
+    threads_(std::max<int64_t>(1, options.threads)),
+    row_group_rows_(resolveRowGroupRows(options.row_group_rows, schema.writerOptions())),
+    min_copy_rows_((options.min_copy_rows > 0) ? options.min_copy_rows : std::max<int64_t>(1, row_group_rows_ / 2)),
+    rows_(0), row_groups_copied_(0), row_groups_merged_(0), row_groups_written_(0),
+    next_job_(0), jobs_written_(0), stopped_(false) {
+    page_index_columns_.resize(schema.descr()->num_columns(), false);
+  }
+
+  KJ_DISALLOW_COPY(ParquetCompactor);
+
+  // Merge the files at `paths` into `sink` and close it.
+  void compact(const std::vector<std::string>& paths, std::shared_ptr<parquet::OutputStream> sink) {
+    plan(paths);
+
+    bloom_filters_.clear();
+    page_indexes_.clear();
+    row_groups_written_ = 0;
+    next_job_ = 0;
+    jobs_written_ = 0;
+    stopped_ = false;
+    metadata_ = std::make_shared<::arrow::KeyValueMetadata>();
+    auto schema_metadata = schema_.metadata();
+    if (schema_metadata != nullptr) {
+      for (int64_t i = 0; i < schema_metadata->size(); i++) {
+        metadata_->Append(schema_metadata->key(i), schema_metadata->value(i));
+      }
+    }
+    appender_.reset(new ParquetRowGroupAppender(sink, schema_.descr(), properties_, metadata_));
+
+    std::vector<std::thread> workers;
+    for (int64_t i = 0; (i < threads_) && (i < static_cast<int64_t>(jobs_.size())); i++) {
+      workers.emplace_back([this]() { encodeJobs(); });
+    }
+
+    try {
+      writeItems();
+    } catch (...) {
+      stop(workers);
+      throw;
+    }
+    stop(workers);
+
+    if (!bloom_filters_.empty()) {
+      metadata_->Append(CAPNP_BLOOM_FILTERS_KEY, formatColumnChunkLocations(bloom_filters_));
+    }
+    if (!page_indexes_.empty()) {
+      metadata_->Append(CAPNP_PAGE_INDEX_KEY, formatColumnChunkLocations(page_indexes_));
+      metadata_->Append(CAPNP_PAGE_INDEX_ROWS_KEY, std::to_string(PAGE_INDEX_RANGE_ROWS));
+    }
+    appender_->close();
+  }
+
+  int64_t rows() const { return rows_; }
+
+  // Input row groups copied as they are
+  int64_t row_groups_copied() const { return row_groups_copied_; }
+
+  // Input row groups merged and written again
+  int64_t row_groups_merged() const { return row_groups_merged_; }
+
+  int64_t row_groups_written() const { return row_groups_written_; }
+
+  int64_t row_group_rows() const { return row_group_rows_; }
+
+  int64_t min_copy_rows() const { return min_copy_rows_; }
+
+private:
+  struct CompactSource {
+    std::string                             path;
+    std::shared_ptr<parquet::FileMetaData>  metadata;
+    std::vector<ColumnChunkLocation>        bloom_filters;
+    std::vector<ColumnChunkLocation>        page_indexes;
+    bool                                    same_settings;  // see sameSettings()
+  };
+
+  // Row groups [first, last) of a source
+  struct RowGroupRange {
+    int source;
+    int first;
+    int last;
+  };
+
+  // A row group copied from a source, or row groups merged by a job
+  struct CompactItem {
+    CompactItem() : source(-1), row_group(-1), job(-1) {}
+
+    int source;
+    int row_group;
+    int job;
+  };
+
+  struct CompactJob {
+    CompactJob() : rows(0), done(false) {}
+
+    std::vector<RowGroupRange>        ranges;
+    int64_t                           rows;
+    std::shared_ptr<::arrow::Buffer>  encoded;  // file written by CapnpParquetWriter
+    std::string                       error;
+    bool                              done;
+  };
+
+  const CapnpSchemaFile&                      schema_;
+  std::shared_ptr<parquet::WriterProperties>  properties_;
+  CapnpColumnMap                              map_;
+  CapnpRowSorter                              sorter_;  // shared by the workers
+  std::vector<double>                         bloom_filter_fpp_;
+  std::vector<bool>                           page_index_columns_;
+  int64_t                                     threads_;
+  int64_t                                     row_group_rows_;
+  int64_t                                     min_copy_rows_;
+  int64_t                                     rows_;
+  int64_t                                     row_groups_copied_;
+  int64_t                                     row_groups_merged_;
+  int                                         row_groups_written_;
+  std::vector<CompactSource>                  sources_;
+  std::vector<CompactItem>                    items_;
+  std::vector<CompactJob>                     jobs_;
+  std::shared_ptr<::arrow::KeyValueMetadata>  metadata_;
+  std::unique_ptr<ParquetRowGroupAppender>    appender_;
+  std::vector<ColumnChunkLocation>            bloom_filters_;
+  std::vector<ColumnChunkLocation>            page_indexes_;
+  std::mutex                                  mutex_;
+  std::condition_variable                     changed_;
+  size_t                                      next_job_;
+  size_t                                      jobs_written_;
+  bool                                        stopped_;
+
+  static std::shared_ptr<::arrow::io::RandomAccessFile> openSource(const std::string& path) {
+    std::shared_ptr<::arrow::io::ReadableFile> file;
+    PARQUET_THROW_NOT_OK(::arrow::io::ReadableFile::Open(path, &file));
+    return file;
+  }
+
+  static bool hasLocation(const std::vector<ColumnChunkLocation>& locations, int row_group, int column) {
+    for (const auto& location : locations) {
+      if ((location.row_group == row_group) && (location.column == column)) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Encodings of the pages parquet-cpp writes, FileMetaDataBuilder lists these
+  static bool isWrittenEncoding(parquet::Encoding::type encoding) {
+    switch (encoding) {
+      case parquet::Encoding::PLAIN:
+      case parquet::Encoding::PLAIN_DICTIONARY:
+      case parquet::Encoding::RLE_DICTIONARY:
+      case parquet::Encoding::RLE:
+      case parquet::Encoding::BIT_PACKED:
+        return true;
+      default:
+        return false;
+    }
+  }
+
+  // Read the footers, and decide which row groups are copied and which are merged.
+  void plan(const std::vector<std::string>& paths) {
+    sources_.clear();
+    items_.clear();
+    jobs_.clear();
+    rows_ = 0;
+    row_groups_copied_ = 0;
+    row_groups_merged_ = 0;
+
+    for (const auto& path : paths) {
+      CompactSource source;
+      source.path = path;
+      source.metadata = parquet::ReadMetaData(openSource(path));
+      KJ_REQUIRE(source.metadata->schema()->Equals(*schema_.descr()),
+                 "file does not have the Parquet schema of the $schema struct", path);
+      source.bloom_filters = columnChunkLocations(source.metadata->key_value_metadata(), CAPNP_BLOOM_FILTERS_KEY);
+      source.page_indexes = columnChunkLocations(source.metadata->key_value_metadata(), CAPNP_PAGE_INDEX_KEY);
+      source.same_settings = sameSettings(source.metadata->key_value_metadata());
+      sources_.push_back(std::move(source));
+    }
+
+    int open_job = -1;
+    for (int s = 0; s < static_cast<int>(sources_.size()); s++) {
+      const CompactSource& source = sources_[s];
+      for (int r = 0; r < source.metadata->num_row_groups(); r++) {
+        std::unique_ptr<parquet::RowGroupMetaData> row_group = source.metadata->RowGroup(r);
+        int64_t rows = row_group->num_rows();
+        if (rows == 0) {
+          continue;
+        }
+        rows_ += rows;
+
+        CompactItem item;
+        if (copyable(source, r, *row_group)) {
+          // A copied row group ends the merge before it, to keep the order of the rows
+          open_job = -1;
+          item.source = s;
+          item.row_group = r;
+          items_.push_back(item);
+          row_groups_copied_++;
+          continue;
+        }
+
+        if ((open_job < 0) || (jobs_[open_job].rows + rows > row_group_rows_)) {
+          open_job = static_cast<int>(jobs_.size());
+          jobs_.emplace_back();
+          item.job = open_job;
+          items_.push_back(item);
+        }
+        CompactJob& job = jobs_[open_job];
+        if (!job.ranges.empty() && (job.ranges.back().source == s) && (job.ranges.back().last == r)) {
+          job.ranges.back().last = r + 1;
+        } else {
+          RowGroupRange range;
+          range.source = s;
+          range.first = r;
+          range.last = r + 1;
+          job.ranges.push_back(range);
+        }
+        job.rows += rows;
+        row_groups_merged_++;
+      }
+    }
+  }
+
+  // Was a source written with the settings of the schema? The $sourceUnit
+  // conversions, the writer options and the Bloom filter probabilities must
+  // be the schema's, and page indexes must have the ranges the output writes.
+  // Files that do not say are written again.
+  bool sameSettings(const std::shared_ptr<const ::arrow::KeyValueMetadata>& metadata) const {
+    const char* keys[] = {CAPNP_SOURCE_UNITS_KEY, CAPNP_ROW_GROUP_ROWS_KEY, CAPNP_ROW_GROUP_BYTES_KEY,
+                          CAPNP_DATA_PAGE_SIZE_KEY, CAPNP_DICTIONARY_PAGE_LIMIT_KEY, CAPNP_BLOOM_FILTER_FPP_KEY};
+    for (const char* key : keys) {
+      if (metadataValue(metadata, key) != metadataValue(schema_.metadata(), key)) {
+        return false;
+      }
+    }
+    if (std::find(page_index_columns_.begin(), page_index_columns_.end(), true) == page_index_columns_.end()) {
+      return true;
+    }
+    return metadataValue(metadata, CAPNP_PAGE_INDEX_ROWS_KEY) == std::to_string(PAGE_INDEX_RANGE_ROWS);
+  }
+
+  // Would the output write the column chunks of the row group the same way?
+  bool copyable(const CompactSource& source, int index, const parquet::RowGroupMetaData& row_group) const {
+    if ((row_group.num_rows() < min_copy_rows_) || !source.same_settings) {
+      return false;
+    }
+
+    const parquet::SchemaDescriptor* descr = schema_.descr();
+    for (int i = 0; i < row_group.num_columns(); i++) {
+      std::unique_ptr<parquet::ColumnChunkMetaData> chunk = row_group.ColumnChunk(i);
+      const std::shared_ptr<parquet::schema::ColumnPath>& path = descr->Column(i)->path();
+
+      if (chunk->compression() != properties_->compression(path)) {
+        return false;
+      }
+      if (chunk->has_dictionary_page() && !properties_->dictionary_enabled(path)) {
+        return false;
+      }
+      for (parquet::Encoding::type encoding : chunk->encodings()) {
+        if (!isWrittenEncoding(encoding)) {
+          return false;
+        }
+      }
+      if ((bloom_filter_fpp_[i] > 0.0) && !hasLocation(source.bloom_filters, index, i)) {
+        return false;
+      }
+      if (page_index_columns_[i] && !hasLocation(source.page_indexes, index, i)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // Write the items in order, the sources are opened one at a time.
+  void writeItems() {
+    int open_source = -1;
+    std::shared_ptr<::arrow::io::RandomAccessFile> file;
+
+    for (const auto& item : items_) {
+      if (item.job < 0) {
+        if (item.source != open_source) {
+          file = openSource(sources_[item.source].path);
+          open_source = item.source;
+        }
+        const CompactSource& source = sources_[item.source];
+        copyRowGroup(file.get(), source.path, *source.metadata, item.row_group,
+                     source.bloom_filters, source.page_indexes);
+        continue;
+      }
+
+      std::shared_ptr<::arrow::Buffer> encoded;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        CompactJob& job = jobs_[item.job];
+        changed_.wait(lock, [&job]() { return job.done; });
+        KJ_REQUIRE(job.error.empty(), job.error);
+        encoded.swap(job.encoded);
+        jobs_written_++;
+      }
+      changed_.notify_all();
+
+      auto buffer = std::make_shared<::arrow::io::BufferReader>(encoded);
+      std::shared_ptr<parquet::FileMetaData> metadata = parquet::ReadMetaData(buffer);
+      auto bloom_filters = columnChunkLocations(metadata->key_value_metadata(), CAPNP_BLOOM_FILTERS_KEY);
+      auto page_indexes = columnChunkLocations(metadata->key_value_metadata(), CAPNP_PAGE_INDEX_KEY);
+      for (int r = 0; r < metadata->num_row_groups(); r++) {
+        copyRowGroup(buffer.get(), "merged row groups", *metadata, r, bloom_filters, page_indexes);
+      }
+    }
+  }
+
+  // Runs on the workers. A job is only started while fewer than twice the
+  // threads are waiting to be written, which bounds the memory they hold.
+  void encodeJobs() {
+    for (;;) {
+      size_t index;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        changed_.wait(lock, [this]() {
+          return stopped_ || (next_job_ >= jobs_.size()) ||
+                 (next_job_ < jobs_written_ + static_cast<size_t>(2 * threads_));
+        });
+        if (stopped_ || (next_job_ >= jobs_.size())) {
+          return;
+        }
+        index = next_job_++;
+      }
+
+      std::shared_ptr<::arrow::Buffer> encoded;
+      std::string error;
+      try {
+        encoded = encode(jobs_[index]);
+      } catch (const std::exception& e) {
+        error = e.what();
+      }
+
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        jobs_[index].encoded = encoded;
+        jobs_[index].error = error;
+        jobs_[index].done = true;
+      }
+      changed_.notify_all();
+    }
+  }
+
+  void stop(std::vector<std::thread>& workers) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopped_ = true;
+    }
+    changed_.notify_all();
+    for (auto& worker : workers) {
+      worker.join();
+    }
+  }
+
+  // Read the rows of a job back into messages and write them to a file in memory.
+  std::shared_ptr<::arrow::Buffer> encode(const CompactJob& job) {
+    capnp::StructSchema root = schema_.root();
+    auto sink = std::make_shared<parquet::InMemoryOutputStream>();
+    CapnpParquetWriter writer(root, schema_.parquetSchema(), sink, properties_, row_group_rows_,
+                              schema_.metadata());
+    writer.set_bloom_filters(bloom_filter_fpp_);
+    writer.set_page_index(page_index_columns_);
+
+    std::vector<std::unique_ptr<capnp::MallocMessageBuilder>> messages;
+    for (const auto& range : job.ranges) {
+      ParquetCapnpReader reader(root, sources_[range.source].path);
+      reader.set_row_groups(range.first, range.last);
+
+      for (;;) {
+        std::unique_ptr<capnp::MallocMessageBuilder> message(new capnp::MallocMessageBuilder());
+        if (!reader.next(*message)) {
+          break;
+        }
+        if (sorter_.enabled()) {
+          messages.push_back(std::move(message));
+        } else {
+          writer.write(message->getRoot<capnp::DynamicStruct>(root).asReader());
+        }
+      }
+    }
+
+    if (sorter_.enabled()) {
+      std::vector<capnp::DynamicStruct::Reader> rows;
+      rows.reserve(messages.size());
+      for (const auto& message : messages) {
+        rows.push_back(message->getRoot<capnp::DynamicStruct>(root).asReader());
+      }
+      for (uint32_t position : sorter_.order(rows)) {
+        writer.write(rows[position]);
+      }
+    }
+
+    writer.close();
+    return sink->GetBuffer();
+  }
+
+  // Copy a row group's column chunks, and the side data the output keeps, to the sink.
+  void copyRowGroup(::arrow::io::RandomAccessFile* file, const std::string& path,
+                    const parquet::FileMetaData& metadata, int index,
+                    const std::vector<ColumnChunkLocation>& bloom_filters,
+                    const std::vector<ColumnChunkLocation>& page_indexes) {
+    appender_->append(file, path, metadata, index);
+    copyColumnChunkData(file, path, bloom_filters, index, bloom_filter_fpp_.size(),
+                        [this](int column) { return bloom_filter_fpp_[column] > 0.0; }, &bloom_filters_);
+    copyColumnChunkData(file, path, page_indexes, index, page_index_columns_.size(),
+                        [this](int column) -> bool { return page_index_columns_[column]; }, &page_indexes_);
+    row_groups_written_++;
+  }
+
+  // Copy the side data of the row group `index` of the columns the output keeps it for
+  template <typename Keep>
+  void copyColumnChunkData(::arrow::io::RandomAccessFile* file, const std::string& path,
+                           const std::vector<ColumnChunkLocation>& locations, int index,
+                           size_t num_columns, Keep keep, std::vector<ColumnChunkLocation>* copied) {
+    for (const auto& location : locations) {
+      if ((location.row_group != index) || (location.column < 0) ||
+          (static_cast<size_t>(location.column) >= num_columns) || !keep(location.column)) {
+        continue;
+      }
+      ColumnChunkLocation copy = location;
+      copy.row_group = row_groups_written_;
+      copy.offset = appender_->tell();
+      appender_->copyBytes(file, path, location.offset, location.length);
+      copied->push_back(copy);
+    }
+  }
+};
+
+};  // namespace capnpparquet
+
+#endif  // _CAPNPCOMPACT_H_
@@ -0,0 +1,64 @@
+/*
+ * Copyright 2017 Rene Sugar
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * @file capnpcpu.h
+ * @author Rene Sugar <rene.sugar@gmail.com>
+ * @brief Instruction sets of the CPU, for the kernels picked at run time.
+ */
+#ifndef _CAPNPCPU_H_
+#define _CAPNPCPU_H_
+
+// The SIMD kernels are compiled for their instruction set with a target
+// attribute and called when the CPU running them has it, so a build for the
+// baseline x86-64 still uses them. A build for a CPU that has the instruction
+// set (-march=native, -mavx2) calls them without checking.
+//
+// Other compilers and CPUs only have the scalar kernels.
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CAPNPPARQUET_X86_KERNELS 1
+#include <immintrin.h>
+#define CAPNPPARQUET_TARGET(isa) __attribute__((target(isa)))
+#endif
+
+namespace capnpparquet {
+
+inline bool cpuHasAvx2() {
+#if defined(__AVX2__)
+  return true;
+#elif defined(CAPNPPARQUET_X86_KERNELS)
+  static const bool avx2 = (__builtin_cpu_init(), __builtin_cpu_supports("avx2") != 0);
+  return avx2;
+#else
+  return false;
+#endif
+}
+
+inline bool cpuHasSsse3() {
+#if defined(__SSSE3__)
+  return true;
+#elif defined(CAPNPPARQUET_X86_KERNELS)
+  static const bool ssse3 = (__builtin_cpu_init(), __builtin_cpu_supports("ssse3") != 0);
+  return ssse3;
+#else
+  return false;
+#endif
+}
+
+};  // namespace capnpparquet
+
+#endif  // _CAPNPCPU_H_
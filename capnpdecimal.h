@@ -0,0 +1,179 @@
+/*
+ * Copyright 2017 Rene Sugar
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * @file capnpdecimal.h
+ * @author Rene Sugar <rene.sugar@gmail.com>
+ * @brief DECIMAL width tables and conversion kernels.
+ */
+#ifndef _CAPNPDECIMAL_H_
+#define _CAPNPDECIMAL_H_
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+
+namespace capnpparquet {
+
+// Widest FIXED_LEN_BYTE_ARRAY decimal the tables cover, and its precision
+static const int32_t DECIMAL_TABLE_MAX_BYTES = 32;
+static const int32_t DECIMAL_TABLE_MAX_PRECISION = 76;
+
+// Max precision of an INT64 decimal
+static const int32_t DECIMAL_INT64_MAX_PRECISION = 18;
+
+// Fewest bytes of two's complement holding 10^precision - 1, by precision
+static const int8_t DECIMAL_BYTES_FOR_PRECISION[DECIMAL_TABLE_MAX_PRECISION + 1] = {
+  1, 1, 1, 2, 2, 3, 3, 4, 4, 4, 5, 5, 6, 6, 6, 7,
+  7, 8, 8, 9, 9, 9, 10, 10, 11, 11, 11, 12, 12, 13, 13, 13,
+  14, 14, 15, 15, 16, 16, 16, 17, 17, 18, 18, 18, 19, 19, 20, 20,
+  21, 21, 21, 22, 22, 23, 23, 23, 24, 24, 25, 25, 26, 26, 26, 27,
+  27, 28, 28, 28, 29, 29, 30, 30, 31, 31, 31, 32, 32
+};
+
+// Max precision stored in a number of bytes: floor(log10(2^(8 * bytes - 1) - 1))
+static const int8_t DECIMAL_PRECISION_FOR_BYTES[DECIMAL_TABLE_MAX_BYTES + 1] = {
+  0, 2, 4, 6, 9, 11, 14, 16, 18, 21, 23, 26, 28, 31, 33, 35, 38,
+  40, 43, 45, 47, 50, 52, 55, 57, 59, 62, 64, 67, 69, 71, 74, 76
+};
+
+static const double DECIMAL_POWERS_OF_TEN[DECIMAL_TABLE_MAX_PRECISION + 1] = {
+  1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9,
+  1e10, 1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19,
+  1e20, 1e21, 1e22, 1e23, 1e24, 1e25, 1e26, 1e27, 1e28, 1e29,
+  1e30, 1e31, 1e32, 1e33, 1e34, 1e35, 1e36, 1e37, 1e38, 1e39,
+  1e40, 1e41, 1e42, 1e43, 1e44, 1e45, 1e46, 1e47, 1e48, 1e49,
+  1e50, 1e51, 1e52, 1e53, 1e54, 1e55, 1e56, 1e57, 1e58, 1e59,
+  1e60, 1e61, 1e62, 1e63, 1e64, 1e65, 1e66, 1e67, 1e68, 1e69,
+  1e70, 1e71, 1e72, 1e73, 1e74, 1e75, 1e76
+};
+
+static const int64_t DECIMAL_INT64_POWERS_OF_TEN[DECIMAL_INT64_MAX_PRECISION + 1] = {
+  1LL, 10LL, 100LL, 1000LL,
+  10000LL, 100000LL, 1000000LL, 10000000LL,
+  100000000LL, 1000000000LL, 10000000000LL, 100000000000LL,
+  1000000000000LL, 10000000000000LL, 100000000000000LL, 1000000000000000LL,
+  10000000000000000LL, 100000000000000000LL, 1000000000000000000LL
+};
+
+inline int32_t decimalBytesForPrecision(int32_t precision) {
+  if ((precision >= 0) && (precision <= DECIMAL_TABLE_MAX_PRECISION)) {
+    return DECIMAL_BYTES_FOR_PRECISION[precision];
+  }
+  int32_t numBytes = DECIMAL_TABLE_MAX_BYTES;
+  while (pow(2.0, 8.0 * numBytes - 1.0) < pow(10.0, precision)) {
+    numBytes += 1;
+  }
+  return numBytes;
+}
+
+inline int32_t decimalPrecisionForBytes(int32_t numBytes) {
+  if ((numBytes >= 0) && (numBytes <= DECIMAL_TABLE_MAX_BYTES)) {
+    return DECIMAL_PRECISION_FOR_BYTES[numBytes];
+  }
+  return static_cast<int32_t>(floor(log10(pow(2.0, 8.0 * numBytes - 1.0) - 1.0)));
+}
+
+// 10^scale
+inline double decimalPowerOfTen(int32_t scale) {
+  if ((scale >= 0) && (scale <= DECIMAL_TABLE_MAX_PRECISION)) {
+    return DECIMAL_POWERS_OF_TEN[scale];
+  }
+  return pow(10.0, scale);
+}
+
+// The kernels below hold unscaled values in 64 bits, as the rest of the
+// writer does, so precisions above 18 are bounded by the int64 range. They
+// return the position of the first value that does not fit `precision`
+// digits, or `count` when all fit. The loops have no branches, the position
+// is only looked for once a value did not fit.
+
+// Unscaled values of doubles: value * 10^scale, rounded half away from zero
+inline int64_t unscaleDecimals(const double* values, int64_t count, int32_t scale, int32_t precision,
+                               int64_t* unscaled) {
+  const double factor = decimalPowerOfTen(scale);
+  double limit = 9223372036854775808.0;  // 2^63
+  if ((precision >= 0) && (precision <= DECIMAL_INT64_MAX_PRECISION)) {
+    limit = DECIMAL_POWERS_OF_TEN[precision];
+  }
+
+  bool fits = true;
+  for (int64_t i = 0; i < count; i++) {
+    double rounded = std::round(values[i] * factor);
+    bool fit = std::fabs(rounded) < limit;  // false for NaN
+    unscaled[i] = static_cast<int64_t>(fit ? rounded : 0.0);
+    fits = fits && fit;
+  }
+  if (fits) {
+    return count;
+  }
+  for (int64_t i = 0; i < count; i++) {
+    if (!(std::fabs(std::round(values[i] * factor)) < limit)) {
+      return i;
+    }
+  }
+  return count;
+}
+
+// Unscaled values of integers: value * 10^scale
+inline int64_t unscaleDecimals(const int64_t* values, int64_t count, int32_t scale, int32_t precision,
+                               int64_t* unscaled) {
+  int64_t max_unscaled = std::numeric_limits<int64_t>::max();
+  if ((precision >= 0) && (precision <= DECIMAL_INT64_MAX_PRECISION)) {
+    max_unscaled = DECIMAL_INT64_POWERS_OF_TEN[precision] - 1;
+  }
+  // Past 10^18 only zero can be scaled
+  int64_t factor = 0;
+  if ((scale >= 0) && (scale <= DECIMAL_INT64_MAX_PRECISION)) {
+    factor = DECIMAL_INT64_POWERS_OF_TEN[scale];
+  }
+  const int64_t max_value = (factor > 0) ? (max_unscaled / factor) : 0;
+
+  bool fits = true;
+  for (int64_t i = 0; i < count; i++) {
+    int64_t value = values[i];
+    fits = fits && (value >= -max_value) && (value <= max_value);
+    unscaled[i] = static_cast<int64_t>(static_cast<uint64_t>(value) * static_cast<uint64_t>(factor));
+  }
+  if (fits) {
+    return count;
+  }
+  for (int64_t i = 0; i < count; i++) {
+    if ((values[i] < -max_value) || (values[i] > max_value)) {
+      return i;
+    }
+  }
+  return count;
+}
+
+// Big-endian two's complement of unscaled values, `length` bytes each
+inline void decimalBytes(const int64_t* unscaled, int64_t count, int32_t length, uint8_t* out) {
+  for (int64_t i = 0; i < count; i++, out += length) {
+    uint64_t big_endian = __builtin_bswap64(static_cast<uint64_t>(unscaled[i]));
+    const uint8_t* bytes = reinterpret_cast<const uint8_t*>(&big_endian);
+    if (length >= 8) {
+      memset(out, (unscaled[i] < 0) ? 0xff : 0x00, length - 8);
+      memcpy(out + length - 8, bytes, 8);
+    } else {
+      memcpy(out, bytes + 8 - length, length);
+    }
+  }
+}
+
+};  // namespace capnpparquet
+
+#endif  // _CAPNPDECIMAL_H_
@@ -0,0 +1,640 @@
+/*
+ * Copyright 2017 Rene Sugar
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * @file capnpfilter.h
+ * @author Rene Sugar <rene.sugar@gmail.com>
+ * @brief Predicates on Cap'n Proto field paths evaluated against Parquet statistics and rows.
+ */
+#ifndef _CAPNPFILTER_H_
+#define _CAPNPFILTER_H_
+
+#include <parquet/api/reader.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "capnpbloom.h"
+#include "capnpdecimal.h"
+#include "capnppageindex.h"
+#include "capnpschema.h"
+
+namespace capnpparquet {
+
+// A comparison of a Cap'n Proto field against constants, e.g.
+//
+//   timestamp >= 2017-06-01T00:00:00Z
+//   id = 42
+//   id in (1, 2, 3)
+//   timestamp between 2017-06-01 and 2017-06-02
+//
+// Constants are kept as text until the predicate is bound to a column.
+//
+struct CapnpPredicate {
+  enum Op {
+    EQ,
+    LT,
+    LE,
+    GT,
+    GE,
+    BETWEEN,
+    IN
+  };
+
+  std::string              path;
+  Op                       op;
+  std::vector<std::string> values;
+};
+
+// A predicate constant in the representation of the column's physical type.
+struct FilterValue {
+  FilterValue() : i(0), d(0.0) {}
+
+  int64_t     i;   // BOOLEAN, INT32, INT64
+  double      d;   // FLOAT, DOUBLE
+  std::string s;   // BYTE_ARRAY, FIXED_LEN_BYTE_ARRAY
+};
+
+// A predicate bound to a leaf column of a Parquet file.
+struct ColumnPredicate {
+  CapnpPredicate::Op               op;
+  int                              column;
+  const parquet::ColumnDescriptor* descr;
+  bool                             is_unsigned;  // UINT_* logical types sort unsigned
+  std::vector<FilterValue>         values;
+};
+
+// A token of a predicate: a word, a quoted string, an operator, a
+// parenthesis or a comma. `begin` and `end` delimit it in the predicate.
+struct FilterToken {
+  enum Kind {
+    WORD,
+    QUOTED,
+    OPERATOR,
+    OPEN,
+    CLOSE,
+    COMMA
+  };
+
+  Kind        kind;
+  std::string text;   // Without the quotes of a QUOTED token
+  size_t      begin;
+  size_t      end;
+};
+
+inline bool isFilterSpace(char c) { return (c == ' ') || (c == '\t'); }
+
+inline bool isFilterOperator(char c) { return (c == '<') || (c == '>') || (c == '='); }
+
+// Split a predicate into tokens. A string quoted with ' or " is one token,
+// whatever it holds; a quote is doubled to put it in the string.
+inline std::vector<FilterToken> tokenizePredicate(const std::string& text) {
+  std::vector<FilterToken> tokens;
+  size_t i = 0;
+  while (i < text.size()) {
+    char c = text[i];
+    if (isFilterSpace(c)) {
+      i++;
+      continue;
+    }
+
+    FilterToken token;
+    token.begin = i;
+    if ((c == '\'') || (c == '"')) {
+      token.kind = FilterToken::QUOTED;
+      i++;
+      for (;;) {
+        KJ_REQUIRE(i < text.size(), "unterminated quoted string in predicate", text);
+        if (text[i] == c) {
+          if ((i + 1 < text.size()) && (text[i + 1] == c)) {
+            token.text.push_back(c);
+            i += 2;
+            continue;
+          }
+          i++;
+          break;
+        }
+        token.text.push_back(text[i++]);
+      }
+    } else if (isFilterOperator(c)) {
+      // "<=", ">=" and "==" are one operator
+      token.kind = FilterToken::OPERATOR;
+      i++;
+      if ((i < text.size()) && (text[i] == '=')) {
+        i++;
+      }
+      token.text = text.substr(token.begin, i - token.begin);
+    } else if ((c == '(') || (c == ')') || (c == ',')) {
+      token.kind = (c == '(') ? FilterToken::OPEN : ((c == ')') ? FilterToken::CLOSE : FilterToken::COMMA);
+      token.text = std::string(1, c);
+      i++;
+    } else {
+      token.kind = FilterToken::WORD;
+      while ((i < text.size()) && !isFilterSpace(text[i]) && !isFilterOperator(text[i]) &&
+             (text[i] != '(') && (text[i] != ')') && (text[i] != ',') && (text[i] != '\'') && (text[i] != '"')) {
+        i++;
+      }
+      token.text = text.substr(token.begin, i - token.begin);
+    }
+    token.end = i;
+    tokens.push_back(token);
+  }
+  return tokens;
+}
+
+inline std::string lowerFilterText(std::string text) {
+  std::transform(text.begin(), text.end(), text.begin(), ::tolower);
+  return text;
+}
+
+// Whether `token` is the unquoted keyword `keyword` (lower case)
+inline bool isFilterKeyword(const FilterToken& token, const char* keyword) {
+  return (token.kind == FilterToken::WORD) && (lowerFilterText(token.text) == keyword);
+}
+
+// The text of tokens[begin, end): the string of a single quoted token, or
+// the predicate text they span, so "2017-06-01 12:00" stays one constant.
+inline std::string filterTokenText(const std::string& text, const std::vector<FilterToken>& tokens,
+                                   size_t begin, size_t end) {
+  KJ_REQUIRE(begin < end, "missing constant in predicate", text);
+  if ((end - begin == 1) && (tokens[begin].kind == FilterToken::QUOTED)) {
+    return tokens[begin].text;
+  }
+  for (size_t i = begin; i < end; i++) {
+    KJ_REQUIRE(tokens[i].kind != FilterToken::QUOTED, "unexpected text next to a quoted string in predicate", text);
+  }
+  return text.substr(tokens[begin].begin, tokens[end - 1].end - tokens[begin].begin);
+}
+
+// Parse "path op value", "path in (v1, v2)" or "path between v1 and v2".
+// Keywords and operators inside quoted strings are part of the constant.
+inline CapnpPredicate parsePredicate(const std::string& text) {
+  CapnpPredicate predicate;
+  std::vector<FilterToken> tokens = tokenizePredicate(text);
+
+  // The path runs up to the first operator or keyword
+  size_t pos = 0;
+  while ((pos < tokens.size()) && (tokens[pos].kind != FilterToken::OPERATOR) &&
+         !isFilterKeyword(tokens[pos], "between") && !isFilterKeyword(tokens[pos], "in")) {
+    pos++;
+  }
+  KJ_REQUIRE(pos < tokens.size(), "could not parse predicate", text);
+  KJ_REQUIRE(pos == 1 && tokens[0].kind == FilterToken::WORD, "expected a field path before the operator", text);
+  predicate.path = tokens[0].text;
+
+  if (isFilterKeyword(tokens[pos], "between")) {
+    size_t conj = pos + 1;
+    while ((conj < tokens.size()) && !isFilterKeyword(tokens[conj], "and")) {
+      conj++;
+    }
+    KJ_REQUIRE(conj < tokens.size(), "expected 'and' in between predicate", text);
+    predicate.op = CapnpPredicate::BETWEEN;
+    predicate.values.push_back(filterTokenText(text, tokens, pos + 1, conj));
+    predicate.values.push_back(filterTokenText(text, tokens, conj + 1, tokens.size()));
+    return predicate;
+  }
+
+  if (isFilterKeyword(tokens[pos], "in")) {
+    KJ_REQUIRE((pos + 2 < tokens.size()) && (tokens[pos + 1].kind == FilterToken::OPEN) &&
+               (tokens.back().kind == FilterToken::CLOSE),
+               "expected a parenthesized list in in predicate", text);
+    predicate.op = CapnpPredicate::IN;
+    size_t start = pos + 2;
+    size_t close = tokens.size() - 1;
+    while (start <= close) {
+      size_t end = start;
+      while ((end < close) && (tokens[end].kind != FilterToken::COMMA)) {
+        end++;
+      }
+      if (end > start) {
+        predicate.values.push_back(filterTokenText(text, tokens, start, end));
+      }
+      start = end + 1;
+    }
+    KJ_REQUIRE(!predicate.values.empty(), "empty in predicate", text);
+    return predicate;
+  }
+
+  static const struct {
+    const char*        token;
+    CapnpPredicate::Op op;
+  } ops[] = {
+    { "<=", CapnpPredicate::LE },
+    { ">=", CapnpPredicate::GE },
+    { "==", CapnpPredicate::EQ },
+    { "=",  CapnpPredicate::EQ },
+    { "<",  CapnpPredicate::LT },
+    { ">",  CapnpPredicate::GT },
+  };
+
+  for (const auto& op : ops) {
+    if (tokens[pos].text == op.token) {
+      predicate.op = op.op;
+      predicate.values.push_back(filterTokenText(text, tokens, pos + 1, tokens.size()));
+      return predicate;
+    }
+  }
+
+  KJ_FAIL_REQUIRE("unknown operator in predicate", tokens[pos].text, text);
+}
+
+// a / b rounded toward negative infinity, for b > 0: times before the epoch
+// fall in the day or millisecond that holds them.
+inline int64_t floorDivide(int64_t a, int64_t b) {
+  return (a / b) - (((a % b) < 0) ? 1 : 0);
+}
+
+// Days since 1970-01-01 of a proleptic Gregorian date.
+// http://howardhinnant.github.io/date_algorithms.html#days_from_civil
+inline int64_t daysFromCivil(int64_t y, int64_t m, int64_t d) {
+  y -= m <= 2;
+  const int64_t era = (y >= 0 ? y : y - 399) / 400;
+  const int64_t yoe = y - era * 400;
+  const int64_t doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+  const int64_t doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+  return era * 146097 + doe - 719468;
+}
+
+// Parse YYYY-MM-DD[(T| )HH:MM[:SS[.ffffff]]][Z] into microseconds since the epoch.
+// Returns false when `text` is not a date.
+inline bool parseTimestampMicros(const std::string& text, int64_t* micros) {
+  int year = 0, month = 0, day = 0, hour = 0, minute = 0, consumed = 0;
+  double second = 0.0;
+
+  if ((sscanf(text.c_str(), "%4d-%2d-%2d%n", &year, &month, &day, &consumed) != 3) ||
+      (consumed != 10)) {
+    return false;
+  }
+  if ((text.size() > 10) && (text[10] == 'T' || text[10] == ' ')) {
+    if (sscanf(text.c_str() + 11, "%2d:%2d:%lf", &hour, &minute, &second) < 2) {
+      return false;
+    }
+  }
+
+  int64_t seconds = (daysFromCivil(year, month, day) * 86400) + (hour * 3600) + (minute * 60);
+  *micros = (seconds * 1000000) + static_cast<int64_t>(llround(second * 1000000.0));
+  return true;
+}
+
+// Convert a predicate constant to the representation of the column it is compared with.
+inline FilterValue bindFilterValue(const std::string& text, const parquet::ColumnDescriptor* descr) {
+  FilterValue value;
+  int64_t micros = 0;
+
+  switch (descr->physical_type()) {
+    case parquet::Type::BOOLEAN:
+      value.i = ((text == "true") || (text == "1")) ? 1 : 0;
+      break;
+    case parquet::Type::INT32:
+    case parquet::Type::INT64:
+      switch (descr->logical_type()) {
+        case parquet::LogicalType::TIMESTAMP_MILLIS:
+          value.i = parseTimestampMicros(text, &micros) ? floorDivide(micros, 1000)
+                                                        : strtoll(text.c_str(), nullptr, 10);
+          break;
+        case parquet::LogicalType::TIMESTAMP_MICROS:
+          value.i = parseTimestampMicros(text, &micros) ? micros : strtoll(text.c_str(), nullptr, 10);
+          break;
+        case parquet::LogicalType::DATE:
+          value.i = parseTimestampMicros(text, &micros) ? floorDivide(micros, 86400000000LL)
+                                                        : strtoll(text.c_str(), nullptr, 10);
+          break;
+        case parquet::LogicalType::DECIMAL:
+          value.i = llround(strtod(text.c_str(), nullptr) * decimalPowerOfTen(descr->type_scale()));
+          break;
+        case parquet::LogicalType::UINT_32:
+        case parquet::LogicalType::UINT_64:
+          value.i = static_cast<int64_t>(strtoull(text.c_str(), nullptr, 10));
+          break;
+        default:
+          value.i = strtoll(text.c_str(), nullptr, 10);
+          break;
+      }
+      break;
+    case parquet::Type::FLOAT:
+      // Rounded as the column stores it, so "0.1" equals 0.1f
+      value.d = static_cast<float>(strtod(text.c_str(), nullptr));
+      break;
+    case parquet::Type::DOUBLE:
+      value.d = strtod(text.c_str(), nullptr);
+      break;
+    case parquet::Type::FIXED_LEN_BYTE_ARRAY:
+      if (descr->logical_type() == parquet::LogicalType::DECIMAL) {
+        // Big-endian two's complement of the unscaled value
+        int64_t unscaled = llround(strtod(text.c_str(), nullptr) * decimalPowerOfTen(descr->type_scale()));
+        value.s.resize(descr->type_length());
+        for (int i = descr->type_length() - 1; i >= 0; i--) {
+          value.s[i] = static_cast<char>(unscaled & 0xff);
+          unscaled >>= 8;  // arithmetic shift keeps the sign
+        }
+      } else {
+        value.s = text;
+        value.s.resize(descr->type_length());
+      }
+      break;
+    default:
+      value.s = text;
+      break;
+  }
+  return value;
+}
+
+inline ColumnPredicate bindPredicate(const CapnpPredicate& predicate, const CapnpColumnMap& map) {
+  const CapnpFieldNode* node = map.find(predicate.path);
+  KJ_REQUIRE(node != nullptr && node->is_leaf(),
+             "predicate field is not a Parquet leaf column", predicate.path);
+
+  ColumnPredicate bound;
+  bound.op = predicate.op;
+  bound.column = node->column;
+  bound.descr = map.descr()->Column(node->column);
+  KJ_REQUIRE(bound.descr->max_repetition_level() == 0,
+             "predicates on fields inside lists are not supported", predicate.path);
+
+  switch (bound.descr->logical_type()) {
+    case parquet::LogicalType::UINT_8:
+    case parquet::LogicalType::UINT_16:
+    case parquet::LogicalType::UINT_32:
+    case parquet::LogicalType::UINT_64:
+      bound.is_unsigned = true;
+      break;
+    default:
+      bound.is_unsigned = false;
+      break;
+  }
+
+  for (const auto& text : predicate.values) {
+    bound.values.push_back(bindFilterValue(text, bound.descr));
+  }
+  return bound;
+}
+
+// Sign of (value - constant) in the sort order of the column.
+inline int compareFilterValue(const ColumnPredicate& predicate, const FilterValue& constant, bool value) {
+  return static_cast<int>(value) - static_cast<int>(constant.i);
+}
+
+inline int compareFilterValue(const ColumnPredicate& predicate, const FilterValue& constant, int32_t value) {
+  if (predicate.is_unsigned) {
+    uint32_t a = static_cast<uint32_t>(value);
+    uint32_t b = static_cast<uint32_t>(constant.i);
+    return (a < b) ? -1 : ((a > b) ? 1 : 0);
+  }
+  return (value < constant.i) ? -1 : ((value > constant.i) ? 1 : 0);
+}
+
+inline int compareFilterValue(const ColumnPredicate& predicate, const FilterValue& constant, int64_t value) {
+  if (predicate.is_unsigned) {
+    uint64_t a = static_cast<uint64_t>(value);
+    uint64_t b = static_cast<uint64_t>(constant.i);
+    return (a < b) ? -1 : ((a > b) ? 1 : 0);
+  }
+  return (value < constant.i) ? -1 : ((value > constant.i) ? 1 : 0);
+}
+
+inline int compareFilterValue(const ColumnPredicate& predicate, const FilterValue& constant, float value) {
+  return (value < constant.d) ? -1 : ((value > constant.d) ? 1 : 0);
+}
+
+inline int compareFilterValue(const ColumnPredicate& predicate, const FilterValue& constant, double value) {
+  return (value < constant.d) ? -1 : ((value > constant.d) ? 1 : 0);
+}
+
+inline int compareFilterBytes(const uint8_t* value, size_t length, const std::string& constant) {
+  int result = memcmp(value, constant.data(), std::min(length, constant.size()));
+  if (result != 0) {
+    return (result < 0) ? -1 : 1;
+  }
+  return (length < constant.size()) ? -1 : ((length > constant.size()) ? 1 : 0);
+}
+
+inline int compareFilterValue(const ColumnPredicate& predicate, const FilterValue& constant,
+                              const parquet::ByteArray& value) {
+  return compareFilterBytes(value.ptr, value.len, constant.s);
+}
+
+inline int compareFilterValue(const ColumnPredicate& predicate, const FilterValue& constant,
+                              const parquet::FixedLenByteArray& value) {
+  size_t length = predicate.descr->type_length();
+  if ((predicate.descr->logical_type() == parquet::LogicalType::DECIMAL) && (length > 0)) {
+    // Signed big-endian: compare the sign bytes first
+    int8_t a = static_cast<int8_t>(value.ptr[0]);
+    int8_t b = static_cast<int8_t>(constant.s[0]);
+    if (a != b) {
+      return (a < b) ? -1 : 1;
+    }
+  }
+  return compareFilterBytes(value.ptr, length, constant.s);
+}
+
+// Is the value or the constant NaN, which neither equals nor orders against anything?
+template <typename T>
+inline bool isUnorderedFilterValue(const FilterValue& constant, const T& value) {
+  return false;
+}
+
+inline bool isUnorderedFilterValue(const FilterValue& constant, float value) {
+  return std::isnan(value) || std::isnan(constant.d);
+}
+
+inline bool isUnorderedFilterValue(const FilterValue& constant, double value) {
+  return std::isnan(value) || std::isnan(constant.d);
+}
+
+// Does a non-null value satisfy the predicate?
+template <typename T>
+bool matchesFilter(const ColumnPredicate& predicate, const T& value) {
+  const std::vector<FilterValue>& values = predicate.values;
+  for (const auto& constant : values) {
+    if ((predicate.op != CapnpPredicate::IN) && isUnorderedFilterValue(constant, value)) {
+      return false;
+    }
+  }
+
+  switch (predicate.op) {
+    case CapnpPredicate::EQ:
+      return compareFilterValue(predicate, values[0], value) == 0;
+    case CapnpPredicate::LT:
+      return compareFilterValue(predicate, values[0], value) < 0;
+    case CapnpPredicate::LE:
+      return compareFilterValue(predicate, values[0], value) <= 0;
+    case CapnpPredicate::GT:
+      return compareFilterValue(predicate, values[0], value) > 0;
+    case CapnpPredicate::GE:
+      return compareFilterValue(predicate, values[0], value) >= 0;
+    case CapnpPredicate::BETWEEN:
+      return (compareFilterValue(predicate, values[0], value) >= 0) &&
+             (compareFilterValue(predicate, values[1], value) <= 0);
+    case CapnpPredicate::IN:
+      for (const auto& constant : values) {
+        if (!isUnorderedFilterValue(constant, value) && (compareFilterValue(predicate, constant, value) == 0)) {
+          return true;
+        }
+      }
+      return false;
+  }
+  return false;
+}
+
+// Can a value in [min, max] satisfy the predicate?
+template <typename T>
+bool mayMatchFilter(const ColumnPredicate& predicate, const T& min, const T& max) {
+  const std::vector<FilterValue>& values = predicate.values;
+
+  switch (predicate.op) {
+    case CapnpPredicate::EQ:
+      return (compareFilterValue(predicate, values[0], min) <= 0) &&
+             (compareFilterValue(predicate, values[0], max) >= 0);
+    case CapnpPredicate::LT:
+      return compareFilterValue(predicate, values[0], min) < 0;
+    case CapnpPredicate::LE:
+      return compareFilterValue(predicate, values[0], min) <= 0;
+    case CapnpPredicate::GT:
+      return compareFilterValue(predicate, values[0], max) > 0;
+    case CapnpPredicate::GE:
+      return compareFilterValue(predicate, values[0], max) >= 0;
+    case CapnpPredicate::BETWEEN:
+      return (compareFilterValue(predicate, values[0], max) >= 0) &&
+             (compareFilterValue(predicate, values[1], min) <= 0);
+    case CapnpPredicate::IN:
+      for (const auto& constant : values) {
+        if ((compareFilterValue(predicate, constant, min) <= 0) &&
+            (compareFilterValue(predicate, constant, max) >= 0)) {
+          return true;
+        }
+      }
+      return false;
+  }
+  return true;
+}
+
+template <typename DType>
+bool mayMatchStatistics(const ColumnPredicate& predicate, parquet::RowGroupStatistics* statistics) {
+  auto typed = static_cast<parquet::TypedRowGroupStatistics<DType>*>(statistics);
+  return mayMatchFilter(predicate, typed->min(), typed->max());
+}
+
+// Can any row of a row group satisfy the predicate, judging by the column chunk statistics?
+inline bool mayMatchRowGroup(const ColumnPredicate& predicate, const parquet::RowGroupMetaData& row_group) {
+  std::unique_ptr<parquet::ColumnChunkMetaData> chunk = row_group.ColumnChunk(predicate.column);
+
+  if (!chunk->is_stats_set()) {
+    // Missing or untrusted statistics (e.g. written with a signed sort order)
+    return true;
+  }
+
+  std::shared_ptr<parquet::RowGroupStatistics> statistics = chunk->statistics();
+
+  if (!statistics->HasMinMax()) {
+    // No min/max is only written when every value is null, and a null never matches
+    return statistics->null_count() == 0 && statistics->num_values() > 0;
+  }
+
+  switch (predicate.descr->physical_type()) {
+    case parquet::Type::BOOLEAN:
+      return mayMatchStatistics<parquet::BooleanType>(predicate, statistics.get());
+    case parquet::Type::INT32:
+      return mayMatchStatistics<parquet::Int32Type>(predicate, statistics.get());
+    case parquet::Type::INT64:
+      return mayMatchStatistics<parquet::Int64Type>(predicate, statistics.get());
+    case parquet::Type::FLOAT:
+      return mayMatchStatistics<parquet::FloatType>(predicate, statistics.get());
+    case parquet::Type::DOUBLE:
+      return mayMatchStatistics<parquet::DoubleType>(predicate, statistics.get());
+    case parquet::Type::BYTE_ARRAY:
+      return mayMatchStatistics<parquet::ByteArrayType>(predicate, statistics.get());
+    case parquet::Type::FIXED_LEN_BYTE_ARRAY:
+      return mayMatchStatistics<parquet::FLBAType>(predicate, statistics.get());
+    default:
+      return true;
+  }
+}
+
+// Hash of a predicate constant as the writer hashes a value of the column.
+inline uint64_t bloomHashFilterValue(const ColumnPredicate& predicate, const FilterValue& value) {
+  switch (predicate.descr->physical_type()) {
+    case parquet::Type::INT32:
+      return bloomHash(static_cast<int32_t>(value.i));
+    case parquet::Type::INT64:
+      return bloomHash(value.i);
+    case parquet::Type::FLOAT:
+      return bloomHash(static_cast<float>(value.d));
+    case parquet::Type::DOUBLE:
+      return bloomHash(value.d);
+    default:
+      return xxHash64(reinterpret_cast<const uint8_t*>(value.s.data()), value.s.size());
+  }
+}
+
+// Can any row of a column chunk satisfy the predicate, judging by its Bloom
+// filter? Only equality predicates can be ruled out.
+inline bool mayMatchBloomFilter(const ColumnPredicate& predicate, const BloomFilter& filter) {
+  if ((predicate.op != CapnpPredicate::EQ) && (predicate.op != CapnpPredicate::IN)) {
+    return true;
+  }
+  for (const auto& constant : predicate.values) {
+    if (filter.mayContain(bloomHashFilterValue(predicate, constant))) {
+      return true;
+    }
+  }
+  return false;
+}
+
+template <typename DType>
+bool mayMatchPageRangeValues(const ColumnPredicate& predicate, const PageIndexRange& range) {
+  typename DType::c_type min;
+  typename DType::c_type max;
+  pageIndexValue(range.min, &min);
+  pageIndexValue(range.max, &max);
+  return mayMatchFilter(predicate, min, max);
+}
+
+// Can any row of a page index range satisfy the predicate? A range without
+// min/max only holds nulls, which never match.
+inline bool mayMatchPageRange(const ColumnPredicate& predicate, const PageIndexRange& range) {
+  if (!range.has_min_max) {
+    return false;
+  }
+
+  switch (predicate.descr->physical_type()) {
+    case parquet::Type::BOOLEAN:
+      return mayMatchPageRangeValues<parquet::BooleanType>(predicate, range);
+    case parquet::Type::INT32:
+      return mayMatchPageRangeValues<parquet::Int32Type>(predicate, range);
+    case parquet::Type::INT64:
+      return mayMatchPageRangeValues<parquet::Int64Type>(predicate, range);
+    case parquet::Type::FLOAT:
+      return mayMatchPageRangeValues<parquet::FloatType>(predicate, range);
+    case parquet::Type::DOUBLE:
+      return mayMatchPageRangeValues<parquet::DoubleType>(predicate, range);
+    case parquet::Type::BYTE_ARRAY:
+      return mayMatchPageRangeValues<parquet::ByteArrayType>(predicate, range);
+    case parquet::Type::FIXED_LEN_BYTE_ARRAY:
+      return mayMatchPageRangeValues<parquet::FLBAType>(predicate, range);
+    default:
+      return true;
+  }
+}
+
+};  // namespace capnpparquet
+
+#endif  // _CAPNPFILTER_H_
@@ -0,0 +1,212 @@
+/*
+ * Copyright 2017 Rene Sugar
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * @file capnppacked.h
+ * @author Rene Sugar <rene.sugar@gmail.com>
+ * @brief Unpacking kernel of the Cap'n Proto packed encoding.
+ */
+#ifndef _CAPNPPACKED_H_
+#define _CAPNPPACKED_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#include "capnpcpu.h"
+
+namespace capnpparquet {
+
+// The packed encoding (https://capnproto.org/encoding.html#packing) stores
+// each word as a tag byte, with a bit set for each non-zero byte of the word,
+// followed by those bytes. A 0x00 tag is followed by the number of zero words
+// after it, a 0xff tag by the word and the number of words after it that are
+// stored as they are.
+//
+// Streams are unpacked a buffer at a time in two passes: the first finds the
+// whole words the buffer holds and the size they unpack to, the second writes
+// them. With SSSE3 the bytes of a word are moved to their place by one
+// shuffle, whose mask is looked up by the tag (picked at run time, see
+// capnpcpu.h).
+
+// Shuffle masks of the tags: byte i of a word is the next byte of the input
+// when bit i of the tag is set, and zero (0x80) otherwise.
+struct PackedShuffleMasks {
+  PackedShuffleMasks() {
+    for (int tag = 0; tag < 256; tag++) {
+      uint8_t next = 0;
+      for (int i = 0; i < 8; i++) {
+        masks[tag][i] = ((tag >> i) & 1) ? next++ : 0x80;
+      }
+    }
+  }
+
+  uint8_t masks[256][8];
+};
+
+inline const PackedShuffleMasks& packedShuffleMasks() {
+  static const PackedShuffleMasks masks;
+  return masks;
+}
+
+enum StreamEncodingGuess {
+  UNPACKED_STREAM,
+  PACKED_STREAM,
+  EITHER_STREAM     // both readings are valid, only the first message tells
+};
+
+// The encoding of a stream that begins with the 4 bytes at `data`.
+//
+// The first four bytes of an unpacked stream are its segment count minus
+// one, below `max_segments` or a reader rejects the stream. Those of a packed
+// stream are the tag of the segment table word and the bytes after it: the
+// word is not zero, so their second byte is a non-zero byte of the word or
+// the count of the zero words after it. A count of at least `max_segments`
+// is packed, a count below 256 unpacked. In between, packers never write a
+// zero byte after a tag, which rules out most of the counts; the rest are
+// tiny or empty packed messages or unpacked ones of 257 to `max_segments`
+// segments.
+inline StreamEncodingGuess guessStreamEncoding(const uint8_t* data, uint32_t max_segments) {
+  uint32_t count = static_cast<uint32_t>(data[0]) | (static_cast<uint32_t>(data[1]) << 8) |
+                   (static_cast<uint32_t>(data[2]) << 16) | (static_cast<uint32_t>(data[3]) << 24);
+  if (count >= max_segments) {
+    return PACKED_STREAM;
+  }
+  if (data[1] == 0) {
+    return UNPACKED_STREAM;
+  }
+  uint8_t tag = data[0];
+  int literals = (tag == 0) ? 0 : __builtin_popcount(tag);
+  for (int i = 1; (i <= literals) && (i < 4); i++) {
+    if (data[i] == 0) {
+      return UNPACKED_STREAM;
+    }
+  }
+  return EITHER_STREAM;
+}
+
+// Bytes at the start of `in` that hold whole packed words. `unpacked` is set
+// to their size once unpacked.
+inline size_t packedWords(const uint8_t* in, size_t size, size_t* unpacked) {
+  size_t pos = 0;
+  size_t words = 0;
+  while (pos < size) {
+    uint8_t tag = in[pos];
+    size_t length;
+    size_t count = 1;
+    if (tag == 0) {
+      if (pos + 2 > size) {
+        break;
+      }
+      length = 2;
+      count += in[pos + 1];
+    } else if (tag == 0xff) {
+      if (pos + 10 > size) {
+        break;
+      }
+      count += in[pos + 9];
+      length = 10 + (static_cast<size_t>(in[pos + 9]) * 8);
+    } else {
+      length = 1 + __builtin_popcount(tag);
+    }
+    if (pos + length > size) {
+      break;
+    }
+    pos += length;
+    words += count;
+  }
+  *unpacked = words * 8;
+  return pos;
+}
+
+// Unpack the run of words of a 0x00 or 0xff tag at in[pos]. Returns the
+// bytes read.
+inline size_t unpackRun(const uint8_t* in, size_t pos, uint8_t** out) {
+  if (in[pos] == 0) {
+    size_t bytes = (1 + static_cast<size_t>(in[pos + 1])) * 8;
+    memset(*out, 0, bytes);
+    *out += bytes;
+    return 2;
+  }
+  size_t bytes = (1 + static_cast<size_t>(in[pos + 9])) * 8;
+  memcpy(*out, in + pos + 1, 8);
+  memcpy(*out + 8, in + pos + 10, bytes - 8);
+  *out += bytes;
+  return 10 + (bytes - 8);
+}
+
+// Unpack the word of any other tag at in[pos]
+inline void unpackWordScalar(const uint8_t* in, size_t pos, const uint8_t* mask, uint8_t* out) {
+  for (int i = 0; i < 8; i++) {
+    out[i] = (mask[i] & 0x80) ? 0 : in[pos + 1 + mask[i]];
+  }
+}
+
+// Unpack the words of in[0, size), as found by packedWords(), into `out`.
+inline void unpackWordsScalar(const uint8_t* in, size_t size, uint8_t* out) {
+  const PackedShuffleMasks& shuffle = packedShuffleMasks();
+  size_t pos = 0;
+  while (pos < size) {
+    uint8_t tag = in[pos];
+    if ((tag == 0) || (tag == 0xff)) {
+      pos += unpackRun(in, pos, &out);
+    } else {
+      unpackWordScalar(in, pos, shuffle.masks[tag], out);
+      out += 8;
+      pos += 1 + __builtin_popcount(tag);
+    }
+  }
+}
+
+#ifdef CAPNPPARQUET_X86_KERNELS
+CAPNPPARQUET_TARGET("ssse3")
+inline void unpackWordsSsse3(const uint8_t* in, size_t size, uint8_t* out) {
+  const PackedShuffleMasks& shuffle = packedShuffleMasks();
+  size_t pos = 0;
+  while (pos < size) {
+    uint8_t tag = in[pos];
+    if ((tag == 0) || (tag == 0xff)) {
+      pos += unpackRun(in, pos, &out);
+      continue;
+    }
+    const uint8_t* mask = shuffle.masks[tag];
+    // The load reads up to 8 bytes past the tag
+    if (pos + 9 <= size) {
+      __m128i bytes = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(in + pos + 1));
+      __m128i lanes = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(mask));
+      _mm_storel_epi64(reinterpret_cast<__m128i*>(out), _mm_shuffle_epi8(bytes, lanes));
+    } else {
+      unpackWordScalar(in, pos, mask, out);
+    }
+    out += 8;
+    pos += 1 + __builtin_popcount(tag);
+  }
+}
+#endif
+
+inline void unpackWords(const uint8_t* in, size_t size, uint8_t* out) {
+#ifdef CAPNPPARQUET_X86_KERNELS
+  if (cpuHasSsse3()) {
+    unpackWordsSsse3(in, size, out);
+    return;
+  }
+#endif
+  unpackWordsScalar(in, size, out);
+}
+
+};  // namespace capnpparquet
+
+#endif  // _CAPNPPACKED_H_
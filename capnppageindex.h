@@ -0,0 +1,300 @@
+/*
+ * Copyright 2017 Rene Sugar
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * @file capnppageindex.h
+ * @author Rene Sugar <rene.sugar@gmail.com>
+ * @brief Min/max/null count index of fixed row ranges of Parquet column chunks.
+ */
+#ifndef _CAPNPPAGEINDEX_H_
+#define _CAPNPPAGEINDEX_H_
+
+#include <kj/debug.h>
+
+#include <parquet/schema.h>
+#include <parquet/types.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "capnpstats.h"
+
+namespace capnpparquet {
+
+// Rows per range of a page index
+static const int64_t PAGE_INDEX_RANGE_ROWS = 8192;
+
+// Statistics of one row range of a column chunk. Values are plain encoded.
+struct PageIndexRange {
+  PageIndexRange() : null_count(0), has_min_max(false) {}
+
+  int64_t     null_count;
+  bool        has_min_max;  // false when the range has no non-null values
+  std::string min;
+  std::string max;
+};
+
+// The page index of a column chunk.
+//
+// parquet-cpp does not expose where it cuts pages, so instead of a
+// ColumnIndex and OffsetIndex per page, the index covers ranges of a fixed
+// number of rows: range i holds rows [i * range_rows, (i + 1) * range_rows)
+// of the row group. A reader skips the rows of ranges that cannot match,
+// which lets parquet-cpp skip the pages inside them without decoding.
+//
+// Serialized little-endian as the range size and count followed by, per
+// range, the null count, a min/max flag and the lengths and bytes of min
+// and max.
+//
+class ColumnPageIndex {
+public:
+  explicit ColumnPageIndex(int64_t range_rows = PAGE_INDEX_RANGE_ROWS) : range_rows_(range_rows) {}
+
+  static ColumnPageIndex parse(const uint8_t* data, int64_t length) {
+    const uint8_t* end = data + length;
+    ColumnPageIndex index(readInt<int64_t>(data, end));
+    int64_t count = readInt<int64_t>(data, end);
+    KJ_REQUIRE((index.range_rows_ > 0) && (count >= 0), "invalid page index");
+
+    for (int64_t i = 0; i < count; i++) {
+      PageIndexRange range;
+      range.null_count = readInt<int64_t>(data, end);
+      range.has_min_max = (readInt<uint8_t>(data, end) != 0);
+      if (range.has_min_max) {
+        range.min = readBytes(data, end);
+        range.max = readBytes(data, end);
+      }
+      index.ranges_.push_back(range);
+    }
+    return index;
+  }
+
+  std::string serialize() const {
+    std::string out;
+    appendInt<int64_t>(out, range_rows_);
+    appendInt<int64_t>(out, static_cast<int64_t>(ranges_.size()));
+    for (const auto& range : ranges_) {
+      appendInt<int64_t>(out, range.null_count);
+      appendInt<uint8_t>(out, range.has_min_max ? 1 : 0);
+      if (range.has_min_max) {
+        appendInt<uint32_t>(out, static_cast<uint32_t>(range.min.size()));
+        out += range.min;
+        appendInt<uint32_t>(out, static_cast<uint32_t>(range.max.size()));
+        out += range.max;
+      }
+    }
+    return out;
+  }
+
+  void add(const PageIndexRange& range) { ranges_.push_back(range); }
+
+  int64_t range_rows() const { return range_rows_; }
+
+  const std::vector<PageIndexRange>& ranges() const { return ranges_; }
+
+private:
+  int64_t                     range_rows_;
+  std::vector<PageIndexRange> ranges_;
+
+  template <typename T>
+  static void appendInt(std::string& out, T value) {
+    out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+  }
+
+  template <typename T>
+  static T readInt(const uint8_t*& data, const uint8_t* end) {
+    KJ_REQUIRE(data + sizeof(T) <= end, "page index ends early");
+    T value;
+    memcpy(&value, data, sizeof(value));
+    data += sizeof(value);
+    return value;
+  }
+
+  static std::string readBytes(const uint8_t*& data, const uint8_t* end) {
+    uint32_t length = readInt<uint32_t>(data, end);
+    KJ_REQUIRE(data + length <= end, "page index ends early");
+    std::string bytes(reinterpret_cast<const char*>(data), length);
+    data += length;
+    return bytes;
+  }
+};
+
+// UINT_* columns sort unsigned, as in the column statistics
+inline bool pageIndexUnsigned(const parquet::ColumnDescriptor* descr) {
+  switch (descr->logical_type()) {
+    case parquet::LogicalType::UINT_8:
+    case parquet::LogicalType::UINT_16:
+    case parquet::LogicalType::UINT_32:
+    case parquet::LogicalType::UINT_64:
+      return true;
+    default:
+      return false;
+  }
+}
+
+inline bool pageIndexLess(const parquet::ColumnDescriptor* descr, bool a, bool b) { return !a && b; }
+
+inline bool pageIndexLess(const parquet::ColumnDescriptor* descr, int32_t a, int32_t b) {
+  return pageIndexUnsigned(descr) ? (static_cast<uint32_t>(a) < static_cast<uint32_t>(b)) : (a < b);
+}
+
+inline bool pageIndexLess(const parquet::ColumnDescriptor* descr, int64_t a, int64_t b) {
+  return pageIndexUnsigned(descr) ? (static_cast<uint64_t>(a) < static_cast<uint64_t>(b)) : (a < b);
+}
+
+inline bool pageIndexLess(const parquet::ColumnDescriptor* descr, float a, float b) { return a < b; }
+
+inline bool pageIndexLess(const parquet::ColumnDescriptor* descr, double a, double b) { return a < b; }
+
+inline bool pageIndexLess(const parquet::ColumnDescriptor* descr,
+                          const parquet::ByteArray& a, const parquet::ByteArray& b) {
+  int result = memcmp(a.ptr, b.ptr, std::min(a.len, b.len));
+  return (result < 0) || ((result == 0) && (a.len < b.len));
+}
+
+inline bool pageIndexLess(const parquet::ColumnDescriptor* descr,
+                          const parquet::FixedLenByteArray& a, const parquet::FixedLenByteArray& b) {
+  int32_t length = descr->type_length();
+  if ((descr->logical_type() == parquet::LogicalType::DECIMAL) && (length > 0) && (a.ptr[0] != b.ptr[0])) {
+    // Signed big-endian: the sign byte decides
+    return static_cast<int8_t>(a.ptr[0]) < static_cast<int8_t>(b.ptr[0]);
+  }
+  return memcmp(a.ptr, b.ptr, length) < 0;
+}
+
+// NaN has no place in the order, it is left out of min and max
+template <typename T>
+inline bool pageIndexIgnored(const T& value) { return false; }
+
+template <>
+inline bool pageIndexIgnored<float>(const float& value) { return std::isnan(value); }
+
+template <>
+inline bool pageIndexIgnored<double>(const double& value) { return std::isnan(value); }
+
+template <typename T>
+inline std::string pageIndexBytes(const parquet::ColumnDescriptor* descr, const T& value) {
+  return std::string(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+inline std::string pageIndexBytes(const parquet::ColumnDescriptor* descr, const parquet::ByteArray& value) {
+  return std::string(reinterpret_cast<const char*>(value.ptr), value.len);
+}
+
+inline std::string pageIndexBytes(const parquet::ColumnDescriptor* descr,
+                                  const parquet::FixedLenByteArray& value) {
+  return std::string(reinterpret_cast<const char*>(value.ptr), descr->type_length());
+}
+
+// Statistics of the `count` non-null values of a range with `null_count` nulls
+template <typename T>
+PageIndexRange pageIndexRange(const parquet::ColumnDescriptor* descr, const T* values, int64_t count,
+                              int64_t null_count) {
+  PageIndexRange range;
+  range.null_count = null_count;
+
+  const T* min = nullptr;
+  const T* max = nullptr;
+  for (int64_t i = 0; i < count; i++) {
+    if (pageIndexIgnored(values[i])) {
+      continue;
+    }
+    if ((min == nullptr) || pageIndexLess(descr, values[i], *min)) {
+      min = &values[i];
+    }
+    if ((max == nullptr) || pageIndexLess(descr, *max, values[i])) {
+      max = &values[i];
+    }
+  }
+
+  if (min != nullptr) {
+    range.has_min_max = true;
+    range.min = pageIndexBytes(descr, *min);
+    range.max = pageIndexBytes(descr, *max);
+  }
+  return range;
+}
+
+// The numeric types use the vectorized kernels of capnpstats.h
+template <typename T>
+inline PageIndexRange pageIndexMinMax(const parquet::ColumnDescriptor* descr, bool found, const T& min,
+                                      const T& max, int64_t null_count) {
+  PageIndexRange range;
+  range.null_count = null_count;
+  if (found) {
+    range.has_min_max = true;
+    range.min = pageIndexBytes(descr, min);
+    range.max = pageIndexBytes(descr, max);
+  }
+  return range;
+}
+
+inline PageIndexRange pageIndexRange(const parquet::ColumnDescriptor* descr, const int32_t* values,
+                                     int64_t count, int64_t null_count) {
+  int32_t min = 0;
+  int32_t max = 0;
+  bool found = minMaxValues(values, count, pageIndexUnsigned(descr), &min, &max);
+  return pageIndexMinMax(descr, found, min, max, null_count);
+}
+
+inline PageIndexRange pageIndexRange(const parquet::ColumnDescriptor* descr, const int64_t* values,
+                                     int64_t count, int64_t null_count) {
+  int64_t min = 0;
+  int64_t max = 0;
+  bool found = minMaxValues(values, count, pageIndexUnsigned(descr), &min, &max);
+  return pageIndexMinMax(descr, found, min, max, null_count);
+}
+
+inline PageIndexRange pageIndexRange(const parquet::ColumnDescriptor* descr, const float* values,
+                                     int64_t count, int64_t null_count) {
+  float min = 0;
+  float max = 0;
+  bool found = minMaxValues(values, count, &min, &max);
+  return pageIndexMinMax(descr, found, min, max, null_count);
+}
+
+inline PageIndexRange pageIndexRange(const parquet::ColumnDescriptor* descr, const double* values,
+                                     int64_t count, int64_t null_count) {
+  double min = 0;
+  double max = 0;
+  bool found = minMaxValues(values, count, &min, &max);
+  return pageIndexMinMax(descr, found, min, max, null_count);
+}
+
+// Plain encoded bytes of a range back to a value. Byte array values point
+// into `bytes`.
+template <typename T>
+inline void pageIndexValue(const std::string& bytes, T* value) {
+  KJ_REQUIRE(bytes.size() == sizeof(T), "invalid page index value");
+  memcpy(value, bytes.data(), sizeof(T));
+}
+
+inline void pageIndexValue(const std::string& bytes, parquet::ByteArray* value) {
+  value->ptr = reinterpret_cast<const uint8_t*>(bytes.data());
+  value->len = static_cast<uint32_t>(bytes.size());
+}
+
+inline void pageIndexValue(const std::string& bytes, parquet::FixedLenByteArray* value) {
+  value->ptr = reinterpret_cast<const uint8_t*>(bytes.data());
+}
+
+};  // namespace capnpparquet
+
+#endif  // _CAPNPPAGEINDEX_H_
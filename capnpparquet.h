@@ -34,9 +34,12 @@
 #include <ostream>
 #include <string>
 #include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
+#include "capnpdecimal.h"
 #include "capnpgeneric.h"
+#include "capnptemporal.h"
 
 /*
  
@@ -346,6 +349,18 @@ namespace capnpparquet {
  ('map',               '',                          '',                          '',             ''),
  ('map_key_value',     '',                          '',                          '',             ''),
  ('list',              '',                          '',                          '',             ''),
+ ('encoding',          'std::string',               'std::string',               'name',         ''),
+ ('compression',       'std::string',               'std::string',               'name',         ''),
+ ('compression_level', 'int32_t',                   'int32_t',                   'level',        '0'),
+ ('row_group_rows',    'int64_t',                   'int64_t',                   'rows',         '0'),
+ ('row_group_bytes',   'int64_t',                   'int64_t',                   'bytes',        '0'),
+ ('data_page_size',    'int64_t',                   'int64_t',                   'bytes',        '0'),
+ ('dictionary_page_limit', 'int64_t',               'int64_t',                   'bytes',        '0'),
+ ('bloom_filter_fpp',  'double',                    'double',                    'fpp',          '0.0'),
+ ('sort_key',          'int32_t',                   'int32_t',                   'position',     '0'),
+ ('partition_key',     'int32_t',                   'int32_t',                   'position',     '0'),
+ ('no_page_index',     '',                          '',                          '',             ''),
+ ('source_unit',       'std::string',               'std::string',               'unit',         ''),
  ('value',             '',                          '',                          '',             ''),
  
  ]
@@ -407,6 +422,18 @@ typedef struct _ASTNode__isset {
   , map(false)
   , map_key_value(false)
   , list(false)
+  , encoding(false)
+  , compression(false)
+  , compression_level(false)
+  , row_group_rows(false)
+  , row_group_bytes(false)
+  , data_page_size(false)
+  , dictionary_page_limit(false)
+  , bloom_filter_fpp(false)
+  , sort_key(false)
+  , partition_key(false)
+  , no_page_index(false)
+  , source_unit(false)
   , value(false)
     {}
   bool node_type :1;
@@ -447,6 +474,18 @@ typedef struct _ASTNode__isset {
   bool map :1;
   bool map_key_value :1;
   bool list :1;
+  bool encoding :1;
+  bool compression :1;
+  bool compression_level :1;
+  bool row_group_rows :1;
+  bool row_group_bytes :1;
+  bool data_page_size :1;
+  bool dictionary_page_limit :1;
+  bool bloom_filter_fpp :1;
+  bool sort_key :1;
+  bool partition_key :1;
+  bool no_page_index :1;
+  bool source_unit :1;
   bool value :1;
 } _ASTNode__isset;
 
@@ -468,9 +507,25 @@ typedef struct _value {
 } _ASTNodeValue;
 //[[[end]]]
 
+// Name of the column that stores which member of a union is set. It is added
+// to the group of the struct (or named union) holding the union, ahead of the
+// member columns. Like enums (see NOTE(1)), it holds the member's name.
+static const char* const UNION_DISCRIMINANT_NAME = "which";
+
+// Names of the repeated group and of the element of the LIST groups that
+// store Cap'n Proto lists (standard mode, see ARRAYS AND MAPS above).
+static const char* const LIST_REPEATED_NAME = "list";
+static const char* const LIST_ELEMENT_NAME = "element";
+
+// Names of the repeated group, key and value of the MAP groups that store
+// $map lists of key/value structs
+static const char* const MAP_REPEATED_NAME = "key_value";
+static const char* const MAP_KEY_NAME = "key";
+static const char* const MAP_VALUE_NAME = "value";
+
 // Convert lowerCamelCase and UpperCamelCase strings to lower_with_underscore.
 // https://gist.github.com/rodamber/2558e25d4d8f6b9f2ffdf7bd49471340
-std::string convertCamelCase(std::string camelCase) {
+inline std::string convertCamelCase(std::string camelCase) {
   std::string str(1, tolower(camelCase[0]));
   //printf("convertCamelCase: input: %s\n", camelCase.c_str());
 
@@ -540,6 +595,14 @@ public:
   , type_id_(0)
   , parent_(nullptr)
   , node_(nullptr)
+  , compression_level_(0)
+  , row_group_rows_(0)
+  , row_group_bytes_(0)
+  , data_page_size_(0)
+  , dictionary_page_limit_(0)
+  , bloom_filter_fpp_(0.0)
+  , sort_key_(0)
+  , partition_key_(0)
   {}
   //[[[end]]]
 
@@ -592,6 +655,18 @@ public:
   bool is_map() const { return __isset.map == true; }
   bool is_map_key_value() const { return __isset.map_key_value == true; }
   bool is_list() const { return __isset.list == true; }
+  bool is_encoding() const { return __isset.encoding == true; }
+  bool is_compression() const { return __isset.compression == true; }
+  bool is_compression_level() const { return __isset.compression_level == true; }
+  bool is_row_group_rows() const { return __isset.row_group_rows == true; }
+  bool is_row_group_bytes() const { return __isset.row_group_bytes == true; }
+  bool is_data_page_size() const { return __isset.data_page_size == true; }
+  bool is_dictionary_page_limit() const { return __isset.dictionary_page_limit == true; }
+  bool is_bloom_filter_fpp() const { return __isset.bloom_filter_fpp == true; }
+  bool is_sort_key() const { return __isset.sort_key == true; }
+  bool is_partition_key() const { return __isset.partition_key == true; }
+  bool is_no_page_index() const { return __isset.no_page_index == true; }
+  bool is_source_unit() const { return __isset.source_unit == true; }
   bool is_value() const { return __isset.value == true; }
   //[[[end]]]
 
@@ -656,6 +731,28 @@ public:
 
   parquet::schema::NodePtr node() { return node_; }
 
+  std::string encoding() { return encoding_; }
+
+  std::string compression() { return compression_; }
+
+  int32_t compression_level() { return compression_level_; }
+
+  int64_t row_group_rows() { return row_group_rows_; }
+
+  int64_t row_group_bytes() { return row_group_bytes_; }
+
+  int64_t data_page_size() { return data_page_size_; }
+
+  int64_t dictionary_page_limit() { return dictionary_page_limit_; }
+
+  double bloom_filter_fpp() { return bloom_filter_fpp_; }
+
+  int32_t sort_key() { return sort_key_; }
+
+  int32_t partition_key() { return partition_key_; }
+
+  std::string source_unit() { return source_unit_; }
+
   //[[[end]]]
 
   /*[[[cog
@@ -939,6 +1036,65 @@ public:
     __isset.list = true;
   }
 
+  void setEncoding(std::string name) {
+    encoding_ = name;
+    __isset.encoding = true;
+  }
+
+  void setCompression(std::string name) {
+    compression_ = name;
+    __isset.compression = true;
+  }
+
+  void setCompressionLevel(int32_t level) {
+    compression_level_ = level;
+    __isset.compression_level = true;
+  }
+
+  void setRowGroupRows(int64_t rows) {
+    row_group_rows_ = rows;
+    __isset.row_group_rows = true;
+  }
+
+  void setRowGroupBytes(int64_t bytes) {
+    row_group_bytes_ = bytes;
+    __isset.row_group_bytes = true;
+  }
+
+  void setDataPageSize(int64_t bytes) {
+    data_page_size_ = bytes;
+    __isset.data_page_size = true;
+  }
+
+  void setDictionaryPageLimit(int64_t bytes) {
+    dictionary_page_limit_ = bytes;
+    __isset.dictionary_page_limit = true;
+  }
+
+  void setBloomFilterFpp(double fpp) {
+    bloom_filter_fpp_ = fpp;
+    __isset.bloom_filter_fpp = true;
+  }
+
+  void setSortKey(int32_t position) {
+    sort_key_ = position;
+    __isset.sort_key = true;
+  }
+
+  void setPartitionKey(int32_t position) {
+    partition_key_ = position;
+    __isset.partition_key = true;
+  }
+
+  void setIsNoPageIndex() {
+    __isset.no_page_index = true;
+  }
+
+  void setSourceUnit(std::string unit) {
+    source_unit_ = unit;
+    __isset.source_unit = true;
+  }
+
   void setIsValue() {
     __isset.value = true;
   }
@@ -1139,6 +1295,17 @@ public:
   std::string                  schema_name_;
   ASTNode*                     parent_;
   parquet::schema::NodePtr     node_;
+  std::string                  encoding_;
+  std::string                  compression_;
+  int32_t                      compression_level_;
+  int64_t                      row_group_rows_;
+  int64_t                      row_group_bytes_;
+  int64_t                      data_page_size_;
+  int64_t                      dictionary_page_limit_;
+  double                       bloom_filter_fpp_;
+  int32_t                      sort_key_;
+  int32_t                      partition_key_;
+  std::string                  source_unit_;
   //[[[end]]]
 
   _ASTNodeValue value_;
@@ -1167,6 +1334,42 @@ public:
   }
 };
 
+// Writer settings of a leaf column, from the $encoding, $compression,
+// $compressionLevel, $bloomFilter, $noPageIndex and $sourceUnit annotations
+// of the fields above it and the $sortKey and $partitionKey annotations of
+// its own field. Empty names keep the writer's defaults.
+struct ParquetColumnOptions {
+  ParquetColumnOptions()
+  : encoding_inherited(false), compression_level(0), has_compression_level(false), bloom_filter_fpp(0.0),
+    sort_key(0), has_sort_key(false), partition_key(0), has_partition_key(false), page_index(true) {}
+
+  std::string encoding;             // PLAIN, DICTIONARY, DELTA_BINARY_PACKED, ...
+  bool        encoding_inherited;   // $encoding of a field above several columns
+  std::string compression;          // UNCOMPRESSED, SNAPPY, GZIP, LZO, BROTLI, LZ4, ZSTD
+  int32_t     compression_level;
+  bool        has_compression_level;
+  double      bloom_filter_fpp;     // $bloomFilter: false positive probability, 0 for no filter
+  int32_t     sort_key;             // $sortKey: position of the column in the sort order of a row group
+  bool        has_sort_key;
+  int32_t     partition_key;        // $partitionKey: directory level of the column in partitioned output
+  bool        has_partition_key;
+  bool        page_index;           // cleared by $noPageIndex
+  std::string source_unit;          // $sourceUnit: unit of the Cap'n Proto values (d, s, ms, us, ns)
+};
+
+// Writer settings of a table, from the $rowGroupRows, $rowGroupBytes,
+// $dataPageSize and $dictionaryPageLimit annotations of the $schema struct.
+// Zero keeps the writer's default.
+struct ParquetWriterOptions {
+  ParquetWriterOptions()
+  : row_group_rows(0), row_group_bytes(0), data_page_size(0), dictionary_page_limit(0) {}
+
+  int64_t row_group_rows;
+  int64_t row_group_bytes;        // uncompressed column data per row group
+  int64_t data_page_size;
+  int64_t dictionary_page_limit;
+};
+
 class CapnpcParquet : public BaseGenerator {
 public:
   explicit CapnpcParquet(SchemaLoader &schemaLoader)
@@ -1226,28 +1429,78 @@ public:
       return document_->node();
   }
 
+  uint64_t getRootStructId() const {
+      // id of the struct annotated with $schema that the Parquet schema was built from
+      return document_->type_id();
+  }
+
+  // Cap'n Proto field ordinals leading to each leaf column of the Parquet
+  // schema, in column order, as dotted paths (e.g. "4.0" is field @0 of the
+  // struct in field @4).
+  std::vector<std::string> getColumnFieldIds() const {
+    std::vector<std::string> ids;
+    parquet::schema::NodePtr document = getDocument();
+    if (document != nullptr) {
+      collectColumnFieldIds(document.get(), "", ids);
+    }
+    return ids;
+  }
+
+  // Writer settings of the struct annotated with $schema
+  ParquetWriterOptions getWriterOptions() const {
+    ParquetWriterOptions options;
+    if (document_ == nullptr) {
+      return options;
+    }
+
+    for (int i = 0; i < document_->num_children(); i++) {
+      ASTNode* element = document_->child(i);
+      if ((element->is_schema_name()) && (element->node() == document_->node())) {
+        options.row_group_rows = element->row_group_rows();
+        options.row_group_bytes = element->row_group_bytes();
+        options.data_page_size = element->data_page_size();
+        options.dictionary_page_limit = element->dictionary_page_limit();
+        break;
+      }
+    }
+    return options;
+  }
+
+  // Writer settings of each leaf column of the Parquet schema, in column order
+  std::vector<ParquetColumnOptions> getColumnOptions() const {
+    std::vector<ParquetColumnOptions> columns;
+    parquet::schema::NodePtr document = getDocument();
+    if (document != nullptr) {
+      collectColumnOptions(document.get(), ParquetColumnOptions(), columns);
+    }
+    return columns;
+  }
+
 private:
   ASTNode* document_;
   ASTNode* currentParent_;
 
+  // Ordinals of the Parquet nodes built for struct fields
+  std::unordered_map<const parquet::schema::Node*, uint16_t> field_ordinals_;
+
+  // Writer settings of the Parquet nodes built for annotated struct fields
+  std::unordered_map<const parquet::schema::Node*, ParquetColumnOptions> column_options_;
+
+  // Parquet nodes of the struct declarations, by node id, and the ids of
+  // those stored as list elements (see buildListType())
+  std::unordered_map<uint64_t, parquet::schema::NodePtr> decl_nodes_;
+  std::unordered_set<uint64_t>                           list_decls_;
+
   kj::String struct_field_reason_;
   kj::String value_reason_;
-  constexpr static const char* default_type_reason_ = u8"type";
-  const char* type_reason_ = default_type_reason_;
 
   int32_t minBytesForPrecision(int32_t precision) {
-    int32_t numBytes = 1;
-    while (pow(2.0, 8.0 * numBytes - 1.0) < pow(10.0, precision)) {
-      numBytes += 1;
-    }
-    return numBytes;
+    return decimalBytesForPrecision(precision);
   }
 
   // Max precision of a decimal value stored in `numBytes` bytes
   int32_t maxPrecisionForBytes(int32_t numBytes) {
-    return round(                                   // convert double to int32_t
-             floor(log10(                           // number of base-10 digits
-            pow(2, 8.0 * numBytes - 1.0) - 1.0)));  // max value stored in numBytes
+    return decimalPrecisionForBytes(numBytes);
   }
 
   int32_t getAnnotationValueI32(ASTNode* node) {
@@ -1296,6 +1549,80 @@ private:
     return value;
   }
 
+  int64_t getAnnotationValueI64(ASTNode* node) {
+    int num_children = node->num_children();
+    int64_t value = 0;
+
+    ASTNode* child;
+
+    for (int i = 0; i < num_children; i++) {
+      child = node->child(i);
+
+      if ((child->node() != nullptr) &&
+          (child->node_type() == ASTNode::type::VALUE) &&
+          (child->is_value())) {
+        switch (child->capnp_type()) {
+            case schema::Type::INT64:
+              value = child->getValueI64();
+              break;
+            case schema::Type::UINT64:
+              value = static_cast<int64_t>(child->getValueUI64());
+              break;
+            case schema::Type::INT8:
+              value = static_cast<int64_t>(child->getValueI8());
+              break;
+            case schema::Type::INT16:
+              value = static_cast<int64_t>(child->getValueI16());
+              break;
+            case schema::Type::INT32:
+              value = static_cast<int64_t>(child->getValueI32());
+              break;
+            case schema::Type::UINT8:
+              value = static_cast<int64_t>(child->getValueUI8());
+              break;
+            case schema::Type::UINT16:
+              value = static_cast<int64_t>(child->getValueUI16());
+              break;
+            case schema::Type::UINT32:
+              value = static_cast<int64_t>(child->getValueUI32());
+              break;
+            default:
+              value = 0;
+        }
+      }
+    }
+
+    return value;
+  }
+
+  double getAnnotationValueDOUBLE(ASTNode* node) {
+    int num_children = node->num_children();
+    double value = 0.0;
+
+    ASTNode* child;
+
+    for (int i = 0; i < num_children; i++) {
+      child = node->child(i);
+
+      if ((child->node() != nullptr) &&
+          (child->node_type() == ASTNode::type::VALUE) &&
+          (child->is_value())) {
+        switch (child->capnp_type()) {
+            case schema::Type::FLOAT32:
+              value = static_cast<double>(child->getValueFLOAT());
+              break;
+            case schema::Type::FLOAT64:
+              value = child->getValueDOUBLE();
+              break;
+            default:
+              value = 0.0;
+        }
+      }
+    }
+
+    return value;
+  }
+
   std::string getAnnotationValueTEXT(ASTNode* node) {
     int num_children = node->num_children();
     std::string value;
@@ -1357,6 +1684,17 @@ private:
         // annotation map(*)                :Void;
         // annotation mapKeyValue(*)        :Void;
         // annotation list(*)               :Void;
+        // annotation encoding(field)       :Text;
+        // annotation compression(field)    :Text;
+        // annotation compressionLevel(field) :Int32;
+        // annotation rowGroupRows(struct)  :Int64;
+        // annotation rowGroupBytes(struct) :Int64;
+        // annotation dataPageSize(struct)  :Int64;
+        // annotation dictionaryPageLimit(struct) :Int64;
+        // annotation bloomFilter(field)    :Float64;
+        // annotation sortKey(field)        :Int32;
+        // annotation partitionKey(field)   :Int32;
+        // annotation sourceUnit(field)     :Text;
 
         if (child->name() == "schema") {
           node->setSchemaName(getAnnotationValueTEXT(child));
@@ -1398,6 +1736,30 @@ private:
           node->setIsMapKeyValue();
         } else if (child->name() == "list") {
           node->setIsList();
+        } else if (child->name() == "encoding") {
+          node->setEncoding(getAnnotationValueTEXT(child));
+        } else if (child->name() == "compression") {
+          node->setCompression(getAnnotationValueTEXT(child));
+        } else if (child->name() == "compressionLevel") {
+          node->setCompressionLevel(getAnnotationValueI32(child));
+        } else if (child->name() == "rowGroupRows") {
+          node->setRowGroupRows(getAnnotationValueI64(child));
+        } else if (child->name() == "rowGroupBytes") {
+          node->setRowGroupBytes(getAnnotationValueI64(child));
+        } else if (child->name() == "dataPageSize") {
+          node->setDataPageSize(getAnnotationValueI64(child));
+        } else if (child->name() == "dictionaryPageLimit") {
+          node->setDictionaryPageLimit(getAnnotationValueI64(child));
+        } else if (child->name() == "bloomFilter") {
+          node->setBloomFilterFpp(getAnnotationValueDOUBLE(child));
+        } else if (child->name() == "sortKey") {
+          node->setSortKey(getAnnotationValueI32(child));
+        } else if (child->name() == "partitionKey") {
+          node->setPartitionKey(getAnnotationValueI32(child));
+        } else if (child->name() == "noPageIndex") {
+          node->setIsNoPageIndex();
+        } else if (child->name() == "sourceUnit") {
+          node->setSourceUnit(getAnnotationValueTEXT(child));
         }
       }
     }
@@ -1452,7 +1814,8 @@ private:
           node->setLogicalType(parquet::LogicalType::NONE);
           break;
         case capnp::schema::Type::LIST:
-          node->setLogicalType(parquet::LogicalType::LIST);
+          // A $map list of key/value structs (see buildMapType())
+          node->setLogicalType(node->is_map() ? parquet::LogicalType::MAP : parquet::LogicalType::LIST);
           break;
         case capnp::schema::Type::ENUM:
           node->setLogicalType(parquet::LogicalType::ENUM);
@@ -1742,6 +2105,7 @@ private:
             (element->child(i)->node_type() != ASTNode::type::ANNOTATION)) {
           // Set the Parquet node
           element->setNode(element->child(i)->node());
+          element->setTypeId(element->child(i)->node_id());
           return;
         }
       }
@@ -1760,6 +2124,11 @@ private:
 
     applyParquetNodeType(element);
 
+    if ((element->node_type() == ASTNode::type::FIELD) && element->is_map() &&
+        (element->capnp_type() == capnp::schema::Type::LIST)) {
+      buildMapType(element);
+    }
+
    /* // Get Parquet schema nodes from children
     for (int i = 0; i < element->num_children(); i++) {
       if ((element->child(i)->node() != nullptr) &&
@@ -1786,7 +2155,9 @@ private:
           }
           for (int j = 0; j < element->num_children(); j++) {
             //printf("\t****parquet node: %s\n", element->child(j)->name().c_str());
-            if ((element->child(j)->is_decl()) &&
+            // Group fields and union discriminants have no type
+            if ((type != nullptr) &&
+                (element->child(j)->is_decl()) &&
                 (element->child(j)->capnp_type() == type->capnp_type()) &&
                 (element->child(j)->name() == type->type_name())) {
               child = element->child(j);
@@ -1803,6 +2174,7 @@ private:
                                                       decl_children, child_node->logical_type());
 
               element->child(i)->setNode(child_node);
+              recordFieldNode(element->child(i));
 
               decl_nodeid.push_back(element->child(j)->node_id());
               break;
@@ -1830,6 +2202,13 @@ private:
       }
     }
 
+    // Declarations of list elements are stored in the lists, like those of struct fields
+    for (int j = element->num_children() - 1; j >= 0; j--) {
+      if (element->child(j)->is_decl() && (list_decls_.count(element->child(j)->node_id()) > 0)) {
+        element->removeChild(j);
+      }
+    }
+
     for (int i = 0; i < element->num_children(); i++) {
       if ((element->child(i)->node() != nullptr) &&
           (element->child(i)->node_type() != ASTNode::type::ANNOTATION)) {
@@ -1879,6 +2258,236 @@ private:
     // Set the Parquet node
 
     element->setNode(std::move(node));
+    recordFieldNode(element);
+  }
+
+  // A Cap'n Proto list is stored as the repeated group of a 3-level LIST group:
+  //
+  //   <list-repetition> group <name> (LIST) {   // the field
+  //     repeated group list {                    // the list type
+  //       optional <element-type> element;
+  //     }
+  //   }
+  //
+  // The element of a list of lists is a LIST group in turn, and the element of
+  // a list of structs is a group of the fields of the struct's declaration.
+  void buildListType(ASTNode* element) {
+    parquet::schema::NodeVector children;
+
+    for (int i = 0; i < element->num_children(); i++) {
+      ASTNode* child = element->child(i);
+      if ((child->node_type() != ASTNode::type::TYPE) || (child->node() == nullptr)) {
+        continue;
+      }
+
+      parquet::schema::NodePtr child_node = child->node();
+      if (child->capnp_type() == capnp::schema::Type::LIST) {
+        child_node = parquet::schema::GroupNode::Make(LIST_ELEMENT_NAME, parquet::Repetition::OPTIONAL,
+                                                      parquet::schema::NodeVector({child_node}),
+                                                      parquet::LogicalType::LIST);
+      } else {
+        if (child->capnp_type() == capnp::schema::Type::STRUCT) {
+          auto decl = decl_nodes_.find(child->type_id());
+          if (decl != decl_nodes_.end()) {
+            child_node = decl->second;
+            list_decls_.insert(child->type_id());
+          }
+        }
+        child_node = renameNode(child_node, LIST_ELEMENT_NAME);
+      }
+      children.push_back(child_node);
+    }
+
+    element->setNode(parquet::schema::GroupNode::Make(LIST_REPEATED_NAME, parquet::Repetition::REPEATED,
+                                                      children));
+  }
+
+  // A list field annotated with $map, whose elements are structs with a key
+  // and a value field, is stored as a MAP group instead:
+  //
+  //   <map-repetition> group <name> (MAP) {
+  //     repeated group key_value {
+  //       required <key-type> key;
+  //       <value-repetition> <value-type> value;
+  //     }
+  //   }
+  //
+  // The keys are dictionary encoded unless the key field sets an $encoding.
+  void buildMapType(ASTNode* element) {
+    for (int i = 0; i < element->num_children(); i++) {
+      ASTNode* child = element->child(i);
+      if ((child->node_type() != ASTNode::type::TYPE) || (child->node() == nullptr)) {
+        continue;
+      }
+
+      auto repeated = static_cast<const parquet::schema::GroupNode*>(child->node().get());
+      const parquet::schema::Node* entry = (repeated->field_count() == 1) ? repeated->field(0).get() : nullptr;
+      auto fields = static_cast<const parquet::schema::GroupNode*>(entry);
+      KJ_REQUIRE((entry != nullptr) && entry->is_group() && (fields->field_count() == 2) &&
+                 (fields->field(0)->name() == MAP_KEY_NAME) && (fields->field(1)->name() == MAP_VALUE_NAME) &&
+                 fields->field(0)->is_primitive(),
+                 "$map only applies to lists of structs with a key and a value field", element->name());
+
+      parquet::schema::NodePtr key = copyNode(fields->field(0), MAP_KEY_NAME, parquet::Repetition::REQUIRED);
+      ParquetColumnOptions& options = column_options_[key.get()];
+      auto found = column_options_.find(fields->field(0).get());
+      if (found != column_options_.end()) {
+        options = found->second;
+      }
+      if (options.encoding.empty()) {
+        options.encoding = "DICTIONARY";
+      }
+      auto ordinal = field_ordinals_.find(fields->field(0).get());
+      if (ordinal != field_ordinals_.end()) {
+        field_ordinals_[key.get()] = ordinal->second;
+      }
+
+      child->setNode(parquet::schema::GroupNode::Make(MAP_REPEATED_NAME, parquet::Repetition::REPEATED,
+                                                      parquet::schema::NodeVector({key, fields->field(1)})));
+    }
+  }
+
+  // Copy of `node` with another name (parquet-cpp nodes are immutable)
+  static parquet::schema::NodePtr renameNode(const parquet::schema::NodePtr& node, const std::string& name) {
+    return copyNode(node, name, node->repetition());
+  }
+
+  static parquet::schema::NodePtr copyNode(const parquet::schema::NodePtr& node, const std::string& name,
+                                           parquet::Repetition::type repetition) {
+    if (node->is_group()) {
+      auto group = static_cast<const parquet::schema::GroupNode*>(node.get());
+      parquet::schema::NodeVector fields;
+      for (int i = 0; i < group->field_count(); i++) {
+        fields.push_back(group->field(i));
+      }
+      return parquet::schema::GroupNode::Make(name, repetition, fields, node->logical_type());
+    }
+
+    auto primitive = static_cast<const parquet::schema::PrimitiveNode*>(node.get());
+    const auto& decimal = primitive->decimal_metadata();
+    return parquet::schema::PrimitiveNode::Make(name, repetition, primitive->physical_type(),
+                                                node->logical_type(), primitive->type_length(),
+                                                decimal.isset ? decimal.precision : -1,
+                                                decimal.isset ? decimal.scale : -1);
+  }
+
+  // Parquet nodes cannot carry the ordinal themselves (see the TODO above),
+  // so the ordinal of each field's node is kept on the side. The same goes
+  // for the writer settings of the field's columns.
+  void recordFieldNode(ASTNode* element) {
+    if (element->node_type() != ASTNode::type::FIELD) {
+      return;
+    }
+
+    if (element->is_ordinal()) {
+      field_ordinals_[element->node().get()] = element->ordinal();
+    }
+
+    if (element->is_encoding() || element->is_compression() || element->is_compression_level() ||
+        element->is_bloom_filter_fpp() || element->is_sort_key() || element->is_partition_key() ||
+        element->is_no_page_index() || element->is_source_unit()) {
+      ParquetColumnOptions& options = column_options_[element->node().get()];
+      options.encoding = element->encoding();
+      options.compression = element->compression();
+      options.compression_level = element->compression_level();
+      options.has_compression_level = element->is_compression_level();
+      options.bloom_filter_fpp = element->bloom_filter_fpp();
+      options.sort_key = element->sort_key();
+      options.has_sort_key = element->is_sort_key();
+      options.partition_key = element->partition_key();
+      options.has_partition_key = element->is_partition_key();
+      options.page_index = !element->is_no_page_index();
+      options.source_unit = element->source_unit();
+    }
+  }
+
+  // Settings of a field apply to every leaf column below it, unless a nested
+  // field overrides them. Sort and partition keys only apply to their own column.
+  void collectColumnOptions(const parquet::schema::Node* node, const ParquetColumnOptions& parent,
+                            std::vector<ParquetColumnOptions>& columns) const {
+    ParquetColumnOptions options = parent;
+    options.sort_key = 0;
+    options.has_sort_key = false;
+    options.partition_key = 0;
+    options.has_partition_key = false;
+    auto found = column_options_.find(node);
+    if (found != column_options_.end()) {
+      if (!found->second.encoding.empty()) {
+        options.encoding = found->second.encoding;
+        options.encoding_inherited = (countLeaves(node) > 1);
+      }
+      if (!found->second.compression.empty()) {
+        options.compression = found->second.compression;
+      }
+      if (found->second.has_compression_level) {
+        options.compression_level = found->second.compression_level;
+        options.has_compression_level = true;
+      }
+      if (found->second.bloom_filter_fpp > 0.0) {
+        options.bloom_filter_fpp = found->second.bloom_filter_fpp;
+      }
+      if (!found->second.page_index) {
+        options.page_index = false;
+      }
+      if (!found->second.source_unit.empty()) {
+        KJ_REQUIRE(temporalUnit(found->second.source_unit) != 0, "unknown $sourceUnit",
+                   found->second.source_unit, node->name());
+        options.source_unit = found->second.source_unit;
+      }
+      if (found->second.has_sort_key) {
+        KJ_REQUIRE(node->is_primitive(), "$sortKey only applies to scalar fields", node->name());
+        options.sort_key = found->second.sort_key;
+        options.has_sort_key = true;
+      }
+      if (found->second.has_partition_key) {
+        KJ_REQUIRE(node->is_primitive(), "$partitionKey only applies to scalar fields", node->name());
+        options.partition_key = found->second.partition_key;
+        options.has_partition_key = true;
+      }
+    }
+
+    if (node->is_primitive()) {
+      KJ_REQUIRE(options.source_unit.empty() || (temporalColumnUnit(node->logical_type()) != 0),
+                 "$sourceUnit only applies to date, time and timestamp fields", node->name());
+      columns.push_back(options);
+      return;
+    }
+
+    auto group = static_cast<const parquet::schema::GroupNode*>(node);
+    for (int i = 0; i < group->field_count(); i++) {
+      collectColumnOptions(group->field(i).get(), options, columns);
+    }
+  }
+
+  static int countLeaves(const parquet::schema::Node* node) {
+    if (node->is_primitive()) {
+      return 1;
+    }
+    auto group = static_cast<const parquet::schema::GroupNode*>(node);
+    int leaves = 0;
+    for (int i = 0; i < group->field_count(); i++) {
+      leaves += countLeaves(group->field(i).get());
+    }
+    return leaves;
+  }
+
+  void collectColumnFieldIds(const parquet::schema::Node* node, const std::string& prefix,
+                             std::vector<std::string>& ids) const {
+    std::string path = prefix;
+    auto found = field_ordinals_.find(node);
+    if (found != field_ordinals_.end()) {
+      path = (prefix.empty() ? "" : prefix + ".") + std::to_string(found->second);
+    }
+
+    if (node->is_primitive()) {
+      ids.push_back(path);
+      return;
+    }
+
+    auto group = static_cast<const parquet::schema::GroupNode*>(node);
+    for (int i = 0; i < group->field_count(); i++) {
+      collectColumnFieldIds(group->field(i).get(), path, ids);
+    }
   }
 
   bool pre_visit_file(const Schema& schema, const schema::CodeGeneratorRequest::RequestedFile::Reader& decl) override {
@@ -2001,6 +2610,10 @@ private:
     // Build the Parquet schema node
     buildParquetNode(element);
 
+    if ((element->node_type() == ASTNode::type::STRUCT) && (element->node() != nullptr)) {
+      decl_nodes_[element->node_id()] = element->node();
+    }
+
     if (currentParent_ != nullptr) {
       currentParent_ = currentParent_->parent();
     }
@@ -2302,26 +2915,8 @@ private:
     }
     currentParent_ = element;
 
-    switch (capnp_type) {
-      case schema::Type::LIST: {
-        {
-            type_reason_ = "elementType";
-            auto _ = Finally([&](){type_reason_ = default_type_reason_;});
-
-            TRAVERSE(type, schema, type.getList().getElementType());
-        }
-        return true;
-      }
-      case schema::Type::ENUM:
-      case schema::Type::STRUCT:
-      case schema::Type::INTERFACE:
-        break;
-      case schema::Type::ANY_POINTER:
-        break;
-      default:
-        break;
-    }
-
+    // traverse_type() visits the element type of a list next, as a child of
+    // this node, then calls post_visit_type() on it.
     return false;
   }
 
@@ -2329,7 +2924,11 @@ private:
     ASTNode* element = ((currentParent_ == nullptr) ? document_ : currentParent_);
 
     // Build the Parquet schema node
-    buildParquetNode(element);
+    if (element->capnp_type() == schema::Type::LIST) {
+      buildListType(element);
+    } else {
+      buildParquetNode(element);
+    }
 
     if (currentParent_ != nullptr) {
       currentParent_ = currentParent_->parent();
@@ -2470,6 +3069,36 @@ private:
     return false;
   }
 
+  bool pre_visit_struct_field_union(const StructSchema& schema) override {
+    // The union members are visited next, so the discriminant column comes
+    // ahead of their columns. It is built right away since it has no type.
+    KJ_REQUIRE(schema.findFieldByName(UNION_DISCRIMINANT_NAME) == nullptr,
+               "a struct with a union cannot have a field with the name of its discriminant column",
+               UNION_DISCRIMINANT_NAME, schema.getProto().getDisplayName());
+
+    ASTNode* element = new ASTNode(ASTNode::type::FIELD, UNION_DISCRIMINANT_NAME);
+
+    element->setCapnpType(capnp::schema::Type::ENUM);
+    // A few distinct values: dictionary encoded whatever the $encoding of the struct
+    element->setEncoding("DICTIONARY");
+
+    if (currentParent_ == nullptr) {
+      document_->addChild(element);
+    } else {
+      currentParent_->addChild(element);
+    }
+
+    buildParquetNode(element);
+    return false;
+  }
+
+  bool pre_visit_struct_field_group(const StructSchema& schema, const StructSchema::Field& field,
+                                    const schema::Field::Group::Reader& group, const Schema& groupSchema) override {
+    // Groups (named unions among them) are stored as a group of their fields
+    currentParent_->setIsParquetGROUP();
+    return false;
+  }
+
   bool pre_visit_struct_field(const StructSchema& schema, const StructSchema::Field& field) override {
     auto proto = field.getProto();
 
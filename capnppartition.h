@@ -0,0 +1,432 @@
+/*
+ * Copyright 2017 Rene Sugar
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * @file capnppartition.h
+ * @author Rene Sugar <rene.sugar@gmail.com>
+ * @brief Write rows to Hive style partition directories by the columns annotated with $partitionKey.
+ */
+#ifndef _CAPNPPARTITION_H_
+#define _CAPNPPARTITION_H_
+
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <capnp/dynamic.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "capnp2parquet.h"
+#include "capnpsort.h"
+
+namespace capnpparquet {
+
+// Directory value of a null partition column, as Hive and Spark name it
+static const char HIVE_DEFAULT_PARTITION[] = "__HIVE_DEFAULT_PARTITION__";
+
+// Append `size` bytes to a partition directory name, with the characters Hive
+// escapes (control characters and "#%'*/:=?\{[]^) as %XX.
+inline void appendPartitionEscaped(std::string& out, const char* data, size_t size) {
+  static const char HEX[] = "0123456789ABCDEF";
+  for (size_t i = 0; i < size; i++) {
+    unsigned char c = static_cast<unsigned char>(data[i]);
+    if ((c < 0x20) || (c == 0x7f) || (strchr("\"#%'*/:=?\\{[]^", c) != nullptr)) {
+      out += '%';
+      out += HEX[c >> 4];
+      out += HEX[c & 0x0f];
+    } else {
+      out += static_cast<char>(c);
+    }
+  }
+}
+
+// Shortest text that reads back as `value`
+inline std::string formatPartitionFloat(double value, bool is_float32) {
+  char text[32];
+  for (int precision = 1; precision <= 17; precision++) {
+    snprintf(text, sizeof(text), "%.*g", precision, value);
+    double parsed = strtod(text, nullptr);
+    if (is_float32 ? (static_cast<float>(parsed) == static_cast<float>(value)) : (parsed == value)) {
+      break;
+    }
+  }
+  return text;
+}
+
+// Names the partition directory of a message from its $partitionKey columns,
+// e.g. "country=NZ/year=2017" for the columns country and year.
+//
+// A directory level is <column path>=<value> with the Cap'n Proto value of
+// the field: integers in decimal, Bool as true or false, enums by enumerant
+// name, Text and Data as their bytes. Values are escaped like Hive escapes
+// them, so they never add a level or leave the output directory. Null and
+// empty values name HIVE_DEFAULT_PARTITION.
+//
+// partition() only reads its arguments, one partitioner can serve several threads.
+//
+class CapnpPartitioner {
+public:
+  CapnpPartitioner(const CapnpColumnMap& map, const std::vector<int>& columns) {
+    for (int column : columns) {
+      PartitionColumn partition;
+      partition.path = scalarColumnPath(map, column, "$partitionKey");
+      partition.is_float32 = (partition.path.back()->type.which() == capnp::schema::Type::FLOAT32);
+
+      std::string name = map.descr()->Column(column)->path()->ToDotString();
+      appendPartitionEscaped(partition.prefix, name.data(), name.size());
+      partition.prefix += '=';
+      columns_.push_back(partition);
+    }
+  }
+
+  KJ_DISALLOW_COPY(CapnpPartitioner);
+
+  bool enabled() const { return !columns_.empty(); }
+
+  // Directory of `row` relative to the output directory, empty without partition columns
+  std::string partition(capnp::DynamicStruct::Reader row) const {
+    std::string directory;
+    for (const auto& column : columns_) {
+      if (!directory.empty()) {
+        directory += '/';
+      }
+      directory += column.prefix;
+
+      size_t length = directory.size();
+      capnp::DynamicValue::Reader value;
+      if (scalarColumnValue(row, column.path, &value)) {
+        appendValue(directory, value, column.is_float32);
+      }
+      if (directory.size() == length) {
+        directory += HIVE_DEFAULT_PARTITION;
+      }
+    }
+    return directory;
+  }
+
+private:
+  struct PartitionColumn {
+    PartitionColumn() : is_float32(false) {}
+
+    std::vector<const CapnpFieldNode*> path;     // fields from the root struct to the column
+    std::string                        prefix;   // "<escaped column path>="
+    bool                               is_float32;
+  };
+
+  std::vector<PartitionColumn> columns_;
+
+  static void appendValue(std::string& out, const capnp::DynamicValue::Reader& value, bool is_float32) {
+    switch (value.getType()) {
+      case capnp::DynamicValue::BOOL:
+        out += value.as<bool>() ? "true" : "false";
+        break;
+      case capnp::DynamicValue::INT:
+        out += std::to_string(value.as<int64_t>());
+        break;
+      case capnp::DynamicValue::UINT:
+        out += std::to_string(value.as<uint64_t>());
+        break;
+      case capnp::DynamicValue::FLOAT: {
+        std::string text = formatPartitionFloat(value.as<double>(), is_float32);
+        appendPartitionEscaped(out, text.data(), text.size());
+        break;
+      }
+      case capnp::DynamicValue::ENUM: {
+        capnp::DynamicEnum enumerant = value.as<capnp::DynamicEnum>();
+        KJ_IF_MAYBE(known, enumerant.getEnumerant()) {
+          capnp::Text::Reader name = known->getProto().getName();
+          appendPartitionEscaped(out, name.cStr(), name.size());
+        } else {
+          out += std::to_string(enumerant.getRaw());
+        }
+        break;
+      }
+      case capnp::DynamicValue::TEXT: {
+        capnp::Text::Reader text = value.as<capnp::Text>();
+        appendPartitionEscaped(out, text.cStr(), text.size());
+        break;
+      }
+      case capnp::DynamicValue::DATA: {
+        capnp::Data::Reader data = value.as<capnp::Data>();
+        appendPartitionEscaped(out, reinterpret_cast<const char*>(data.begin()), data.size());
+        break;
+      }
+      default:
+        KJ_FAIL_REQUIRE("unsupported $partitionKey type", static_cast<int>(value.getType()));
+    }
+  }
+};
+
+// Writes a stream of messages to Hive style partition directories below a
+// directory, each partition a sequence of files like RollingParquetWriter
+// writes (the rolling policy applies to each partition on its own).
+//
+// At most `max_open_files` files are open at once. Opening one more closes
+// and publishes the file of the partition written least recently; its next
+// rows start a new file. A partition is forgotten once its file is closed,
+// so the writer holds no more than the open files however many partitions
+// the keys make.
+//
+// Row groups of different partitions can be written by several threads at
+// once, e.g. by the encode stage of a CapnpPipeline. Row groups of one
+// partition must be written by one thread at a time.
+//
+class PartitionedParquetWriter {
+public:
+  typedef std::chrono::steady_clock::time_point time_point;
+
+  static const int DEFAULT_MAX_OPEN_FILES = 64;
+
+  PartitionedParquetWriter(capnp::StructSchema root,
+                           std::shared_ptr<parquet::schema::GroupNode> schema,
+                           const std::string& directory, const std::string& prefix,
+                           const RollingPolicy& policy,
+                           std::shared_ptr<parquet::WriterProperties> properties = parquet::default_writer_properties(),
+                           int64_t row_group_rows = CapnpParquetWriter::DEFAULT_ROW_GROUP_ROWS,
+                           SinkFactory open_sink = openFileSink,
+                           std::shared_ptr<const ::arrow::KeyValueMetadata> metadata = nullptr,
+                           int max_open_files = DEFAULT_MAX_OPEN_FILES)
+  : root_(root), schema_(schema), directory_(directory), prefix_(prefix), policy_(policy),
+    properties_(properties), row_group_rows_(row_group_rows), open_sink_(open_sink),
+    metadata_(metadata), page_index_rows_(PAGE_INDEX_RANGE_ROWS),
+    max_open_files_(max_open_files), open_files_(0), closed_files_(0), next_sequence_(0),
+    partitions_created_(0), evicted_files_(0) {
+    KJ_REQUIRE(max_open_files > 0, "at least one file has to be open", max_open_files);
+  }
+
+  KJ_DISALLOW_COPY(PartitionedParquetWriter);
+
+  // Write a row group whose rows all belong to `partition`, a directory
+  // relative to the output directory as named by CapnpPartitioner.
+  void writeRowGroup(CapnpShredder& row_group, time_point first_row, const std::string& partition) {
+    Partition* target = acquire(partition);
+    try {
+      target->writer->writeRowGroup(row_group, first_row);
+    } catch (...) {
+      release(target);
+      throw;
+    }
+    release(target);
+  }
+
+  // Close the files whose time window has passed.
+  void tick() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto it = lru_.begin(); it != lru_.end();) {
+      Partition* partition = *it++;
+      partition->writer->tick();
+      if (!partition->writer->is_open()) {
+        unlist(partition);
+        open_files_--;
+        drop(partition);
+      }
+    }
+  }
+
+  // Milliseconds until the first open file has to be closed, or -1 when there is no deadline.
+  int timeout() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    int timeout = -1;
+    for (const Partition* partition : lru_) {
+      int remaining = partition->writer->timeout();
+      if ((remaining >= 0) && ((timeout < 0) || (remaining < timeout))) {
+        timeout = remaining;
+      }
+    }
+    return timeout;
+  }
+
+  // Close and publish every open file.
+  void close() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    while (!lru_.empty()) {
+      Partition* partition = lru_.front();
+      unlist(partition);
+      partition->writer->close();
+      open_files_--;
+      drop(partition);
+    }
+  }
+
+  int64_t files_written() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    int64_t files = closed_files_;
+    for (const auto& partition : partitions_) {
+      files += partition.second->writer->files_written();
+    }
+    return files;
+  }
+
+  // Partitions written to so far, one written again after its file was
+  // closed counts again
+  int64_t partitions() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return partitions_created_;
+  }
+
+  // Files closed early to stay within max_open_files
+  int64_t evicted_files() const { return evicted_files_; }
+
+  // Bloom filters of the files opened after this call, see CapnpParquetWriter
+  void set_bloom_filters(const std::vector<double>& fpp) { bloom_filter_fpp_ = fpp; }
+
+  // Page indexes of the files opened after this call, see CapnpParquetWriter
+  void set_page_index(const std::vector<bool>& columns, int64_t range_rows = PAGE_INDEX_RANGE_ROWS) {
+    page_index_columns_ = columns;
+    page_index_rows_ = range_rows;
+  }
+
+private:
+  struct Partition {
+    Partition() : busy(false), listed(false) {}
+
+    std::string                           name;
+    std::unique_ptr<RollingParquetWriter> writer;
+    bool                                  busy;    // being written or closed outside the lock
+    bool                                  listed;  // has an open file and is in lru_
+    std::list<Partition*>::iterator       lru;
+  };
+
+  capnp::StructSchema                              root_;
+  std::shared_ptr<parquet::schema::GroupNode>      schema_;
+  std::string                                      directory_;
+  std::string                                      prefix_;
+  RollingPolicy                                    policy_;
+  std::shared_ptr<parquet::WriterProperties>       properties_;
+  int64_t                                          row_group_rows_;
+  SinkFactory                                      open_sink_;
+  std::shared_ptr<const ::arrow::KeyValueMetadata> metadata_;
+  std::vector<double>                              bloom_filter_fpp_;
+  std::vector<bool>                                page_index_columns_;
+  int64_t                                          page_index_rows_;
+  int                                              max_open_files_;
+
+  mutable std::mutex                               mutex_;
+  std::map<std::string, std::unique_ptr<Partition>> partitions_;
+  std::list<Partition*>                            lru_;          // open files, most recently written first
+  int                                              open_files_;   // including those of busy partitions
+  int64_t                                          closed_files_;   // by the partitions dropped
+  int64_t                                          next_sequence_;  // first file number of a new partition
+  int64_t                                          partitions_created_;
+  std::atomic<int64_t>                             evicted_files_;
+
+  void unlist(Partition* partition) {
+    lru_.erase(partition->lru);
+    partition->listed = false;
+  }
+
+  // Forget a partition whose file is closed, called with the lock held
+  void drop(Partition* partition) {
+    closed_files_ += partition->writer->files_written();
+    next_sequence_ = std::max(next_sequence_, partition->writer->sequence());
+    partitions_.erase(partition->name);
+  }
+
+  // Create the directories of `partition` below the output directory
+  void makeDirectories(const std::string& partition) const {
+    for (size_t i = 0; i <= partition.size(); i++) {
+      if ((i == partition.size()) || (partition[i] == '/')) {
+        std::string path = directory_ + "/" + partition.substr(0, i);
+        if ((mkdir(path.c_str(), 0777) < 0) && (errno != EEXIST)) {
+          KJ_FAIL_SYSCALL("mkdir", errno, path);
+        }
+      }
+    }
+  }
+
+  // Take a partition for writing, closing the least recently written file
+  // first when the partition opens one more than max_open_files.
+  Partition* acquire(const std::string& name) {
+    Partition* partition = nullptr;
+    Partition* evicted = nullptr;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto found = partitions_.find(name);
+      if (found == partitions_.end()) {
+        std::string directory = directory_;
+        if (!name.empty()) {
+          makeDirectories(name);
+          directory += "/" + name;
+        }
+        std::unique_ptr<Partition> created(new Partition());
+        created->name = name;
+        created->writer.reset(new RollingParquetWriter(root_, schema_, directory, prefix_, policy_, properties_,
+                                                       row_group_rows_, open_sink_, metadata_));
+        created->writer->set_bloom_filters(bloom_filter_fpp_);
+        created->writer->set_page_index(page_index_columns_, page_index_rows_);
+        created->writer->set_sequence(next_sequence_);
+        found = partitions_.emplace(name, std::move(created)).first;
+        partitions_created_++;
+      }
+
+      partition = found->second.get();
+      KJ_REQUIRE(!partition->busy, "partition is written by two threads at once", name);
+      partition->busy = true;
+      if (partition->listed) {
+        unlist(partition);
+      } else {
+        // Partitions being written are not listed, they are never evicted
+        if ((open_files_ >= max_open_files_) && !lru_.empty()) {
+          evicted = lru_.back();
+          unlist(evicted);
+          evicted->busy = true;
+        }
+        open_files_++;
+      }
+    }
+
+    if (evicted != nullptr) {
+      try {
+        evicted->writer->roll();
+      } catch (...) {
+        release(evicted);
+        release(partition);
+        throw;
+      }
+      evicted_files_++;
+      release(evicted);
+    }
+    return partition;
+  }
+
+  void release(Partition* partition) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    partition->busy = false;
+    if (partition->writer->is_open()) {
+      lru_.push_front(partition);
+      partition->lru = lru_.begin();
+      partition->listed = true;
+    } else {
+      open_files_--;
+      drop(partition);
+    }
+  }
+};
+
+};  // namespace capnpparquet
+
+#endif  // _CAPNPPARTITION_H_
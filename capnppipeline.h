@@ -0,0 +1,995 @@
+/*
+ * Copyright 2017 Rene Sugar
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * @file capnppipeline.h
+ * @author Rene Sugar <rene.sugar@gmail.com>
+ * @brief Multithreaded Cap'n Proto to Parquet conversion in stages connected by bounded queues.
+ */
+#ifndef _CAPNPPIPELINE_H_
+#define _CAPNPPIPELINE_H_
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <parquet/exception.h>
+#include <parquet/util/memory.h>
+
+#include <capnp/serialize.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <exception>
+#include <functional>
+#include <iomanip>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "capnp2parquet.h"
+#include "capnppartition.h"
+#include "capnpqueue.h"
+#include "capnpsort.h"
+#include "capnpstream.h"
+
+namespace capnpparquet {
+
+// An output file written by the threads of a WriteStage.
+class QueuedFile {
+public:
+  explicit QueuedFile(const std::string& path)
+  : path_(path), pending_(0), error_(0) {
+    int fd;
+    KJ_SYSCALL(fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666), path);
+    fd_ = kj::AutoCloseFd(fd);
+  }
+
+  KJ_DISALLOW_COPY(QueuedFile);
+
+  // Write `length` bytes at `offset`. Chunks of a file may be written by several threads at once.
+  void write(const uint8_t* data, size_t length, int64_t offset) {
+    while (length > 0) {
+      ssize_t n = pwrite(fd_.get(), data, length, offset);
+      if (n < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        error_.store(errno);
+        return;
+      }
+      data += n;
+      length -= n;
+      offset += n;
+    }
+  }
+
+  const std::string& path() const { return path_; }
+
+  std::atomic<int>& pending() { return pending_; }
+
+  int error() const { return error_.load(); }
+
+private:
+  std::string       path_;
+  kj::AutoCloseFd   fd_;
+  std::atomic<int>  pending_;  // chunks queued but not yet written
+  std::atomic<int>  error_;
+};
+
+// Bytes of a QueuedFile waiting for a write stage thread.
+struct WriteChunk {
+  std::shared_ptr<QueuedFile> file;
+  int64_t                     offset;
+  std::vector<uint8_t>        bytes;
+};
+
+typedef BoundedQueue<std::unique_ptr<WriteChunk>> WriteQueue;
+
+// The sink the encode stage writes a Parquet file to. Bytes are gathered into
+// chunks and handed to the write stage, blocking while its queue is full.
+class QueuedOutputStream : public parquet::OutputStream {
+public:
+  static const size_t CHUNK_SIZE = 1 << 20;
+
+  QueuedOutputStream(std::shared_ptr<QueuedFile> file, WriteQueue& queue)
+  : file_(file), queue_(queue), position_(0), closed_(false) {
+    newChunk();
+  }
+
+  ~QueuedOutputStream() {
+    try {
+      Close();
+    } catch (...) {
+    }
+  }
+
+  void Write(const uint8_t* data, int64_t length) override {
+    while (length > 0) {
+      size_t count = std::min<size_t>(length, CHUNK_SIZE - chunk_->bytes.size());
+      chunk_->bytes.insert(chunk_->bytes.end(), data, data + count);
+      data += count;
+      length -= count;
+      position_ += count;
+      if (chunk_->bytes.size() >= CHUNK_SIZE) {
+        send();
+      }
+    }
+  }
+
+  int64_t Tell() override { return position_; }
+
+  // Wait for every chunk to reach the file, so it can be renamed once closed.
+  void Close() override {
+    if (closed_) {
+      return;
+    }
+    closed_ = true;
+    send();
+
+    Backoff backoff;
+    while ((file_->pending().load() > 0) && !queue_.aborted()) {
+      backoff.wait();
+    }
+    if (file_->error() != 0) {
+      throw parquet::ParquetException(std::string("write error: ") + strerror(file_->error()) +
+                                      " " + file_->path());
+    }
+    if (queue_.aborted()) {
+      throw parquet::ParquetException("write stage stopped before " + file_->path() + " was written");
+    }
+  }
+
+private:
+  std::shared_ptr<QueuedFile> file_;
+  WriteQueue&                 queue_;
+  std::unique_ptr<WriteChunk> chunk_;
+  int64_t                     position_;
+  bool                        closed_;
+
+  void newChunk() {
+    chunk_.reset(new WriteChunk());
+    chunk_->file = file_;
+    chunk_->offset = position_;
+    chunk_->bytes.reserve(CHUNK_SIZE);
+  }
+
+  void send() {
+    if (chunk_->bytes.empty()) {
+      return;
+    }
+    file_->pending().fetch_add(1);
+    if (!queue_.push(std::move(chunk_))) {
+      throw parquet::ParquetException("write stage stopped before " + file_->path() + " was written");
+    }
+    newChunk();
+  }
+};
+
+// Writes the chunks of output files on its own threads, so a slow disk stalls
+// the encode stage (and through the queues, the read stage) instead of the
+// converter buffering without limit.
+class WriteStage {
+public:
+  WriteStage(int threads, size_t queue_capacity)
+  : queue_(queue_capacity), threads_(threads) {
+    queue_.addProducer();
+    for (int i = 0; i < threads; i++) {
+      workers_.emplace_back([this]() { run(); });
+    }
+  }
+
+  ~WriteStage() { finish(); }
+
+  KJ_DISALLOW_COPY(WriteStage);
+
+  // Sinks for the files of a CapnpParquetWriter, RollingParquetWriter or PartitionedParquetWriter
+  SinkFactory sinkFactory() {
+    return [this](const std::string& path) -> std::shared_ptr<parquet::OutputStream> {
+      return std::make_shared<QueuedOutputStream>(std::make_shared<QueuedFile>(path), queue_);
+    };
+  }
+
+  // Write the queued chunks and stop the threads.
+  void finish() {
+    if (workers_.empty()) {
+      return;
+    }
+    queue_.removeProducer();
+    for (auto& worker : workers_) {
+      worker.join();
+    }
+    workers_.clear();
+  }
+
+  void abort() { queue_.abort(); }
+
+  const WriteQueue& queue() const { return queue_; }
+
+  int threads() const { return threads_; }
+
+private:
+  WriteQueue               queue_;
+  int                      threads_;
+  std::vector<std::thread> workers_;
+
+  void run() {
+    std::unique_ptr<WriteChunk> chunk;
+    while (queue_.pop(chunk)) {
+      chunk->file->write(chunk->bytes.data(), chunk->bytes.size(), chunk->offset);
+      chunk->file->pending().fetch_sub(1);
+      chunk.reset();
+    }
+  }
+};
+
+// Tasks of one EncodePool::forEach() call, taken by index.
+class EncodeJob {
+public:
+  EncodeJob(const std::function<void(size_t)>& task, size_t count)
+  : task_(task), count_(count), next_(0), helpers_(0) {}
+
+  KJ_DISALLOW_COPY(EncodeJob);
+
+  // Run tasks until none is left. Errors are kept for rethrow().
+  void run() {
+    for (size_t i = next_++; i < count_; i = next_++) {
+      try {
+        task_(i);
+      } catch (...) {
+        std::lock_guard<std::mutex> lock(error_mutex_);
+        if (error_ == nullptr) {
+          error_ = std::current_exception();
+        }
+      }
+    }
+  }
+
+  // Pool threads that took the job and are not done with it
+  std::atomic<int>& helpers() { return helpers_; }
+
+  // Rethrow the first error of a task
+  void rethrow() {
+    if (error_ != nullptr) {
+      std::rethrow_exception(error_);
+    }
+  }
+
+private:
+  const std::function<void(size_t)>& task_;
+  size_t                              count_;
+  std::atomic<size_t>                 next_;
+  std::atomic<int>                    helpers_;
+  std::mutex                          error_mutex_;
+  std::exception_ptr                  error_;
+};
+
+// Threads that help the encode stage write the row groups of different
+// partitions at once. They are started with the pipeline and wait on a
+// queue for jobs, rather than being started for every batch.
+class EncodePool {
+public:
+  explicit EncodePool(int threads)
+  : queue_(std::max(threads, 1)) {
+    queue_.addProducer();
+    for (int i = 0; i < threads; i++) {
+      workers_.emplace_back([this]() { run(); });
+    }
+  }
+
+  ~EncodePool() { finish(); }
+
+  KJ_DISALLOW_COPY(EncodePool);
+
+  // Run `task` for each of `count` indices on the calling thread and the
+  // pool threads. Rethrows the first error once every task is done.
+  void forEach(size_t count, const std::function<void(size_t)>& task) {
+    EncodeJob job(task, count);
+    size_t helpers = std::min(workers_.size(), (count > 0) ? count - 1 : 0);
+    for (size_t i = 0; i < helpers; i++) {
+      // A job queues at most one entry per thread, the queue has room for them
+      job.helpers().fetch_add(1);
+      EncodeJob* entry = &job;
+      if (!queue_.tryPush(entry)) {
+        job.helpers().fetch_sub(1);
+        break;
+      }
+    }
+
+    job.run();
+    Backoff backoff;
+    while (job.helpers().load() > 0) {
+      backoff.wait();
+    }
+    job.rethrow();
+  }
+
+  // Stop the threads
+  void finish() {
+    if (workers_.empty()) {
+      return;
+    }
+    queue_.removeProducer();
+    for (auto& worker : workers_) {
+      worker.join();
+    }
+    workers_.clear();
+  }
+
+  int threads() const { return static_cast<int>(workers_.size()); }
+
+private:
+  BoundedQueue<EncodeJob*> queue_;
+  std::vector<std::thread> workers_;
+
+  void run() {
+    EncodeJob* job;
+    while (queue_.pop(job)) {
+      job->run();
+      // The job may be gone once its last helper is done
+      job->helpers().fetch_sub(1);
+    }
+  }
+};
+
+// Thread counts and buffering of a CapnpPipeline.
+struct PipelineOptions {
+  PipelineOptions()
+  : decode_threads(1), shred_threads(1), encode_threads(1), queue_capacity(4),
+    row_group_rows(CapnpParquetWriter::DEFAULT_ROW_GROUP_ROWS), row_group_bytes(0),
+    flush_ms(-1), budget(nullptr), unique_map_keys(false) {}
+
+  int                   decode_threads;
+  int                   shred_threads;
+  int                   encode_threads;  // row groups of different partitions encoded at once
+  size_t                queue_capacity;  // batches queued between two stages
+  int64_t               row_group_rows;  // messages per batch (and row group)
+  int64_t               row_group_bytes; // message bytes that also end a batch (0: no limit)
+  int                   flush_ms;        // pass on a partial batch this long after its first message (-1: never)
+  std::function<bool()> stopped;         // polled by the read stage
+  MemoryBudget*         budget;          // bytes held by batches and row groups (nullptr: not counted)
+  bool                  unique_map_keys; // see CapnpShredder::set_unique_map_keys()
+  std::vector<int>      partition_columns;  // $partitionKey columns that split batches, see CapnpPartitioner
+};
+
+// Messages on their way through the pipeline, one row group's worth.
+//
+// The shred stage splits a batch into several row groups (parts), one or
+// more per partition, and more when the memory budget runs out.
+struct MessageBatch {
+  MessageBatch() : sequence(0), part(0), last(true), early(false), bytes(0) {}
+
+  int64_t                                                     sequence;
+  int                                                         part;
+  bool                                                        last;       // last part of the batch
+  bool                                                        early;      // passed on to release its memory
+  std::string                                                 partition;  // directory of the rows, see CapnpPartitioner
+  int64_t                                                     bytes;      // message bytes charged to the budget
+  std::chrono::steady_clock::time_point                       first_row;
+  std::vector<kj::Array<capnp::word>>                         words;      // read stage
+  std::vector<std::unique_ptr<capnp::FlatArrayMessageReader>> readers;    // decode stage
+  std::unique_ptr<CapnpShredder>                              row_group;  // shred stage
+};
+
+typedef BoundedQueue<std::unique_ptr<MessageBatch>> BatchQueue;
+
+// The encode stage target for a single output file.
+class SingleFileTarget {
+public:
+  explicit SingleFileTarget(CapnpParquetWriter& writer) : writer_(writer) {}
+
+  // A single file has no partitions
+  void writeRowGroup(CapnpShredder& row_group, std::chrono::steady_clock::time_point first_row,
+                     const std::string& partition) {
+    writer_.writeRowGroup(row_group);
+  }
+
+  int timeout() const { return -1; }
+
+  void tick() {}
+
+private:
+  CapnpParquetWriter& writer_;
+};
+
+// Converts a stream of messages in stages:
+//
+//   read/frame --> decode --> shred --> encode/compress --> write
+//    1 thread     N threads   N threads  calling thread     WriteStage threads
+//
+// Each arrow is a bounded queue of batches (the last one a queue of file
+// chunks), so the read stage stalls when a later stage falls behind. Row
+// groups that finish ahead of a slower one wait for it in the encode stage;
+// the read stage also stalls while maxInFlight() batches are unwritten, which
+// bounds them.
+//
+// With a memory budget, the read stage also stalls while the budget is
+// exceeded, and the shred stage passes on a row group early once it is. The
+// encode stage writes row groups in input order through `target`, which is a
+// PartitionedParquetWriter or a SingleFileTarget whose files are opened
+// through the WriteStage sink factory.
+//
+// When the schema has $sortKey columns, the shred stage sorts the messages of
+// each batch by them first, so the column statistics of a row group cover
+// narrow ranges.
+//
+// With partition columns, the shred stage splits each batch into a row group
+// per partition. The encode stage gathers the rows of each partition across
+// batches until they fill a row group, and writes those of different
+// partitions on up to `encode_threads` threads at once. Gathered rows are
+// also written once their first row waited `flush_ms`, when memory runs
+// short, and when the input ends.
+//
+template <typename Target>
+class CapnpPipeline {
+public:
+  // Longest wait of the read stage for input, between checks for a stop
+  static const int INPUT_POLL_MS = 100;
+
+  CapnpPipeline(const CapnpSchemaFile& schema, CapnpMessageStream& input, Target& target,
+                WriteStage& write_stage, const PipelineOptions& options)
+  : root_(schema.root()), input_(input), target_(target), write_stage_(write_stage),
+    options_(options),
+    map_(schema.root(), schema.descr(), nullptr,
+         sourceUnitsFromMetadata(schema.metadata(), schema.descr()->num_columns())),
+    sorter_(map_, schema.sortingColumns()),
+    partitioner_(map_, options.partition_columns),
+    decode_queue_(options.queue_capacity), shred_queue_(options.queue_capacity),
+    encode_queue_(options.queue_capacity),
+    free_row_groups_(options.queue_capacity + options.shred_threads + 1),
+    encode_pool_(std::max(options.encode_threads, 1) - 1),
+    rows_(0), row_groups_(0), in_flight_(0), budget_stalls_(0), early_row_groups_(0), order_stalls_(0) {
+    reader_options_.traversalLimitInWords = CapnpcParquet::TRAVERSAL_LIMIT;
+  }
+
+  KJ_DISALLOW_COPY(CapnpPipeline);
+
+  // Convert messages until the input ends or `stopped` returns true. Rethrows
+  // the first error of any stage.
+  void run() {
+    decode_queue_.addProducer();
+    for (int i = 0; i < options_.decode_threads; i++) {
+      shred_queue_.addProducer();
+    }
+    for (int i = 0; i < options_.shred_threads; i++) {
+      encode_queue_.addProducer();
+    }
+
+    std::vector<std::thread> threads;
+    threads.emplace_back([this]() { guard([this]() { readStage(); }); decode_queue_.removeProducer(); });
+    for (int i = 0; i < options_.decode_threads; i++) {
+      threads.emplace_back([this]() { guard([this]() { decodeStage(); }); shred_queue_.removeProducer(); });
+    }
+    for (int i = 0; i < options_.shred_threads; i++) {
+      threads.emplace_back([this]() { guard([this]() { shredStage(); }); encode_queue_.removeProducer(); });
+    }
+
+    guard([this]() { encodeStage(); });
+
+    for (auto& thread : threads) {
+      thread.join();
+    }
+
+    if (error_ != nullptr) {
+      std::rethrow_exception(error_);
+    }
+  }
+
+  int64_t rows() const { return rows_; }
+
+  int64_t row_groups() const { return row_groups_; }
+
+  // Queue depth and stall counters of each stage, to tune the thread counts.
+  //
+  // A queue that stays full with many push stalls feeds a stage that needs
+  // more threads; one that stays empty with many pop stalls has too many
+  // consumers.
+  void printStats(std::ostream& out) const {
+    out << std::left << std::setw(18) << "queue"
+        << std::right << std::setw(10) << "consumers"
+        << std::setw(10) << "capacity"
+        << std::setw(10) << "max depth"
+        << std::setw(14) << "push stalls"
+        << std::setw(14) << "pop stalls" << std::endl;
+    printQueue(out, "read -> decode", options_.decode_threads, decode_queue_);
+    printQueue(out, "decode -> shred", options_.shred_threads, shred_queue_);
+    printQueue(out, "shred -> encode", options_.encode_threads, encode_queue_);
+    printQueue(out, "encode -> write", write_stage_.threads(), write_stage_.queue());
+    out << rows_ << " rows in " << row_groups_ << " row groups, "
+        << order_stalls_ << " read stalls for batches out of order" << std::endl;
+    if (options_.budget != nullptr) {
+      out << "memory peak " << options_.budget->peak() << " bytes";
+      if (options_.budget->limit() > 0) {
+        out << " of " << options_.budget->limit() << " budget, "
+            << early_row_groups_ << " row groups flushed early, "
+            << budget_stalls_ << " read stalls";
+      }
+      out << std::endl;
+    }
+  }
+
+private:
+  capnp::StructSchema        root_;
+  CapnpMessageStream&        input_;
+  Target&                    target_;
+  WriteStage&                write_stage_;
+  PipelineOptions            options_;
+  CapnpColumnMap             map_;             // shared by the shred threads
+  CapnpRowSorter             sorter_;          // shared by the shred threads
+  CapnpPartitioner           partitioner_;     // shared by the shred threads
+  capnp::ReaderOptions       reader_options_;
+
+  BatchQueue                                   decode_queue_;
+  BatchQueue                                   shred_queue_;
+  BatchQueue                                   encode_queue_;
+  BoundedQueue<std::unique_ptr<CapnpShredder>> free_row_groups_;  // cleared row groups for reuse
+  EncodePool                                   encode_pool_;      // helpers of the encode stage
+
+  std::mutex                 error_mutex_;
+  std::exception_ptr         error_;
+  int64_t                    rows_;
+  std::atomic<int64_t>       row_groups_;
+  std::atomic<int64_t>       in_flight_;          // batches read but not yet written
+  std::atomic<int64_t>       budget_stalls_;      // times the read stage waited for the budget
+  std::atomic<int64_t>       early_row_groups_;   // row groups passed on before their batch ended
+  std::atomic<int64_t>       order_stalls_;       // times the read stage waited for maxInFlight()
+
+  // Rows of a partition gathered across batches, see writeRowGroups()
+  struct PartitionRows {
+    std::unique_ptr<CapnpShredder>        row_group;
+    std::chrono::steady_clock::time_point first_row;
+  };
+  std::map<std::string, PartitionRows> partition_rows_;  // encode stage
+
+  template <typename Queue>
+  static void printQueue(std::ostream& out, const char* name, int consumers, const Queue& queue) {
+    out << std::left << std::setw(18) << name
+        << std::right << std::setw(10) << consumers
+        << std::setw(10) << queue.capacity()
+        << std::setw(10) << queue.max_depth()
+        << std::setw(14) << queue.push_stalls()
+        << std::setw(14) << queue.pop_stalls() << std::endl;
+  }
+
+  // Run a stage, on failure record the error and stop every stage.
+  void guard(const std::function<void()>& stage) {
+    try {
+      stage();
+    } catch (...) {
+      {
+        std::lock_guard<std::mutex> lock(error_mutex_);
+        if (error_ == nullptr) {
+          error_ = std::current_exception();
+        }
+      }
+      decode_queue_.abort();
+      shred_queue_.abort();
+      encode_queue_.abort();
+      write_stage_.abort();
+    }
+  }
+
+  bool stopped() const {
+    return options_.stopped && options_.stopped();
+  }
+
+  bool overBudget() const {
+    return (options_.budget != nullptr) && options_.budget->exceeded();
+  }
+
+  void charge(int64_t bytes) {
+    if (options_.budget != nullptr) {
+      options_.budget->charge(bytes);
+    }
+  }
+
+  void release(int64_t bytes) {
+    if (options_.budget != nullptr) {
+      options_.budget->release(bytes);
+    }
+  }
+
+  // Batches read but not yet written that keep every queue and thread of
+  // the stages busy. More would only wait in the encode stage for a batch
+  // that is slower to shred than those read after it.
+  int64_t maxInFlight() const {
+    return (3 * static_cast<int64_t>(options_.queue_capacity)) + options_.decode_threads +
+           options_.shred_threads + 1;
+  }
+
+  int flushTimeout(const std::unique_ptr<MessageBatch>& batch) const {
+    return (batch != nullptr) ? flushTimeout(batch->first_row) : -1;
+  }
+
+  // Milliseconds until rows that arrived at `first_row` have to be passed on, or -1
+  int flushTimeout(std::chrono::steady_clock::time_point first_row) const {
+    if (options_.flush_ms < 0) {
+      return -1;
+    }
+    auto deadline = first_row + std::chrono::milliseconds(options_.flush_ms);
+    auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(
+        deadline - std::chrono::steady_clock::now()).count();
+    return static_cast<int>(std::max<int64_t>(0, remaining));
+  }
+
+  void readStage() {
+    std::unique_ptr<MessageBatch> batch;
+    int64_t sequence = 0;
+
+    auto pass = [&]() {
+      if (batch != nullptr) {
+        in_flight_++;
+        decode_queue_.push(std::move(batch));
+        batch.reset();
+      }
+    };
+
+    while (!stopped() && !decode_queue_.aborted()) {
+      if (in_flight_.load() >= maxInFlight()) {
+        // The encode stage holds the batches that finished ahead of a slow
+        // one until it is written, wait for it rather than pile up more
+        pass();
+        order_stalls_++;
+        Backoff backoff;
+        while ((in_flight_.load() >= maxInFlight()) && !stopped() && !decode_queue_.aborted()) {
+          backoff.wait();
+        }
+      }
+
+      if (overBudget()) {
+        // Let the messages already read go on and wait for memory to be released
+        pass();
+        budget_stalls_++;
+        Backoff backoff;
+        // Nothing in flight means nothing to wait for, keep going with small row groups
+        while (overBudget() && (in_flight_.load() > 0) && !stopped() && !decode_queue_.aborted()) {
+          backoff.wait();
+        }
+      }
+
+      // A finite wait, so a stop or a failed stage is seen while the input is idle
+      int timeout = flushTimeout(batch);
+      if ((timeout < 0) || (timeout > INPUT_POLL_MS)) {
+        timeout = INPUT_POLL_MS;
+      }
+      bool more = input_.wait(timeout);
+
+      for (auto words = input_.next(); words != nullptr; words = input_.next()) {
+        if (batch == nullptr) {
+          batch.reset(new MessageBatch());
+          batch->sequence = sequence++;
+          batch->first_row = std::chrono::steady_clock::now();
+        }
+        batch->bytes += words.size() * sizeof(capnp::word);
+        charge(words.size() * sizeof(capnp::word));
+        batch->words.push_back(std::move(words));
+        if ((static_cast<int64_t>(batch->words.size()) >= options_.row_group_rows) ||
+            ((options_.row_group_bytes > 0) && (batch->bytes >= options_.row_group_bytes)) ||
+            overBudget()) {
+          pass();
+        }
+      }
+
+      // Bound the delay of a slow trickle of messages
+      if (flushTimeout(batch) == 0) {
+        pass();
+      }
+
+      if (!more) {
+        break;
+      }
+    }
+    pass();
+  }
+
+  void decodeStage() {
+    std::unique_ptr<MessageBatch> batch;
+    while (decode_queue_.pop(batch)) {
+      for (const auto& words : batch->words) {
+        std::unique_ptr<capnp::FlatArrayMessageReader> reader(
+            new capnp::FlatArrayMessageReader(words, reader_options_));
+        // Validate the whole message here rather than fail in the middle of a row group
+        reader->getRoot<capnp::DynamicStruct>(root_).totalSize();
+        batch->readers.push_back(std::move(reader));
+      }
+      if (!shred_queue_.push(std::move(batch))) {
+        return;
+      }
+    }
+  }
+
+  std::unique_ptr<CapnpShredder> newRowGroup() {
+    std::unique_ptr<CapnpShredder> row_group;
+    if (!free_row_groups_.tryPop(row_group)) {
+      row_group.reset(new CapnpShredder(map_, options_.budget));
+      row_group->set_unique_map_keys(options_.unique_map_keys);
+    }
+    return row_group;
+  }
+
+  // Messages of each partition of a batch, by position, in the order the
+  // partitions first appear
+  std::vector<std::pair<std::string, std::vector<uint32_t>>> partitionBatch(const MessageBatch& batch) const {
+    std::vector<std::pair<std::string, std::vector<uint32_t>>> partitions;
+    std::unordered_map<std::string, size_t> index;
+    for (uint32_t i = 0; i < static_cast<uint32_t>(batch.readers.size()); i++) {
+      std::string partition;
+      if (partitioner_.enabled()) {
+        partition = partitioner_.partition(batch.readers[i]->getRoot<capnp::DynamicStruct>(root_));
+      }
+      auto found = index.emplace(partition, partitions.size());
+      if (found.second) {
+        partitions.emplace_back(partition, std::vector<uint32_t>());
+      }
+      partitions[found.first->second].second.push_back(i);
+    }
+    return partitions;
+  }
+
+  // Pass on a row group of `batch` that is not its last part
+  bool passPart(const MessageBatch& batch, int part, const std::string& partition,
+                std::unique_ptr<CapnpShredder> row_group, bool early) {
+    std::unique_ptr<MessageBatch> pass(new MessageBatch());
+    pass->sequence = batch.sequence;
+    pass->part = part;
+    pass->last = false;
+    pass->early = early;
+    pass->partition = partition;
+    pass->first_row = batch.first_row;
+    pass->row_group = std::move(row_group);
+    return encode_queue_.push(std::move(pass));
+  }
+
+  void shredStage() {
+    std::unique_ptr<MessageBatch> batch;
+    while (shred_queue_.pop(batch)) {
+      if (sorter_.enabled()) {
+        sortBatch(*batch);
+      }
+
+      // Partitions keep the sorted order of their messages
+      auto partitions = partitionBatch(*batch);
+      std::unique_ptr<CapnpShredder> row_group;
+      int part = 0;
+
+      for (size_t i = 0; i < partitions.size(); i++) {
+        row_group = newRowGroup();
+        for (uint32_t position : partitions[i].second) {
+          if (overBudget() && (row_group->rows() > 0)) {
+            // Pass on the rows so far as their own row group to release their memory sooner
+            early_row_groups_++;
+            if (!passPart(*batch, part++, partitions[i].first, std::move(row_group), true)) {
+              return;
+            }
+            row_group = newRowGroup();
+          }
+          row_group->shred(batch->readers[position]->getRoot<capnp::DynamicStruct>(root_));
+        }
+        if ((i + 1 < partitions.size()) &&
+            !passPart(*batch, part++, partitions[i].first, std::move(row_group), false)) {
+          return;
+        }
+      }
+      batch->readers.clear();
+      batch->words.clear();
+      release(batch->bytes);
+      batch->bytes = 0;
+      batch->part = part;
+      batch->last = true;
+      batch->partition = partitions.back().first;
+      batch->row_group = std::move(row_group);
+
+      if (!encode_queue_.push(std::move(batch))) {
+        return;
+      }
+    }
+  }
+
+  void sortBatch(MessageBatch& batch) const {
+    std::vector<capnp::DynamicStruct::Reader> rows;
+    rows.reserve(batch.readers.size());
+    for (const auto& reader : batch.readers) {
+      rows.push_back(reader->getRoot<capnp::DynamicStruct>(root_));
+    }
+
+    std::vector<uint32_t> order = sorter_.order(rows);
+    std::vector<std::unique_ptr<capnp::FlatArrayMessageReader>> sorted;
+    sorted.reserve(order.size());
+    for (uint32_t position : order) {
+      sorted.push_back(std::move(batch.readers[position]));
+    }
+    batch.readers.swap(sorted);
+  }
+
+  // Run `task` for each of `count` partitions, up to encode_threads at once.
+  // Rethrows the first error once every task is done.
+  void forEachPartition(size_t count, const std::function<void(size_t)>& task) {
+    encode_pool_.forEach(count, task);
+  }
+
+  void writeRowGroup(CapnpShredder& row_group, std::chrono::steady_clock::time_point first_row,
+                     const std::string& partition) {
+    target_.writeRowGroup(row_group, first_row, partition);
+    row_groups_++;
+  }
+
+  // Cleared row groups keep their buffer capacity, which a budget cannot see
+  void recycle(std::unique_ptr<CapnpShredder>& row_group) {
+    row_group->clear();
+    if ((options_.budget == nullptr) || (options_.budget->limit() == 0)) {
+      free_row_groups_.tryPush(row_group);
+    }
+    row_group.reset();
+  }
+
+  // The gathered rows of a partition are a row group once they reach the
+  // rows or bytes of a batch, or memory runs short
+  bool filled(const PartitionRows& rows) const {
+    return (rows.row_group->rows() >= options_.row_group_rows) ||
+           ((options_.row_group_bytes > 0) && (rows.row_group->byte_size() >= options_.row_group_bytes)) ||
+           overBudget();
+  }
+
+  // Write row groups through the target in input order. Row groups of
+  // different partitions go to different files, up to encode_threads
+  // partitions are encoded and compressed at once.
+  //
+  // A batch holds a few rows of each partition, so with partition columns
+  // the rows of a partition are gathered across batches and written once
+  // they fill a row group (or by flushPartitions()).
+  void writeRowGroups(std::vector<std::unique_ptr<MessageBatch>>& ready) {
+    std::vector<std::pair<std::string, std::vector<MessageBatch*>>> partitions;
+    std::unordered_map<std::string, size_t> index;
+    for (const auto& batch : ready) {
+      auto found = index.emplace(batch->partition, partitions.size());
+      if (found.second) {
+        partitions.emplace_back(batch->partition, std::vector<MessageBatch*>());
+      }
+      partitions[found.first->second].second.push_back(batch.get());
+    }
+
+    if (!partitioner_.enabled()) {
+      forEachPartition(partitions.size(), [&](size_t i) {
+        for (MessageBatch* batch : partitions[i].second) {
+          writeRowGroup(*batch->row_group, batch->first_row, batch->partition);
+        }
+      });
+      return;
+    }
+
+    // The map is not changed while the threads gather
+    std::vector<std::map<std::string, PartitionRows>::iterator> gathered;
+    for (const auto& partition : partitions) {
+      gathered.push_back(partition_rows_.emplace(partition.first, PartitionRows()).first);
+    }
+
+    forEachPartition(partitions.size(), [&](size_t i) {
+      PartitionRows& rows = gathered[i]->second;
+      for (MessageBatch* batch : partitions[i].second) {
+        if (rows.row_group == nullptr) {
+          rows.row_group = std::move(batch->row_group);
+          rows.first_row = batch->first_row;
+        } else {
+          rows.row_group->append(*batch->row_group);
+        }
+        if (filled(rows)) {
+          writeRowGroup(*rows.row_group, rows.first_row, gathered[i]->first);
+          recycle(rows.row_group);
+        }
+      }
+    });
+
+    for (auto it : gathered) {
+      if (it->second.row_group == nullptr) {
+        partition_rows_.erase(it);
+      }
+    }
+  }
+
+  // Write the gathered rows of the partitions whose first row waited
+  // flush_ms, or of all of them.
+  void flushPartitions(bool all) {
+    std::vector<std::map<std::string, PartitionRows>::iterator> flushed;
+    for (auto it = partition_rows_.begin(); it != partition_rows_.end(); ++it) {
+      if (all || (flushTimeout(it->second.first_row) == 0)) {
+        flushed.push_back(it);
+      }
+    }
+
+    forEachPartition(flushed.size(), [&](size_t i) {
+      writeRowGroup(*flushed[i]->second.row_group, flushed[i]->second.first_row, flushed[i]->first);
+    });
+
+    for (auto it : flushed) {
+      recycle(it->second.row_group);
+      partition_rows_.erase(it);
+    }
+  }
+
+  // Milliseconds until the encode stage has to flush or close something, or -1
+  int encodeTimeout() const {
+    int timeout = target_.timeout();
+    for (const auto& rows : partition_rows_) {
+      int remaining = flushTimeout(rows.second.first_row);
+      if ((remaining >= 0) && ((timeout < 0) || (remaining < timeout))) {
+        timeout = remaining;
+      }
+    }
+    return timeout;
+  }
+
+  // Row groups can finish shredding out of order, they are written in input
+  // order. The parts of a batch are held until its last part, so the
+  // partitions of the batch are written together, unless a part was passed
+  // on early to release its memory.
+  void encodeStage() {
+    std::map<std::pair<int64_t, int>, std::unique_ptr<MessageBatch>> pending;
+    std::pair<int64_t, int> next(0, 0);
+    std::vector<std::unique_ptr<MessageBatch>> ready;
+
+    for (;;) {
+      std::unique_ptr<MessageBatch> batch;
+      if (encode_queue_.pop(batch, encodeTimeout())) {
+        std::pair<int64_t, int> key(batch->sequence, batch->part);
+        pending[key] = std::move(batch);
+
+        while (!pending.empty() && (pending.begin()->first == next)) {
+          ready.push_back(std::move(pending.begin()->second));
+          pending.erase(pending.begin());
+          next = ready.back()->last ? std::make_pair(next.first + 1, 0) : std::make_pair(next.first, next.second + 1);
+        }
+
+        if (!ready.empty() && (ready.back()->last || ready.back()->early)) {
+          for (auto& written : ready) {
+            rows_ += written->row_group->rows();
+          }
+          writeRowGroups(ready);
+
+          for (auto& written : ready) {
+            if (written->row_group != nullptr) {
+              recycle(written->row_group);
+            }
+            if (written->last) {
+              in_flight_--;
+            }
+          }
+          ready.clear();
+        }
+      } else if (encode_queue_.finished() || encode_queue_.aborted()) {
+        break;
+      }
+      // Gathered rows are written early too when memory runs short
+      flushPartitions(overBudget());
+      target_.tick();
+    }
+
+    if (!encode_queue_.aborted()) {
+      flushPartitions(true);
+    }
+  }
+};
+
+};  // namespace capnpparquet
+
+#endif  // _CAPNPPIPELINE_H_
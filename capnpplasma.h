@@ -0,0 +1,116 @@
+/*
+ * Copyright 2017 Rene Sugar
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * @file capnpplasma.h
+ * @author Rene Sugar <rene.sugar@gmail.com>
+ * @brief Put Arrow record batches into a Plasma shared memory object store.
+ */
+#ifndef _CAPNPPLASMA_H_
+#define _CAPNPPLASMA_H_
+
+#include <arrow/io/memory.h>
+#include <arrow/ipc/api.h>
+
+#include <plasma/client.h>
+
+#include <functional>
+#include <memory>
+#include <string>
+
+#include "capnparrow.h"
+
+namespace capnpparquet {
+
+// Puts each record batch into a Plasma store as a sealed object.
+//
+// An object holds the batch in the Arrow IPC stream format (schema followed
+// by the batch), so a reader on the same host can map it from shared memory
+// and read it with RecordBatchStreamReader without copying:
+//
+//   plasma_store -m 1000000000 -s /tmp/plasma
+//
+// The batch is serialized twice: once to size the object, once into the
+// object's memory. Object ids are random; `on_sealed` is called with the id of
+// each sealed object so consumers can be told where to find it.
+//
+class ArrowPlasmaWriter : public ArrowBatchWriter {
+public:
+  typedef std::function<void(const plasma::ObjectID& id, int64_t rows)> SealedCallback;
+
+  ArrowPlasmaWriter(const std::string& store_socket, SealedCallback on_sealed = nullptr)
+  : on_sealed_(on_sealed), objects_written_(0), connected_(false) {
+    PARQUET_THROW_NOT_OK(client_.Connect(store_socket, "", plasma::kPlasmaDefaultReleaseDelay));
+    connected_ = true;
+  }
+
+  ~ArrowPlasmaWriter() {
+    if (connected_) {
+      // Errors cannot be reported from a destructor
+      client_.Disconnect();
+    }
+  }
+
+  KJ_DISALLOW_COPY(ArrowPlasmaWriter);
+
+  void write(const std::shared_ptr<::arrow::RecordBatch>& batch) override {
+    ::arrow::io::MockOutputStream counter;
+    writeStream(*batch, &counter);
+    int64_t size = counter.GetExtentBytesWritten();
+
+    plasma::ObjectID id = plasma::ObjectID::from_random();
+    std::shared_ptr<::arrow::Buffer> buffer;
+    PARQUET_THROW_NOT_OK(client_.Create(id, size, nullptr, 0, &buffer));
+
+    ::arrow::io::FixedSizeBufferWriter object(buffer);
+    writeStream(*batch, &object);
+
+    PARQUET_THROW_NOT_OK(client_.Seal(id));
+    // The store may evict the object once its readers release it
+    PARQUET_THROW_NOT_OK(client_.Release(id));
+    objects_written_++;
+
+    if (on_sealed_) {
+      on_sealed_(id, batch->num_rows());
+    }
+  }
+
+  void close() override {
+    if (connected_) {
+      connected_ = false;
+      PARQUET_THROW_NOT_OK(client_.Disconnect());
+    }
+  }
+
+  int64_t objects_written() const { return objects_written_; }
+
+private:
+  plasma::PlasmaClient client_;
+  SealedCallback       on_sealed_;
+  int64_t              objects_written_;
+  bool                 connected_;
+
+  static void writeStream(const ::arrow::RecordBatch& batch, ::arrow::io::OutputStream* sink) {
+    std::shared_ptr<::arrow::ipc::RecordBatchWriter> writer;
+    PARQUET_THROW_NOT_OK(::arrow::ipc::RecordBatchStreamWriter::Open(sink, batch.schema(), &writer));
+    PARQUET_THROW_NOT_OK(writer->WriteRecordBatch(batch));
+    PARQUET_THROW_NOT_OK(writer->Close());
+  }
+};
+
+};  // namespace capnpparquet
+
+#endif  // _CAPNPPLASMA_H_
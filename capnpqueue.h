@@ -0,0 +1,251 @@
+/*
+ * Copyright 2017 Rene Sugar
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * @file capnpqueue.h
+ * @author Rene Sugar <rene.sugar@gmail.com>
+ * @brief Bounded lock-free queue connecting the stages of the conversion pipeline.
+ */
+#ifndef _CAPNPQUEUE_H_
+#define _CAPNPQUEUE_H_
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <thread>
+#include <utility>
+
+namespace capnpparquet {
+
+// Waits for a queue slot: spin briefly, then yield, then sleep.
+class Backoff {
+public:
+  Backoff() : count_(0) {}
+
+  void wait() {
+    if (count_ < SPIN_LIMIT) {
+      // Busy wait, the other side is usually a few instructions away
+    } else if (count_ < YIELD_LIMIT) {
+      std::this_thread::yield();
+    } else {
+      std::this_thread::sleep_for(std::chrono::microseconds(SLEEP_MICROSECONDS));
+    }
+    count_++;
+  }
+
+private:
+  static const int SPIN_LIMIT = 64;
+  static const int YIELD_LIMIT = 128;
+  static const int SLEEP_MICROSECONDS = 200;
+
+  int count_;
+};
+
+// Bounded multi-producer multi-consumer queue.
+//
+// Each cell carries a sequence number that tells producers and consumers
+// whether it is free or full, so push and pop only contend on one atomic
+// position each (Dmitry Vyukov's bounded MPMC queue):
+//
+//   http://www.1024cores.net/home/lock-free-algorithms/queues/bounded-mpmc-queue
+//
+// push() waits while the queue is full, which is what stalls an upstream stage
+// when a downstream stage falls behind. The queue finishes when its last
+// producer calls removeProducer(); pop() then drains it and returns false.
+//
+template <typename T>
+class BoundedQueue {
+public:
+  explicit BoundedQueue(size_t capacity)
+  : capacity_(roundUpPowerOfTwo(capacity)), mask_(capacity_ - 1),
+    cells_(new Cell[capacity_]),
+    enqueue_pos_(0), dequeue_pos_(0), producers_(0), aborted_(false),
+    push_stalls_(0), pop_stalls_(0), max_depth_(0) {
+    for (size_t i = 0; i < capacity_; i++) {
+      cells_[i].sequence.store(i, std::memory_order_relaxed);
+    }
+  }
+
+  BoundedQueue(const BoundedQueue&) = delete;
+  BoundedQueue& operator=(const BoundedQueue&) = delete;
+
+  bool tryPush(T& value) {
+    size_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+    Cell* cell;
+
+    for (;;) {
+      cell = &cells_[pos & mask_];
+      size_t sequence = cell->sequence.load(std::memory_order_acquire);
+      intptr_t diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos);
+      if (diff == 0) {
+        if (enqueue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+          break;
+        }
+      } else if (diff < 0) {
+        return false;  // full
+      } else {
+        pos = enqueue_pos_.load(std::memory_order_relaxed);
+      }
+    }
+
+    cell->data = std::move(value);
+    cell->sequence.store(pos + 1, std::memory_order_release);
+
+    size_t depth = this->depth();
+    size_t max_depth = max_depth_.load(std::memory_order_relaxed);
+    while ((depth > max_depth) &&
+           !max_depth_.compare_exchange_weak(max_depth, depth, std::memory_order_relaxed)) {}
+    return true;
+  }
+
+  bool tryPop(T& value) {
+    size_t pos = dequeue_pos_.load(std::memory_order_relaxed);
+    Cell* cell;
+
+    for (;;) {
+      cell = &cells_[pos & mask_];
+      size_t sequence = cell->sequence.load(std::memory_order_acquire);
+      intptr_t diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos + 1);
+      if (diff == 0) {
+        if (dequeue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+          break;
+        }
+      } else if (diff < 0) {
+        return false;  // empty
+      } else {
+        pos = dequeue_pos_.load(std::memory_order_relaxed);
+      }
+    }
+
+    value = std::move(cell->data);
+    cell->sequence.store(pos + mask_ + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Wait until `value` is queued. Returns false when the queue was aborted.
+  bool push(T value) {
+    if (tryPush(value)) {
+      return true;
+    }
+
+    push_stalls_.fetch_add(1, std::memory_order_relaxed);
+    Backoff backoff;
+    while (!aborted_.load(std::memory_order_relaxed)) {
+      if (tryPush(value)) {
+        return true;
+      }
+      backoff.wait();
+    }
+    return false;
+  }
+
+  // Wait for a value. Returns false once every producer is done and the queue
+  // is drained, when the queue was aborted, or after `timeout_ms` (-1: no limit).
+  bool pop(T& value, int timeout_ms = -1) {
+    if (tryPop(value)) {
+      return true;
+    }
+
+    pop_stalls_.fetch_add(1, std::memory_order_relaxed);
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+    Backoff backoff;
+    while (!aborted_.load(std::memory_order_relaxed)) {
+      // Check for producers before the queue, a value pushed by the last
+      // producer is visible once its removeProducer() is.
+      bool finished = (producers_.load(std::memory_order_acquire) == 0);
+      if (tryPop(value)) {
+        return true;
+      }
+      if (finished) {
+        return false;
+      }
+      if ((timeout_ms >= 0) && (std::chrono::steady_clock::now() >= deadline)) {
+        return false;
+      }
+      backoff.wait();
+    }
+    return false;
+  }
+
+  void addProducer() { producers_.fetch_add(1, std::memory_order_release); }
+
+  void removeProducer() { producers_.fetch_sub(1, std::memory_order_release); }
+
+  // Every producer is done and the queue is drained
+  bool finished() const {
+    return (producers_.load(std::memory_order_acquire) == 0) && (depth() == 0);
+  }
+
+  // Wake up and fail every waiting push() and pop(), e.g. after a stage failed.
+  void abort() { aborted_.store(true, std::memory_order_relaxed); }
+
+  bool aborted() const { return aborted_.load(std::memory_order_relaxed); }
+
+  size_t capacity() const { return capacity_; }
+
+  // Approximate number of queued values
+  size_t depth() const {
+    size_t enqueued = enqueue_pos_.load(std::memory_order_relaxed);
+    size_t dequeued = dequeue_pos_.load(std::memory_order_relaxed);
+    return (enqueued > dequeued) ? (enqueued - dequeued) : 0;
+  }
+
+  size_t max_depth() const { return max_depth_.load(std::memory_order_relaxed); }
+
+  // Number of push() calls that found the queue full
+  int64_t push_stalls() const { return push_stalls_.load(std::memory_order_relaxed); }
+
+  // Number of pop() calls that found the queue empty
+  int64_t pop_stalls() const { return pop_stalls_.load(std::memory_order_relaxed); }
+
+private:
+  static const size_t CACHE_LINE_SIZE = 64;
+
+  struct Cell {
+    std::atomic<size_t> sequence;
+    T                   data;
+  };
+
+  typedef char CacheLinePad[CACHE_LINE_SIZE];
+
+  static size_t roundUpPowerOfTwo(size_t value) {
+    size_t result = 2;
+    while (result < value) {
+      result <<= 1;
+    }
+    return result;
+  }
+
+  const size_t             capacity_;
+  const size_t             mask_;
+  std::unique_ptr<Cell[]>  cells_;
+  CacheLinePad             pad0_;
+  std::atomic<size_t>      enqueue_pos_;
+  CacheLinePad             pad1_;
+  std::atomic<size_t>      dequeue_pos_;
+  CacheLinePad             pad2_;
+  std::atomic<int>         producers_;
+  std::atomic<bool>        aborted_;
+  std::atomic<int64_t>     push_stalls_;
+  std::atomic<int64_t>     pop_stalls_;
+  std::atomic<size_t>      max_depth_;
+};
+
+};  // namespace capnpparquet
+
+#endif  // _CAPNPQUEUE_H_
@@ -0,0 +1,619 @@
+/*
+ * Copyright 2017 Rene Sugar
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * @file capnprandom.h
+ * @author Rene Sugar <rene.sugar@gmail.com>
+ * @brief Fill Parquet files with random data using the schema generated from a Cap'n Proto schema.
+ */
+#ifndef _CAPNPRANDOM_H_
+#define _CAPNPRANDOM_H_
+
+#include <parquet/api/writer.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "capnp2parquet.h"
+#include "capnpappend.h"
+
+namespace capnpparquet {
+
+// SplitMix64: fast, small state and good enough for test data. A generator
+// is seeded per row group from the seed of its file, so files are
+// reproducible no matter which thread writes them.
+class RandomSource {
+public:
+  explicit RandomSource(uint64_t seed) : state_(seed) {}
+
+  uint64_t next() {
+    uint64_t z = (state_ += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+  }
+
+  // Uniform in [min, max]
+  int64_t uniform(int64_t min, int64_t max) {
+    uint64_t range = static_cast<uint64_t>(max) - static_cast<uint64_t>(min) + 1;
+    if (range == 0) {
+      // [INT64_MIN, INT64_MAX]
+      return static_cast<int64_t>(next());
+    }
+    return static_cast<int64_t>(static_cast<uint64_t>(min) + (next() % range));
+  }
+
+  // Uniform in [0, 1)
+  double real() { return static_cast<double>(next() >> 11) * (1.0 / 9007199254740992.0); }
+
+  bool chance(double probability) { return (probability > 0.0) && (real() < probability); }
+
+  // Seed of the `index`-th generator derived from `seed`
+  static uint64_t derive(uint64_t seed, uint64_t index) {
+    RandomSource random(seed ^ (index * 0xd1b54a32d192ed03ULL));
+    return random.next();
+  }
+
+private:
+  uint64_t state_;
+};
+
+// Characters of random strings, 64 so that six bits pick one
+static const char RANDOM_CHARACTERS[] = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz_-";
+
+struct RandomOptions {
+  RandomOptions()
+  : seed(0), null_ratio(0.1), min_list_length(0), max_list_length(4),
+    max_string_length(16), string_cardinality(0) {}
+
+  uint64_t seed;
+  double   null_ratio;          // probability that an optional value is null
+  int64_t  min_list_length;     // elements of a repeated field (lists, maps)
+  int64_t  max_list_length;
+  int64_t  max_string_length;   // strings are 1 to max_string_length characters
+  int64_t  string_cardinality;  // distinct strings per column, 0: every string is random
+};
+
+// How the values of one leaf column are drawn.
+struct RandomColumnSpec {
+  RandomColumnSpec()
+  : min(std::numeric_limits<int64_t>::min()), max(std::numeric_limits<int64_t>::max()),
+    decimal(false), length(0) {}
+
+  int64_t                  min;         // integer (and unscaled decimal) range, inclusive
+  int64_t                  max;
+  bool                     decimal;     // byte arrays hold big-endian unscaled decimals
+  int32_t                  length;      // FIXED_LEN_BYTE_ARRAY length, or the longest string
+  std::vector<std::string> dictionary;  // strings to choose from, empty: random strings
+};
+
+// Range of values that respects the logical type (annotation) of a column.
+inline RandomColumnSpec randomColumnSpec(const parquet::ColumnDescriptor* descr,
+                                         const CapnpFieldNode* leaf,
+                                         const RandomOptions& options, uint64_t seed) {
+  // 2000-01-01 to 2030-01-01
+  static const int64_t MIN_SECONDS = 946684800LL;
+  static const int64_t MAX_SECONDS = 1893456000LL;
+
+  RandomColumnSpec spec;
+
+  switch (descr->logical_type()) {
+    case parquet::LogicalType::INT_8:   spec.min = -128; spec.max = 127; break;
+    case parquet::LogicalType::INT_16:  spec.min = -32768; spec.max = 32767; break;
+    case parquet::LogicalType::UINT_8:  spec.min = 0; spec.max = 255; break;
+    case parquet::LogicalType::UINT_16: spec.min = 0; spec.max = 65535; break;
+    case parquet::LogicalType::UINT_32: spec.min = 0; spec.max = 4294967295LL; break;
+    case parquet::LogicalType::INT_32:
+      spec.min = std::numeric_limits<int32_t>::min();
+      spec.max = std::numeric_limits<int32_t>::max();
+      break;
+    case parquet::LogicalType::DATE:
+      spec.min = MIN_SECONDS / 86400;
+      spec.max = MAX_SECONDS / 86400;
+      break;
+    case parquet::LogicalType::TIME_MILLIS:  spec.min = 0; spec.max = 86400LL * 1000 - 1; break;
+    case parquet::LogicalType::TIME_MICROS:  spec.min = 0; spec.max = 86400LL * 1000000 - 1; break;
+    case parquet::LogicalType::TIMESTAMP_MILLIS:
+      spec.min = MIN_SECONDS * 1000;
+      spec.max = MAX_SECONDS * 1000;
+      break;
+    case parquet::LogicalType::TIMESTAMP_MICROS:
+      spec.min = MIN_SECONDS * 1000000;
+      spec.max = MAX_SECONDS * 1000000;
+      break;
+    case parquet::LogicalType::DECIMAL: {
+      // Unscaled values with at most `precision` digits (and at most 18, the digits of an int64)
+      int64_t bound = 1;
+      for (int32_t i = 0; i < std::min<int32_t>(descr->type_precision(), 18); i++) {
+        bound *= 10;
+      }
+      spec.min = -(bound - 1);
+      spec.max = bound - 1;
+      spec.decimal = true;
+      break;
+    }
+    default:
+      if (descr->physical_type() == parquet::Type::INT32) {
+        spec.min = std::numeric_limits<int32_t>::min();
+        spec.max = std::numeric_limits<int32_t>::max();
+      } else if ((descr->physical_type() == parquet::Type::FLOAT) ||
+                 (descr->physical_type() == parquet::Type::DOUBLE)) {
+        spec.min = -1000000;
+        spec.max = 1000000;
+      }
+      break;
+  }
+
+  spec.length = (descr->physical_type() == parquet::Type::FIXED_LEN_BYTE_ARRAY)
+                ? descr->type_length() : static_cast<int32_t>(options.max_string_length);
+
+  if ((leaf != nullptr) && leaf->type.isEnum() && (descr->physical_type() == parquet::Type::BYTE_ARRAY)) {
+    // Enums are stored as enumerant names
+    for (auto enumerant : leaf->type.asEnum().getEnumerants()) {
+      spec.dictionary.push_back(enumerant.getProto().getName().cStr());
+    }
+  } else if ((leaf != nullptr) && (leaf->kind == CapnpFieldNode::DISCRIMINANT)) {
+    // and union discriminants as member names
+    for (auto member : leaf->type.asStruct().getUnionFields()) {
+      spec.dictionary.push_back(member.getProto().getName().cStr());
+    }
+  } else if ((descr->physical_type() == parquet::Type::BYTE_ARRAY) && !spec.decimal &&
+             (options.string_cardinality > 0)) {
+    RandomSource random(seed);
+    for (int64_t i = 0; i < options.string_cardinality; i++) {
+      std::string value(static_cast<size_t>(random.uniform(1, std::max<int64_t>(1, spec.length))), ' ');
+      for (auto& c : value) {
+        c = RANDOM_CHARACTERS[random.next() & 63];
+      }
+      spec.dictionary.push_back(value);
+    }
+  }
+
+  return spec;
+}
+
+// A column buffer that appends random values.
+class RandomColumn {
+public:
+  virtual ~RandomColumn() {}
+
+  // Append a non-null random value
+  virtual void appendRandom(RandomSource& random, int16_t rep) = 0;
+
+  virtual ColumnBuffer& buffer() = 0;
+};
+
+template <typename DType>
+class TypedRandomColumn : public TypedColumnBuffer<DType>, public RandomColumn {
+public:
+  TypedRandomColumn(const parquet::ColumnDescriptor* descr, const RandomColumnSpec& spec)
+  : TypedColumnBuffer<DType>(descr), spec_(spec) {}
+
+  void appendRandom(RandomSource& random, int16_t rep) override {
+    this->pushLevels(this->max_def_, rep);
+    pushRandom(random);
+  }
+
+  ColumnBuffer& buffer() override { return *this; }
+
+private:
+  const RandomColumnSpec& spec_;
+  std::vector<uint8_t>    scratch_;
+
+  void pushRandom(RandomSource& random);
+
+  // Random characters, eight per draw
+  void randomString(RandomSource& random, size_t length) {
+    scratch_.resize(length);
+    for (size_t i = 0; i < length; i += 8) {
+      uint64_t bits = random.next();
+      for (size_t j = i; (j < i + 8) && (j < length); j++) {
+        scratch_[j] = RANDOM_CHARACTERS[bits & 63];
+        bits >>= 8;
+      }
+    }
+  }
+
+  // Big-endian two's complement, as pushCapnpBytes stores decimals
+  void randomDecimal(RandomSource& random, size_t length) {
+    int64_t unscaled = random.uniform(spec_.min, spec_.max);
+    scratch_.resize(length);
+    for (size_t i = length; i > 0; i--) {
+      scratch_[i - 1] = static_cast<uint8_t>(unscaled & 0xff);
+      unscaled >>= 8;
+    }
+  }
+};
+
+template <typename DType>
+void TypedRandomColumn<DType>::pushRandom(RandomSource& random) {
+  this->values_.push(static_cast<typename DType::c_type>(random.uniform(spec_.min, spec_.max)));
+}
+
+template <>
+inline void TypedRandomColumn<parquet::BooleanType>::pushRandom(RandomSource& random) {
+  this->values_.push((random.next() & 1) != 0);
+}
+
+template <>
+inline void TypedRandomColumn<parquet::FloatType>::pushRandom(RandomSource& random) {
+  this->values_.push(static_cast<float>(spec_.min + (random.real() * (spec_.max - spec_.min))));
+}
+
+template <>
+inline void TypedRandomColumn<parquet::DoubleType>::pushRandom(RandomSource& random) {
+  this->values_.push(spec_.min + (random.real() * (spec_.max - spec_.min)));
+}
+
+template <>
+inline void TypedRandomColumn<parquet::ByteArrayType>::pushRandom(RandomSource& random) {
+  if (spec_.decimal) {
+    randomDecimal(random, sizeof(int64_t));
+  } else if (!spec_.dictionary.empty()) {
+    const std::string& value = spec_.dictionary[random.next() % spec_.dictionary.size()];
+    this->values_.push(reinterpret_cast<const uint8_t*>(value.data()), value.size());
+    return;
+  } else {
+    randomString(random, static_cast<size_t>(random.uniform(1, std::max<int32_t>(1, spec_.length))));
+  }
+  this->values_.push(scratch_.data(), scratch_.size());
+}
+
+template <>
+inline void TypedRandomColumn<parquet::FLBAType>::pushRandom(RandomSource& random) {
+  if (spec_.decimal) {
+    randomDecimal(random, spec_.length);
+  } else {
+    scratch_.resize(spec_.length);
+    for (int32_t i = 0; i < spec_.length; i++) {
+      scratch_[i] = static_cast<uint8_t>(random.next());
+    }
+  }
+  this->values_.push(scratch_.data(), scratch_.size());
+}
+
+inline std::unique_ptr<RandomColumn> makeRandomColumn(const parquet::ColumnDescriptor* descr,
+                                                      const RandomColumnSpec& spec) {
+  switch (descr->physical_type()) {
+    case parquet::Type::BOOLEAN:
+      return std::unique_ptr<RandomColumn>(new TypedRandomColumn<parquet::BooleanType>(descr, spec));
+    case parquet::Type::INT32:
+      return std::unique_ptr<RandomColumn>(new TypedRandomColumn<parquet::Int32Type>(descr, spec));
+    case parquet::Type::INT64:
+      return std::unique_ptr<RandomColumn>(new TypedRandomColumn<parquet::Int64Type>(descr, spec));
+    case parquet::Type::FLOAT:
+      return std::unique_ptr<RandomColumn>(new TypedRandomColumn<parquet::FloatType>(descr, spec));
+    case parquet::Type::DOUBLE:
+      return std::unique_ptr<RandomColumn>(new TypedRandomColumn<parquet::DoubleType>(descr, spec));
+    case parquet::Type::BYTE_ARRAY:
+      return std::unique_ptr<RandomColumn>(new TypedRandomColumn<parquet::ByteArrayType>(descr, spec));
+    case parquet::Type::FIXED_LEN_BYTE_ARRAY:
+      return std::unique_ptr<RandomColumn>(new TypedRandomColumn<parquet::FLBAType>(descr, spec));
+    default:
+      KJ_FAIL_REQUIRE("unsupported Parquet physical type", descr->path()->ToDotString());
+  }
+}
+
+// A node of the Parquet schema with the levels the generator emits for it.
+struct RandomNode {
+  RandomNode() : node(nullptr), def_level(0), rep_level(0), column(-1), first_column(0), last_column(0) {}
+
+  const parquet::schema::Node* node;
+  int16_t                      def_level;     // definition level when the node is defined
+  int16_t                      rep_level;     // repetition level of the node (or its innermost repeated ancestor)
+  int                          column;        // leaf column index
+  int                          first_column;  // leaf columns below this node are
+  int                          last_column;   // [first_column, last_column)
+  std::vector<RandomNode>      children;
+};
+
+// The random data layout of a schema: levels of every node and the value
+// ranges of every leaf column. Read-only once built, shared by the threads
+// that generate files.
+class RandomSchema {
+public:
+  RandomSchema(const CapnpSchemaFile& schema, const RandomOptions& options)
+  : schema_(schema), options_(options), map_(schema.root(), schema.descr()) {
+    const parquet::SchemaDescriptor* descr = schema.descr();
+
+    int next_column = 0;
+    root_.node = descr->group_node();
+    build(root_, 0, 0, next_column);
+
+    for (int i = 0; i < descr->num_columns(); i++) {
+      specs_.push_back(randomColumnSpec(descr->Column(i), map_.leaf(i), options_,
+                                        RandomSource::derive(options_.seed, i)));
+    }
+  }
+
+  KJ_DISALLOW_COPY(RandomSchema);
+
+  const RandomNode& root() const { return root_; }
+
+  const RandomColumnSpec& spec(int column) const { return specs_[column]; }
+
+  const RandomOptions& options() const { return options_; }
+
+  const CapnpSchemaFile& schema() const { return schema_; }
+
+private:
+  const CapnpSchemaFile&        schema_;
+  RandomOptions                 options_;
+  CapnpColumnMap                map_;
+  RandomNode                    root_;
+  std::vector<RandomColumnSpec> specs_;
+
+  static void build(RandomNode& out, int16_t def, int16_t rep, int& next_column) {
+    out.def_level = def;
+    out.rep_level = rep;
+    out.first_column = next_column;
+
+    if (out.node->is_primitive()) {
+      out.column = next_column++;
+    } else {
+      auto group = static_cast<const parquet::schema::GroupNode*>(out.node);
+      for (int i = 0; i < group->field_count(); i++) {
+        RandomNode child;
+        child.node = group->field(i).get();
+        build(child,
+              child.node->is_required() ? def : static_cast<int16_t>(def + 1),
+              child.node->is_repeated() ? static_cast<int16_t>(rep + 1) : rep,
+              next_column);
+        out.children.push_back(std::move(child));
+      }
+    }
+
+    out.last_column = next_column;
+  }
+};
+
+// Generates random rows into the column buffers of one row group (Dremel
+// encoding, like CapnpShredder but driven by the Parquet schema).
+class RandomRowGenerator {
+public:
+  RandomRowGenerator(const RandomSchema& schema, uint64_t seed)
+  : schema_(schema), options_(schema.options()), random_(seed) {
+    const parquet::SchemaDescriptor* descr = schema.schema().descr();
+    for (int i = 0; i < descr->num_columns(); i++) {
+      columns_.push_back(makeRandomColumn(descr->Column(i), schema.spec(i)));
+    }
+  }
+
+  KJ_DISALLOW_COPY(RandomRowGenerator);
+
+  // Start over from `seed`
+  void reseed(uint64_t seed) { random_ = RandomSource(seed); }
+
+  void generate(int64_t rows) {
+    for (int64_t i = 0; i < rows; i++) {
+      generateChildren(schema_.root(), 0);
+    }
+  }
+
+  // Write the generated rows as the column chunks of `row_group`.
+  void write(parquet::RowGroupWriter* row_group) {
+    for (auto& column : columns_) {
+      column->buffer().write(row_group);
+    }
+  }
+
+  void clear() {
+    for (auto& column : columns_) {
+      column->buffer().clear();
+    }
+  }
+
+private:
+  const RandomSchema&                        schema_;
+  const RandomOptions&                       options_;
+  RandomSource                               random_;
+  std::vector<std::unique_ptr<RandomColumn>> columns_;
+
+  void appendNulls(const RandomNode& node, int16_t def, int16_t rep) {
+    for (int i = node.first_column; i < node.last_column; i++) {
+      columns_[i]->buffer().appendNull(def, rep);
+    }
+  }
+
+  void generateChildren(const RandomNode& group, int16_t rep) {
+    for (const auto& child : group.children) {
+      generateNode(child, group.def_level, rep);
+    }
+  }
+
+  // `def` is the definition level of the parent of `node`.
+  void generateNode(const RandomNode& node, int16_t def, int16_t rep) {
+    if (node.node->is_optional() && random_.chance(options_.null_ratio)) {
+      appendNulls(node, def, rep);
+      return;
+    }
+
+    if (!node.node->is_repeated()) {
+      generateValue(node, rep);
+      return;
+    }
+
+    int64_t length = random_.uniform(options_.min_list_length, options_.max_list_length);
+    if (length == 0) {
+      appendNulls(node, def, rep);
+      return;
+    }
+    for (int64_t i = 0; i < length; i++) {
+      generateValue(node, (i == 0) ? rep : node.rep_level);
+    }
+  }
+
+  void generateValue(const RandomNode& node, int16_t rep) {
+    if (node.column >= 0) {
+      columns_[node.column]->appendRandom(random_, rep);
+    } else {
+      generateChildren(node, rep);
+    }
+  }
+};
+
+// Generates row group `index` of a random file, of `rows` rows, and writes
+// it to `row_group`.
+inline void writeRandomRowGroup(RandomRowGenerator& generator, parquet::RowGroupWriter* row_group,
+                                uint64_t seed, int64_t index, int64_t rows) {
+  generator.reseed(RandomSource::derive(seed, index));
+  generator.generate(rows);
+  generator.write(row_group);
+  row_group->Close();
+  generator.clear();
+}
+
+// Generates row group `index` of a random file and encodes it to a file in memory.
+inline std::shared_ptr<::arrow::Buffer> encodeRandomRowGroup(RandomRowGenerator& generator, const RandomSchema& schema,
+                                                             std::shared_ptr<parquet::WriterProperties> properties,
+                                                             uint64_t seed, int64_t index, int64_t rows) {
+  auto sink = std::make_shared<parquet::InMemoryOutputStream>();
+  auto file_writer = parquet::ParquetFileWriter::Open(sink, schema.schema().parquetSchema(), properties);
+  writeRandomRowGroup(generator, file_writer->AppendRowGroup(), seed, index, rows);
+  file_writer->Close();
+  return sink->GetBuffer();
+}
+
+// Writes `rows` random rows to a Parquet file. The data depends only on the
+// schema, the options and `seed`: row group i is generated from
+// RandomSource::derive(seed, i), whatever the number of threads.
+//
+// With `threads` above one, row groups are generated and encoded on that
+// many threads, each to a file in memory, and copied to `sink` in order by a
+// ParquetRowGroupAppender. At most twice the threads row groups are held at
+// once, like the merges of ParquetCompactor.
+inline void writeRandomFile(const RandomSchema& schema, std::shared_ptr<parquet::OutputStream> sink,
+                            int64_t rows, uint64_t seed,
+                            std::shared_ptr<parquet::WriterProperties> properties = parquet::default_writer_properties(),
+                            int64_t row_group_rows = CapnpParquetWriter::DEFAULT_ROW_GROUP_ROWS,
+                            int threads = 1) {
+  int64_t row_groups = (rows + row_group_rows - 1) / row_group_rows;
+  auto rowsOf = [&](int64_t index) { return std::min<int64_t>(row_group_rows, rows - (index * row_group_rows)); };
+
+  if ((threads <= 1) || (row_groups <= 1)) {
+    auto file_writer = parquet::ParquetFileWriter::Open(sink, schema.schema().parquetSchema(), properties,
+                                                        schema.schema().metadata());
+    RandomRowGenerator generator(schema, seed);
+    for (int64_t index = 0; index < row_groups; index++) {
+      writeRandomRowGroup(generator, file_writer->AppendRowGroup(), seed, index, rowsOf(index));
+    }
+    file_writer->Close();
+    return;
+  }
+
+  struct EncodedRowGroup {
+    EncodedRowGroup() : done(false) {}
+
+    std::shared_ptr<::arrow::Buffer>  encoded;
+    std::string                       error;
+    bool                              done;
+  };
+
+  std::vector<EncodedRowGroup> encoded(row_groups);
+  std::mutex mutex;
+  std::condition_variable changed;
+  int64_t next = 0;
+  int64_t written = 0;
+  bool stopped = false;
+
+  auto encode = [&]() {
+    RandomRowGenerator generator(schema, seed);
+    for (;;) {
+      int64_t index;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        changed.wait(lock, [&]() { return stopped || (next >= row_groups) || (next < written + (2 * threads)); });
+        if (stopped || (next >= row_groups)) {
+          return;
+        }
+        index = next++;
+      }
+
+      std::shared_ptr<::arrow::Buffer> buffer;
+      std::string error;
+      try {
+        buffer = encodeRandomRowGroup(generator, schema, properties, seed, index, rowsOf(index));
+      } catch (const std::exception& e) {
+        error = e.what();
+      }
+
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        encoded[index].encoded = buffer;
+        encoded[index].error = error;
+        encoded[index].done = true;
+      }
+      changed.notify_all();
+    }
+  };
+
+  std::vector<std::thread> workers;
+  for (int i = 0; (i < threads) && (i < row_groups); i++) {
+    workers.emplace_back(encode);
+  }
+  auto stop = [&]() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopped = true;
+    }
+    changed.notify_all();
+    for (auto& worker : workers) {
+      worker.join();
+    }
+  };
+
+  try {
+    auto metadata = std::make_shared<::arrow::KeyValueMetadata>();
+    auto schema_metadata = schema.schema().metadata();
+    if (schema_metadata != nullptr) {
+      for (int64_t i = 0; i < schema_metadata->size(); i++) {
+        metadata->Append(schema_metadata->key(i), schema_metadata->value(i));
+      }
+    }
+    ParquetRowGroupAppender appender(sink, schema.schema().descr(), properties, metadata);
+
+    for (int64_t index = 0; index < row_groups; index++) {
+      std::shared_ptr<::arrow::Buffer> buffer;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        EncodedRowGroup& row_group = encoded[index];
+        changed.wait(lock, [&row_group]() { return row_group.done; });
+        KJ_REQUIRE(row_group.error.empty(), row_group.error);
+        buffer.swap(row_group.encoded);
+        written++;
+      }
+      changed.notify_all();
+      appender.append(buffer, "random row group");
+    }
+    appender.close();
+  } catch (...) {
+    stop();
+    throw;
+  }
+  stop();
+}
+
+};  // namespace capnpparquet
+
+#endif  // _CAPNPRANDOM_H_
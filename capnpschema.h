@@ -0,0 +1,907 @@
+/*
+ * Copyright 2017 Rene Sugar
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * @file capnpschema.h
+ * @author Rene Sugar <rene.sugar@gmail.com>
+ * @brief Load a compiled Cap'n Proto schema at runtime and map its fields to Parquet columns.
+ */
+#ifndef _CAPNPSCHEMA_H_
+#define _CAPNPSCHEMA_H_
+
+#include <fcntl.h>
+
+#include <kj/debug.h>
+#include <kj/io.h>
+
+#include <arrow/util/key_value_metadata.h>
+
+#include <parquet/schema.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "capnpparquet.h"
+#include "capnptemporal.h"
+
+namespace capnpparquet {
+
+// Key of the field ids in the key/value metadata of a Parquet file
+static const char CAPNP_FIELD_IDS_KEY[] = "capnp.field_ids";
+
+// Keys of the writer settings of the $schema struct in the key/value metadata
+static const char CAPNP_ROW_GROUP_ROWS_KEY[] = "capnp.row_group_rows";
+static const char CAPNP_ROW_GROUP_BYTES_KEY[] = "capnp.row_group_bytes";
+static const char CAPNP_DATA_PAGE_SIZE_KEY[] = "capnp.data_page_size";
+static const char CAPNP_DICTIONARY_PAGE_LIMIT_KEY[] = "capnp.dictionary_page_limit";
+
+// Key of the columns the rows of each row group are sorted by.
+//
+// parquet-cpp cannot set the sorting_columns of a row group, so they are
+// stored in the key/value metadata: the leaf column indexes in sort order,
+// separated by commas. Every column sorts ascending with nulls first.
+static const char CAPNP_SORTING_COLUMNS_KEY[] = "capnp.sorting_columns";
+
+// Key of the columns whose values name the partition directory of a file,
+// in the same format. The directories are <column path>=<value>, see
+// CapnpPartitioner.
+static const char CAPNP_PARTITION_COLUMNS_KEY[] = "capnp.partition_columns";
+
+// Keys of the Bloom filters and page indexes of the column chunks.
+//
+// parquet-cpp has no place for either in the column metadata, so they are
+// written to the file after their row group and located through these
+// key/value metadata entries, see ColumnChunkLocation.
+static const char CAPNP_BLOOM_FILTERS_KEY[] = "capnp.bloom_filters";
+static const char CAPNP_PAGE_INDEX_KEY[] = "capnp.page_index";
+
+// Key of the false positive probability of the $bloomFilter columns, entries
+// "column:fpp" separated by commas, and key of the rows per range of the page
+// indexes (see ColumnPageIndex). Copies of column chunks check them.
+static const char CAPNP_BLOOM_FILTER_FPP_KEY[] = "capnp.bloom_filter_fpp";
+static const char CAPNP_PAGE_INDEX_ROWS_KEY[] = "capnp.page_index_rows";
+
+// Key of the $sourceUnit of the date, time and timestamp columns: entries
+// "column:unit" separated by commas, e.g. "3:ns,5:s". The writer converts the
+// Cap'n Proto values of these columns to the column's unit and the reader
+// converts them back.
+static const char CAPNP_SOURCE_UNITS_KEY[] = "capnp.source_units";
+
+// Where the side data of a column chunk (a Bloom filter or page index) is
+// stored in the file. A metadata entry lists them as
+// "<row group>:<column>:<offset>:<length>", separated by commas.
+struct ColumnChunkLocation {
+  ColumnChunkLocation() : row_group(0), column(0), offset(0), length(0) {}
+
+  int     row_group;
+  int     column;
+  int64_t offset;
+  int64_t length;
+};
+
+inline std::string formatColumnChunkLocations(const std::vector<ColumnChunkLocation>& locations) {
+  std::string value;
+  for (const auto& location : locations) {
+    if (!value.empty()) {
+      value += ',';
+    }
+    value += std::to_string(location.row_group) + ":" + std::to_string(location.column) + ":" +
+             std::to_string(location.offset) + ":" + std::to_string(location.length);
+  }
+  return value;
+}
+
+inline std::vector<ColumnChunkLocation> parseColumnChunkLocations(const std::string& value) {
+  std::vector<ColumnChunkLocation> locations;
+  const char* text = value.c_str();
+  while (*text != '\0') {
+    ColumnChunkLocation location;
+    char* end = nullptr;
+    location.row_group = static_cast<int>(strtol(text, &end, 10));
+    KJ_REQUIRE(*end == ':', "invalid column chunk location", value);
+    location.column = static_cast<int>(strtol(end + 1, &end, 10));
+    KJ_REQUIRE(*end == ':', "invalid column chunk location", value);
+    location.offset = strtoll(end + 1, &end, 10);
+    KJ_REQUIRE(*end == ':', "invalid column chunk location", value);
+    location.length = strtoll(end + 1, &end, 10);
+    KJ_REQUIRE((*end == ',') || (*end == '\0'), "invalid column chunk location", value);
+    locations.push_back(location);
+    text = (*end == ',') ? end + 1 : end;
+  }
+  return locations;
+}
+
+// Locations stored under `key` in the key/value metadata of a file
+inline std::vector<ColumnChunkLocation> columnChunkLocations(
+    const std::shared_ptr<const ::arrow::KeyValueMetadata>& metadata, const char* key) {
+  if (metadata == nullptr) {
+    return std::vector<ColumnChunkLocation>();
+  }
+  int index = metadata->FindKey(key);
+  return (index < 0) ? std::vector<ColumnChunkLocation>() : parseColumnChunkLocations(metadata->value(index));
+}
+
+// Value stored under `key`, empty when there is none
+inline std::string metadataValue(const std::shared_ptr<const ::arrow::KeyValueMetadata>& metadata, const char* key) {
+  int index = (metadata != nullptr) ? metadata->FindKey(key) : -1;
+  return (index < 0) ? std::string() : metadata->value(index);
+}
+
+// Store the settings that are set (non-zero) in `metadata`
+inline void appendWriterOptions(const ParquetWriterOptions& options, ::arrow::KeyValueMetadata* metadata) {
+  if (options.row_group_rows > 0) {
+    metadata->Append(CAPNP_ROW_GROUP_ROWS_KEY, std::to_string(options.row_group_rows));
+  }
+  if (options.row_group_bytes > 0) {
+    metadata->Append(CAPNP_ROW_GROUP_BYTES_KEY, std::to_string(options.row_group_bytes));
+  }
+  if (options.data_page_size > 0) {
+    metadata->Append(CAPNP_DATA_PAGE_SIZE_KEY, std::to_string(options.data_page_size));
+  }
+  if (options.dictionary_page_limit > 0) {
+    metadata->Append(CAPNP_DICTIONARY_PAGE_LIMIT_KEY, std::to_string(options.dictionary_page_limit));
+  }
+}
+
+// Leaf columns annotated with $sortKey, ordered by the annotation's position
+inline std::vector<int> sortingColumns(const std::vector<ParquetColumnOptions>& options) {
+  std::vector<int> columns;
+  for (int i = 0; i < static_cast<int>(options.size()); i++) {
+    if (options[i].has_sort_key) {
+      columns.push_back(i);
+    }
+  }
+  std::stable_sort(columns.begin(), columns.end(), [&options](int a, int b) {
+    return options[a].sort_key < options[b].sort_key;
+  });
+  return columns;
+}
+
+// Leaf columns annotated with $partitionKey, ordered by the annotation's position
+inline std::vector<int> partitionColumns(const std::vector<ParquetColumnOptions>& options) {
+  std::vector<int> columns;
+  for (int i = 0; i < static_cast<int>(options.size()); i++) {
+    if (options[i].has_partition_key) {
+      columns.push_back(i);
+    }
+  }
+  std::stable_sort(columns.begin(), columns.end(), [&options](int a, int b) {
+    return options[a].partition_key < options[b].partition_key;
+  });
+  return columns;
+}
+
+// Column indexes separated by commas
+inline std::string formatColumns(const std::vector<int>& columns) {
+  std::string value;
+  for (int column : columns) {
+    value += (value.empty() ? "" : ",") + std::to_string(column);
+  }
+  return value;
+}
+
+// Value stored under CAPNP_SOURCE_UNITS_KEY, empty when no column has a $sourceUnit
+inline std::string formatSourceUnits(const std::vector<ParquetColumnOptions>& options) {
+  std::string value;
+  for (size_t i = 0; i < options.size(); i++) {
+    if (!options[i].source_unit.empty()) {
+      value += (value.empty() ? "" : ",") + std::to_string(i) + ":" + options[i].source_unit;
+    }
+  }
+  return value;
+}
+
+// Value stored under CAPNP_BLOOM_FILTER_FPP_KEY, empty when no column has a $bloomFilter
+inline std::string formatBloomFilterFpp(const std::vector<ParquetColumnOptions>& options) {
+  std::string value;
+  for (size_t i = 0; i < options.size(); i++) {
+    if (options[i].bloom_filter_fpp != 0.0) {
+      char fpp[32];
+      snprintf(fpp, sizeof(fpp), "%.9g", options[i].bloom_filter_fpp);
+      value += (value.empty() ? "" : ",") + std::to_string(i) + ":" + fpp;
+    }
+  }
+  return value;
+}
+
+// Units (see capnptemporal.h) of the Cap'n Proto values of each leaf column
+// stored in the key/value metadata of a file. 0 when values are in the
+// column's unit.
+inline std::vector<int64_t> sourceUnitsFromMetadata(const std::shared_ptr<const ::arrow::KeyValueMetadata>& metadata,
+                                                    int num_columns) {
+  std::vector<int64_t> units(num_columns, 0);
+  int index = (metadata != nullptr) ? metadata->FindKey(CAPNP_SOURCE_UNITS_KEY) : -1;
+  if (index < 0) {
+    return units;
+  }
+
+  const std::string value = metadata->value(index);
+  size_t start = 0;
+  while (start < value.size()) {
+    size_t end = value.find(',', start);
+    std::string entry = value.substr(start, end - start);
+    size_t colon = entry.find(':');
+    KJ_REQUIRE(colon != std::string::npos, "invalid source unit", entry);
+    int column = atoi(entry.substr(0, colon).c_str());
+    int64_t unit = temporalUnit(entry.substr(colon + 1));
+    KJ_REQUIRE((column >= 0) && (column < num_columns) && (unit != 0), "invalid source unit", entry);
+    units[column] = unit;
+    start = (end == std::string::npos) ? value.size() : end + 1;
+  }
+  return units;
+}
+
+// Writer settings stored in the key/value metadata of a file, so a rewrite
+// of the file keeps the tuning of its schema
+inline ParquetWriterOptions writerOptionsFromMetadata(
+    const std::shared_ptr<const ::arrow::KeyValueMetadata>& metadata) {
+  ParquetWriterOptions options;
+  if (metadata == nullptr) {
+    return options;
+  }
+
+  auto lookup = [&](const char* key) -> int64_t {
+    int index = metadata->FindKey(key);
+    return (index < 0) ? 0 : std::max<int64_t>(0, strtoll(metadata->value(index).c_str(), nullptr, 10));
+  };
+  options.row_group_rows = lookup(CAPNP_ROW_GROUP_ROWS_KEY);
+  options.row_group_bytes = lookup(CAPNP_ROW_GROUP_BYTES_KEY);
+  options.data_page_size = lookup(CAPNP_DATA_PAGE_SIZE_KEY);
+  options.dictionary_page_limit = lookup(CAPNP_DICTIONARY_PAGE_LIMIT_KEY);
+  return options;
+}
+
+// Cap'n Proto field ordinals of the leaf columns of a Parquet schema.
+//
+// The id of a leaf column is the dotted path of the ordinals of the fields
+// leading to it, e.g. "4.0" is field @0 of the struct in field @4. Ordinals
+// do not change when a field is renamed, so files written with different
+// versions of a schema can be matched column by column.
+//
+// parquet-cpp cannot set the field_id of a schema element, so the ids are
+// stored in the key/value metadata of the file, one per leaf column in
+// column order, separated by commas. A column without an id (e.g. below an
+// implicit group) has an empty entry.
+//
+class CapnpFieldIds {
+public:
+  explicit CapnpFieldIds(const std::vector<std::string>& paths)
+  : paths_(paths), ordinals_(paths.size()) {
+    for (size_t column = 0; column < paths_.size(); column++) {
+      const std::string& path = paths_[column];
+      if (path.empty()) {
+        continue;
+      }
+
+      uint32_t ordinal = 0;
+      for (size_t i = 0; i <= path.size(); i++) {
+        if ((i == path.size()) || (path[i] == '.')) {
+          ordinals_[column].push_back(static_cast<uint16_t>(ordinal));
+          ordinal = 0;
+        } else {
+          KJ_REQUIRE((path[i] >= '0') && (path[i] <= '9') && (ordinal <= 0xffff / 10),
+                     "invalid Cap'n Proto field id", path);
+          ordinal = (ordinal * 10) + (path[i] - '0');
+        }
+      }
+
+      columns_.emplace(path, static_cast<int>(column));
+    }
+  }
+
+  // Field ids stored in the key/value metadata of a file, or nullptr when it has none
+  static std::unique_ptr<CapnpFieldIds> fromMetadata(
+      const std::shared_ptr<const ::arrow::KeyValueMetadata>& metadata) {
+    if (metadata == nullptr) {
+      return nullptr;
+    }
+    int index = metadata->FindKey(CAPNP_FIELD_IDS_KEY);
+    if (index < 0) {
+      return nullptr;
+    }
+
+    std::vector<std::string> paths;
+    const std::string value = metadata->value(index);
+    size_t start = 0;
+    for (;;) {
+      size_t end = value.find(',', start);
+      paths.push_back(value.substr(start, end - start));
+      if (end == std::string::npos) {
+        break;
+      }
+      start = end + 1;
+    }
+    return std::unique_ptr<CapnpFieldIds>(new CapnpFieldIds(paths));
+  }
+
+  // Value stored under CAPNP_FIELD_IDS_KEY
+  std::string toString() const {
+    std::string value;
+    for (size_t column = 0; column < paths_.size(); column++) {
+      if (column > 0) {
+        value += ',';
+      }
+      value += paths_[column];
+    }
+    return value;
+  }
+
+  int num_columns() const { return static_cast<int>(paths_.size()); }
+
+  // Dotted ordinal path of a leaf column, empty when it has no id
+  const std::string& path(int column) const { return paths_[column]; }
+
+  // Ordinal of the field `depth` levels below the root on the path of a leaf column
+  bool ordinal(int column, size_t depth, uint16_t* ordinal) const {
+    if ((column < 0) || (column >= num_columns()) || (depth >= ordinals_[column].size())) {
+      return false;
+    }
+    *ordinal = ordinals_[column][depth];
+    return true;
+  }
+
+  // Leaf column of a dotted ordinal path, or -1 when no column has the id
+  int column(const std::string& path) const {
+    auto found = columns_.find(path);
+    return (found != columns_.end()) ? found->second : -1;
+  }
+
+private:
+  std::vector<std::string>             paths_;
+  std::vector<std::vector<uint16_t>>   ordinals_;
+  std::unordered_map<std::string, int> columns_;
+};
+
+// A compiled Cap'n Proto schema together with the Parquet schema that
+// CapnpcParquet generates from it.
+//
+// The schema file is the CodeGeneratorRequest that the capnp compiler hands
+// to its plugins. It can be saved with:
+//
+//   capnp compile -o- file.capnp > file.request
+//
+// The root struct is the struct annotated with $schema, the same struct the
+// capnpc-parquet plugin prints the Parquet schema for.
+//
+class CapnpSchemaFile {
+public:
+  explicit CapnpSchemaFile(const std::string& path) {
+    kj::AutoCloseFd fd(open(path.c_str(), O_RDONLY));
+    KJ_REQUIRE(fd.get() >= 0, "could not open schema file", path);
+
+    ReaderOptions options;
+    options.traversalLimitInWords = CapnpcParquet::TRAVERSAL_LIMIT;
+    StreamFdMessageReader reader(fd.get(), options);
+    const auto& request = reader.getRoot<schema::CodeGeneratorRequest>();
+
+    // Load the nodes first, the generator looks them up while traversing.
+    for (const auto& node : request.getNodes()) {
+      schemaLoader_.load(node);
+    }
+
+    generator_.reset(new CapnpcParquet(schemaLoader_));
+    for (const auto& requestedFile : request.getRequestedFiles()) {
+      const auto& file = schemaLoader_.get(requestedFile.getId());
+      generator_->traverse_file(file, requestedFile);
+    }
+
+    parquet::schema::NodePtr document = generator_->getDocument();
+    KJ_REQUIRE(document != nullptr && document->is_group(),
+               "schema file has no struct annotated with $schema", path);
+
+    schema_ = std::static_pointer_cast<parquet::schema::GroupNode>(document);
+    descr_.Init(schema_);
+    root_ = schemaLoader_.get(generator_->getRootStructId()).asStruct();
+
+    field_ids_.reset(new CapnpFieldIds(generator_->getColumnFieldIds()));
+    column_options_ = generator_->getColumnOptions();
+    writer_options_ = generator_->getWriterOptions();
+    sorting_columns_ = sortingColumns(column_options_);
+    partition_columns_ = partitionColumns(column_options_);
+
+    auto metadata = std::make_shared<::arrow::KeyValueMetadata>();
+    metadata->Append(CAPNP_FIELD_IDS_KEY, field_ids_->toString());
+    appendWriterOptions(writer_options_, metadata.get());
+    if (!sorting_columns_.empty()) {
+      metadata->Append(CAPNP_SORTING_COLUMNS_KEY, formatColumns(sorting_columns_));
+    }
+    if (!partition_columns_.empty()) {
+      metadata->Append(CAPNP_PARTITION_COLUMNS_KEY, formatColumns(partition_columns_));
+    }
+    std::string source_units = formatSourceUnits(column_options_);
+    if (!source_units.empty()) {
+      metadata->Append(CAPNP_SOURCE_UNITS_KEY, source_units);
+    }
+    std::string bloom_filter_fpp = formatBloomFilterFpp(column_options_);
+    if (!bloom_filter_fpp.empty()) {
+      metadata->Append(CAPNP_BLOOM_FILTER_FPP_KEY, bloom_filter_fpp);
+    }
+    metadata_ = metadata;
+  }
+
+  KJ_DISALLOW_COPY(CapnpSchemaFile);
+
+  // Cap'n Proto struct the Parquet schema was generated from
+  capnp::StructSchema root() const { return root_; }
+
+  // Parquet schema generated by CapnpcParquet
+  std::shared_ptr<parquet::schema::GroupNode> parquetSchema() const { return schema_; }
+
+  // Leaf columns of the Parquet schema
+  const parquet::SchemaDescriptor* descr() const { return &descr_; }
+
+  // Cap'n Proto field ids of the leaf columns
+  const CapnpFieldIds& fieldIds() const { return *field_ids_; }
+
+  // Writer settings of the leaf columns, from the field annotations
+  const std::vector<ParquetColumnOptions>& columnOptions() const { return column_options_; }
+
+  // Row group and page sizes, from the annotations of the root struct
+  const ParquetWriterOptions& writerOptions() const { return writer_options_; }
+
+  // Leaf columns the rows of a row group are sorted by, from the $sortKey annotations
+  const std::vector<int>& sortingColumns() const { return sorting_columns_; }
+
+  // Leaf columns that name the partition directories, from the $partitionKey annotations
+  const std::vector<int>& partitionColumns() const { return partition_columns_; }
+
+  // Key/value metadata written to the footer of files with this schema
+  std::shared_ptr<const ::arrow::KeyValueMetadata> metadata() const { return metadata_; }
+
+  CapnpcParquet& generator() const { return *generator_; }
+
+private:
+  capnp::SchemaLoader                              schemaLoader_;
+  std::unique_ptr<CapnpcParquet>                   generator_;
+  std::shared_ptr<parquet::schema::GroupNode>      schema_;
+  parquet::SchemaDescriptor                        descr_;
+  capnp::StructSchema                              root_;
+  std::unique_ptr<CapnpFieldIds>                   field_ids_;
+  std::vector<ParquetColumnOptions>                column_options_;
+  ParquetWriterOptions                             writer_options_;
+  std::vector<int>                                 sorting_columns_;
+  std::vector<int>                                 partition_columns_;
+  std::shared_ptr<const ::arrow::KeyValueMetadata> metadata_;
+};
+
+// A Cap'n Proto value and the Parquet node it is stored in.
+//
+// The tree mirrors the Parquet schema: Cap'n Proto fields are matched to
+// Parquet nodes by field id when the file has them (see CapnpFieldIds),
+// otherwise by name (convertCamelCase). Struct and group fields map to
+// groups and List fields map to the repeated node of a 2- or 3-level LIST
+// group. A struct with a union also has its discriminant column (see
+// UNION_DISCRIMINANT_NAME) among its children.
+//
+// Definition and repetition levels follow the Dremel encoding used by Parquet.
+//
+struct CapnpFieldNode {
+  enum Kind {
+    STRUCT,
+    LIST,
+    LEAF,
+    DISCRIMINANT,
+    UNMAPPED
+  };
+
+  CapnpFieldNode()
+  : kind(UNMAPPED), node(nullptr), has_field(false), def_level(0), rep_level(0),
+    element_def_level(0), element_rep_level(0), is_map(false), column(-1), first_column(0), last_column(0) {}
+
+  Kind                              kind;
+  const parquet::schema::Node*      node;               // Parquet node the value is stored in
+  bool                              has_field;          // reached through a struct field
+  capnp::StructSchema::Field        field;
+  capnp::Type                       type;               // Cap'n Proto type of the value, DISCRIMINANT: the struct
+  int16_t                           def_level;          // definition level when the value is non-null
+  int16_t                           rep_level;          // repetition level of the innermost enclosing list
+  int16_t                           element_def_level;  // LIST: definition level when the list has an element
+  int16_t                           element_rep_level;  // LIST: repetition level of the second and later elements
+  bool                              is_map;             // LIST: a MAP whose element holds a key leaf and a value
+  int                               column;             // LEAF, DISCRIMINANT: column index in the schema descriptor
+  int                               first_column;       // leaf columns below this node are
+  int                               last_column;        // [first_column, last_column)
+  std::string                       path;               // dotted Cap'n Proto field path
+  std::vector<CapnpFieldNode>       children;           // STRUCT: fields, LIST: the element
+
+  bool is_leaf() const { return kind == LEAF; }
+  bool is_mapped() const { return kind != UNMAPPED; }
+};
+
+inline bool isUnionMember(capnp::StructSchema::Field field) {
+  return field.getProto().getDiscriminantValue() != capnp::schema::Field::NO_DISCRIMINANT;
+}
+
+// Maps the leaf columns of a Parquet schema to Cap'n Proto field paths of a root struct.
+//
+// With `field_ids`, fields are found by ordinal, so renamed fields still map
+// to the columns written under their old names. The ids are only used while
+// the map is built. `source_units` are the units of the Cap'n Proto values of
+// the columns, see sourceUnitsFromMetadata().
+class CapnpColumnMap {
+public:
+  CapnpColumnMap(capnp::StructSchema root, const parquet::SchemaDescriptor* descr,
+                 const CapnpFieldIds* field_ids = nullptr,
+                 const std::vector<int64_t>& source_units = std::vector<int64_t>())
+  : descr_(descr), field_ids_(field_ids), source_units_(source_units), next_column_(0), group_depth_(0) {
+    // Ids of another schema are ignored
+    if ((field_ids_ != nullptr) && (field_ids_->num_columns() != descr->num_columns())) {
+      field_ids_ = nullptr;
+    }
+
+    root_.kind = CapnpFieldNode::STRUCT;
+    root_.node = descr->group_node();
+    root_.type = capnp::Type(root);
+    buildStruct(root_, descr->group_node(), root, 0, 0, "");
+    field_ids_ = nullptr;
+
+    leaves_.resize(descr->num_columns(), nullptr);
+    indexLeaves(root_);
+    source_units_.resize(descr->num_columns(), 0);
+  }
+
+  KJ_DISALLOW_COPY(CapnpColumnMap);
+
+  const CapnpFieldNode& root() const { return root_; }
+
+  const parquet::SchemaDescriptor* descr() const { return descr_; }
+
+  int num_columns() const { return static_cast<int>(leaves_.size()); }
+
+  // Tree node of a leaf column, or nullptr when the column has no Cap'n Proto field
+  const CapnpFieldNode* leaf(int column) const { return leaves_[column]; }
+
+  // Unit of the Cap'n Proto values of a date, time or timestamp column, 0
+  // when they are in the column's unit
+  int64_t sourceUnit(int column) const { return source_units_[column]; }
+
+  // Find the tree node of a dotted Cap'n Proto field path (e.g. "specialMeals.value").
+  const CapnpFieldNode* find(const std::string& path) const {
+    return find(root_, path);
+  }
+
+  // Leaf columns needed to rebuild the given Cap'n Proto field paths.
+  // An empty list selects every mapped column.
+  std::vector<int> select(const std::vector<std::string>& paths) const {
+    std::vector<bool> selected(leaves_.size(), false);
+
+    if (paths.empty()) {
+      for (size_t i = 0; i < leaves_.size(); i++) {
+        selected[i] = (leaves_[i] != nullptr);
+      }
+    }
+
+    for (const auto& path : paths) {
+      const CapnpFieldNode* node = find(path);
+      KJ_REQUIRE(node != nullptr && node->is_mapped(),
+                 "field is not stored in the Parquet schema", path);
+      for (int i = node->first_column; i < node->last_column; i++) {
+        selected[i] = (leaves_[i] != nullptr);
+      }
+    }
+
+    std::vector<int> columns;
+    for (size_t i = 0; i < selected.size(); i++) {
+      if (selected[i]) {
+        columns.push_back(static_cast<int>(i));
+      }
+    }
+    return columns;
+  }
+
+private:
+  const parquet::SchemaDescriptor* descr_;
+  const CapnpFieldIds*             field_ids_;
+  std::vector<int64_t>             source_units_;
+  CapnpFieldNode                   root_;
+  std::vector<const CapnpFieldNode*> leaves_;
+  int                              next_column_;
+  size_t                           group_depth_;  // groups on the field path being built
+
+  static int16_t definedLevel(const parquet::schema::Node* node, int16_t level) {
+    return node->is_required() ? level : static_cast<int16_t>(level + 1);
+  }
+
+  static int16_t repeatedLevel(const parquet::schema::Node* node, int16_t level) {
+    return node->is_repeated() ? static_cast<int16_t>(level + 1) : level;
+  }
+
+  static const parquet::schema::GroupNode* asGroup(const parquet::schema::Node* node) {
+    return static_cast<const parquet::schema::GroupNode*>(node);
+  }
+
+  static int countLeaves(const parquet::schema::Node* node) {
+    if (node->is_primitive()) {
+      return 1;
+    }
+    int count = 0;
+    const parquet::schema::GroupNode* group = asGroup(node);
+    for (int i = 0; i < group->field_count(); i++) {
+      count += countLeaves(group->field(i).get());
+    }
+    return count;
+  }
+
+  void unmapped(CapnpFieldNode& out) {
+    out.kind = CapnpFieldNode::UNMAPPED;
+    out.children.clear();
+    next_column_ = out.first_column + countLeaves(out.node);
+    out.last_column = next_column_;
+  }
+
+  void buildStruct(CapnpFieldNode& out, const parquet::schema::GroupNode* group,
+                   capnp::StructSchema schema, int16_t def, int16_t rep,
+                   const std::string& prefix) {
+    out.first_column = next_column_;
+
+    for (int i = 0; i < group->field_count(); i++) {
+      const parquet::schema::Node* child = group->field(i).get();
+
+      CapnpFieldNode value;
+      value.node = child;
+      value.first_column = next_column_;
+      value.def_level = definedLevel(child, def);
+      value.rep_level = repeatedLevel(child, rep);
+
+      capnp::StructSchema::Field field;
+      bool found = findField(schema, child, prefix, &field);
+
+      if (found) {
+        value.has_field = true;
+        value.field = field;
+        value.type = field.getType();
+        value.path = prefix + field.getProto().getName().cStr();
+        buildValue(value, child, def, rep);
+      } else if (isDiscriminant(schema, child)) {
+        value.kind = CapnpFieldNode::DISCRIMINANT;
+        value.type = capnp::Type(schema);
+        value.column = next_column_++;
+        value.last_column = next_column_;
+      } else {
+        unmapped(value);
+      }
+
+      out.children.push_back(std::move(value));
+    }
+
+    out.last_column = next_column_;
+  }
+
+  // Find the field of `schema` stored in `child`, by the ordinal of its first
+  // leaf column when there are field ids, otherwise by name.
+  bool findField(capnp::StructSchema schema, const parquet::schema::Node* child,
+                 const std::string& prefix, capnp::StructSchema::Field* out) const {
+    auto fields = schema.getFields();
+
+    // Every struct level of the field path ends the prefix with a dot.
+    // Groups have no ordinal, the ids of their fields skip them.
+    uint16_t ordinal = 0;
+    size_t depth = std::count(prefix.begin(), prefix.end(), '.') - group_depth_;
+    if ((field_ids_ != nullptr) && field_ids_->ordinal(next_column_, depth, &ordinal)) {
+      // Fields are usually declared in ordinal order
+      if ((ordinal < fields.size()) && hasOrdinal(fields[ordinal], ordinal)) {
+        *out = fields[ordinal];
+        return true;
+      }
+      for (auto field : fields) {
+        if (hasOrdinal(field, ordinal) ||
+            (field.getProto().isGroup() && groupHasOrdinal(field.getType().asStruct(), ordinal))) {
+          *out = field;
+          return true;
+        }
+      }
+      return false;
+    }
+
+    for (auto field : fields) {
+      if ((field.getProto().isSlot() || child->is_group()) &&
+          (convertCamelCase(field.getProto().getName().cStr()) == child->name())) {
+        *out = field;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  static bool hasOrdinal(capnp::StructSchema::Field field, uint16_t ordinal) {
+    auto proto = field.getProto();
+    return proto.isSlot() && proto.getOrdinal().isExplicit() &&
+           (proto.getOrdinal().getExplicit() == ordinal);
+  }
+
+  // Ordinals are unique in a struct, its groups included
+  static bool groupHasOrdinal(capnp::StructSchema group, uint16_t ordinal) {
+    for (auto field : group.getFields()) {
+      if (hasOrdinal(field, ordinal) ||
+          (field.getProto().isGroup() && groupHasOrdinal(field.getType().asStruct(), ordinal))) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // The discriminant column of the union of `schema` (see CapnpcParquet)
+  static bool isDiscriminant(capnp::StructSchema schema, const parquet::schema::Node* child) {
+    return child->is_primitive() && (child->name() == UNION_DISCRIMINANT_NAME) &&
+           (schema.getUnionFields().size() > 0);
+  }
+
+  // `def` and `rep` are the levels of the parent of `node`.
+  void buildValue(CapnpFieldNode& out, const parquet::schema::Node* node,
+                  int16_t def, int16_t rep) {
+    out.first_column = next_column_;
+
+    switch (out.type.which()) {
+      case capnp::schema::Type::STRUCT: {
+        if (!node->is_group()) {
+          unmapped(out);
+          return;
+        }
+        out.kind = CapnpFieldNode::STRUCT;
+        size_t group = (out.has_field && out.field.getProto().isGroup()) ? 1 : 0;
+        group_depth_ += group;
+        buildStruct(out, asGroup(node), out.type.asStruct(),
+                    out.def_level, out.rep_level, out.path + ".");
+        group_depth_ -= group;
+        return;
+      }
+      case capnp::schema::Type::LIST:
+        buildList(out, node, def, rep);
+        return;
+      case capnp::schema::Type::INTERFACE:
+      case capnp::schema::Type::ANY_POINTER:
+        // Not represented in Parquet
+        unmapped(out);
+        return;
+      default:
+        if (!node->is_primitive()) {
+          unmapped(out);
+          return;
+        }
+        out.kind = CapnpFieldNode::LEAF;
+        out.column = next_column_++;
+        out.last_column = next_column_;
+        return;
+    }
+  }
+
+  // Lists are stored in the repeated node of a LIST group:
+  //
+  //   <list-repetition> group <name> (LIST) {    // 3-level (standard mode)
+  //     repeated group list {
+  //       <element-repetition> <element-type> element;
+  //     }
+  //   }
+  //
+  //   <list-repetition> group <name> (LIST) {    // 2-level (legacy mode)
+  //     repeated <element-type> array;
+  //   }
+  //
+  void buildList(CapnpFieldNode& out, const parquet::schema::Node* node,
+                 int16_t def, int16_t rep) {
+    const parquet::schema::Node* repeated = node;
+    int16_t element_def = out.def_level;
+    int16_t element_rep = out.rep_level;
+
+    if (node->is_repeated()) {
+      // The list itself is repeated: a null list is stored as an empty list.
+      out.def_level = def;
+    }
+
+    while (!repeated->is_repeated()) {
+      if (!repeated->is_group() || (asGroup(repeated)->field_count() != 1)) {
+        unmapped(out);
+        return;
+      }
+      repeated = asGroup(repeated)->field(0).get();
+      element_def = definedLevel(repeated, element_def);
+      element_rep = repeatedLevel(repeated, element_rep);
+    }
+
+    out.kind = CapnpFieldNode::LIST;
+    out.element_def_level = element_def;
+    out.element_rep_level = element_rep;
+
+    CapnpFieldNode element;
+    element.type = out.type.asList().getElementType();
+    element.path = out.path;
+    element.def_level = element_def;
+    element.rep_level = element_rep;
+    element.node = repeated;
+
+    // 3-level lists wrap the element in a single child of the repeated group,
+    // unless the repeated group itself holds the fields of a struct element.
+    if (repeated->is_group() && (asGroup(repeated)->field_count() == 1)) {
+      const parquet::schema::Node* child = asGroup(repeated)->field(0).get();
+      bool struct_fields = false;
+      if (element.type.isStruct()) {
+        for (auto field : element.type.asStruct().getFields()) {
+          if (convertCamelCase(field.getProto().getName().cStr()) == child->name()) {
+            struct_fields = true;
+          }
+        }
+      }
+      if (!struct_fields) {
+        element.node = child;
+        element.def_level = definedLevel(child, element_def);
+        element.rep_level = repeatedLevel(child, element_rep);
+      }
+    }
+
+    buildValue(element, element.node, element_def, element_rep);
+    out.is_map = isMap(node, element);
+
+    out.children.clear();
+    out.children.push_back(std::move(element));
+    out.last_column = next_column_;
+  }
+
+  //   <map-repetition> group <name> (MAP) {
+  //     repeated group key_value {
+  //       required <key-type> key;
+  //       <value-repetition> <value-type> value;
+  //     }
+  //   }
+  static bool isMap(const parquet::schema::Node* node, const CapnpFieldNode& element) {
+    if ((node->logical_type() != parquet::LogicalType::MAP) &&
+        (node->logical_type() != parquet::LogicalType::MAP_KEY_VALUE)) {
+      return false;
+    }
+    return (element.kind == CapnpFieldNode::STRUCT) && (element.children.size() == 2) &&
+           element.children[0].is_leaf() && (element.children[0].node->name() == MAP_KEY_NAME) &&
+           element.children[1].has_field;
+  }
+
+  void indexLeaves(const CapnpFieldNode& node) {
+    if ((node.kind == CapnpFieldNode::LEAF) || (node.kind == CapnpFieldNode::DISCRIMINANT)) {
+      leaves_[node.column] = &node;
+    }
+    for (const auto& child : node.children) {
+      indexLeaves(child);
+    }
+  }
+
+  static const CapnpFieldNode* find(const CapnpFieldNode& node, const std::string& path) {
+    for (const auto& child : node.children) {
+      if (child.has_field) {
+        if (child.path == path) {
+          return &child;
+        }
+        if ((path.size() > child.path.size()) &&
+            (path.compare(0, child.path.size(), child.path) == 0) &&
+            (path[child.path.size()] == '.')) {
+          return find(child, path);
+        }
+      } else if (child.kind == CapnpFieldNode::STRUCT || child.kind == CapnpFieldNode::LIST) {
+        // List elements share the path of their list
+        const CapnpFieldNode* found = find(child, path);
+        if (found != nullptr) {
+          return found;
+        }
+      }
+    }
+    return nullptr;
+  }
+};
+
+};  // namespace capnpparquet
+
+#endif  // _CAPNPSCHEMA_H_
@@ -0,0 +1,283 @@
+/*
+ * Copyright 2017 Rene Sugar
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * @file capnpsort.h
+ * @author Rene Sugar <rene.sugar@gmail.com>
+ * @brief Sort the rows of a row group by the columns annotated with $sortKey.
+ */
+#ifndef _CAPNPSORT_H_
+#define _CAPNPSORT_H_
+
+#include <capnp/dynamic.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "capnp2parquet.h"
+
+namespace capnpparquet {
+
+// Fields from the root struct to a scalar leaf column that is not inside a
+// list. `annotation` names the annotation that selected the column in errors.
+inline std::vector<const CapnpFieldNode*> scalarColumnPath(const CapnpColumnMap& map, int column,
+                                                           const char* annotation) {
+  std::vector<const CapnpFieldNode*> path;
+  const CapnpFieldNode* node = &map.root();
+  while (!node->is_leaf()) {
+    KJ_REQUIRE(node->kind == CapnpFieldNode::STRUCT, "column is inside a list", annotation, map.leaf(column)->path);
+    const CapnpFieldNode* next = nullptr;
+    for (const auto& child : node->children) {
+      if ((column >= child.first_column) && (column < child.last_column)) {
+        next = &child;
+        break;
+      }
+    }
+    KJ_REQUIRE((next != nullptr) && next->has_field, "column has no Cap'n Proto field", annotation, column);
+    path.push_back(next);
+    node = next;
+  }
+
+  capnp::schema::Type::Which type = node->type.which();
+  KJ_REQUIRE((type != capnp::schema::Type::LIST) && (type != capnp::schema::Type::STRUCT),
+             "only applies to scalar fields", annotation, node->path);
+  return path;
+}
+
+// Value of the column at the end of `path` in `row`. Returns false when the
+// column is null: a field on the way is not set or not the active union member.
+inline bool scalarColumnValue(capnp::DynamicStruct::Reader row, const std::vector<const CapnpFieldNode*>& path,
+                              capnp::DynamicValue::Reader* value) {
+  for (size_t depth = 0; depth + 1 < path.size(); depth++) {
+    if (!hasCapnpField(row, path[depth]->field)) {
+      return false;
+    }
+    row = row.get(path[depth]->field).as<capnp::DynamicStruct>();
+  }
+  if (!hasCapnpField(row, path.back()->field)) {
+    return false;
+  }
+  *value = row.get(path.back()->field);
+  return true;
+}
+
+// Orders the messages of a row group by its sort columns, ascending with
+// nulls first. Ties keep their input order.
+//
+// Each sort value is reduced to a 64-bit key that compares like the value:
+// integers with the sign bit flipped, floating point numbers with the IEEE
+// bit trick, Text and Data by their first 8 bytes (big-endian). When every
+// sort column is fixed width the keys are the whole value and the rows are
+// ordered with an LSD radix sort. Otherwise rows are compared on the keys
+// and only equal prefixes fall back to comparing the bytes.
+//
+// order() keeps its keys on the stack, one sorter can serve several threads.
+//
+class CapnpRowSorter {
+public:
+  CapnpRowSorter(const CapnpColumnMap& map, const std::vector<int>& columns) {
+    for (int column : columns) {
+      SortColumn sort;
+      sort.path = scalarColumnPath(map, column, "$sortKey");
+      capnp::schema::Type::Which type = sort.path.back()->type.which();
+      sort.is_bytes = (type == capnp::schema::Type::TEXT) || (type == capnp::schema::Type::DATA);
+      columns_.push_back(sort);
+    }
+  }
+
+  KJ_DISALLOW_COPY(CapnpRowSorter);
+
+  bool enabled() const { return !columns_.empty(); }
+
+  // Positions of `rows` in sorted order
+  std::vector<uint32_t> order(const std::vector<capnp::DynamicStruct::Reader>& rows) const {
+    size_t count = rows.size();
+    std::vector<uint32_t> positions(count);
+    for (size_t i = 0; i < count; i++) {
+      positions[i] = static_cast<uint32_t>(i);
+    }
+    if (columns_.empty() || (count < 2)) {
+      return positions;
+    }
+
+    bool has_bytes = false;
+    std::vector<SortKeys> keys(columns_.size());
+    for (size_t i = 0; i < columns_.size(); i++) {
+      extractKeys(columns_[i], rows, keys[i]);
+      has_bytes = has_bytes || columns_[i].is_bytes;
+    }
+
+    if (!has_bytes) {
+      // Least significant column first, each pass is stable
+      std::vector<uint32_t> scratch(count);
+      for (auto column = keys.rbegin(); column != keys.rend(); ++column) {
+        radixSort(column->keys, positions, scratch);
+        nullsFirst(column->nulls, positions, scratch);
+      }
+    } else {
+      std::stable_sort(positions.begin(), positions.end(),
+                       [&keys](uint32_t a, uint32_t b) { return compare(keys, a, b) < 0; });
+    }
+
+    return positions;
+  }
+
+private:
+  struct SortColumn {
+    SortColumn() : is_bytes(false) {}
+
+    std::vector<const CapnpFieldNode*> path;   // fields from the root struct to the column
+    bool                               is_bytes;
+  };
+
+  // Keys of one sort column, by row
+  struct SortKeys {
+    std::vector<uint64_t>                     keys;
+    std::vector<uint8_t>                      nulls;
+    std::vector<kj::ArrayPtr<const kj::byte>> bytes;  // Text and Data values
+  };
+
+  std::vector<SortColumn> columns_;
+
+  static uint64_t bytesKey(kj::ArrayPtr<const kj::byte> bytes) {
+    uint64_t key = 0;
+    for (size_t i = 0; i < 8; i++) {
+      key = (key << 8) | ((i < bytes.size()) ? bytes[i] : 0);
+    }
+    return key;
+  }
+
+  static uint64_t valueKey(const capnp::DynamicValue::Reader& value) {
+    switch (value.getType()) {
+      case capnp::DynamicValue::BOOL:
+        return value.as<bool>() ? 1 : 0;
+      case capnp::DynamicValue::INT:
+        return static_cast<uint64_t>(value.as<int64_t>()) ^ (uint64_t(1) << 63);
+      case capnp::DynamicValue::UINT:
+        return value.as<uint64_t>();
+      case capnp::DynamicValue::FLOAT: {
+        double d = value.as<double>();
+        uint64_t bits;
+        memcpy(&bits, &d, sizeof(bits));
+        return ((bits >> 63) != 0) ? ~bits : (bits | (uint64_t(1) << 63));
+      }
+      case capnp::DynamicValue::ENUM:
+        return value.as<capnp::DynamicEnum>().getRaw();
+      default:
+        KJ_FAIL_REQUIRE("unsupported $sortKey type", static_cast<int>(value.getType()));
+    }
+  }
+
+  static void extractKeys(const SortColumn& column, const std::vector<capnp::DynamicStruct::Reader>& rows,
+                          SortKeys& keys) {
+    size_t count = rows.size();
+    keys.keys.assign(count, 0);
+    keys.nulls.assign(count, 0);
+    keys.bytes.assign(column.is_bytes ? count : 0, kj::ArrayPtr<const kj::byte>());
+
+    for (size_t i = 0; i < count; i++) {
+      capnp::DynamicValue::Reader value;
+      if (!scalarColumnValue(rows[i], column.path, &value)) {
+        keys.nulls[i] = 1;
+        continue;
+      }
+
+      if (column.is_bytes) {
+        if (value.getType() == capnp::DynamicValue::TEXT) {
+          keys.bytes[i] = value.as<capnp::Text>().asBytes();
+        } else {
+          keys.bytes[i] = value.as<capnp::Data>();
+        }
+        keys.keys[i] = bytesKey(keys.bytes[i]);
+      } else {
+        keys.keys[i] = valueKey(value);
+      }
+    }
+  }
+
+  // Stable LSD radix sort of `positions` by `keys`, one byte per pass.
+  // Passes where every key has the same byte are skipped.
+  static void radixSort(const std::vector<uint64_t>& keys, std::vector<uint32_t>& positions,
+                        std::vector<uint32_t>& scratch) {
+    size_t count = positions.size();
+    scratch.resize(count);
+
+    for (int shift = 0; shift < 64; shift += 8) {
+      size_t histogram[257] = {0};
+      for (size_t i = 0; i < count; i++) {
+        histogram[((keys[positions[i]] >> shift) & 0xff) + 1]++;
+      }
+      if (histogram[((keys[positions[0]] >> shift) & 0xff) + 1] == count) {
+        continue;
+      }
+      for (int digit = 0; digit < 256; digit++) {
+        histogram[digit + 1] += histogram[digit];
+      }
+      for (size_t i = 0; i < count; i++) {
+        uint32_t position = positions[i];
+        scratch[histogram[(keys[position] >> shift) & 0xff]++] = position;
+      }
+      positions.swap(scratch);
+    }
+  }
+
+  static void nullsFirst(const std::vector<uint8_t>& nulls, std::vector<uint32_t>& positions,
+                         std::vector<uint32_t>& scratch) {
+    scratch.clear();
+    size_t out = 0;
+    for (uint32_t position : positions) {
+      if (nulls[position] != 0) {
+        positions[out++] = position;
+      } else {
+        scratch.push_back(position);
+      }
+    }
+    std::copy(scratch.begin(), scratch.end(), positions.begin() + out);
+  }
+
+  static int compare(const std::vector<SortKeys>& columns, uint32_t a, uint32_t b) {
+    for (const auto& column : columns) {
+      if (column.nulls[a] != column.nulls[b]) {
+        return (column.nulls[a] != 0) ? -1 : 1;
+      }
+      if (column.nulls[a] != 0) {
+        continue;
+      }
+      if (column.keys[a] != column.keys[b]) {
+        return (column.keys[a] < column.keys[b]) ? -1 : 1;
+      }
+      if (!column.bytes.empty()) {
+        const kj::ArrayPtr<const kj::byte>& x = column.bytes[a];
+        const kj::ArrayPtr<const kj::byte>& y = column.bytes[b];
+        size_t length = std::min(x.size(), y.size());
+        int result = (length > 0) ? memcmp(x.begin(), y.begin(), length) : 0;
+        if (result != 0) {
+          return result;
+        }
+        if (x.size() != y.size()) {
+          return (x.size() < y.size()) ? -1 : 1;
+        }
+      }
+    }
+    return 0;
+  }
+};
+
+};  // namespace capnpparquet
+
+#endif  // _CAPNPSORT_H_
@@ -0,0 +1,268 @@
+/*
+ * Copyright 2017 Rene Sugar
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * @file capnpstats.h
+ * @author Rene Sugar <rene.sugar@gmail.com>
+ * @brief Min, max and null count kernels of the numeric physical types.
+ */
+#ifndef _CAPNPSTATS_H_
+#define _CAPNPSTATS_H_
+
+#include <cstdint>
+#include <limits>
+
+#include "capnpcpu.h"
+
+namespace capnpparquet {
+
+// The AVX2 kernels take 8 (32-bit) or 4 (64-bit) values at a time and are
+// picked at run time (see capnpcpu.h). The scalar loops that finish them, and
+// that run without AVX2, have no branches so compilers can still vectorize
+// them.
+//
+// UINT_* columns order unsigned: their values are compared with the sign bit
+// flipped, which maps the unsigned order onto the signed one.
+
+inline int64_t countNullsScalar(const int16_t* def_levels, int64_t count, int16_t max_def) {
+  int64_t nulls = 0;
+  for (int64_t i = 0; i < count; i++) {
+    nulls += (def_levels[i] < max_def) ? 1 : 0;
+  }
+  return nulls;
+}
+
+// Running min and max of values[begin, end), flipped by `flip`
+template <typename T>
+inline void minMaxFlipped(const T* values, int64_t begin, int64_t end, T flip, T* lo, T* hi) {
+  for (int64_t i = begin; i < end; i++) {
+    T v = values[i] ^ flip;
+    *lo = (v < *lo) ? v : *lo;
+    *hi = (v > *hi) ? v : *hi;
+  }
+}
+
+// Running min and max of values[begin, end), NaN left out
+template <typename T>
+inline void minMaxFloating(const T* values, int64_t begin, int64_t end, T* lo, T* hi) {
+  for (int64_t i = begin; i < end; i++) {
+    T v = values[i];
+    *lo = (v < *lo) ? v : *lo;
+    *hi = (v > *hi) ? v : *hi;
+  }
+}
+
+template <typename T>
+inline void minMaxScalar(const T* values, int64_t count, T flip, T* lo, T* hi) {
+  minMaxFlipped(values, 0, count, flip, lo, hi);
+}
+
+inline void minMaxScalar(const float* values, int64_t count, float* lo, float* hi) {
+  minMaxFloating(values, 0, count, lo, hi);
+}
+
+inline void minMaxScalar(const double* values, int64_t count, double* lo, double* hi) {
+  minMaxFloating(values, 0, count, lo, hi);
+}
+
+#ifdef CAPNPPARQUET_X86_KERNELS
+CAPNPPARQUET_TARGET("avx2")
+inline int64_t countNullsAvx2(const int16_t* def_levels, int64_t count, int16_t max_def) {
+  int64_t nulls = 0;
+  int64_t i = 0;
+  const __m256i max = _mm256_set1_epi16(max_def);
+  for (; i + 16 <= count; i += 16) {
+    __m256i levels = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(def_levels + i));
+    // Two mask bits per 16-bit lane
+    nulls += __builtin_popcount(_mm256_movemask_epi8(_mm256_cmpgt_epi16(max, levels))) / 2;
+  }
+  return nulls + countNullsScalar(def_levels + i, count - i, max_def);
+}
+
+CAPNPPARQUET_TARGET("avx2")
+inline void minMaxAvx2(const int32_t* values, int64_t count, int32_t flip, int32_t* lo, int32_t* hi) {
+  int64_t i = 0;
+  if (count >= 8) {
+    const __m256i flips = _mm256_set1_epi32(flip);
+    __m256i los = _mm256_set1_epi32(*lo);
+    __m256i his = _mm256_set1_epi32(*hi);
+    for (; i + 8 <= count; i += 8) {
+      __m256i v = _mm256_xor_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(values + i)), flips);
+      los = _mm256_min_epi32(los, v);
+      his = _mm256_max_epi32(his, v);
+    }
+    int32_t lanes[8];
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(lanes), los);
+    for (int lane = 0; lane < 8; lane++) {
+      *lo = (lanes[lane] < *lo) ? lanes[lane] : *lo;
+    }
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(lanes), his);
+    for (int lane = 0; lane < 8; lane++) {
+      *hi = (lanes[lane] > *hi) ? lanes[lane] : *hi;
+    }
+  }
+  minMaxFlipped(values, i, count, flip, lo, hi);
+}
+
+CAPNPPARQUET_TARGET("avx2")
+inline void minMaxAvx2(const int64_t* values, int64_t count, int64_t flip, int64_t* lo, int64_t* hi) {
+  int64_t i = 0;
+  if (count >= 4) {
+    // No 64-bit min/max before AVX-512, compare and blend instead
+    const __m256i flips = _mm256_set1_epi64x(flip);
+    __m256i los = _mm256_set1_epi64x(*lo);
+    __m256i his = _mm256_set1_epi64x(*hi);
+    for (; i + 4 <= count; i += 4) {
+      __m256i v = _mm256_xor_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(values + i)), flips);
+      los = _mm256_blendv_epi8(los, v, _mm256_cmpgt_epi64(los, v));
+      his = _mm256_blendv_epi8(his, v, _mm256_cmpgt_epi64(v, his));
+    }
+    int64_t lanes[4];
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(lanes), los);
+    for (int lane = 0; lane < 4; lane++) {
+      *lo = (lanes[lane] < *lo) ? lanes[lane] : *lo;
+    }
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(lanes), his);
+    for (int lane = 0; lane < 4; lane++) {
+      *hi = (lanes[lane] > *hi) ? lanes[lane] : *hi;
+    }
+  }
+  minMaxFlipped(values, i, count, flip, lo, hi);
+}
+
+// The AVX min/max instructions return their second operand, the running min
+// or max, when either operand is NaN.
+CAPNPPARQUET_TARGET("avx2")
+inline void minMaxAvx2(const float* values, int64_t count, float* lo, float* hi) {
+  int64_t i = 0;
+  if (count >= 8) {
+    __m256 los = _mm256_set1_ps(*lo);
+    __m256 his = _mm256_set1_ps(*hi);
+    for (; i + 8 <= count; i += 8) {
+      __m256 v = _mm256_loadu_ps(values + i);
+      los = _mm256_min_ps(v, los);
+      his = _mm256_max_ps(v, his);
+    }
+    float lanes[8];
+    _mm256_storeu_ps(lanes, los);
+    for (int lane = 0; lane < 8; lane++) {
+      *lo = (lanes[lane] < *lo) ? lanes[lane] : *lo;
+    }
+    _mm256_storeu_ps(lanes, his);
+    for (int lane = 0; lane < 8; lane++) {
+      *hi = (lanes[lane] > *hi) ? lanes[lane] : *hi;
+    }
+  }
+  minMaxFloating(values, i, count, lo, hi);
+}
+
+CAPNPPARQUET_TARGET("avx2")
+inline void minMaxAvx2(const double* values, int64_t count, double* lo, double* hi) {
+  int64_t i = 0;
+  if (count >= 4) {
+    __m256d los = _mm256_set1_pd(*lo);
+    __m256d his = _mm256_set1_pd(*hi);
+    for (; i + 4 <= count; i += 4) {
+      __m256d v = _mm256_loadu_pd(values + i);
+      los = _mm256_min_pd(v, los);
+      his = _mm256_max_pd(v, his);
+    }
+    double lanes[4];
+    _mm256_storeu_pd(lanes, los);
+    for (int lane = 0; lane < 4; lane++) {
+      *lo = (lanes[lane] < *lo) ? lanes[lane] : *lo;
+    }
+    _mm256_storeu_pd(lanes, his);
+    for (int lane = 0; lane < 4; lane++) {
+      *hi = (lanes[lane] > *hi) ? lanes[lane] : *hi;
+    }
+  }
+  minMaxFloating(values, i, count, lo, hi);
+}
+#endif
+
+// Number of definition levels below `max_def`, the nulls of a column
+inline int64_t countNulls(const int16_t* def_levels, int64_t count, int16_t max_def) {
+#ifdef CAPNPPARQUET_X86_KERNELS
+  if (cpuHasAvx2()) {
+    return countNullsAvx2(def_levels, count, max_def);
+  }
+#endif
+  return countNullsScalar(def_levels, count, max_def);
+}
+
+// Min and max of `count` values. Returns false when there are none.
+template <typename T>
+inline bool minMaxIntegers(const T* values, int64_t count, bool is_unsigned, T* min, T* max) {
+  if (count == 0) {
+    return false;
+  }
+  const T flip = is_unsigned ? std::numeric_limits<T>::min() : 0;
+  T lo = std::numeric_limits<T>::max();
+  T hi = std::numeric_limits<T>::min();
+#ifdef CAPNPPARQUET_X86_KERNELS
+  if (cpuHasAvx2()) {
+    minMaxAvx2(values, count, flip, &lo, &hi);
+  } else {
+    minMaxScalar(values, count, flip, &lo, &hi);
+  }
+#else
+  minMaxScalar(values, count, flip, &lo, &hi);
+#endif
+  *min = lo ^ flip;
+  *max = hi ^ flip;
+  return true;
+}
+
+inline bool minMaxValues(const int32_t* values, int64_t count, bool is_unsigned, int32_t* min, int32_t* max) {
+  return minMaxIntegers(values, count, is_unsigned, min, max);
+}
+
+inline bool minMaxValues(const int64_t* values, int64_t count, bool is_unsigned, int64_t* min, int64_t* max) {
+  return minMaxIntegers(values, count, is_unsigned, min, max);
+}
+
+// NaN is left out: a comparison with NaN is false. Returns false when every
+// value is NaN.
+template <typename T>
+inline bool minMaxFloatingValues(const T* values, int64_t count, T* min, T* max) {
+  T lo = std::numeric_limits<T>::infinity();
+  T hi = -std::numeric_limits<T>::infinity();
+#ifdef CAPNPPARQUET_X86_KERNELS
+  if (cpuHasAvx2()) {
+    minMaxAvx2(values, count, &lo, &hi);
+  } else {
+    minMaxScalar(values, count, &lo, &hi);
+  }
+#else
+  minMaxScalar(values, count, &lo, &hi);
+#endif
+  *min = lo;
+  *max = hi;
+  return lo <= hi;
+}
+
+inline bool minMaxValues(const float* values, int64_t count, float* min, float* max) {
+  return minMaxFloatingValues(values, count, min, max);
+}
+
+inline bool minMaxValues(const double* values, int64_t count, double* min, double* max) {
+  return minMaxFloatingValues(values, count, min, max);
+}
+
+};  // namespace capnpparquet
+
+#endif  // _CAPNPSTATS_H_
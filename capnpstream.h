@@ -0,0 +1,294 @@
+/*
+ * Copyright 2017 Rene Sugar
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * @file capnpstream.h
+ * @author Rene Sugar <rene.sugar@gmail.com>
+ * @brief Read framed Cap'n Proto messages from a pipe or a growing file as they arrive.
+ */
+#ifndef _CAPNPSTREAM_H_
+#define _CAPNPSTREAM_H_
+
+#include <errno.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <capnp/common.h>
+
+#include <kj/array.h>
+#include <kj/common.h>
+#include <kj/debug.h>
+
+#include <cstring>
+#include <vector>
+
+#include "capnppacked.h"
+
+namespace capnpparquet {
+
+// Reads messages in the Cap'n Proto stream framing (segment table followed by
+// segments) from a file descriptor without blocking longer than a timeout.
+//
+// StreamFdMessageReader blocks until a whole message is read, which would keep
+// a converter from closing its output file while the producer is idle. Here
+// input is buffered as it arrives and complete messages are taken with next().
+//
+// With `follow` set, the end of a regular file is not the end of input: more
+// messages are expected to be appended to it (like tail -f).
+//
+// Packed streams (capnp::writePackedMessage) are detected from their first
+// word, or set with `encoding`. Each read is unpacked as a whole into the same
+// buffer the messages are framed from, words split by a read are kept packed
+// until the rest arrives (see capnppacked.h).
+//
+// A first word that reads both ways (see guessStreamEncoding()) is taken as
+// packed until the first message is framed. When its segment table is
+// invalid or its first segment empty, or the input ends first, the stream is
+// read again unpacked from its first byte.
+//
+class CapnpMessageStream {
+public:
+  static const size_t READ_SIZE = 64 * 1024;
+  static const int FOLLOW_INTERVAL_MS = 100;   // polling interval at the end of a followed file
+  static const uint32_t MAX_SEGMENTS = 512;    // same limit as InputStreamMessageReader
+
+  enum Encoding {
+    DETECT,
+    UNPACKED,
+    PACKED
+  };
+
+  explicit CapnpMessageStream(int fd, bool follow = false, Encoding encoding = DETECT)
+  : fd_(fd), follow_(follow), eof_(false), encoding_(encoding), tentative_(false), begin_(0) {
+    struct stat info;
+    KJ_SYSCALL(fstat(fd, &info));
+    regular_ = S_ISREG(info.st_mode);
+  }
+
+  KJ_DISALLOW_COPY(CapnpMessageStream);
+
+  // Wait up to `timeout_ms` (-1: no limit) for more input and buffer it.
+  // Returns false at the end of input. A signal ends the wait early.
+  bool wait(int timeout_ms) {
+    if (eof_) {
+      return false;
+    }
+
+    if (!regular_) {
+      struct pollfd pfd;
+      pfd.fd = fd_;
+      pfd.events = POLLIN;
+      pfd.revents = 0;
+
+      int ready = poll(&pfd, 1, timeout_ms);
+      if (ready < 0) {
+        if (errno == EINTR) {
+          return true;
+        }
+        KJ_FAIL_SYSCALL("poll", errno);
+      }
+      if (ready == 0) {
+        return true;
+      }
+    }
+
+    ssize_t n = fill();
+    if (n > 0) {
+      return true;
+    }
+    if (n < 0) {
+      // Interrupted by a signal
+      return true;
+    }
+
+    if (regular_ && follow_) {
+      // Regular files always poll readable, wait for the writer to append
+      int interval = FOLLOW_INTERVAL_MS;
+      if ((timeout_ms >= 0) && (timeout_ms < interval)) {
+        interval = timeout_ms;
+      }
+      usleep(interval * 1000);
+      return true;
+    }
+
+    if (tentative_ && (buffered() > 0)) {
+      // Not a packed message, frame what was read as it is
+      fallBack();
+      return true;
+    }
+
+    eof_ = true;
+    KJ_REQUIRE(buffered() == 0, "input ended in the middle of a message");
+    return false;
+  }
+
+  // Take the next complete buffered message. Returns an empty array when none is buffered.
+  kj::Array<capnp::word> next() {
+    size_t size = 0;
+    if (!complete(&size)) {
+      return nullptr;
+    }
+
+    auto message = kj::heapArray<capnp::word>(size / sizeof(capnp::word));
+    memcpy(message.begin(), bytes_.data() + begin_, size);
+    begin_ += size;
+
+    if (tentative_) {
+      // The first message framed: the stream is packed
+      tentative_ = false;
+      std::vector<uint8_t>().swap(raw_);
+    }
+
+    // Drop consumed bytes once they outweigh the rest of the buffer
+    if (begin_ > (bytes_.size() / 2)) {
+      bytes_.erase(bytes_.begin(), bytes_.begin() + begin_);
+      begin_ = 0;
+    }
+    return message;
+  }
+
+  bool eof() const { return eof_; }
+
+  // Bytes buffered but not yet taken as a message
+  size_t buffered() const { return (bytes_.size() - begin_) + packed_.size(); }
+
+  bool packed() const { return encoding_ == PACKED; }
+
+private:
+  int                  fd_;
+  bool                 follow_;
+  bool                 regular_;
+  bool                 eof_;
+  Encoding             encoding_;
+  bool                 tentative_;  // PACKED, unless the first message says otherwise
+  std::vector<uint8_t> bytes_;
+  size_t               begin_;
+  std::vector<uint8_t> packed_;   // packed input not yet unpacked to bytes_
+  std::vector<uint8_t> raw_;      // input as read, while tentative_
+
+  ssize_t fill() {
+    std::vector<uint8_t>& input = (encoding_ == UNPACKED) ? bytes_ : packed_;
+    size_t end = input.size();
+    input.resize(end + READ_SIZE);
+
+    ssize_t n = read(fd_, input.data() + end, READ_SIZE);
+    if (n < 0) {
+      input.resize(end);
+      if (errno == EINTR || errno == EAGAIN) {
+        return -1;
+      }
+      KJ_FAIL_SYSCALL("read", errno);
+    }
+
+    input.resize(end + n);
+    if (tentative_) {
+      raw_.insert(raw_.end(), input.begin() + end, input.end());
+    }
+    if (encoding_ == DETECT) {
+      if (packed_.size() < 4) {
+        return n;
+      }
+      StreamEncodingGuess guess = guessStreamEncoding(packed_.data(), MAX_SEGMENTS);
+      encoding_ = (guess == UNPACKED_STREAM) ? UNPACKED : PACKED;
+      if (encoding_ == UNPACKED) {
+        bytes_.swap(packed_);
+        return n;
+      }
+      if (guess == EITHER_STREAM) {
+        tentative_ = true;
+        raw_ = packed_;
+      }
+    }
+    if (encoding_ == PACKED) {
+      unpack();
+    }
+    return n;
+  }
+
+  // Unpack the whole words of packed_ to the end of bytes_
+  void unpack() {
+    size_t unpacked = 0;
+    size_t consumed = packedWords(packed_.data(), packed_.size(), &unpacked);
+    if (consumed == 0) {
+      return;
+    }
+
+    size_t end = bytes_.size();
+    bytes_.resize(end + unpacked);
+    unpackWords(packed_.data(), consumed, bytes_.data() + end);
+    packed_.erase(packed_.begin(), packed_.begin() + consumed);
+  }
+
+  static uint32_t readWord32(const uint8_t* p) {
+    // Segment tables are little-endian
+    return static_cast<uint32_t>(p[0]) | (static_cast<uint32_t>(p[1]) << 8) |
+           (static_cast<uint32_t>(p[2]) << 16) | (static_cast<uint32_t>(p[3]) << 24);
+  }
+
+  // Read the input again unpacked, from its first byte
+  void fallBack() {
+    KJ_REQUIRE(begin_ == 0, "a message was taken from the packed input");
+    encoding_ = UNPACKED;
+    tentative_ = false;
+    bytes_.swap(raw_);
+    std::vector<uint8_t>().swap(raw_);
+    std::vector<uint8_t>().swap(packed_);
+  }
+
+  // Is a whole message buffered? `size` is set to its size in bytes.
+  bool complete(size_t* size) {
+    // Only unpacked bytes: packed_ may end inside a word of the message
+    const uint8_t* p = bytes_.data() + begin_;
+    size_t available = bytes_.size() - begin_;
+
+    if (available < 4) {
+      return false;
+    }
+
+    uint32_t segments = readWord32(p) + 1;
+    if (tentative_) {
+      // Messages have at most MAX_SEGMENTS segments, and a root pointer in the first
+      bool empty = (available >= 8) && (readWord32(p + 4) == 0);
+      if ((segments == 0) || (segments > MAX_SEGMENTS) || empty) {
+        fallBack();
+        return complete(size);
+      }
+    }
+    KJ_REQUIRE((segments > 0) && (segments <= MAX_SEGMENTS), "message has too many segments", segments);
+
+    // The segment table is padded to a whole word
+    size_t header = ((4 + (segments * 4)) + 7) & ~static_cast<size_t>(7);
+    if (available < header) {
+      return false;
+    }
+
+    size_t total = header;
+    for (uint32_t i = 0; i < segments; i++) {
+      total += static_cast<size_t>(readWord32(p + 4 + (i * 4))) * sizeof(capnp::word);
+    }
+    if (available < total) {
+      return false;
+    }
+
+    *size = total;
+    return true;
+  }
+};
+
+};  // namespace capnpparquet
+
+#endif  // _CAPNPSTREAM_H_
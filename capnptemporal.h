@@ -0,0 +1,193 @@
+/*
+ * Copyright 2017 Rene Sugar
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * @file capnptemporal.h
+ * @author Rene Sugar <rene.sugar@gmail.com>
+ * @brief Unit conversion kernels of DATE, TIME and TIMESTAMP columns.
+ */
+#ifndef _CAPNPTEMPORAL_H_
+#define _CAPNPTEMPORAL_H_
+
+#include <parquet/types.h>
+
+#include <cstdint>
+#include <limits>
+#include <string>
+
+namespace capnpparquet {
+
+// Units are counted in nanoseconds per unit, 0 is no unit
+static const int64_t TEMPORAL_NANOS = 1;
+static const int64_t TEMPORAL_MICROS = 1000;
+static const int64_t TEMPORAL_MILLIS = 1000000;
+static const int64_t TEMPORAL_SECONDS = 1000000000;
+static const int64_t TEMPORAL_DAYS = 86400 * TEMPORAL_SECONDS;
+
+// Unit of a $sourceUnit name: "d", "s", "ms", "us" or "ns". 0 for other names.
+inline int64_t temporalUnit(const std::string& name) {
+  if (name == "d") {
+    return TEMPORAL_DAYS;
+  } else if (name == "s") {
+    return TEMPORAL_SECONDS;
+  } else if (name == "ms") {
+    return TEMPORAL_MILLIS;
+  } else if (name == "us") {
+    return TEMPORAL_MICROS;
+  } else if (name == "ns") {
+    return TEMPORAL_NANOS;
+  }
+  return 0;
+}
+
+// Unit of a DATE, TIME_* or TIMESTAMP_* column, 0 for other columns
+inline int64_t temporalColumnUnit(parquet::LogicalType::type type) {
+  switch (type) {
+    case parquet::LogicalType::DATE:
+      return TEMPORAL_DAYS;
+    case parquet::LogicalType::TIME_MILLIS:
+    case parquet::LogicalType::TIMESTAMP_MILLIS:
+      return TEMPORAL_MILLIS;
+    case parquet::LogicalType::TIME_MICROS:
+    case parquet::LogicalType::TIMESTAMP_MICROS:
+      return TEMPORAL_MICROS;
+    default:
+      return 0;
+  }
+}
+
+// Values a column of `type` stored in `physical` holds: times of day are
+// below 24 hours, other values fit the physical type.
+inline void temporalColumnRange(parquet::LogicalType::type type, parquet::Type::type physical,
+                                int64_t* min, int64_t* max) {
+  if (physical == parquet::Type::INT32) {
+    *min = std::numeric_limits<int32_t>::min();
+    *max = std::numeric_limits<int32_t>::max();
+  } else {
+    *min = std::numeric_limits<int64_t>::min();
+    *max = std::numeric_limits<int64_t>::max();
+  }
+  if ((type == parquet::LogicalType::TIME_MILLIS) || (type == parquet::LogicalType::TIME_MICROS)) {
+    *min = 0;
+    *max = (TEMPORAL_DAYS / temporalColumnUnit(type)) - 1;
+  }
+}
+
+// Convert one value between units. Coarser units round down, so times
+// before the epoch land on the unit they fall in. Returns false when the
+// result is outside [min, max].
+inline bool convertTemporalValue(int64_t value, int64_t from, int64_t to, int64_t min, int64_t max,
+                                 int64_t* converted) {
+  if (from >= to) {
+    int64_t factor = from / to;
+    if ((value < min / factor) || (value > max / factor)) {
+      return false;
+    }
+    *converted = value * factor;
+  } else {
+    int64_t factor = to / from;
+    int64_t quotient = (value / factor) - (((value % factor) < 0) ? 1 : 0);
+    if ((quotient < min) || (quotient > max)) {
+      return false;
+    }
+    *converted = quotient;
+  }
+  return true;
+}
+
+// The batch kernels take the factor between the units as a template
+// argument for the usual ones, which lets compilers replace the division by
+// a multiplication and vectorize the loops. FACTOR 0 takes `factor` instead.
+// They have no branches and only report whether every value was in range.
+
+template <int64_t FACTOR>
+inline bool scaleUpTemporal(const int64_t* values, int64_t count, int64_t factor, int64_t min, int64_t max,
+                            int64_t* converted) {
+  const int64_t f = (FACTOR != 0) ? FACTOR : factor;
+  // Truncation rounds the bounds toward zero, inside [min, max]
+  const int64_t low = min / f;
+  const int64_t high = max / f;
+  bool fits = true;
+  for (int64_t i = 0; i < count; i++) {
+    int64_t value = values[i];
+    fits = fits & (value >= low) & (value <= high);
+    converted[i] = static_cast<int64_t>(static_cast<uint64_t>(value) * static_cast<uint64_t>(f));
+  }
+  return fits;
+}
+
+template <int64_t FACTOR>
+inline bool scaleDownTemporal(const int64_t* values, int64_t count, int64_t factor, int64_t min, int64_t max,
+                              int64_t* converted) {
+  const int64_t f = (FACTOR != 0) ? FACTOR : factor;
+  bool fits = true;
+  for (int64_t i = 0; i < count; i++) {
+    int64_t value = values[i];
+    int64_t quotient = (value / f) - static_cast<int64_t>((value % f) < 0);
+    fits = fits & (quotient >= min) & (quotient <= max);
+    converted[i] = quotient;
+  }
+  return fits;
+}
+
+// Convert `count` values from unit `from` to unit `to`. Returns the position
+// of the first value outside [min, max] once converted, or `count` when all
+// are inside.
+inline int64_t convertTemporal(const int64_t* values, int64_t count, int64_t from, int64_t to,
+                               int64_t min, int64_t max, int64_t* converted) {
+  bool fits = true;
+  if (from >= to) {
+    int64_t factor = from / to;
+    switch (factor) {
+      case 1:              fits = scaleUpTemporal<1>(values, count, factor, min, max, converted); break;
+      case 1000:           fits = scaleUpTemporal<1000>(values, count, factor, min, max, converted); break;
+      case 1000000:        fits = scaleUpTemporal<1000000>(values, count, factor, min, max, converted); break;
+      case 1000000000:     fits = scaleUpTemporal<1000000000>(values, count, factor, min, max, converted); break;
+      case 86400:          fits = scaleUpTemporal<86400>(values, count, factor, min, max, converted); break;
+      case 86400000:       fits = scaleUpTemporal<86400000>(values, count, factor, min, max, converted); break;
+      case 86400000000:    fits = scaleUpTemporal<86400000000>(values, count, factor, min, max, converted); break;
+      case 86400000000000: fits = scaleUpTemporal<86400000000000>(values, count, factor, min, max, converted); break;
+      default:             fits = scaleUpTemporal<0>(values, count, factor, min, max, converted); break;
+    }
+  } else {
+    int64_t factor = to / from;
+    switch (factor) {
+      case 1000:           fits = scaleDownTemporal<1000>(values, count, factor, min, max, converted); break;
+      case 1000000:        fits = scaleDownTemporal<1000000>(values, count, factor, min, max, converted); break;
+      case 1000000000:     fits = scaleDownTemporal<1000000000>(values, count, factor, min, max, converted); break;
+      case 86400:          fits = scaleDownTemporal<86400>(values, count, factor, min, max, converted); break;
+      case 86400000:       fits = scaleDownTemporal<86400000>(values, count, factor, min, max, converted); break;
+      case 86400000000:    fits = scaleDownTemporal<86400000000>(values, count, factor, min, max, converted); break;
+      case 86400000000000: fits = scaleDownTemporal<86400000000000>(values, count, factor, min, max, converted); break;
+      default:             fits = scaleDownTemporal<0>(values, count, factor, min, max, converted); break;
+    }
+  }
+  if (fits) {
+    return count;
+  }
+
+  for (int64_t i = 0; i < count; i++) {
+    int64_t value;
+    if (!convertTemporalValue(values[i], from, to, min, max, &value)) {
+      return i;
+    }
+  }
+  return count;
+}
+
+};  // namespace capnpparquet
+
+#endif  // _CAPNPTEMPORAL_H_
@@ -0,0 +1,180 @@
+/*
+ * Copyright 2017 Rene Sugar
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ *
+ * @file compactparquet.cpp
+ * @author Rene Sugar <rene.sugar@gmail.com>
+ * @brief Merge small Parquet files written with a compiled Cap'n Proto schema into one file.
+ */
+
+#include <stdio.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdlib>
+#include <exception>
+#include <iomanip>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+#include "capnpcompact.h"
+
+// Merges the Parquet files written by capnp2parquet for a $schema struct
+// into one file:
+//
+//   capnp compile -o- file.capnp > file.request
+//   compactparquet --schema file.request --output merged.parquet out/*.parquet
+//
+// Large row groups that match the output's column settings are copied
+// without being decoded, the others are merged and written again (see
+// ParquetCompactor). The file is written as <output>.tmp and renamed once
+// its footer is written.
+//
+
+class CompactParquetMain {
+public:
+  explicit CompactParquetMain(kj::ProcessContext& context)
+  : context(context) {
+    options.threads = std::max<int64_t>(1, std::thread::hardware_concurrency());
+  }
+
+  kj::MainFunc getMain() {
+    return kj::MainBuilder(context, "compactparquet",
+                           "Merges Parquet files with the schema of the $schema struct into one file, "
+                           "copying the column chunks that need not be written again.")
+        .addOptionWithArg({'s', "schema"}, KJ_BIND_METHOD(*this, setSchema), "<request>",
+                          "CodeGeneratorRequest of the schema (capnp compile -o- file.capnp).")
+        .addOptionWithArg({'o', "output"}, KJ_BIND_METHOD(*this, setOutput), "<file>",
+                          "Parquet file to write.")
+        .addOptionWithArg("threads", KJ_BIND_METHOD(*this, setThreads), "<n>",
+                          "Threads writing merged row groups. Default: number of cores")
+        .addOptionWithArg("row-group-rows", KJ_BIND_METHOD(*this, setRowGroupRows), "<n>",
+                          "Rows per merged row group. Default: $rowGroupRows of the schema, or 65536")
+        .addOptionWithArg("min-copy-rows", KJ_BIND_METHOD(*this, setMinCopyRows), "<n>",
+                          "Row groups with fewer rows are merged rather than copied. "
+                          "Default: half of --row-group-rows")
+        .expectOneOrMoreArgs("<file>", KJ_BIND_METHOD(*this, addInput))
+        .callAfterParsing(KJ_BIND_METHOD(*this, run))
+        .build();
+  }
+
+private:
+  kj::ProcessContext&           context;
+  std::string                   schemaPath;
+  std::string                   outputPath;
+  std::vector<std::string>      inputs;
+  capnpparquet::CompactOptions  options;
+
+  kj::MainBuilder::Validity setSchema(kj::StringPtr path) {
+    schemaPath = path.cStr();
+    return true;
+  }
+
+  kj::MainBuilder::Validity setOutput(kj::StringPtr path) {
+    outputPath = path.cStr();
+    return true;
+  }
+
+  static kj::MainBuilder::Validity parseNumber(kj::StringPtr text, int64_t* number) {
+    char* end = nullptr;
+    long long value = strtoll(text.cStr(), &end, 10);
+    if ((end == text.cStr()) || (*end != '\0') || (value < 1)) {
+      return "expected a positive number";
+    }
+    *number = value;
+    return true;
+  }
+
+  kj::MainBuilder::Validity setThreads(kj::StringPtr text) {
+    return parseNumber(text, &options.threads);
+  }
+
+  kj::MainBuilder::Validity setRowGroupRows(kj::StringPtr text) {
+    return parseNumber(text, &options.row_group_rows);
+  }
+
+  kj::MainBuilder::Validity setMinCopyRows(kj::StringPtr text) {
+    return parseNumber(text, &options.min_copy_rows);
+  }
+
+  kj::MainBuilder::Validity addInput(kj::StringPtr path) {
+    inputs.push_back(path.cStr());
+    return true;
+  }
+
+  kj::MainBuilder::Validity run() {
+    if (schemaPath.empty()) {
+      return "--schema is required";
+    }
+    if (outputPath.empty()) {
+      return "--output is required";
+    }
+    for (const auto& input : inputs) {
+      if (input == outputPath) {
+        return kj::str("--output is also an input: ", input.c_str());
+      }
+    }
+
+    capnpparquet::CapnpSchemaFile schema(schemaPath);
+
+    parquet::WriterProperties::Builder builder;
+    capnpparquet::applyWriterOptions(builder, schema.writerOptions());
+    std::shared_ptr<parquet::WriterProperties> properties;
+    try {
+      for (const auto& warning : capnpparquet::applyColumnOptions(builder, schema.descr(), schema.columnOptions())) {
+        std::cerr << warning << std::endl;
+      }
+      properties = builder.build();
+    } catch (const std::exception& e) {
+      return kj::str("Parquet schema error: ", e.what());
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    std::string tempPath = outputPath + ".tmp";
+    std::unique_ptr<capnpparquet::ParquetCompactor> compactor;
+
+    try {
+      compactor.reset(new capnpparquet::ParquetCompactor(schema, properties, options));
+      compactor->compact(inputs, capnpparquet::openFileSink(tempPath));
+    } catch (const std::exception& e) {
+      unlink(tempPath.c_str());
+      return kj::str("Parquet compaction error: ", e.what());
+    }
+
+    if (rename(tempPath.c_str(), outputPath.c_str()) != 0) {
+      return kj::str("cannot rename ", tempPath.c_str(), " to ", outputPath.c_str());
+    }
+
+    int64_t bytes = 0;
+    struct stat info;
+    if (stat(outputPath.c_str(), &info) == 0) {
+      bytes = info.st_size;
+    }
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cerr << compactor->rows() << " rows from " << inputs.size() << " files, "
+              << compactor->row_groups_copied() << " row groups copied, "
+              << compactor->row_groups_merged() << " merged, "
+              << compactor->row_groups_written() << " written, " << bytes << " bytes, "
+              << std::fixed << std::setprecision(1) << seconds << " s" << std::endl;
+    return true;
+  }
+};
+
+KJ_MAIN(CompactParquetMain);
@@ -0,0 +1,135 @@
+/*
+ * Copyright 2017 Rene Sugar
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ *
+ * @file parquet2capnp.cpp
+ * @author Rene Sugar <rene.sugar@gmail.com>
+ * @brief Read a Parquet file and write Cap'n Proto messages of the root struct.
+ */
+
+#include <unistd.h>
+
+#include <capnp/serialize.h>
+#include <capnp/serialize-packed.h>
+
+#include "parquet2capnp.h"
+
+// Reads a Parquet file written with a capnpc-parquet schema and writes one
+// Cap'n Proto message per row to standard output.
+//
+//   capnp compile -o- file.capnp > file.request
+//   parquet2capnp --schema file.request --fields id,name file.parquet > file.bin
+//   parquet2capnp --schema file.request --where "timestamp >= 2017-06-01" file.parquet > file.bin
+//
+
+class Parquet2CapnpMain {
+public:
+  explicit Parquet2CapnpMain(kj::ProcessContext& context): context(context), packed(false) {}
+
+  kj::MainFunc getMain() {
+    return kj::MainBuilder(context, "parquet2capnp",
+                           "Reads <file> and writes a Cap'n Proto message of the $schema "
+                           "struct for each row to standard output.")
+        .addOptionWithArg({'s', "schema"}, KJ_BIND_METHOD(*this, setSchema), "<request>",
+                          "CodeGeneratorRequest of the schema (capnp compile -o- file.capnp).")
+        .addOptionWithArg({'f', "fields"}, KJ_BIND_METHOD(*this, setFields), "<paths>",
+                          "Comma separated Cap'n Proto field paths to read. Default: all fields.")
+        .addOptionWithArg({'w', "where"}, KJ_BIND_METHOD(*this, addPredicate), "<predicate>",
+                          "Only write rows where <predicate> holds, e.g. \"id = 42\", \"id in (1, 2)\" "
+                          "or \"timestamp between 2017-06-01 and 2017-06-02\". May be repeated.")
+        .addOption({'p', "packed"}, KJ_BIND_METHOD(*this, setPacked),
+                   "Write messages with the packed encoding.")
+        .expectArg("<file>", KJ_BIND_METHOD(*this, run))
+        .build();
+  }
+
+private:
+  kj::ProcessContext&      context;
+  std::string              schemaPath;
+  std::vector<std::string> fields;
+  std::vector<capnpparquet::CapnpPredicate> predicates;
+  bool                     packed;
+
+  kj::MainBuilder::Validity setSchema(kj::StringPtr path) {
+    schemaPath = path.cStr();
+    return true;
+  }
+
+  kj::MainBuilder::Validity setFields(kj::StringPtr paths) {
+    std::string list(paths.cStr());
+    size_t start = 0;
+    while (start <= list.size()) {
+      size_t end = list.find(',', start);
+      if (end == std::string::npos) {
+        end = list.size();
+      }
+      if (end > start) {
+        fields.push_back(list.substr(start, end - start));
+      }
+      start = end + 1;
+    }
+    return true;
+  }
+
+  kj::MainBuilder::Validity addPredicate(kj::StringPtr text) {
+    KJ_IF_MAYBE(exception, kj::runCatchingExceptions([&]() {
+      predicates.push_back(capnpparquet::parsePredicate(text.cStr()));
+    })) {
+      return kj::str("invalid predicate: ", text);
+    }
+    return true;
+  }
+
+  kj::MainBuilder::Validity setPacked() {
+    packed = true;
+    return true;
+  }
+
+  kj::MainBuilder::Validity run(kj::StringPtr path) {
+    if (schemaPath.empty()) {
+      return "--schema is required";
+    }
+
+    capnpparquet::CapnpSchemaFile schema(schemaPath);
+
+    kj::FdOutputStream rawOutput(STDOUT_FILENO);
+    kj::BufferedOutputStreamWrapper output(rawOutput);
+
+    try {
+      capnpparquet::ParquetCapnpReader reader(schema.root(), path.cStr(), fields, predicates);
+
+      for (;;) {
+        capnp::MallocMessageBuilder message;
+        if (!reader.next(message)) {
+          break;
+        }
+        if (packed) {
+          capnp::writePackedMessage(output, message);
+        } else {
+          capnp::writeMessage(output, message);
+        }
+      }
+    } catch (const std::exception& e) {
+      return kj::str("Parquet read error: ", e.what());
+    }
+
+    output.flush();
+    return true;
+  }
+};
+
+KJ_MAIN(Parquet2CapnpMain);
@@ -0,0 +1,952 @@
+/*
+ * Copyright 2017 Rene Sugar
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * @file parquet2capnp.h
+ * @author Rene Sugar <rene.sugar@gmail.com>
+ * @brief Rebuild Cap'n Proto messages from a Parquet file written with a capnpc-parquet schema.
+ */
+#ifndef _PARQUET2CAPNP_H_
+#define _PARQUET2CAPNP_H_
+
+#include <arrow/io/file.h>
+
+#include <parquet/api/reader.h>
+
+#include <capnp/dynamic.h>
+#include <capnp/message.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "capnpfilter.h"
+#include "capnpschema.h"
+#include "capnptemporal.h"
+
+namespace capnpparquet {
+
+// A place a value is assembled into: a field of a struct or an element of a list.
+class CapnpSlot {
+public:
+  CapnpSlot(capnp::DynamicStruct::Builder parent, capnp::StructSchema::Field field)
+  : struct_(parent), field_(field), index_(0), is_element_(false) {}
+
+  CapnpSlot(capnp::DynamicList::Builder parent, uint index)
+  : list_(parent), index_(index), is_element_(true) {}
+
+  void set(const capnp::DynamicValue::Reader& value) {
+    if (is_element_) {
+      list_.set(index_, value);
+    } else {
+      struct_.set(field_, value);
+    }
+  }
+
+  capnp::DynamicStruct::Builder initStruct() {
+    if (is_element_) {
+      // Struct list elements are allocated with the list
+      return list_[index_].as<capnp::DynamicStruct>();
+    }
+    return struct_.init(field_).as<capnp::DynamicStruct>();
+  }
+
+  capnp::DynamicList::Builder initList(uint size) {
+    if (is_element_) {
+      return list_.init(index_, size).as<capnp::DynamicList>();
+    }
+    return struct_.init(field_, size).as<capnp::DynamicList>();
+  }
+
+  void setText(const uint8_t* value, size_t length) {
+    capnp::DynamicValue::Builder text = is_element_ ? list_.init(index_, length)
+                                                    : struct_.init(field_, length);
+    memcpy(text.as<capnp::Text>().begin(), value, length);
+  }
+
+  void setData(const uint8_t* value, size_t length) {
+    set(capnp::Data::Reader(value, length));
+  }
+
+private:
+  capnp::DynamicStruct::Builder struct_;
+  capnp::StructSchema::Field    field_;
+  capnp::DynamicList::Builder   list_;
+  uint                          index_;
+  bool                          is_element_;
+};
+
+// Decode a big-endian two's complement DECIMAL stored in a byte array.
+inline double decodeDecimal(const uint8_t* value, int32_t length, int32_t scale) {
+  bool negative = (length > 0) && ((value[0] & 0x80) != 0);
+  double result = 0.0;
+
+  for (int32_t i = 0; i < length; i++) {
+    uint8_t byte = negative ? static_cast<uint8_t>(~value[i]) : value[i];
+    result = (result * 256.0) + byte;
+  }
+  if (negative) {
+    result = -(result + 1.0);
+  }
+  return result / decimalPowerOfTen(scale);
+}
+
+// Store an integer column value into a Cap'n Proto slot of the leaf's type.
+inline void assignInteger(CapnpSlot& slot, const CapnpFieldNode& leaf,
+                          const parquet::ColumnDescriptor* descr, int64_t value) {
+  switch (leaf.type.which()) {
+    case capnp::schema::Type::BOOL:
+      slot.set(value != 0);
+      break;
+    case capnp::schema::Type::UINT32:
+      // UINT_32 is stored in an INT32 column
+      slot.set(static_cast<uint32_t>(value));
+      break;
+    case capnp::schema::Type::UINT64:
+      slot.set(static_cast<uint64_t>(value));
+      break;
+    case capnp::schema::Type::FLOAT32:
+    case capnp::schema::Type::FLOAT64:
+      if (descr->logical_type() == parquet::LogicalType::DECIMAL) {
+        slot.set(static_cast<double>(value) / decimalPowerOfTen(descr->type_scale()));
+      } else {
+        slot.set(static_cast<double>(value));
+      }
+      break;
+    case capnp::schema::Type::ENUM:
+      slot.set(capnp::DynamicEnum(leaf.type.asEnum(), static_cast<uint16_t>(value)));
+      break;
+    case capnp::schema::Type::VOID:
+      break;
+    default:
+      slot.set(value);
+      break;
+  }
+}
+
+inline void assignValue(CapnpSlot& slot, const CapnpFieldNode& leaf,
+                        const parquet::ColumnDescriptor* descr, bool value) {
+  assignInteger(slot, leaf, descr, value ? 1 : 0);
+}
+
+inline void assignValue(CapnpSlot& slot, const CapnpFieldNode& leaf,
+                        const parquet::ColumnDescriptor* descr, int32_t value) {
+  assignInteger(slot, leaf, descr, value);
+}
+
+inline void assignValue(CapnpSlot& slot, const CapnpFieldNode& leaf,
+                        const parquet::ColumnDescriptor* descr, int64_t value) {
+  assignInteger(slot, leaf, descr, value);
+}
+
+inline void assignValue(CapnpSlot& slot, const CapnpFieldNode& leaf,
+                        const parquet::ColumnDescriptor* descr, float value) {
+  slot.set(value);
+}
+
+inline void assignValue(CapnpSlot& slot, const CapnpFieldNode& leaf,
+                        const parquet::ColumnDescriptor* descr, double value) {
+  slot.set(value);
+}
+
+inline void assignBytes(CapnpSlot& slot, const CapnpFieldNode& leaf,
+                        const parquet::ColumnDescriptor* descr,
+                        const uint8_t* value, int32_t length) {
+  switch (leaf.type.which()) {
+    case capnp::schema::Type::TEXT:
+      slot.setText(value, length);
+      break;
+    case capnp::schema::Type::DATA:
+      slot.setData(value, length);
+      break;
+    case capnp::schema::Type::ENUM: {
+      // Enums are stored as enumerant names, see NOTE(1) in capnpparquet.h
+      std::string name(reinterpret_cast<const char*>(value), length);
+      KJ_IF_MAYBE(enumerant, leaf.type.asEnum().findEnumerantByName(name)) {
+        slot.set(capnp::DynamicEnum(*enumerant));
+      }
+      break;
+    }
+    case capnp::schema::Type::FLOAT32:
+    case capnp::schema::Type::FLOAT64:
+      slot.set(decodeDecimal(value, length, descr->type_scale()));
+      break;
+    case capnp::schema::Type::VOID:
+      break;
+    default:
+      KJ_FAIL_REQUIRE("byte array column cannot be stored in field", leaf.path);
+  }
+}
+
+inline void assignValue(CapnpSlot& slot, const CapnpFieldNode& leaf,
+                        const parquet::ColumnDescriptor* descr, const parquet::ByteArray& value) {
+  assignBytes(slot, leaf, descr, value.ptr, value.len);
+}
+
+inline void assignValue(CapnpSlot& slot, const CapnpFieldNode& leaf,
+                        const parquet::ColumnDescriptor* descr, const parquet::FixedLenByteArray& value) {
+  assignBytes(slot, leaf, descr, value.ptr, descr->type_length());
+}
+
+// Text of a BYTE_ARRAY value, such as a union discriminant. Other values have none.
+template <typename T>
+inline std::string valueText(const T& value) {
+  return std::string();
+}
+
+inline std::string valueText(const parquet::ByteArray& value) {
+  return std::string(reinterpret_cast<const char*>(value.ptr), value.len);
+}
+
+// Byte array values point into the page they were decoded from. Values kept
+// across a ReadBatch call are copied into an arena the cursor owns.
+template <typename DType>
+class ValueArena {
+public:
+  void stabilize(typename DType::c_type* values, int64_t count, int32_t type_length) {}
+};
+
+template <>
+class ValueArena<parquet::ByteArrayType> {
+public:
+  void stabilize(parquet::ByteArray* values, int64_t count, int32_t type_length) {
+    size_t size = 0;
+    for (int64_t i = 0; i < count; i++) {
+      size += values[i].len;
+    }
+    scratch_.resize(size);
+    uint8_t* out = scratch_.data();
+    for (int64_t i = 0; i < count; i++) {
+      memcpy(out, values[i].ptr, values[i].len);
+      values[i].ptr = out;
+      out += values[i].len;
+    }
+    bytes_.swap(scratch_);
+  }
+
+private:
+  std::vector<uint8_t> bytes_;
+  std::vector<uint8_t> scratch_;
+};
+
+template <>
+class ValueArena<parquet::FLBAType> {
+public:
+  void stabilize(parquet::FixedLenByteArray* values, int64_t count, int32_t type_length) {
+    scratch_.resize(count * type_length);
+    uint8_t* out = scratch_.data();
+    for (int64_t i = 0; i < count; i++) {
+      memcpy(out, values[i].ptr, type_length);
+      values[i].ptr = out;
+      out += type_length;
+    }
+    bytes_.swap(scratch_);
+  }
+
+private:
+  std::vector<uint8_t> bytes_;
+  std::vector<uint8_t> scratch_;
+};
+
+// Reads the levels and values of one leaf column of a row group, a row at a time.
+class ColumnCursor {
+public:
+  static const int64_t BATCH_SIZE = 4096;
+
+  ColumnCursor(const CapnpFieldNode* leaf, const parquet::ColumnDescriptor* descr)
+  : leaf_(leaf), descr_(descr),
+    max_def_(descr->max_definition_level()), max_rep_(descr->max_repetition_level()),
+    pos_(0), end_(0), row_end_(0), value_pos_(0), value_end_(0) {}
+
+  virtual ~ColumnCursor() {}
+
+  // Buffer the levels of the row starting at the current entry.
+  // Returns false when the column chunk has no more rows.
+  bool nextRow() {
+    if ((pos_ >= end_) && !fill()) {
+      return false;
+    }
+
+    if (max_rep_ == 0) {
+      row_end_ = pos_ + 1;
+      return true;
+    }
+
+    // The next row starts at the next entry with repetition level 0
+    int64_t ahead = 1;
+    for (;;) {
+      while (pos_ + ahead < end_) {
+        if (rep_levels_[pos_ + ahead] == 0) {
+          row_end_ = pos_ + ahead;
+          return true;
+        }
+        ahead++;
+      }
+      if (!fill()) {
+        row_end_ = end_;
+        return true;
+      }
+    }
+  }
+
+  int16_t def() const { return def_levels_[pos_]; }
+
+  int16_t rep() const { return rep_levels_[pos_]; }
+
+  // Number of elements of the list at `rep_level` whose first element is the current entry.
+  uint32_t countElements(int16_t rep_level) const {
+    uint32_t count = 1;
+    for (int64_t i = pos_ + 1; i < row_end_; i++) {
+      if (rep_levels_[i] < rep_level) {
+        break;
+      }
+      if (rep_levels_[i] == rep_level) {
+        count++;
+      }
+    }
+    return count;
+  }
+
+  // Consume the current entry.
+  void skip() {
+    if (def_levels_[pos_] == max_def_) {
+      value_pos_++;
+    }
+    pos_++;
+  }
+
+  // Consume the remaining entries of the current row.
+  void skipRow() {
+    while (pos_ < row_end_) {
+      skip();
+    }
+  }
+
+  // Consume the next `rows` rows, starting at a row boundary. Rows of a
+  // non-repeated column past the buffered entries are skipped by the column
+  // reader, which skips whole pages without decoding them.
+  void skipRows(int64_t rows) {
+    while ((rows > 0) && ((max_rep_ > 0) || (pos_ < end_))) {
+      if (!nextRow()) {
+        return;
+      }
+      skipRow();
+      rows--;
+    }
+    if (rows > 0) {
+      skipUnbuffered(rows);
+    }
+  }
+
+  // Does the current entry satisfy `predicate`? Nulls never do.
+  virtual bool matches(const ColumnPredicate& predicate) const = 0;
+
+  // Store the current entry into `slot` (unless it is null) and consume it.
+  void assign(CapnpSlot& slot) {
+    if (def_levels_[pos_] == max_def_) {
+      assignCurrent(slot, value_pos_);
+    }
+    skip();
+  }
+
+  // Store the text of the current entry into `text` (unless it is null) and
+  // consume it. Returns false for a null.
+  bool takeText(std::string* text) {
+    bool present = (def_levels_[pos_] == max_def_);
+    if (present) {
+      *text = currentText(value_pos_);
+    }
+    skip();
+    return present;
+  }
+
+  const CapnpFieldNode* leaf() const { return leaf_; }
+
+protected:
+  const CapnpFieldNode*            leaf_;
+  const parquet::ColumnDescriptor* descr_;
+  int16_t                          max_def_;
+  int16_t                          max_rep_;
+
+  std::vector<int16_t>             def_levels_;
+  std::vector<int16_t>             rep_levels_;
+  int64_t                          pos_;        // current entry
+  int64_t                          end_;        // number of buffered entries
+  int64_t                          row_end_;    // first entry of the next row
+  int64_t                          value_pos_;  // value of the current entry
+  int64_t                          value_end_;  // number of buffered values
+
+  virtual bool hasNext() = 0;
+
+  // Skip `rows` levels of a non-repeated column that are not buffered yet.
+  virtual void skipUnbuffered(int64_t rows) = 0;
+
+  // Read up to `batch_size` levels and append their values after value_end_.
+  virtual int64_t readBatch(int64_t batch_size, int16_t* def_levels, int16_t* rep_levels,
+                            int64_t* values_read) = 0;
+
+  // Move the values [value_pos_, value_end_) to the front of the value buffer.
+  virtual void compactValues() = 0;
+
+  virtual void assignCurrent(CapnpSlot& slot, int64_t index) = 0;
+
+  virtual std::string currentText(int64_t index) const = 0;
+
+  // Drop consumed entries and append the next batch. Returns false at the end of the column chunk.
+  bool fill() {
+    if (!hasNext()) {
+      return false;
+    }
+
+    int64_t remaining = end_ - pos_;
+    std::copy(def_levels_.begin() + pos_, def_levels_.begin() + end_, def_levels_.begin());
+    std::copy(rep_levels_.begin() + pos_, rep_levels_.begin() + end_, rep_levels_.begin());
+    row_end_ -= pos_;
+    pos_ = 0;
+    end_ = remaining;
+
+    compactValues();
+    value_end_ -= value_pos_;
+    value_pos_ = 0;
+
+    def_levels_.resize(end_ + BATCH_SIZE);
+    rep_levels_.resize(end_ + BATCH_SIZE);
+
+    int64_t values_read = 0;
+    int64_t levels_read = readBatch(BATCH_SIZE, def_levels_.data() + end_,
+                                    rep_levels_.data() + end_, &values_read);
+
+    // Required and non-repeated columns have no levels to decode
+    if (max_def_ == 0) {
+      std::fill(def_levels_.begin() + end_, def_levels_.begin() + end_ + levels_read, 0);
+    }
+    if (max_rep_ == 0) {
+      std::fill(rep_levels_.begin() + end_, rep_levels_.begin() + end_ + levels_read, 0);
+    }
+
+    end_ += levels_read;
+    value_end_ += values_read;
+    return levels_read > 0;
+  }
+};
+
+template <typename DType>
+class TypedColumnCursor : public ColumnCursor {
+public:
+  typedef typename DType::c_type T;
+
+  TypedColumnCursor(std::shared_ptr<parquet::ColumnReader> reader,
+                    const CapnpFieldNode* leaf, const parquet::ColumnDescriptor* descr)
+  : ColumnCursor(leaf, descr), holder_(reader),
+    reader_(static_cast<parquet::TypedColumnReader<DType>*>(reader.get())), capacity_(0) {}
+
+  bool matches(const ColumnPredicate& predicate) const override {
+    return (def_levels_[pos_] == max_def_) && matchesFilter(predicate, values_[value_pos_]);
+  }
+
+protected:
+  bool hasNext() override { return reader_->HasNext(); }
+
+  void skipUnbuffered(int64_t rows) override { reader_->Skip(rows); }
+
+  int64_t readBatch(int64_t batch_size, int16_t* def_levels, int16_t* rep_levels,
+                    int64_t* values_read) override {
+    reserve(value_end_ + batch_size);
+    int64_t levels = reader_->ReadBatch(batch_size, def_levels, rep_levels,
+                                        values_.get() + value_end_, values_read);
+    arena_.stabilize(values_.get(), value_end_ + *values_read, descr_->type_length());
+    return levels;
+  }
+
+  void compactValues() override {
+    std::copy(values_.get() + value_pos_, values_.get() + value_end_, values_.get());
+  }
+
+  void assignCurrent(CapnpSlot& slot, int64_t index) override {
+    assignValue(slot, *leaf_, descr_, values_[index]);
+  }
+
+  std::string currentText(int64_t index) const override {
+    return valueText(values_[index]);
+  }
+
+  std::shared_ptr<parquet::ColumnReader>  holder_;
+  parquet::TypedColumnReader<DType>*      reader_;
+  std::unique_ptr<T[]>                    values_;    // not std::vector, ReadBatch takes bool*
+  int64_t                                 capacity_;
+  ValueArena<DType>                       arena_;
+
+  void reserve(int64_t capacity) {
+    if (capacity <= capacity_) {
+      return;
+    }
+    std::unique_ptr<T[]> values(new T[capacity]);
+    std::copy(values_.get(), values_.get() + value_end_, values.get());
+    values_.swap(values);
+    capacity_ = capacity;
+  }
+};
+
+// Cursor of a date, time or timestamp column whose Cap'n Proto values are in
+// another unit (see CAPNP_SOURCE_UNITS_KEY). Each batch is converted back to
+// that unit as it is read. Predicates still compare the values of the column.
+template <typename DType>
+class TemporalColumnCursor : public TypedColumnCursor<DType> {
+public:
+  TemporalColumnCursor(std::shared_ptr<parquet::ColumnReader> reader,
+                       const CapnpFieldNode* leaf, const parquet::ColumnDescriptor* descr, int64_t source_unit)
+  : TypedColumnCursor<DType>(reader, leaf, descr),
+    unit_(temporalColumnUnit(descr->logical_type())), source_unit_(source_unit) {}
+
+protected:
+  int64_t              unit_;
+  int64_t              source_unit_;
+  std::vector<int64_t> batch_;      // values of the last batch, widened
+  std::vector<int64_t> converted_;  // buffered values in the source unit
+
+  int64_t readBatch(int64_t batch_size, int16_t* def_levels, int16_t* rep_levels,
+                    int64_t* values_read) override {
+    int64_t levels = TypedColumnCursor<DType>::readBatch(batch_size, def_levels, rep_levels, values_read);
+
+    int64_t begin = this->value_end_;
+    batch_.assign(this->values_.get() + begin, this->values_.get() + begin + *values_read);
+    converted_.resize(begin + *values_read);
+    int64_t fits = convertTemporal(batch_.data(), *values_read, unit_, source_unit_,
+                                   std::numeric_limits<int64_t>::min(), std::numeric_limits<int64_t>::max(),
+                                   converted_.data() + begin);
+    KJ_REQUIRE(fits == *values_read, "value is out of the range of its field", this->leaf_->path);
+    return levels;
+  }
+
+  void compactValues() override {
+    TypedColumnCursor<DType>::compactValues();
+    converted_.erase(converted_.begin(), converted_.begin() + this->value_pos_);
+  }
+
+  void assignCurrent(CapnpSlot& slot, int64_t index) override {
+    assignValue(slot, *this->leaf_, this->descr_, converted_[index]);
+  }
+};
+
+inline std::unique_ptr<ColumnCursor> makeColumnCursor(std::shared_ptr<parquet::ColumnReader> reader,
+                                                      const CapnpFieldNode* leaf,
+                                                      const parquet::ColumnDescriptor* descr,
+                                                      int64_t source_unit = 0) {
+  if ((source_unit != 0) && (temporalColumnUnit(descr->logical_type()) != 0)) {
+    switch (descr->physical_type()) {
+      case parquet::Type::INT32:
+        return std::unique_ptr<ColumnCursor>(
+            new TemporalColumnCursor<parquet::Int32Type>(reader, leaf, descr, source_unit));
+      case parquet::Type::INT64:
+        return std::unique_ptr<ColumnCursor>(
+            new TemporalColumnCursor<parquet::Int64Type>(reader, leaf, descr, source_unit));
+      default:
+        break;
+    }
+  }
+
+  switch (descr->physical_type()) {
+    case parquet::Type::BOOLEAN:
+      return std::unique_ptr<ColumnCursor>(new TypedColumnCursor<parquet::BooleanType>(reader, leaf, descr));
+    case parquet::Type::INT32:
+      return std::unique_ptr<ColumnCursor>(new TypedColumnCursor<parquet::Int32Type>(reader, leaf, descr));
+    case parquet::Type::INT64:
+      return std::unique_ptr<ColumnCursor>(new TypedColumnCursor<parquet::Int64Type>(reader, leaf, descr));
+    case parquet::Type::FLOAT:
+      return std::unique_ptr<ColumnCursor>(new TypedColumnCursor<parquet::FloatType>(reader, leaf, descr));
+    case parquet::Type::DOUBLE:
+      return std::unique_ptr<ColumnCursor>(new TypedColumnCursor<parquet::DoubleType>(reader, leaf, descr));
+    case parquet::Type::BYTE_ARRAY:
+      return std::unique_ptr<ColumnCursor>(new TypedColumnCursor<parquet::ByteArrayType>(reader, leaf, descr));
+    case parquet::Type::FIXED_LEN_BYTE_ARRAY:
+      return std::unique_ptr<ColumnCursor>(new TypedColumnCursor<parquet::FLBAType>(reader, leaf, descr));
+    default:
+      KJ_FAIL_REQUIRE("unsupported Parquet physical type", leaf->path);
+  }
+}
+
+// Reads a Parquet file a row at a time and rebuilds each row as a message of
+// the Cap'n Proto root struct.
+//
+// Only the leaf columns of the requested field paths are read; other fields
+// of the rebuilt messages are left unset.
+//
+// Rows that do not satisfy every predicate are skipped. Row groups whose
+// column statistics or Bloom filters rule out a predicate are skipped
+// without being read, and so are the row ranges of a row group whose page
+// index (see ColumnPageIndex) rules one out.
+//
+class ParquetCapnpReader {
+public:
+  ParquetCapnpReader(capnp::StructSchema root, const std::string& path,
+                     const std::vector<std::string>& fields = std::vector<std::string>(),
+                     const std::vector<CapnpPredicate>& predicates = std::vector<CapnpPredicate>())
+  : root_(root), path_(path),
+    file_(parquet::ParquetFileReader::OpenFile(path)),
+    metadata_(file_->metadata()),
+    field_ids_(CapnpFieldIds::fromMetadata(metadata_->key_value_metadata())),
+    map_(root, metadata_->schema(), field_ids_.get(),
+         sourceUnitsFromMetadata(metadata_->key_value_metadata(), metadata_->schema()->num_columns())),
+    columns_(map_.select(fields)),
+    cursors_(map_.num_columns()),
+    row_group_(-1), end_row_group_(metadata_->num_row_groups()), row_group_rows_(0), row_(0), rows_read_(0),
+    rows_skipped_(0), row_groups_skipped_(0), range_rows_(0), ranges_skipped_(0) {
+    for (const auto& predicate : predicates) {
+      predicates_.push_back(bindPredicate(predicate, map_));
+
+      // Predicate columns outside the projection are read but not assembled
+      int column = predicates_.back().column;
+      if ((std::find(columns_.begin(), columns_.end(), column) == columns_.end()) &&
+          (std::find(filter_columns_.begin(), filter_columns_.end(), column) == filter_columns_.end())) {
+        filter_columns_.push_back(column);
+      }
+    }
+    filter_cursors_.resize(filter_columns_.size());
+
+    if (!predicates_.empty()) {
+      bloom_filters_ = columnChunkLocations(metadata_->key_value_metadata(), CAPNP_BLOOM_FILTERS_KEY);
+      page_indexes_ = columnChunkLocations(metadata_->key_value_metadata(), CAPNP_PAGE_INDEX_KEY);
+    }
+  }
+
+  KJ_DISALLOW_COPY(ParquetCapnpReader);
+
+  // Rebuild the next matching row into `message`. Returns false at the end of the file.
+  bool next(capnp::MessageBuilder& message) {
+    for (;;) {
+      while (row_ >= row_group_rows_) {
+        if (!nextRowGroup()) {
+          return false;
+        }
+      }
+
+      // Every range starts a row at a time, skipped ranges are skipped whole
+      if (!skip_ranges_.empty() && ((row_ % range_rows_) == 0) && skip_ranges_[row_ / range_rows_]) {
+        int64_t rows = std::min(range_rows_, row_group_rows_ - row_);
+        for (int column : columns_) {
+          cursors_[column]->skipRows(rows);
+        }
+        for (auto& cursor : filter_cursors_) {
+          cursor->skipRows(rows);
+        }
+        row_ += rows;
+        rows_skipped_ += rows;
+        ranges_skipped_++;
+        continue;
+      }
+
+      for (int column : columns_) {
+        KJ_REQUIRE(cursors_[column]->nextRow(), "column chunk ended before its row group",
+                   cursors_[column]->leaf()->path);
+      }
+      for (auto& cursor : filter_cursors_) {
+        KJ_REQUIRE(cursor->nextRow(), "column chunk ended before its row group",
+                   cursor->leaf()->path);
+      }
+      row_++;
+
+      bool match = matchesRow();
+
+      for (auto& cursor : filter_cursors_) {
+        cursor->skipRow();
+      }
+
+      if (!match) {
+        for (int column : columns_) {
+          cursors_[column]->skipRow();
+        }
+        rows_skipped_++;
+        continue;
+      }
+
+      auto root = message.initRoot<capnp::DynamicStruct>(root_);
+      assembleStruct(map_.root(), root);
+
+      rows_read_++;
+      return true;
+    }
+  }
+
+  // Read only the row groups [first, last). Call before the first next().
+  void set_row_groups(int first, int last) {
+    KJ_REQUIRE((first >= 0) && (first <= last) && (last <= metadata_->num_row_groups()),
+               "row groups out of range", first, last, path_);
+    row_group_ = first - 1;
+    end_row_group_ = last;
+  }
+
+  const CapnpColumnMap& columnMap() const { return map_; }
+
+  // Cap'n Proto field ids stored in the file, or nullptr when it was written without them
+  const CapnpFieldIds* fieldIds() const { return field_ids_.get(); }
+
+  const std::vector<int>& columns() const { return columns_; }
+
+  int64_t rows_read() const { return rows_read_; }
+
+  // Rows of the row groups that were read but did not satisfy the predicates.
+  int64_t rows_skipped() const { return rows_skipped_; }
+
+  // Row groups pruned by their column statistics or Bloom filters.
+  int row_groups_skipped() const { return row_groups_skipped_; }
+
+  // Row ranges pruned by the page index, their rows count as skipped rows.
+  int64_t ranges_skipped() const { return ranges_skipped_; }
+
+private:
+  capnp::StructSchema                         root_;
+  std::string                                 path_;
+  std::unique_ptr<parquet::ParquetFileReader> file_;
+  std::shared_ptr<parquet::FileMetaData>      metadata_;
+  std::unique_ptr<CapnpFieldIds>              field_ids_;
+  CapnpColumnMap                              map_;
+  std::vector<int>                            columns_;
+  std::vector<std::unique_ptr<ColumnCursor>>  cursors_;
+  std::vector<ColumnPredicate>                predicates_;
+  std::vector<int>                            filter_columns_;
+  std::vector<std::unique_ptr<ColumnCursor>>  filter_cursors_;
+  std::shared_ptr<parquet::RowGroupReader>    row_group_reader_;
+  int                                         row_group_;
+  int                                         end_row_group_;
+  int64_t                                     row_group_rows_;
+  int64_t                                     row_;
+  int64_t                                     rows_read_;
+  int64_t                                     rows_skipped_;
+  int                                         row_groups_skipped_;
+  std::vector<ColumnChunkLocation>            bloom_filters_;
+  std::vector<ColumnChunkLocation>            page_indexes_;
+  std::shared_ptr<::arrow::io::ReadableFile>  side_file_;     // Bloom filters and page indexes
+  std::vector<bool>                           skip_ranges_;   // page index ranges of the row group that cannot match
+  int64_t                                     range_rows_;
+  int64_t                                     ranges_skipped_;
+
+  std::shared_ptr<::arrow::Buffer> readColumnChunkData(const ColumnChunkLocation& location) {
+    if (side_file_ == nullptr) {
+      PARQUET_THROW_NOT_OK(::arrow::io::ReadableFile::Open(path_, &side_file_));
+    }
+    std::shared_ptr<::arrow::Buffer> buffer;
+    PARQUET_THROW_NOT_OK(side_file_->ReadAt(location.offset, location.length, &buffer));
+    KJ_REQUIRE(buffer->size() == location.length, "column chunk data past the end of the file", path_);
+    return buffer;
+  }
+
+  bool mayMatch(const parquet::RowGroupMetaData& row_group) const {
+    for (const auto& predicate : predicates_) {
+      if (!mayMatchRowGroup(predicate, row_group)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // Filters are only read for row groups that pass the statistics.
+  bool mayMatchBloomFilters(int row_group) {
+    for (const auto& predicate : predicates_) {
+      for (const auto& location : bloom_filters_) {
+        if ((location.row_group != row_group) || (location.column != predicate.column)) {
+          continue;
+        }
+        std::shared_ptr<::arrow::Buffer> buffer = readColumnChunkData(location);
+        if (!mayMatchBloomFilter(predicate, BloomFilter(buffer->data(), buffer->size()))) {
+          return false;
+        }
+      }
+    }
+    return true;
+  }
+
+  // Mark the ranges of the row group that some predicate rules out
+  void loadPageIndex() {
+    skip_ranges_.clear();
+    range_rows_ = 0;
+
+    for (const auto& predicate : predicates_) {
+      for (const auto& location : page_indexes_) {
+        if ((location.row_group != row_group_) || (location.column != predicate.column)) {
+          continue;
+        }
+        std::shared_ptr<::arrow::Buffer> buffer = readColumnChunkData(location);
+        ColumnPageIndex index = ColumnPageIndex::parse(buffer->data(), buffer->size());
+        if (range_rows_ == 0) {
+          range_rows_ = index.range_rows();
+          skip_ranges_.assign((row_group_rows_ + range_rows_ - 1) / range_rows_, false);
+        }
+        if ((index.range_rows() != range_rows_) || (index.ranges().size() != skip_ranges_.size())) {
+          continue;
+        }
+        for (size_t i = 0; i < skip_ranges_.size(); i++) {
+          if (!mayMatchPageRange(predicate, index.ranges()[i])) {
+            skip_ranges_[i] = true;
+          }
+        }
+      }
+    }
+  }
+
+  bool matchesRow() const {
+    for (const auto& predicate : predicates_) {
+      const ColumnCursor* cursor = cursors_[predicate.column].get();
+      if (cursor == nullptr) {
+        size_t index = std::find(filter_columns_.begin(), filter_columns_.end(), predicate.column) -
+                       filter_columns_.begin();
+        cursor = filter_cursors_[index].get();
+      }
+      if (!cursor->matches(predicate)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  bool nextRowGroup() {
+    for (;;) {
+      if (row_group_ + 1 >= end_row_group_) {
+        return false;
+      }
+
+      row_group_++;
+      if (!mayMatch(*metadata_->RowGroup(row_group_)) || !mayMatchBloomFilters(row_group_)) {
+        row_group_rows_ = 0;
+        row_groups_skipped_++;
+        continue;
+      }
+      break;
+    }
+
+    row_group_reader_ = file_->RowGroup(row_group_);
+    row_group_rows_ = row_group_reader_->metadata()->num_rows();
+    row_ = 0;
+
+    // Only the projected and predicate columns are read
+    for (int column : columns_) {
+      cursors_[column] = makeColumnCursor(row_group_reader_->Column(column), map_.leaf(column),
+                                          metadata_->schema()->Column(column), map_.sourceUnit(column));
+    }
+    for (size_t i = 0; i < filter_columns_.size(); i++) {
+      int column = filter_columns_[i];
+      filter_cursors_[i] = makeColumnCursor(row_group_reader_->Column(column), map_.leaf(column),
+                                            metadata_->schema()->Column(column), map_.sourceUnit(column));
+    }
+    loadPageIndex();
+    return true;
+  }
+
+  ColumnCursor* leadCursor(const CapnpFieldNode& node) const {
+    for (int i = node.first_column; i < node.last_column; i++) {
+      if (cursors_[i] != nullptr) {
+        return cursors_[i].get();
+      }
+    }
+    return nullptr;
+  }
+
+  // A null (or empty list) value stores one entry in every leaf column below it.
+  void skipValue(const CapnpFieldNode& node) {
+    for (int i = node.first_column; i < node.last_column; i++) {
+      if (cursors_[i] != nullptr) {
+        cursors_[i]->skip();
+      }
+    }
+  }
+
+  // The discriminant column of a union comes ahead of its members. Once it
+  // names the active member, the entries of the other members are skipped
+  // without being assigned, and a member without columns (a Void member, or
+  // one left out of the projection) is still made the active one.
+  void assembleStruct(const CapnpFieldNode& node, capnp::DynamicStruct::Builder builder) {
+    kj::Maybe<capnp::StructSchema::Field> active;
+    bool has_discriminant = false;
+
+    for (const auto& child : node.children) {
+      if (child.kind == CapnpFieldNode::DISCRIMINANT) {
+        ColumnCursor* cursor = cursors_[child.column].get();
+        std::string name;
+        if ((cursor != nullptr) && cursor->takeText(&name)) {
+          active = builder.getSchema().findFieldByName(name);
+        }
+        has_discriminant = (cursor != nullptr);
+        continue;
+      }
+      if (!child.is_mapped() || (leadCursor(child) == nullptr)) {
+        continue;
+      }
+      if (has_discriminant && isUnionMember(child.field) && !isActiveMember(active, child.field)) {
+        skipValue(child);
+        continue;
+      }
+      CapnpSlot slot(builder, child.field);
+      assemble(child, slot);
+    }
+
+    KJ_IF_MAYBE(member, active) {
+      if (isUnionMember(*member) && !isActiveMember(builder.which(), *member)) {
+        builder.clear(*member);
+      }
+    }
+  }
+
+  static bool isActiveMember(kj::Maybe<capnp::StructSchema::Field> active, capnp::StructSchema::Field field) {
+    KJ_IF_MAYBE(member, active) {
+      return *member == field;
+    }
+    return false;
+  }
+
+  void assemble(const CapnpFieldNode& node, CapnpSlot& slot) {
+    ColumnCursor* lead = leadCursor(node);
+
+    switch (node.kind) {
+      case CapnpFieldNode::LEAF:
+        lead->assign(slot);
+        break;
+      case CapnpFieldNode::STRUCT:
+        if (lead->def() < node.def_level) {
+          skipValue(node);
+        } else {
+          assembleStruct(node, slot.initStruct());
+        }
+        break;
+      case CapnpFieldNode::LIST:
+        if (lead->def() < node.def_level) {
+          skipValue(node);
+        } else if (lead->def() < node.element_def_level) {
+          slot.initList(0);
+          skipValue(node);
+        } else {
+          const CapnpFieldNode& element = node.children[0];
+          uint32_t count = lead->countElements(node.element_rep_level);
+          capnp::DynamicList::Builder list = slot.initList(count);
+          for (uint32_t i = 0; i < count; i++) {
+            CapnpSlot element_slot(list, i);
+            assemble(element, element_slot);
+          }
+        }
+        break;
+      case CapnpFieldNode::DISCRIMINANT:
+        // Read by assembleStruct()
+      case CapnpFieldNode::UNMAPPED:
+        break;
+    }
+  }
+};
+
+};  // namespace capnpparquet
+
+#endif  // _PARQUET2CAPNP_H_
@@ -0,0 +1,144 @@
+# Copyright 2017 Rene Sugar
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+# cython: language_level = 3
+
+"""
+Python bindings of capnpc-parquet.
+
+Messages are converted by the C++ code with the GIL released, so several
+Python threads can convert at once. Arrow results are pyarrow objects that
+share their buffers with the C++ side.
+
+    import capnpparquet
+
+    schema = capnpparquet.compile_schema("file.capnp")
+    table = capnpparquet.to_arrow(schema, open("file.bin", "rb").read())
+    capnpparquet.to_parquet(schema, data, "file.parquet")
+"""
+
+import os
+import subprocess
+import tempfile
+
+from libc.stdint cimport int64_t, uint8_t
+from libcpp.memory cimport shared_ptr, unique_ptr
+from libcpp.string cimport string
+
+from pyarrow.includes.libarrow cimport CSchema, CTable
+from pyarrow.lib cimport pyarrow_wrap_schema, pyarrow_wrap_table
+
+cdef extern from "capnpschema.h" namespace "capnpparquet" nogil:
+    cdef cppclass CapnpSchemaFile:
+        CapnpSchemaFile(const string& path) except +
+
+cdef extern from "capnpparquet_api.h" namespace "capnpparquet" nogil:
+    string parquetSchemaString(const CapnpSchemaFile& schema) except +
+    shared_ptr[CSchema] arrowSchema(const CapnpSchemaFile& schema) except +
+    shared_ptr[CTable] capnpToArrow(const CapnpSchemaFile& schema,
+                                    const uint8_t* data, size_t size,
+                                    int64_t batch_rows) except +
+    int64_t capnpToParquet(const CapnpSchemaFile& schema,
+                           const uint8_t* data, size_t size,
+                           const string& path, int64_t row_group_rows) except +
+
+DEFAULT_BATCH_ROWS = 64 * 1024
+
+
+cdef class Schema:
+    """
+    A compiled Cap'n Proto schema and the Parquet schema generated for its
+    $schema struct.
+    """
+    cdef unique_ptr[CapnpSchemaFile] schema
+
+    def __cinit__(self, request_path):
+        cdef string path = os.fsencode(request_path)
+        with nogil:
+            self.schema.reset(new CapnpSchemaFile(path))
+
+    @property
+    def parquet_schema(self):
+        """The generated Parquet schema, as printed by capnpc-parquet."""
+        return parquetSchemaString(self.schema.get()[0]).decode("utf-8")
+
+    @property
+    def arrow_schema(self):
+        """The pyarrow.Schema of the record batches to_arrow() returns."""
+        return pyarrow_wrap_schema(arrowSchema(self.schema.get()[0]))
+
+
+def load_schema(request_path):
+    """
+    Load a CodeGeneratorRequest saved with `capnp compile -o- file.capnp`.
+    """
+    return Schema(request_path)
+
+
+def compile_schema(capnp_path, import_paths=(), capnp="capnp"):
+    """
+    Compile a .capnp file with the capnp compiler and load its schema.
+    """
+    command = [capnp, "compile", "-o-"]
+    for path in import_paths:
+        command.append("--import-path=" + path)
+    command.append(capnp_path)
+
+    request = subprocess.check_output(command)
+    handle, request_path = tempfile.mkstemp(suffix=".request")
+    try:
+        with os.fdopen(handle, "wb") as f:
+            f.write(request)
+        return Schema(request_path)
+    finally:
+        os.remove(request_path)
+
+
+def to_arrow(Schema schema, data, int64_t batch_rows=DEFAULT_BATCH_ROWS):
+    """
+    Convert framed Cap'n Proto messages of the $schema struct to a
+    pyarrow.Table with chunks of `batch_rows` rows.
+
+    `data` is any object with the buffer protocol (bytes, memoryview,
+    pyarrow.Buffer, mmap). It is read in place when word aligned.
+    """
+    cdef const uint8_t[::1] view = memoryview(data).cast("B")
+    cdef const uint8_t* pointer = &view[0] if view.shape[0] > 0 else NULL
+    cdef size_t size = view.shape[0]
+    cdef shared_ptr[CTable] table
+
+    with nogil:
+        table = capnpToArrow(schema.schema.get()[0], pointer, size, batch_rows)
+
+    return pyarrow_wrap_table(table)
+
+
+def to_parquet(Schema schema, data, path, int64_t row_group_rows=0):
+    """
+    Write framed Cap'n Proto messages of the $schema struct to a Parquet
+    file with the generated schema. Returns the number of rows written.
+
+    Row groups follow the $rowGroupRows and $rowGroupBytes annotations of
+    the schema unless `row_group_rows` is given.
+    """
+    cdef const uint8_t[::1] view = memoryview(data).cast("B")
+    cdef const uint8_t* pointer = &view[0] if view.shape[0] > 0 else NULL
+    cdef size_t size = view.shape[0]
+    cdef string cpath = os.fsencode(path)
+    cdef int64_t rows
+
+    with nogil:
+        rows = capnpToParquet(schema.schema.get()[0], pointer, size, cpath, row_group_rows)
+
+    return rows
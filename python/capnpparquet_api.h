@@ -0,0 +1,163 @@
+/*
+ * Copyright 2017 Rene Sugar
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * @file capnpparquet_api.h
+ * @author Rene Sugar <rene.sugar@gmail.com>
+ * @brief Conversions called by the Python bindings without holding the GIL.
+ */
+#ifndef _CAPNPPARQUET_API_H_
+#define _CAPNPPARQUET_API_H_
+
+#include <capnp/serialize.h>
+
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "capnparrow.h"
+#include "capnpsort.h"
+
+namespace capnpparquet {
+
+// Iterates the messages of a buffer in the Cap'n Proto stream framing.
+//
+// Messages are read in place when the buffer is word aligned, which Python
+// bytes objects are; otherwise the buffer is copied once to an aligned array.
+// Readers must not outlive the iterator.
+//
+class CapnpBufferMessages {
+public:
+  CapnpBufferMessages(const uint8_t* data, size_t size) {
+    KJ_REQUIRE((size % sizeof(capnp::word)) == 0, "buffer ends in the middle of a message");
+    if ((reinterpret_cast<uintptr_t>(data) % sizeof(capnp::word)) == 0) {
+      words_ = kj::arrayPtr(reinterpret_cast<const capnp::word*>(data), size / sizeof(capnp::word));
+    } else {
+      copy_ = kj::heapArray<capnp::word>(size / sizeof(capnp::word));
+      memcpy(copy_.begin(), data, size);
+      words_ = copy_;
+    }
+    options_.traversalLimitInWords = CapnpcParquet::TRAVERSAL_LIMIT;
+  }
+
+  KJ_DISALLOW_COPY(CapnpBufferMessages);
+
+  // Reader of the next message, or nullptr at the end of the buffer
+  std::unique_ptr<capnp::FlatArrayMessageReader> next() {
+    if (words_.size() == 0) {
+      return nullptr;
+    }
+    std::unique_ptr<capnp::FlatArrayMessageReader> reader(new capnp::FlatArrayMessageReader(words_, options_));
+    words_ = kj::arrayPtr(reader->getEnd(), words_.end());
+    return reader;
+  }
+
+private:
+  kj::Array<capnp::word>          copy_;
+  kj::ArrayPtr<const capnp::word> words_;
+  capnp::ReaderOptions            options_;
+};
+
+// The Parquet schema generated for a schema file, as printed by capnpc-parquet
+inline std::string parquetSchemaString(const CapnpSchemaFile& schema) {
+  std::ostringstream out;
+  parquet::schema::PrintSchema(schema.descr()->schema_root().get(), out);
+  return out.str();
+}
+
+inline std::shared_ptr<::arrow::Schema> arrowSchema(const CapnpSchemaFile& schema) {
+  CapnpColumnMap map(schema.root(), schema.descr(), nullptr,
+                     sourceUnitsFromMetadata(schema.metadata(), schema.descr()->num_columns()));
+  CapnpArrowBuilder builder(map);
+  return builder.schema();
+}
+
+// Convert the messages of a buffer to an Arrow table of `batch_rows` row chunks.
+inline std::shared_ptr<::arrow::Table> capnpToArrow(const CapnpSchemaFile& schema,
+                                                   const uint8_t* data, size_t size,
+                                                   int64_t batch_rows) {
+  CapnpColumnMap map(schema.root(), schema.descr(), nullptr,
+                     sourceUnitsFromMetadata(schema.metadata(), schema.descr()->num_columns()));
+  CapnpArrowBuilder builder(map);
+  CapnpBufferMessages messages(data, size);
+
+  std::vector<std::shared_ptr<::arrow::RecordBatch>> batches;
+  std::vector<std::unique_ptr<capnp::FlatArrayMessageReader>> readers;
+  std::vector<capnp::DynamicStruct::Reader> roots;
+
+  bool done = false;
+  while (!done) {
+    auto reader = messages.next();
+    done = (reader == nullptr);
+    if (!done) {
+      roots.push_back(reader->getRoot<capnp::DynamicStruct>(schema.root()));
+      readers.push_back(std::move(reader));
+    }
+    // An empty buffer still gives a table with the schema
+    if ((done && (!roots.empty() || batches.empty())) ||
+        (static_cast<int64_t>(roots.size()) >= batch_rows)) {
+      builder.appendBatch(roots);
+      batches.push_back(builder.finish());
+      roots.clear();
+      readers.clear();
+    }
+  }
+
+  std::shared_ptr<::arrow::Table> table;
+  PARQUET_THROW_NOT_OK(::arrow::Table::FromRecordBatches(batches, &table));
+  return table;
+}
+
+// Write the messages of a buffer to a Parquet file. Returns the number of rows.
+// `row_group_rows` of 0 takes the row group size of the schema's annotations.
+// Messages are sorted by the $sortKey columns a row group at a time.
+inline int64_t capnpToParquet(const CapnpSchemaFile& schema, const uint8_t* data, size_t size,
+                              const std::string& path, int64_t row_group_rows) {
+  row_group_rows = resolveRowGroupRows(row_group_rows, schema.writerOptions());
+  CapnpParquetWriter writer(schema.root(), schema.parquetSchema(), openFileSink(path),
+                            schemaWriterProperties(schema), row_group_rows, schema.metadata());
+  writer.set_row_group_bytes(schema.writerOptions().row_group_bytes);
+  writer.set_bloom_filters(bloomFilterColumns(schema.descr(), schema.columnOptions()));
+  writer.set_page_index(pageIndexColumns(schema.columnOptions()));
+  CapnpRowSorter sorter(writer.columnMap(), schema.sortingColumns());
+  CapnpBufferMessages messages(data, size);
+
+  std::vector<std::unique_ptr<capnp::FlatArrayMessageReader>> readers;
+  std::vector<capnp::DynamicStruct::Reader> rows;
+  bool done = false;
+  while (!done) {
+    auto reader = messages.next();
+    done = (reader == nullptr);
+    if (!done) {
+      rows.push_back(reader->getRoot<capnp::DynamicStruct>(schema.root()));
+      readers.push_back(std::move(reader));
+    }
+    if ((done || (static_cast<int64_t>(rows.size()) >= row_group_rows)) && !rows.empty()) {
+      for (uint32_t position : sorter.order(rows)) {
+        writer.write(rows[position]);
+      }
+      rows.clear();
+      readers.clear();
+    }
+  }
+
+  writer.close();
+  return writer.rows();
+}
+
+};  // namespace capnpparquet
+
+#endif  // _CAPNPPARQUET_API_H_
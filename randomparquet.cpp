@@ -0,0 +1,291 @@
+/*
+ * Copyright 2017 Rene Sugar
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ *
+ * @file randomparquet.cpp
+ * @author Rene Sugar <rene.sugar@gmail.com>
+ * @brief Write Parquet files filled with random data using a compiled Cap'n Proto schema.
+ */
+
+#include <sys/stat.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <exception>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "capnprandom.h"
+
+// Writes Parquet files with the schema generated for the $schema struct and
+// random values that respect its annotations:
+//
+//   capnp compile -o- file.capnp > file.request
+//   randomparquet --schema file.request --directory out --rows 100000000 --files 32
+//
+// Files are written in parallel, and the threads left over when there are
+// fewer files than threads generate and encode the row groups of a file.
+// Each row group has its own seed, derived from --seed, the file number and
+// the row group number, so the same options produce the same files whatever
+// the number of threads.
+//
+
+class RandomParquetMain {
+public:
+  explicit RandomParquetMain(kj::ProcessContext& context)
+  : context(context), prefix("random"), rows(1000000), files(1),
+    threads(std::max<int64_t>(1, std::thread::hardware_concurrency())),
+    rowGroupRows(0) {}
+
+  kj::MainFunc getMain() {
+    return kj::MainBuilder(context, "randomparquet",
+                           "Writes Parquet files with the schema of the $schema struct, "
+                           "filled with random data.")
+        .addOptionWithArg({'s', "schema"}, KJ_BIND_METHOD(*this, setSchema), "<request>",
+                          "CodeGeneratorRequest of the schema (capnp compile -o- file.capnp).")
+        .addOptionWithArg({'o', "output"}, KJ_BIND_METHOD(*this, setOutput), "<file>",
+                          "Write a single Parquet file.")
+        .addOptionWithArg({'d', "directory"}, KJ_BIND_METHOD(*this, setDirectory), "<dir>",
+                          "Write --files files to <dir>.")
+        .addOptionWithArg("prefix", KJ_BIND_METHOD(*this, setPrefix), "<name>",
+                          "File name prefix of the files written to --directory. Default: random")
+        .addOptionWithArg("rows", KJ_BIND_METHOD(*this, setRows), "<n>",
+                          "Rows in all files. Default: 1000000")
+        .addOptionWithArg("files", KJ_BIND_METHOD(*this, setFiles), "<n>",
+                          "Files to split the rows into. Default: 1")
+        .addOptionWithArg("threads", KJ_BIND_METHOD(*this, setThreads), "<n>",
+                          "Threads writing files and their row groups. Default: number of cores")
+        .addOptionWithArg("row-group-rows", KJ_BIND_METHOD(*this, setRowGroupRows), "<n>",
+                          "Rows per row group. Default: $rowGroupRows of the schema, or 65536")
+        .addOptionWithArg("seed", KJ_BIND_METHOD(*this, setSeed), "<n>",
+                          "Seed of the random data. Default: 0")
+        .addOptionWithArg("null-ratio", KJ_BIND_METHOD(*this, setNullRatio), "<fraction>",
+                          "Probability that an optional value is null. Default: 0.1")
+        .addOptionWithArg("min-list-length", KJ_BIND_METHOD(*this, setMinListLength), "<n>",
+                          "Fewest elements of a list or map. Default: 0")
+        .addOptionWithArg("max-list-length", KJ_BIND_METHOD(*this, setMaxListLength), "<n>",
+                          "Most elements of a list or map. Default: 4")
+        .addOptionWithArg("max-string-length", KJ_BIND_METHOD(*this, setMaxStringLength), "<n>",
+                          "Longest random string. Default: 16")
+        .addOptionWithArg("cardinality", KJ_BIND_METHOD(*this, setCardinality), "<n>",
+                          "Distinct strings per column. Default: every string is random")
+        .callAfterParsing(KJ_BIND_METHOD(*this, run))
+        .build();
+  }
+
+private:
+  kj::ProcessContext&         context;
+  std::string                 schemaPath;
+  std::string                 outputPath;
+  std::string                 directory;
+  std::string                 prefix;
+  int64_t                     rows;
+  int64_t                     files;
+  int64_t                     threads;
+  int64_t                     rowGroupRows;
+  capnpparquet::RandomOptions options;
+
+  kj::MainBuilder::Validity setSchema(kj::StringPtr path) {
+    schemaPath = path.cStr();
+    return true;
+  }
+
+  kj::MainBuilder::Validity setOutput(kj::StringPtr path) {
+    outputPath = path.cStr();
+    return true;
+  }
+
+  kj::MainBuilder::Validity setDirectory(kj::StringPtr path) {
+    directory = path.cStr();
+    return true;
+  }
+
+  kj::MainBuilder::Validity setPrefix(kj::StringPtr name) {
+    prefix = name.cStr();
+    return true;
+  }
+
+  static kj::MainBuilder::Validity parseNumber(kj::StringPtr text, int64_t minimum, int64_t* number) {
+    char* end = nullptr;
+    long long value = strtoll(text.cStr(), &end, 10);
+    if ((end == text.cStr()) || (*end != '\0') || (value < minimum)) {
+      return (minimum > 0) ? "expected a positive number" : "expected a number of at least zero";
+    }
+    *number = value;
+    return true;
+  }
+
+  kj::MainBuilder::Validity setRows(kj::StringPtr text) {
+    return parseNumber(text, 1, &rows);
+  }
+
+  kj::MainBuilder::Validity setFiles(kj::StringPtr text) {
+    return parseNumber(text, 1, &files);
+  }
+
+  kj::MainBuilder::Validity setThreads(kj::StringPtr text) {
+    return parseNumber(text, 1, &threads);
+  }
+
+  kj::MainBuilder::Validity setRowGroupRows(kj::StringPtr text) {
+    return parseNumber(text, 1, &rowGroupRows);
+  }
+
+  kj::MainBuilder::Validity setSeed(kj::StringPtr text) {
+    char* end = nullptr;
+    unsigned long long value = strtoull(text.cStr(), &end, 10);
+    if ((end == text.cStr()) || (*end != '\0')) {
+      return "expected a number";
+    }
+    options.seed = value;
+    return true;
+  }
+
+  kj::MainBuilder::Validity setNullRatio(kj::StringPtr text) {
+    char* end = nullptr;
+    double value = strtod(text.cStr(), &end);
+    if ((end == text.cStr()) || (*end != '\0') || (value < 0.0) || (value > 1.0)) {
+      return "expected a fraction between 0 and 1";
+    }
+    options.null_ratio = value;
+    return true;
+  }
+
+  kj::MainBuilder::Validity setMinListLength(kj::StringPtr text) {
+    return parseNumber(text, 0, &options.min_list_length);
+  }
+
+  kj::MainBuilder::Validity setMaxListLength(kj::StringPtr text) {
+    return parseNumber(text, 0, &options.max_list_length);
+  }
+
+  kj::MainBuilder::Validity setMaxStringLength(kj::StringPtr text) {
+    return parseNumber(text, 1, &options.max_string_length);
+  }
+
+  kj::MainBuilder::Validity setCardinality(kj::StringPtr text) {
+    return parseNumber(text, 1, &options.string_cardinality);
+  }
+
+  std::string filePath(int64_t file) const {
+    if (!outputPath.empty()) {
+      return outputPath;
+    }
+    return directory + "/" + prefix + "-" + std::to_string(file) + ".parquet";
+  }
+
+  kj::MainBuilder::Validity run() {
+    if (schemaPath.empty()) {
+      return "--schema is required";
+    }
+    if (outputPath.empty() == directory.empty()) {
+      return "one of --output or --directory is required";
+    }
+    if (options.min_list_length > options.max_list_length) {
+      return "--min-list-length is greater than --max-list-length";
+    }
+    if (!outputPath.empty()) {
+      files = 1;
+    }
+
+    capnpparquet::CapnpSchemaFile schema(schemaPath);
+    rowGroupRows = capnpparquet::resolveRowGroupRows(rowGroupRows, schema.writerOptions());
+
+    // Random strings do not repeat, a dictionary would only be thrown away
+    parquet::WriterProperties::Builder builder;
+    if (options.string_cardinality == 0) {
+      builder.disable_dictionary();
+    }
+    capnpparquet::applyWriterOptions(builder, schema.writerOptions());
+    try {
+      capnpparquet::applyColumnOptions(builder, schema.descr(), schema.columnOptions());
+    } catch (const std::exception& e) {
+      return kj::str("Parquet schema error: ", e.what());
+    }
+    auto properties = builder.build();
+
+    auto start = std::chrono::steady_clock::now();
+    std::atomic<int64_t> nextFile(0);
+    std::atomic<int64_t> bytes(0);
+    std::mutex errorMutex;
+    std::string error;
+
+    // Threads a file has for its row groups
+    int64_t fileThreads = std::max<int64_t>(1, threads / files);
+
+    try {
+      capnpparquet::RandomSchema randomSchema(schema, options);
+
+      auto work = [&]() {
+        for (;;) {
+          int64_t file = nextFile.fetch_add(1);
+          if (file >= files) {
+            return;
+          }
+
+          // Rows are spread evenly, the first files take the remainder
+          int64_t fileRows = (rows / files) + ((file < (rows % files)) ? 1 : 0);
+          std::string path = filePath(file);
+
+          try {
+            capnpparquet::writeRandomFile(randomSchema, capnpparquet::openFileSink(path), fileRows,
+                                          capnpparquet::RandomSource::derive(options.seed, file),
+                                          properties, rowGroupRows, static_cast<int>(fileThreads));
+          } catch (const std::exception& e) {
+            std::lock_guard<std::mutex> lock(errorMutex);
+            if (error.empty()) {
+              error = path + ": " + e.what();
+            }
+            nextFile.store(files);
+            return;
+          }
+
+          struct stat info;
+          if (stat(path.c_str(), &info) == 0) {
+            bytes.fetch_add(info.st_size);
+          }
+        }
+      };
+
+      std::vector<std::thread> workers;
+      for (int64_t i = 0; i < std::min(threads, files); i++) {
+        workers.emplace_back(work);
+      }
+      for (auto& worker : workers) {
+        worker.join();
+      }
+    } catch (const std::exception& e) {
+      return kj::str("Parquet write error: ", e.what());
+    }
+
+    if (!error.empty()) {
+      return kj::str("Parquet write error: ", error.c_str());
+    }
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cerr << rows << " rows, " << bytes.load() << " bytes in " << files << " files, "
+              << std::fixed << std::setprecision(1) << seconds << " s ("
+              << (bytes.load() / std::max(seconds, 1e-9) / (1024.0 * 1024.0)) << " MiB/s)" << std::endl;
+    return true;
+  }
+};
+
+KJ_MAIN(RandomParquetMain);
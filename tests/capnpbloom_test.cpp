@@ -0,0 +1,181 @@
+/*
+ * Copyright 2017 Rene Sugar
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ *
+ * @file capnpbloom_test.cpp
+ * @author Rene Sugar <rene.sugar@gmail.com>
+ * @brief Known answers of the XXH64 hash and the split block Bloom filter layout.
+ */
+
+#include <gtest/gtest.h>
+
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <random>
+#include <string>
+
+#include "capnpbloom.h"
+
+namespace capnpparquet {
+
+static uint64_t hashText(const std::string& text) {
+  return xxHash64(reinterpret_cast<const uint8_t*>(text.data()), text.size());
+}
+
+template <typename T>
+static uint64_t hashBytes(T value) {
+  uint8_t bytes[sizeof(T)];
+  memcpy(bytes, &value, sizeof(T));
+  return xxHash64(bytes, sizeof(T));
+}
+
+// Words of the filter, as stored
+static uint32_t filterWord(const BloomFilter& filter, int64_t index) {
+  uint32_t word;
+  memcpy(&word, filter.data() + (index * sizeof(uint32_t)), sizeof(word));
+  return word;
+}
+
+// Reference values of XXH64 with seed 0
+TEST(XxHash64Test, KnownAnswers) {
+  EXPECT_EQ(0xef46db3751d8e999ULL, hashText(""));
+  EXPECT_EQ(0xd24ec4f1a98c6e5bULL, hashText("a"));
+  EXPECT_EQ(0x44bc2cf5ad770999ULL, hashText("abc"));
+  // 39 bytes: the 32 byte stripes, an 8, a 4 and single byte tails
+  EXPECT_EQ(0xfbcea83c8a378bf1ULL, hashText("Nobody inspects the spammish repetition"));
+}
+
+// The branch free hashes of fixed width values are those of their plain encoding
+TEST(XxHash64Test, FixedWidthValues) {
+  const int64_t values[] = {0, 1, -1, 42, std::numeric_limits<int64_t>::min(), std::numeric_limits<int64_t>::max()};
+  for (int64_t value : values) {
+    EXPECT_EQ(hashBytes(value), bloomHash(value));
+    EXPECT_EQ(hashBytes(static_cast<int32_t>(value)), bloomHash(static_cast<int32_t>(value)));
+  }
+  EXPECT_EQ(hashBytes(1.5), bloomHash(1.5));
+  EXPECT_EQ(hashBytes(1.5f), bloomHash(1.5f));
+
+  const char text[] = "abc";
+  parquet::ByteArray bytes(3, reinterpret_cast<const uint8_t*>(text));
+  EXPECT_EQ(0x44bc2cf5ad770999ULL, bloomHash(bytes));
+}
+
+TEST(XxHash64Test, CanonicalFloats) {
+  EXPECT_EQ(bloomHash(0.0), bloomHash(-0.0));
+  EXPECT_EQ(bloomHash(0.0f), bloomHash(-0.0f));
+  EXPECT_EQ(hashBytes(0.0), bloomHash(-0.0));
+  EXPECT_EQ(hashBytes(0.0f), bloomHash(-0.0f));
+
+  double nan = std::numeric_limits<double>::quiet_NaN();
+  uint64_t payload;
+  memcpy(&payload, &nan, sizeof(payload));
+  payload |= 1;
+  double other_nan;
+  memcpy(&other_nan, &payload, sizeof(other_nan));
+  ASSERT_TRUE(std::isnan(other_nan));
+  EXPECT_EQ(bloomHash(nan), bloomHash(other_nan));
+  EXPECT_EQ(bloomHash(nan), bloomHash(-nan));
+  EXPECT_EQ(bloomHash(std::numeric_limits<float>::quiet_NaN()),
+            bloomHash(-std::numeric_limits<float>::quiet_NaN()));
+
+  EXPECT_NE(bloomHash(0.0), bloomHash(nan));
+}
+
+// A key of 1 sets bit (salt[i] >> 27) of word i, per the Parquet specification
+TEST(BloomFilterTest, BlockMask) {
+  BloomFilter filter(BLOOM_FILTER_BLOCK_BYTES);
+  ASSERT_EQ(BLOOM_FILTER_BLOCK_BYTES, filter.size());
+  filter.insert(1);
+
+  const int bits[8] = {8, 8, 17, 20, 14, 5, 19, 11};
+  for (int i = 0; i < 8; i++) {
+    EXPECT_EQ(uint32_t(1) << bits[i], filterWord(filter, i)) << "word " << i;
+  }
+  EXPECT_TRUE(filter.mayContain(1));
+}
+
+// The upper 32 bits of a hash pick the block, scaled to the number of blocks
+TEST(BloomFilterTest, BlockIndex) {
+  BloomFilter filter(4 * BLOOM_FILTER_BLOCK_BYTES);
+  ASSERT_EQ(4 * BLOOM_FILTER_BLOCK_BYTES, filter.size());
+  filter.insert((uint64_t(0x80000000) << 32) | 1);
+
+  for (int64_t block = 0; block < 4; block++) {
+    for (int i = 0; i < 8; i++) {
+      uint32_t word = filterWord(filter, (block * 8) + i);
+      if (block == 2) {
+        EXPECT_NE(0U, word);
+      } else {
+        EXPECT_EQ(0U, word);
+      }
+    }
+  }
+  EXPECT_FALSE(filter.mayContain(1));
+}
+
+TEST(BloomFilterTest, NoFalseNegatives) {
+  BloomFilter filter(BloomFilter::optimalNumBytes(1000, 0.01));
+  for (int64_t i = 0; i < 1000; i++) {
+    filter.insert(bloomHash(i));
+  }
+  for (int64_t i = 0; i < 1000; i++) {
+    EXPECT_TRUE(filter.mayContain(bloomHash(i)));
+  }
+
+  int64_t false_positives = 0;
+  for (int64_t i = 1000; i < 11000; i++) {
+    false_positives += filter.mayContain(bloomHash(i)) ? 1 : 0;
+  }
+  EXPECT_LT(false_positives, 300);
+}
+
+TEST(BloomFilterTest, RoundTrip) {
+  BloomFilter filter(1024);
+  filter.insert(bloomHash(int64_t(7)));
+  BloomFilter copy(filter.data(), filter.size());
+  EXPECT_TRUE(copy.mayContain(bloomHash(int64_t(7))));
+  EXPECT_EQ(0, memcmp(filter.data(), copy.data(), filter.size()));
+}
+
+#ifdef CAPNPPARQUET_X86_KERNELS
+
+// The AVX2 block kernels set and test the same bits as the scalar ones
+TEST(BloomFilterTest, Avx2Kernels) {
+  if (!cpuHasAvx2()) {
+    std::cout << "no AVX2, kernels not tested" << std::endl;
+    return;
+  }
+  std::mt19937 random(1);
+  for (int round = 0; round < 1000; round++) {
+    uint32_t scalar[8] = {0}, avx2[8] = {0};
+    for (int i = 0; i < 1 + (round % 8); i++) {
+      uint32_t key = random();
+      bloomBlockInsertScalar(scalar, key);
+      bloomBlockInsertAvx2(avx2, key);
+    }
+    ASSERT_EQ(0, memcmp(scalar, avx2, sizeof(scalar)));
+    for (int i = 0; i < 16; i++) {
+      uint32_t key = random();
+      EXPECT_EQ(bloomBlockContainsScalar(scalar, key), bloomBlockContainsAvx2(avx2, key));
+    }
+  }
+}
+
+#endif
+
+};  // namespace capnpparquet
@@ -0,0 +1,151 @@
+/*
+ * Copyright 2017 Rene Sugar
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ *
+ * @file capnpfilter_test.cpp
+ * @author Rene Sugar <rene.sugar@gmail.com>
+ * @brief Parsing and matching of --where predicates, and dates before the epoch.
+ */
+
+#include <gtest/gtest.h>
+
+#include <limits>
+#include <string>
+#include <vector>
+
+#include "capnpfilter.h"
+
+namespace capnpparquet {
+
+TEST(FilterTest, Comparisons) {
+  CapnpPredicate predicate = parsePredicate("id>=42");
+  EXPECT_EQ("id", predicate.path);
+  EXPECT_EQ(CapnpPredicate::GE, predicate.op);
+  EXPECT_EQ(std::vector<std::string>{"42"}, predicate.values);
+
+  predicate = parsePredicate("  timestamp < 2017-06-01 12:00:00 ");
+  EXPECT_EQ("timestamp", predicate.path);
+  EXPECT_EQ(CapnpPredicate::LT, predicate.op);
+  EXPECT_EQ(std::vector<std::string>{"2017-06-01 12:00:00"}, predicate.values);
+
+  predicate = parsePredicate("balance == -5");
+  EXPECT_EQ(CapnpPredicate::EQ, predicate.op);
+  EXPECT_EQ(std::vector<std::string>{"-5"}, predicate.values);
+}
+
+// Keywords, operators, commas and parentheses inside quotes belong to the constant
+TEST(FilterTest, QuotedStrings) {
+  CapnpPredicate predicate = parsePredicate("name = 'Tom and Jerry'");
+  EXPECT_EQ("name", predicate.path);
+  EXPECT_EQ(CapnpPredicate::EQ, predicate.op);
+  EXPECT_EQ(std::vector<std::string>{"Tom and Jerry"}, predicate.values);
+
+  predicate = parsePredicate("name = \"a >= b\"");
+  EXPECT_EQ(CapnpPredicate::EQ, predicate.op);
+  EXPECT_EQ(std::vector<std::string>{"a >= b"}, predicate.values);
+
+  predicate = parsePredicate("city in ('Rome, Italy', 'it''s (here)', '')");
+  EXPECT_EQ("city", predicate.path);
+  EXPECT_EQ(CapnpPredicate::IN, predicate.op);
+  EXPECT_EQ((std::vector<std::string>{"Rome, Italy", "it's (here)", ""}), predicate.values);
+
+  predicate = parsePredicate("name BETWEEN 'between' AND 'x and y'");
+  EXPECT_EQ(CapnpPredicate::BETWEEN, predicate.op);
+  EXPECT_EQ((std::vector<std::string>{"between", "x and y"}), predicate.values);
+
+  EXPECT_ANY_THROW(parsePredicate("name = 'unterminated"));
+  EXPECT_ANY_THROW(parsePredicate("name = 'a' b"));
+  EXPECT_ANY_THROW(parsePredicate("name 'a'"));
+  EXPECT_ANY_THROW(parsePredicate("id in ()"));
+}
+
+TEST(FilterTest, FloorDivide) {
+  EXPECT_EQ(0, floorDivide(0, 1000));
+  EXPECT_EQ(1, floorDivide(1999, 1000));
+  EXPECT_EQ(-1, floorDivide(-1, 1000));
+  EXPECT_EQ(-1, floorDivide(-1000, 1000));
+  EXPECT_EQ(-2, floorDivide(-1001, 1000));
+
+  // 1969-12-31T12:00:00 is on day -1, not day 0
+  int64_t micros = 0;
+  ASSERT_TRUE(parseTimestampMicros("1969-12-31T12:00:00", &micros));
+  EXPECT_EQ(-43200000000LL, micros);
+  EXPECT_EQ(-1, floorDivide(micros, 86400000000LL));
+  ASSERT_TRUE(parseTimestampMicros("1969-12-31", &micros));
+  EXPECT_EQ(-1, floorDivide(micros, 86400000000LL));
+}
+
+// A predicate on the column `descr` with the constants `texts`
+static ColumnPredicate bindColumnPredicate(const parquet::ColumnDescriptor* descr, CapnpPredicate::Op op,
+                                           const std::vector<std::string>& texts) {
+  ColumnPredicate predicate;
+  predicate.op = op;
+  predicate.column = 0;
+  predicate.descr = descr;
+  predicate.is_unsigned = false;
+  for (const auto& text : texts) {
+    predicate.values.push_back(bindFilterValue(text, descr));
+  }
+  return predicate;
+}
+
+static parquet::ColumnDescriptor makeColumn(parquet::Type::type type) {
+  return parquet::ColumnDescriptor(
+      parquet::schema::PrimitiveNode::Make("x", parquet::Repetition::REQUIRED, type), 0, 0);
+}
+
+// NaN values and constants match no predicate
+TEST(FilterTest, NaN) {
+  const float nan = std::numeric_limits<float>::quiet_NaN();
+  const double dnan = std::numeric_limits<double>::quiet_NaN();
+  parquet::ColumnDescriptor float_column = makeColumn(parquet::Type::FLOAT);
+  parquet::ColumnDescriptor double_column = makeColumn(parquet::Type::DOUBLE);
+
+  for (auto op : {CapnpPredicate::EQ, CapnpPredicate::LT, CapnpPredicate::LE,
+                  CapnpPredicate::GT, CapnpPredicate::GE}) {
+    EXPECT_FALSE(matchesFilter(bindColumnPredicate(&float_column, op, {"1.5"}), nan)) << op;
+    EXPECT_FALSE(matchesFilter(bindColumnPredicate(&double_column, op, {"1.5"}), dnan)) << op;
+    EXPECT_FALSE(matchesFilter(bindColumnPredicate(&double_column, op, {"nan"}), 1.5)) << op;
+  }
+  EXPECT_FALSE(matchesFilter(bindColumnPredicate(&float_column, CapnpPredicate::BETWEEN, {"-1", "1"}), nan));
+  EXPECT_FALSE(matchesFilter(bindColumnPredicate(&double_column, CapnpPredicate::IN, {"1", "2"}), dnan));
+  EXPECT_FALSE(matchesFilter(bindColumnPredicate(&double_column, CapnpPredicate::IN, {"nan"}), dnan));
+
+  // A NaN constant in a list leaves the others
+  EXPECT_TRUE(matchesFilter(bindColumnPredicate(&double_column, CapnpPredicate::IN, {"nan", "2"}), 2.0));
+  EXPECT_TRUE(matchesFilter(bindColumnPredicate(&double_column, CapnpPredicate::LE, {"2"}), 2.0));
+}
+
+// FLOAT constants are rounded to float, like the values they are compared with
+TEST(FilterTest, FloatConstants) {
+  parquet::ColumnDescriptor float_column = makeColumn(parquet::Type::FLOAT);
+  ColumnPredicate predicate = bindColumnPredicate(&float_column, CapnpPredicate::EQ, {"0.1"});
+  EXPECT_TRUE(matchesFilter(predicate, 0.1f));
+  EXPECT_TRUE(matchesFilter(bindColumnPredicate(&float_column, CapnpPredicate::IN, {"0.3", "0.1"}), 0.1f));
+  EXPECT_TRUE(matchesFilter(bindColumnPredicate(&float_column, CapnpPredicate::LE, {"0.1"}), 0.1f));
+  EXPECT_FALSE(matchesFilter(bindColumnPredicate(&float_column, CapnpPredicate::LT, {"0.1"}), 0.1f));
+
+  // The Bloom filter is probed with the value the row filter matches
+  EXPECT_EQ(bloomHash(0.1f), bloomHashFilterValue(predicate, predicate.values[0]));
+
+  parquet::ColumnDescriptor double_column = makeColumn(parquet::Type::DOUBLE);
+  EXPECT_TRUE(matchesFilter(bindColumnPredicate(&double_column, CapnpPredicate::EQ, {"0.1"}), 0.1));
+  EXPECT_FALSE(matchesFilter(bindColumnPredicate(&double_column, CapnpPredicate::EQ, {"0.1"}),
+                             static_cast<double>(0.1f)));
+}
+
+};  // namespace capnpparquet
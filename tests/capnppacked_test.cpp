@@ -0,0 +1,185 @@
+/*
+ * Copyright 2017 Rene Sugar
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ *
+ * @file capnppacked_test.cpp
+ * @author Rene Sugar <rene.sugar@gmail.com>
+ * @brief Unpacking of the Cap'n Proto packed encoding, SSSE3 kernel against the scalar one.
+ */
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <random>
+#include <vector>
+
+#include "capnppacked.h"
+
+namespace capnpparquet {
+
+static int nonZeroBytes(const uint8_t* word) {
+  int count = 0;
+  for (int i = 0; i < 8; i++) {
+    count += (word[i] != 0) ? 1 : 0;
+  }
+  return count;
+}
+
+// Packs whole words, as capnp::PackedOutputStream does
+static std::vector<uint8_t> pack(const std::vector<uint8_t>& words) {
+  std::vector<uint8_t> packed;
+  size_t count = words.size() / 8;
+  size_t i = 0;
+  while (i < count) {
+    const uint8_t* word = words.data() + (i * 8);
+    uint8_t tag = 0;
+    for (int b = 0; b < 8; b++) {
+      tag |= (word[b] != 0) ? (1 << b) : 0;
+    }
+    packed.push_back(tag);
+    i++;
+    if (tag == 0) {
+      uint8_t run = 0;
+      while ((i < count) && (run < 255) && (nonZeroBytes(words.data() + (i * 8)) == 0)) {
+        run++;
+        i++;
+      }
+      packed.push_back(run);
+      continue;
+    }
+    for (int b = 0; b < 8; b++) {
+      if (word[b] != 0) {
+        packed.push_back(word[b]);
+      }
+    }
+    if (tag == 0xff) {
+      size_t start = i;
+      while ((i < count) && (i - start < 255) && (nonZeroBytes(words.data() + (i * 8)) >= 7)) {
+        i++;
+      }
+      packed.push_back(static_cast<uint8_t>(i - start));
+      packed.insert(packed.end(), words.begin() + (start * 8), words.begin() + (i * 8));
+    }
+  }
+  return packed;
+}
+
+// Words with runs of zero words, runs of full words, and sparse words
+static std::vector<uint8_t> randomWords(std::mt19937& random, size_t count) {
+  std::vector<uint8_t> words;
+  while (words.size() < count * 8) {
+    int kind = random() % 4;
+    int run = 1 + (random() % 300);
+    for (int w = 0; (w < run) && (words.size() < count * 8); w++) {
+      for (int b = 0; b < 8; b++) {
+        uint8_t byte = static_cast<uint8_t>(1 + (random() % 255));
+        if (kind == 0) {
+          byte = 0;
+        } else if (kind == 2) {
+          byte = ((random() % 3) == 0) ? byte : 0;
+        } else if (kind == 3) {
+          byte = ((random() % 8) == 0) ? 0 : byte;
+        }
+        words.push_back(byte);
+      }
+    }
+  }
+  return words;
+}
+
+// The example of https://capnproto.org/encoding.html#packing
+TEST(PackedTest, KnownAnswer) {
+  const std::vector<uint8_t> words = {0x08, 0x00, 0x00, 0x00, 0x03, 0x00, 0x02, 0x00,
+                                      0x19, 0x00, 0x00, 0x00, 0xaa, 0x01, 0x00, 0x00};
+  const std::vector<uint8_t> packed = {0x51, 0x08, 0x03, 0x02, 0x31, 0x19, 0xaa, 0x01};
+  EXPECT_EQ(packed, pack(words));
+
+  size_t unpacked = 0;
+  EXPECT_EQ(packed.size(), packedWords(packed.data(), packed.size(), &unpacked));
+  ASSERT_EQ(words.size(), unpacked);
+  std::vector<uint8_t> out(unpacked);
+  unpackWords(packed.data(), packed.size(), out.data());
+  EXPECT_EQ(words, out);
+}
+
+TEST(PackedTest, GuessStreamEncoding) {
+  // Unpacked: 1 segment, 2 segments, and 300 whose first word has zero bytes after a tag
+  const uint8_t one[] = {0x00, 0x00, 0x00, 0x00};
+  const uint8_t two[] = {0x01, 0x00, 0x00, 0x00};
+  const uint8_t many[] = {0x2b, 0x01, 0x00, 0x00};
+  EXPECT_EQ(UNPACKED_STREAM, guessStreamEncoding(one, 512));
+  EXPECT_EQ(UNPACKED_STREAM, guessStreamEncoding(two, 512));
+  EXPECT_EQ(UNPACKED_STREAM, guessStreamEncoding(many, 512));
+
+  // Packed: a segment of 5 words, 2 segments of 5 and 3 words
+  const uint8_t packed_one[] = {0x10, 0x05, 0x00, 0x05};
+  const uint8_t packed_two[] = {0x11, 0x01, 0x05, 0x01};
+  EXPECT_EQ(PACKED_STREAM, guessStreamEncoding(packed_one, 512));
+  EXPECT_EQ(PACKED_STREAM, guessStreamEncoding(packed_two, 512));
+
+  // Both: 257 unpacked segments, or a packed message of its root pointer
+  const uint8_t segments_257[] = {0x00, 0x01, 0x00, 0x00};
+  const uint8_t packed_root[] = {0x10, 0x01, 0x00, 0x00};
+  EXPECT_EQ(EITHER_STREAM, guessStreamEncoding(segments_257, 512));
+  EXPECT_EQ(EITHER_STREAM, guessStreamEncoding(packed_root, 512));
+
+  // Counts the unpacked reader rejects are packed
+  EXPECT_EQ(PACKED_STREAM, guessStreamEncoding(segments_257, 256));
+}
+
+// Only whole words are taken from a stream cut anywhere
+TEST(PackedTest, PartialWords) {
+  std::mt19937 random(1);
+  std::vector<uint8_t> words = randomWords(random, 2000);
+  std::vector<uint8_t> packed = pack(words);
+  for (size_t cut = 0; cut <= packed.size(); cut++) {
+    size_t unpacked = 0;
+    size_t consumed = packedWords(packed.data(), cut, &unpacked);
+    ASSERT_LE(consumed, cut);
+    std::vector<uint8_t> out(unpacked);
+    unpackWordsScalar(packed.data(), consumed, out.data());
+    EXPECT_TRUE(std::equal(out.begin(), out.end(), words.begin())) << "cut at " << cut;
+  }
+}
+
+#ifdef CAPNPPARQUET_X86_KERNELS
+
+TEST(PackedTest, Ssse3Kernel) {
+  if (!cpuHasSsse3()) {
+    std::cout << "no SSSE3, kernel not tested" << std::endl;
+    return;
+  }
+  std::mt19937 random(2);
+  for (size_t count : {1, 2, 3, 100, 5000}) {
+    std::vector<uint8_t> words = randomWords(random, count);
+    std::vector<uint8_t> packed = pack(words);
+    size_t unpacked = 0;
+    ASSERT_EQ(packed.size(), packedWords(packed.data(), packed.size(), &unpacked));
+    ASSERT_EQ(words.size(), unpacked);
+
+    // No slack after the input, the last words take the scalar path
+    std::vector<uint8_t> scalar(unpacked), ssse3(unpacked);
+    unpackWordsScalar(packed.data(), packed.size(), scalar.data());
+    unpackWordsSsse3(packed.data(), packed.size(), ssse3.data());
+    EXPECT_EQ(words, scalar) << count << " words";
+    EXPECT_EQ(words, ssse3) << count << " words";
+  }
+}
+
+#endif
+
+};  // namespace capnpparquet
@@ -0,0 +1,171 @@
+/*
+ * Copyright 2017 Rene Sugar
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ *
+ * @file capnpstats_test.cpp
+ * @author Rene Sugar <rene.sugar@gmail.com>
+ * @brief The AVX2 statistics kernels against the scalar ones.
+ */
+
+#include <gtest/gtest.h>
+
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <random>
+#include <vector>
+
+#include "capnpstats.h"
+
+namespace capnpparquet {
+
+// Counts that end inside, and on, a vector of every width
+static const int64_t COUNTS[] = {0, 1, 3, 4, 5, 7, 8, 9, 15, 16, 17, 31, 32, 33, 100, 1001};
+
+template <typename T>
+static std::vector<T> randomIntegers(std::mt19937_64& random, int64_t count) {
+  std::vector<T> values(count);
+  for (auto& value : values) {
+    value = static_cast<T>(random());
+  }
+  return values;
+}
+
+template <typename T>
+static std::vector<T> randomFloating(std::mt19937_64& random, int64_t count, bool nans) {
+  std::uniform_real_distribution<T> distribution(-1e6, 1e6);
+  std::vector<T> values(count);
+  for (auto& value : values) {
+    value = distribution(random);
+    if (nans && ((random() % 4) == 0)) {
+      value = std::numeric_limits<T>::quiet_NaN();
+    }
+  }
+  return values;
+}
+
+TEST(StatsTest, ScalarKnownAnswers) {
+  const int16_t levels[] = {0, 1, 2, 2, 1, 2};
+  EXPECT_EQ(3, countNullsScalar(levels, 6, 2));
+
+  const int32_t values[] = {5, -3, 7, 0};
+  int32_t min, max;
+  ASSERT_TRUE(minMaxValues(values, 4, false, &min, &max));
+  EXPECT_EQ(-3, min);
+  EXPECT_EQ(7, max);
+  // -3 is the largest unsigned value
+  ASSERT_TRUE(minMaxValues(values, 4, true, &min, &max));
+  EXPECT_EQ(0, min);
+  EXPECT_EQ(-3, max);
+  EXPECT_FALSE(minMaxValues(values, 0, false, &min, &max));
+
+  const double nan = std::numeric_limits<double>::quiet_NaN();
+  const double floating[] = {nan, 2.5, -1.0, nan};
+  double dmin, dmax;
+  ASSERT_TRUE(minMaxValues(floating, 4, &dmin, &dmax));
+  EXPECT_EQ(-1.0, dmin);
+  EXPECT_EQ(2.5, dmax);
+  EXPECT_FALSE(minMaxValues(floating, 1, &dmin, &dmax));
+}
+
+#ifdef CAPNPPARQUET_X86_KERNELS
+
+// The AVX2 kernels only run where the CPU has them
+#define REQUIRE_AVX2()                                  \
+  if (!cpuHasAvx2()) {                                  \
+    std::cout << "no AVX2, kernels not tested" << std::endl; \
+    return;                                             \
+  }
+
+TEST(StatsTest, CountNullsAvx2) {
+  REQUIRE_AVX2();
+  std::mt19937_64 random(1);
+  for (int64_t count : COUNTS) {
+    std::vector<int16_t> levels(count);
+    for (auto& level : levels) {
+      level = static_cast<int16_t>(random() % 4);
+    }
+    for (int16_t max_def = 0; max_def < 5; max_def++) {
+      EXPECT_EQ(countNullsScalar(levels.data(), count, max_def), countNullsAvx2(levels.data(), count, max_def))
+          << count << " levels, max " << max_def;
+    }
+  }
+}
+
+template <typename T>
+static void expectIntegerKernels(uint64_t seed) {
+  std::mt19937_64 random(seed);
+  for (int64_t count : COUNTS) {
+    std::vector<T> values = randomIntegers<T>(random, count);
+    for (bool is_unsigned : {false, true}) {
+      const T flip = is_unsigned ? std::numeric_limits<T>::min() : 0;
+      T scalar_lo = std::numeric_limits<T>::max(), scalar_hi = std::numeric_limits<T>::min();
+      T avx2_lo = scalar_lo, avx2_hi = scalar_hi;
+      minMaxScalar(values.data(), count, flip, &scalar_lo, &scalar_hi);
+      minMaxAvx2(values.data(), count, flip, &avx2_lo, &avx2_hi);
+      EXPECT_EQ(scalar_lo, avx2_lo) << count << " values";
+      EXPECT_EQ(scalar_hi, avx2_hi) << count << " values";
+    }
+  }
+}
+
+TEST(StatsTest, MinMaxInt32Avx2) {
+  REQUIRE_AVX2();
+  expectIntegerKernels<int32_t>(2);
+}
+
+TEST(StatsTest, MinMaxInt64Avx2) {
+  REQUIRE_AVX2();
+  expectIntegerKernels<int64_t>(3);
+}
+
+template <typename T>
+static void expectFloatingKernels(uint64_t seed) {
+  std::mt19937_64 random(seed);
+  for (int64_t count : COUNTS) {
+    for (bool nans : {false, true}) {
+      std::vector<T> values = randomFloating<T>(random, count, nans);
+      T scalar_lo = std::numeric_limits<T>::infinity(), scalar_hi = -scalar_lo;
+      T avx2_lo = scalar_lo, avx2_hi = scalar_hi;
+      minMaxScalar(values.data(), count, &scalar_lo, &scalar_hi);
+      minMaxAvx2(values.data(), count, &avx2_lo, &avx2_hi);
+      EXPECT_EQ(scalar_lo, avx2_lo) << count << " values";
+      EXPECT_EQ(scalar_hi, avx2_hi) << count << " values";
+    }
+  }
+
+  // Every value NaN
+  std::vector<T> values(33, std::numeric_limits<T>::quiet_NaN());
+  T lo = std::numeric_limits<T>::infinity(), hi = -lo;
+  minMaxAvx2(values.data(), static_cast<int64_t>(values.size()), &lo, &hi);
+  EXPECT_EQ(std::numeric_limits<T>::infinity(), lo);
+  EXPECT_EQ(-std::numeric_limits<T>::infinity(), hi);
+}
+
+TEST(StatsTest, MinMaxFloatAvx2) {
+  REQUIRE_AVX2();
+  expectFloatingKernels<float>(4);
+}
+
+TEST(StatsTest, MinMaxDoubleAvx2) {
+  REQUIRE_AVX2();
+  expectFloatingKernels<double>(5);
+}
+
+#endif
+
+};  // namespace capnpparquet
@@ -0,0 +1,160 @@
+/*
+ * Copyright 2017 Rene Sugar
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ *
+ * @file capnpstream_test.cpp
+ * @author Rene Sugar <rene.sugar@gmail.com>
+ * @brief Framing of packed and unpacked message streams whose first word reads both ways.
+ */
+
+#include <gtest/gtest.h>
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "capnpstream.h"
+
+namespace capnpparquet {
+
+// The sizes in bytes of the messages framed from `bytes`
+static std::vector<size_t> frame(const std::vector<uint8_t>& bytes, bool* packed) {
+  char path[] = "/tmp/capnpstream_testXXXXXX";
+  int fd = mkstemp(path);
+  EXPECT_GE(fd, 0);
+  EXPECT_EQ(static_cast<ssize_t>(bytes.size()), write(fd, bytes.data(), bytes.size()));
+  lseek(fd, 0, SEEK_SET);
+  unlink(path);
+
+  std::vector<size_t> sizes;
+  {
+    CapnpMessageStream stream(fd);
+    bool more = true;
+    while (more) {
+      more = stream.wait(-1);
+      for (auto message = stream.next(); message != nullptr; message = stream.next()) {
+        sizes.push_back(message.size() * sizeof(capnp::word));
+      }
+    }
+    *packed = stream.packed();
+  }
+  close(fd);
+  return sizes;
+}
+
+static void appendWord32(std::vector<uint8_t>& bytes, uint32_t value) {
+  for (int i = 0; i < 4; i++) {
+    bytes.push_back(static_cast<uint8_t>(value >> (8 * i)));
+  }
+}
+
+// 257 segments of a word each: the segment table begins 00 01 00 00, the
+// tag of a zero word and a run of one more
+TEST(MessageStreamTest, UnpackedManySegments) {
+  std::vector<uint8_t> bytes;
+  for (int message = 0; message < 2; message++) {
+    appendWord32(bytes, 256);
+    for (int i = 0; i < 257; i++) {
+      appendWord32(bytes, 1);
+    }
+    // 4 + (257 * 4) bytes of segment table, a whole number of words
+    for (int i = 0; i < 257; i++) {
+      for (int b = 0; b < 8; b++) {
+        bytes.push_back(static_cast<uint8_t>(i + b + 1));
+      }
+    }
+  }
+  size_t message_size = bytes.size() / 2;
+  ASSERT_EQ(EITHER_STREAM, guessStreamEncoding(bytes.data(), CapnpMessageStream::MAX_SEGMENTS));
+
+  bool packed = true;
+  std::vector<size_t> sizes = frame(bytes, &packed);
+  EXPECT_FALSE(packed);
+  ASSERT_EQ(2U, sizes.size());
+  EXPECT_EQ(message_size, sizes[0]);
+  EXPECT_EQ(message_size, sizes[1]);
+}
+
+// A message of a null root pointer, packed: 10 01 00 00
+TEST(MessageStreamTest, PackedRootPointer) {
+  std::vector<uint8_t> bytes;
+  for (int message = 0; message < 3; message++) {
+    const uint8_t packed_message[] = {0x10, 0x01, 0x00, 0x00};
+    bytes.insert(bytes.end(), packed_message, packed_message + sizeof(packed_message));
+  }
+  ASSERT_EQ(EITHER_STREAM, guessStreamEncoding(bytes.data(), CapnpMessageStream::MAX_SEGMENTS));
+
+  bool packed = false;
+  std::vector<size_t> sizes = frame(bytes, &packed);
+  EXPECT_TRUE(packed);
+  EXPECT_EQ(std::vector<size_t>(3, 16), sizes);
+}
+
+// Packed messages written to a pipe `chunk` bytes at a time, each chunk read
+// before the next is written
+TEST(MessageStreamTest, PackedPipeChunks) {
+  // One segment of two words, 11 00 .. 00 and 01 .. 08: the last packed word
+  // is a tag, 8 bytes and a run count, and is cut by most chunk sizes
+  const uint8_t packed_message[] = {0x10, 0x02, 0x01, 0x11, 0xff, 0x01, 0x02, 0x03,
+                                    0x04, 0x05, 0x06, 0x07, 0x08, 0x00};
+  const uint8_t message[] = {0x00, 0x00, 0x00, 0x00, 0x02, 0x00, 0x00, 0x00,
+                             0x11, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+                             0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08};
+  std::vector<uint8_t> bytes;
+  for (int i = 0; i < 4; i++) {
+    bytes.insert(bytes.end(), packed_message, packed_message + sizeof(packed_message));
+  }
+  ASSERT_EQ(PACKED_STREAM, guessStreamEncoding(bytes.data(), CapnpMessageStream::MAX_SEGMENTS));
+
+  for (size_t chunk = 1; chunk <= sizeof(packed_message); chunk++) {
+    int fds[2];
+    ASSERT_EQ(0, pipe(fds));
+    std::vector<std::vector<uint8_t>> messages;
+    {
+      CapnpMessageStream stream(fds[0]);
+      auto take = [&]() {
+        for (auto taken = stream.next(); taken != nullptr; taken = stream.next()) {
+          const uint8_t* begin = reinterpret_cast<const uint8_t*>(taken.begin());
+          messages.push_back(std::vector<uint8_t>(begin, begin + (taken.size() * sizeof(capnp::word))));
+        }
+      };
+      for (size_t offset = 0; offset < bytes.size(); offset += chunk) {
+        size_t size = std::min(chunk, bytes.size() - offset);
+        ASSERT_EQ(static_cast<ssize_t>(size), write(fds[1], bytes.data() + offset, size));
+        ASSERT_TRUE(stream.wait(-1));
+        take();
+      }
+      close(fds[1]);
+      while (stream.wait(-1)) {
+        take();
+      }
+      take();
+      EXPECT_TRUE(stream.packed());
+    }
+    close(fds[0]);
+
+    ASSERT_EQ(4U, messages.size()) << chunk << " byte chunks";
+    for (const auto& taken : messages) {
+      EXPECT_EQ(std::vector<uint8_t>(message, message + sizeof(message)), taken) << chunk << " byte chunks";
+    }
+  }
+}
+
+};  // namespace capnpparquet